@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "powerplay.h"
+
+/*
+ *
+ * Acquisition
+ *
+ */
+
+static void *acquisition_worker_run(void *arg)
+{
+     struct acquisition_worker *worker = arg;
+     struct acquisition *acq = worker->acq;
+
+     pthread_mutex_lock(&acq->lock);
+     for (;;) {
+	  while (!acq->stop && worker->requested == worker->completed)
+	       pthread_cond_wait(&acq->request, &acq->lock);
+	  if (acq->stop) break;
+
+	  uint64_t cycle = worker->requested;
+	  pthread_mutex_unlock(&acq->lock);
+
+	  /* values and link are only touched by the control thread once completed catches up */
+	  int result = link_ready(worker->link, monotonic_ns());
+	  if (result == 0) {
+	       result = worker->read(&worker->link->client, worker->plan, worker->values);
+	       if (result) link_failed(worker->link, monotonic_ns());
+	       else link_succeeded(worker->link);
+	  }
+	  int64_t now = monotonic_ns();
+
+	  pthread_mutex_lock(&acq->lock);
+	  worker->result = result;
+	  worker->completed = cycle;
+	  worker->completed_ns = now;
+	  pthread_cond_broadcast(&acq->done);
+     }
+     pthread_mutex_unlock(&acq->lock);
+
+     return NULL;
+}
+
+static int acquisition_worker_start(struct acquisition *acq, struct acquisition_worker *worker)
+{
+     int err;
+
+     worker->acq = acq;
+     worker->requested = worker->completed = worker->consumed = 0;
+
+     err = pthread_create(&worker->thread, NULL, acquisition_worker_run, worker);
+     if (err) {
+	  fprintf(stderr, "Error: could not start %s acquisition thread: %s\n", worker->name, strerror(err));
+	  fflush(stderr);
+	  worker->acq = NULL;
+	  return -1;
+     }
+
+     return 0;
+}
+
+int acquisition_start(struct acquisition *acq, struct system_status *status)
+{
+     pthread_condattr_t attr;
+
+     acq->stop = 0;
+     pthread_mutex_init(&acq->lock, NULL);
+     pthread_cond_init(&acq->request, NULL);
+
+     /* Deadlines are monotonic so NTP steps cannot stretch a cycle */
+     pthread_condattr_init(&attr);
+     pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+     pthread_cond_init(&acq->done, &attr);
+     pthread_condattr_destroy(&attr);
+
+     struct acquisition_worker *gx = &acq->workers[0];
+     gx->name = "GX";
+     gx->link = &status->gx_link;
+     gx->plan = &status->gx_plan;
+     gx->shadow = &status->gx_shadow;
+     gx->read = gx_values_read;
+     gx->flag = ACQUIRED_GX;
+
+     for (size_t i = 0; i < status->nevcs; ++i) {
+	  struct acquisition_worker *evcs = &acq->workers[1 + i];
+	  evcs->name = status->evcs[i].link.name;
+	  evcs->link = &status->evcs[i].link;
+	  evcs->plan = &status->evcs[i].plan;
+	  evcs->shadow = &status->evcs[i].shadow;
+	  evcs->read = evcs_values_read;
+	  evcs->charger = i;
+	  evcs->flag = ACQUIRED_CHARGER(i);
+     }
+
+     acq->nworkers = 0;
+     for (size_t i = 0; i < 1 + status->nevcs; ++i) {
+	  if (acquisition_worker_start(acq, &acq->workers[i])) {
+	       acquisition_stop(acq);
+	       return -1;
+	  }
+	  acq->nworkers = i + 1;
+     }
+
+     return 0;
+}
+
+static int acquisition_pending(const struct acquisition *acq)
+{
+     for (size_t i = 0; i < acq->nworkers; ++i)
+	  if (acq->workers[i].requested != acq->workers[i].completed) return 1;
+
+     return 0;
+}
+
+static void acquisition_consume(struct acquisition_worker *worker, struct system_status *status)
+{
+     if (worker->completed == worker->consumed) return;
+     worker->consumed = worker->completed;
+
+     if (worker->result) return;
+
+     shadow_update(worker->shadow, worker->values, worker->completed_ns);
+     status->fresh |= worker->flag;
+     if (worker->flag == ACQUIRED_GX) {
+	  gx_values_decode(status, worker->values);
+	  status->gx_updated_ns = worker->completed_ns;
+     } else {
+	  evcs_values_decode(status, worker->charger, worker->values);
+	  status->evcs[worker->charger].updated_ns = worker->completed_ns;
+     }
+}
+
+/*
+ * Requests a read from every idle device and waits until all answered or deadline_ns
+ * (CLOCK_MONOTONIC) passed. Values that arrived are decoded into status; devices that missed the
+ * deadline keep their previous values and timestamps and are left in acq->missed. Returns the set
+ * of fresh devices, which is also left in status->fresh.
+ */
+unsigned acquisition_cycle(struct acquisition *acq, struct system_status *status, int64_t deadline_ns)
+{
+     struct timespec deadline = {
+	  .tv_sec = (time_t)(deadline_ns / NSECS_PER_SEC),
+	  .tv_nsec = (long)(deadline_ns % NSECS_PER_SEC),
+     };
+
+     pthread_mutex_lock(&acq->lock);
+
+     for (size_t i = 0; i < acq->nworkers; ++i) {
+	  struct acquisition_worker *worker = &acq->workers[i];
+	  if (worker->requested == worker->completed) worker->requested += 1;
+     }
+     pthread_cond_broadcast(&acq->request);
+
+     while (acquisition_pending(acq)) {
+	  if (pthread_cond_timedwait(&acq->done, &acq->lock, &deadline) == ETIMEDOUT) break;
+     }
+
+     status->fresh = 0;
+     acq->missed = 0;
+     for (size_t i = 0; i < acq->nworkers; ++i) {
+	  struct acquisition_worker *worker = &acq->workers[i];
+
+	  acquisition_consume(worker, status);
+	  if (worker->requested != worker->completed) acq->missed |= worker->flag;
+     }
+
+     pthread_mutex_unlock(&acq->lock);
+
+     return status->fresh;
+}
+
+/*
+ * Whether the device's link is free for the control thread. A worker that missed the deadline of
+ * acquisition_cycle() may still be reading on it; the gateway asks before forwarding requests.
+ */
+int acquisition_idle(struct acquisition *acq, unsigned device)
+{
+     int idle = 1;
+
+     pthread_mutex_lock(&acq->lock);
+     for (size_t i = 0; i < acq->nworkers; ++i) {
+	  struct acquisition_worker *worker = &acq->workers[i];
+	  if (worker->flag == device) idle = worker->requested == worker->completed;
+     }
+     pthread_mutex_unlock(&acq->lock);
+
+     return idle;
+}
+
+void acquisition_stop(struct acquisition *acq)
+{
+     pthread_mutex_lock(&acq->lock);
+     acq->stop = 1;
+     pthread_cond_broadcast(&acq->request);
+     pthread_mutex_unlock(&acq->lock);
+
+     for (size_t i = 0; i < 1 + EVCS_MAX; ++i) {
+	  struct acquisition_worker *worker = &acq->workers[i];
+	  if (worker->acq) pthread_join(worker->thread, NULL);
+	  worker->acq = NULL;
+     }
+}
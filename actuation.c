@@ -0,0 +1,186 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "powerplay.h"
+
+/*
+ *
+ * Actuation
+ *
+ */
+
+static const char *actuation_event_str[ACTUATION_EVENTS] = { "write", "ack", "status", "power" };
+
+static uint64_t actuation_bucket_msecs(size_t bucket)
+{
+     return (uint64_t)ACTUATION_BUCKET_MIN_MSECS << bucket;
+}
+
+static void actuation_record(struct actuation_latency *latency, int64_t latency_ns)
+{
+     uint64_t msecs = latency_ns > 0 ? (uint64_t)(latency_ns / NSECS_PER_MSEC) : 0;
+     size_t bucket = 0;
+
+     while (bucket < ACTUATION_BUCKETS - 1 && msecs >= actuation_bucket_msecs(bucket)) bucket += 1;
+     iostats_add(&latency->histogram[bucket]);
+     __atomic_add_fetch(&latency->sum_msecs, msecs, __ATOMIC_RELAXED);
+     if (msecs > __atomic_load_n(&latency->max_msecs, __ATOMIC_RELAXED))
+	  __atomic_store_n(&latency->max_msecs, msecs, __ATOMIC_RELAXED);
+}
+
+static void actuation_see(struct actuation *act, actuation_event_t event, int64_t t_ns)
+{
+     if (act->seen_ns[event]) return;
+
+     act->seen_ns[event] = t_ns;
+     actuation_record(&act->stats[act->start].latency[event], t_ns - act->decided_ns);
+}
+
+/* A new decision for the charger; one still followed is counted as superseded if it was written */
+void actuation_decided(struct actuation *act, uint16_t start, int64_t now_ns)
+{
+     if (act->active && act->seen_ns[ACTUATION_WRITE]) iostats_add(&act->stats[act->start].superseded);
+
+     act->active = 1;
+     act->start = start ? EVCS_CHARGING_START : EVCS_CHARGING_STOP;
+     act->decided_ns = now_ns;
+     memset(act->seen_ns, 0, sizeof(act->seen_ns));
+}
+
+/*
+ * After every charge start write with its shadow outcome. An elided first write means the charger
+ * already held the decided value, so there is no change to follow; a deferred one is still to come.
+ */
+void actuation_written(struct actuation *act, int outcome, int64_t now_ns)
+{
+     if (!act->active || act->seen_ns[ACTUATION_WRITE]) return;
+
+     if (outcome == SHADOW_WRITTEN) actuation_see(act, ACTUATION_WRITE, now_ns);
+     else if (outcome == SHADOW_ELIDED) act->active = 0;
+}
+
+static void actuation_log(const struct actuation *act, struct logger *log, const char *name)
+{
+     char line[LOG_LINE_MAX];
+     size_t len = 0;
+
+     for (size_t e = 0; e < ACTUATION_EVENTS; ++e) {
+	  int n;
+
+	  if (act->seen_ns[e])
+	       n = snprintf(line + len, sizeof(line) - len, ", %s %.2fs", actuation_event_str[e],
+			    (double)(act->seen_ns[e] - act->decided_ns) / (double)NSECS_PER_SEC);
+	  else
+	       n = snprintf(line + len, sizeof(line) - len, ", %s -", actuation_event_str[e]);
+	  if (n < 0 || (size_t)n >= sizeof(line) - len) break;
+	  len += (size_t)n;
+     }
+
+     logger_printf(log, "%s: Charging %s after%s\n", name, act->start ? "started" : "stopped", line + 1);
+}
+
+/*
+ * Once per cycle with the charger as last read; fresh tells whether it was read this cycle. Only
+ * readings taken after the write count. A start towards a disconnected charger is dropped, as
+ * there is no car to follow.
+ */
+void actuation_observe(struct actuation *act, struct logger *log, const struct evcs_charger *evcs, int fresh,
+		       int64_t now_ns)
+{
+     const char *name = evcs->link.name;
+     int64_t written_ns = act->seen_ns[ACTUATION_WRITE];
+
+     if (!act->active) return;
+
+     if (now_ns - act->decided_ns > ACTUATION_TIMEOUT_SECS * NSECS_PER_SEC) {
+	  if (written_ns) {
+	       iostats_add(&act->stats[act->start].timeouts);
+	       logger_printf(log, "%s: Charging not %s %ds after the decision\n", name,
+			     act->start ? "started" : "stopped", ACTUATION_TIMEOUT_SECS);
+	  }
+	  act->active = 0;
+	  return;
+     }
+
+     if (!written_ns || !fresh || evcs->updated_ns <= written_ns) return;
+
+     uint16_t status = evcs->charger_status;
+     int charging = status == EVCS_CHARGER_STATUS_CHARGING;
+     int changing = status == EVCS_CHARGER_STATUS_START_CHARGING || status == EVCS_CHARGER_STATUS_STOP_CHARGING;
+
+     if (act->start) {
+	  if (status == EVCS_CHARGER_STATUS_DISCONNECTED) {
+	       act->active = 0;
+	       return;
+	  }
+	  if (status == EVCS_CHARGER_STATUS_START_CHARGING || charging) actuation_see(act, ACTUATION_ACK, evcs->updated_ns);
+	  if (charging) actuation_see(act, ACTUATION_STATUS, evcs->updated_ns);
+	  if (evcs->power >= ACTUATION_POWER_WATTS) actuation_see(act, ACTUATION_POWER, evcs->updated_ns);
+     } else {
+	  if (status == EVCS_CHARGER_STATUS_STOP_CHARGING || (!charging && !changing))
+	       actuation_see(act, ACTUATION_ACK, evcs->updated_ns);
+	  if (!charging && !changing) actuation_see(act, ACTUATION_STATUS, evcs->updated_ns);
+	  if (evcs->power < ACTUATION_POWER_WATTS) actuation_see(act, ACTUATION_POWER, evcs->updated_ns);
+     }
+
+     if (act->seen_ns[ACTUATION_STATUS] && act->seen_ns[ACTUATION_POWER]) {
+	  iostats_add(&act->stats[act->start].completed);
+	  actuation_log(act, log, name);
+	  act->active = 0;
+     }
+}
+
+/* Upper bound of the bucket holding the given fraction of the samples, 0 for the open bucket */
+static uint64_t actuation_quantile_msecs(const uint64_t *histogram, uint64_t total, double q)
+{
+     uint64_t rank = (uint64_t)((double)total * q + 0.5), seen = 0;
+
+     for (size_t b = 0; b < ACTUATION_BUCKETS - 1; ++b) {
+	  seen += histogram[b];
+	  if (seen >= rank) return actuation_bucket_msecs(b);
+     }
+
+     return 0;
+}
+
+static void actuation_print_msecs(const char *label, uint64_t msecs)
+{
+     if (msecs == 0) printf(" %s >%.1fs", label, (double)actuation_bucket_msecs(ACTUATION_BUCKETS - 2) / 1000.0);
+     else printf(" %s <%.1fs", label, (double)msecs / 1000.0);
+}
+
+/* One line per direction with the latency of each event from the decision */
+void actuation_print(const struct actuation *act, const char *name)
+{
+     for (int start = EVCS_CHARGING_START; start >= EVCS_CHARGING_STOP; --start) {
+	  const struct actuation_stats *stats = &act->stats[start];
+	  uint64_t completed = __atomic_load_n(&stats->completed, __ATOMIC_RELAXED);
+	  uint64_t timeouts = __atomic_load_n(&stats->timeouts, __ATOMIC_RELAXED);
+	  uint64_t superseded = __atomic_load_n(&stats->superseded, __ATOMIC_RELAXED);
+
+	  if (!completed && !timeouts && !superseded) continue;
+
+	  printf("%s actuation %s: %" PRIu64 " completed, %" PRIu64 " timeouts, %" PRIu64 " superseded", name, start ? "start" : "stop",
+		 completed, timeouts, superseded);
+	  for (size_t e = 0; e < ACTUATION_EVENTS; ++e) {
+	       const struct actuation_latency *latency = &stats->latency[e];
+	       uint64_t histogram[ACTUATION_BUCKETS], count = 0;
+
+	       for (size_t b = 0; b < ACTUATION_BUCKETS; ++b) {
+		    histogram[b] = __atomic_load_n(&latency->histogram[b], __ATOMIC_RELAXED);
+		    count += histogram[b];
+	       }
+	       if (count == 0) continue;
+
+	       printf("; %s mean %.1fs max %.1fs", actuation_event_str[e],
+		      (double)__atomic_load_n(&latency->sum_msecs, __ATOMIC_RELAXED) / (double)count / 1000.0,
+		      (double)__atomic_load_n(&latency->max_msecs, __ATOMIC_RELAXED) / 1000.0);
+	       actuation_print_msecs("p50", actuation_quantile_msecs(histogram, count, 0.50));
+	       actuation_print_msecs("p95", actuation_quantile_msecs(histogram, count, 0.95));
+	  }
+	  printf("\n");
+     }
+
+     fflush(stdout);
+}
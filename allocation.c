@@ -0,0 +1,114 @@
+#include "powerplay.h"
+
+/*
+ *
+ * Allocation
+ *
+ */
+
+/* A car that is plugged in, not full and left to us to start and stop */
+static int allocation_eligible(const struct evcs_charger *evcs)
+{
+     return evcs->updated_ns
+	  && evcs->charging_mode == EVCS_CHARGE_MODE_AUTO
+	  && evcs->charger_status != EVCS_CHARGER_STATUS_DISCONNECTED
+	  && evcs->charger_status != EVCS_CHARGER_STATUS_CHARGED;
+}
+
+/* Most a charger can take, unlimited while it reports no maximum current */
+static int32_t allocation_power_max(const struct config *config, const struct evcs_charger *evcs)
+{
+     if (!evcs->max_current) return INT32_MAX;
+     return (int32_t)evcs->max_current * EVCS_VOLTAGE * (int32_t)config->evcs_phases;
+}
+
+/* Eligible chargers by ascending priority, ties in configuration order */
+static size_t allocation_order(const struct config *config, const struct system_status *status, unsigned live,
+			       size_t *order)
+{
+     size_t n = 0;
+
+     for (size_t i = 0; i < status->nevcs; ++i) {
+	  if (!(live & ACQUIRED_CHARGER(i)) || !allocation_eligible(&status->evcs[i])) continue;
+
+	  size_t j = n++;
+	  for (; j > 0 && config->evcs_priority[order[j - 1]] > config->evcs_priority[i]; --j) order[j] = order[j - 1];
+	  order[j] = i;
+     }
+
+     return n;
+}
+
+/*
+ * Equal shares of excess for the first n chargers in order. A charger whose maximum is below the
+ * share is given its maximum and the rest is split among the others again. Returns the smallest
+ * share.
+ */
+static int32_t allocation_fair(const struct config *config, const struct system_status *status,
+			       const size_t *order, size_t n, int32_t excess, int32_t *share)
+{
+     int capped[EVCS_MAX] = {0};
+     size_t open = n;
+     int32_t left = excess;
+
+     for (int progress = 1; progress && open;) {
+	  int32_t each = left / (int32_t)open;
+
+	  progress = 0;
+	  for (size_t k = 0; k < n; ++k) {
+	       int32_t max = allocation_power_max(config, &status->evcs[order[k]]);
+	       if (capped[k] || max > each) continue;
+
+	       share[order[k]] = max;
+	       capped[k] = 1;
+	       left -= max;
+	       open -= 1;
+	       progress = 1;
+	  }
+     }
+
+     int32_t least = INT32_MAX;
+     for (size_t k = 0; k < n; ++k) {
+	  if (!capped[k]) share[order[k]] = left / (int32_t)open;
+	  if (share[order[k]] < least) least = share[order[k]];
+     }
+
+     return least;
+}
+
+/*
+ * Splits the site excess, which includes what all cars draw, into one share per charger for the
+ * per-charger decisions. Only cars that can take power on chargers in live, a mask of
+ * ACQUIRED_CHARGER() bits, get a share, all others get 0.
+ *
+ * priority: chargers are served in priority order, each up to its maximum power, so a lower
+ *   priority car only charges on what the cars before it cannot take. A deficit is passed on to
+ *   every car so all of them back off.
+ * fair: the excess is split evenly. When the shares would not reach POWER_EXCESS_MIN the lowest
+ *   priority car drops out, as fewer cars charging beats all of them waiting below the threshold.
+ */
+void excess_allocate(const struct config *config, const struct system_status *status, unsigned live,
+		     int32_t excess, int32_t *share)
+{
+     size_t order[EVCS_MAX];
+     size_t n = allocation_order(config, status, live, order);
+
+     for (size_t i = 0; i < status->nevcs; ++i) share[i] = 0;
+
+     if (config->sharing_policy == SHARING_FAIR) {
+	  while (n > 0) {
+	       int32_t least = allocation_fair(config, status, order, n, excess, share);
+	       if (n == 1 || least > config->power_excess_min) break;
+	       share[order[--n]] = 0;
+	  }
+	  return;
+     }
+
+     int32_t left = excess;
+     for (size_t k = 0; k < n; ++k) {
+	  int32_t max = allocation_power_max(config, &status->evcs[order[k]]);
+
+	  share[order[k]] = left < max ? left : max;
+	  if (share[order[k]] > 0) left -= share[order[k]];
+     }
+}
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "powerplay.h"
+
+/*
+ *
+ * Averaging
+ *
+ */
+
+/*
+ * Each sample holds its value until the next one arrives, so the mean is weighted by how long a
+ * reading was actually in effect instead of by how many readings were taken. The ring stores the
+ * closed intervals between samples together with their running integral; adding a sample closes
+ * one interval and evicts the ones that slid out, so updates are amortised O(1).
+ */
+int average_window_init(struct average_window *window, int64_t span_ns, size_t capacity)
+{
+     *window = (struct average_window){0};
+     window->span_ns = span_ns;
+#ifdef POWERPLAY_SMALL
+     window->capacity = capacity;
+     window->intervals = capacity <= AVERAGE_INTERVALS_MAX ? window->storage : NULL;
+#else
+     window->capacity = capacity;
+     window->intervals = calloc(capacity, sizeof(window->intervals[0]));
+#endif
+     if (window->intervals == NULL) {
+	  fprintf(stderr, "Error: could not allocate averaging window of %zu samples\n", capacity);
+	  fflush(stderr);
+	  return -1;
+     }
+
+     return 0;
+}
+
+void average_window_free(struct average_window *window)
+{
+#ifndef POWERPLAY_SMALL
+     free(window->intervals);
+#endif
+     window->intervals = NULL;
+}
+
+static void average_window_evict(struct average_window *window)
+{
+     const struct average_interval *oldest = &window->intervals[window->tail];
+
+     window->integral -= (int64_t)oldest->value * (oldest->end_ns - oldest->start_ns);
+     window->tail = (window->tail + 1) % window->capacity;
+     window->count -= 1;
+}
+
+void average_window_add(struct average_window *window, int64_t t_ns, int32_t value)
+{
+     if (window->primed && t_ns > window->last_ns) {
+	  if (window->count == window->capacity) {
+	       /* More samples than sized for: the window shrinks rather than allocates */
+	       window->overflows += 1;
+	       average_window_evict(window);
+	  }
+
+	  struct average_interval *interval = &window->intervals[window->head];
+	  interval->start_ns = window->last_ns;
+	  interval->end_ns = t_ns;
+	  interval->value = window->last_value;
+	  window->integral += (int64_t)interval->value * (t_ns - window->last_ns);
+	  window->head = (window->head + 1) % window->capacity;
+	  window->count += 1;
+     }
+
+     if (!window->primed) window->first_ns = t_ns;
+     window->primed = 1;
+     window->last_ns = t_ns;
+     window->last_value = value;
+
+     while (window->count && window->intervals[window->tail].end_ns <= t_ns - window->span_ns)
+	  average_window_evict(window);
+}
+
+/* Whether samples cover the whole span up to now_ns */
+int average_window_full(const struct average_window *window, int64_t now_ns)
+{
+     return window->primed && now_ns - window->first_ns >= window->span_ns;
+}
+
+/*
+ * Time-weighted mean over [now_ns - span, now_ns]. The most recent sample is held up to now_ns
+ * and the oldest interval is clipped to the window start. Returns the last value while less than
+ * a nanosecond is covered.
+ */
+int32_t average_window_mean(const struct average_window *window, int64_t now_ns)
+{
+     int64_t start_ns = now_ns - window->span_ns;
+     int64_t integral = window->integral;
+     int64_t covered_ns;
+
+     if (!window->primed) return 0;
+
+     if (window->count) {
+	  const struct average_interval *oldest = &window->intervals[window->tail];
+	  if (oldest->start_ns < start_ns) integral -= (int64_t)oldest->value * (start_ns - oldest->start_ns);
+	  covered_ns = now_ns - (oldest->start_ns > start_ns ? oldest->start_ns : start_ns);
+     } else {
+	  covered_ns = now_ns - (window->last_ns > start_ns ? window->last_ns : start_ns);
+     }
+
+     if (now_ns > window->last_ns) {
+	  int64_t held_ns = now_ns - (window->last_ns > start_ns ? window->last_ns : start_ns);
+	  integral += (int64_t)window->last_value * held_ns;
+     }
+
+     if (covered_ns <= 0) return window->last_value;
+
+     return (int32_t)(integral / covered_ns);
+}
+
+#ifdef POWERPLAY_SMALL
+static void average_intervals_reverse(struct average_interval *intervals, size_t first, size_t last)
+{
+     while (first + 1 < last) {
+	  struct average_interval t = intervals[first];
+	  intervals[first++] = intervals[--last];
+	  intervals[last] = t;
+     }
+}
+
+/* Without a second buffer the ring is rotated in place so the oldest sample comes first */
+int average_window_resize(struct average_window *window, int64_t span_ns, size_t capacity)
+{
+     if (capacity > AVERAGE_INTERVALS_MAX) {
+	  fprintf(stderr, "Error: averaging window of %zu samples exceeds %d\n", capacity, AVERAGE_INTERVALS_MAX);
+	  fflush(stderr);
+	  return -1;
+     }
+     while (window->count > capacity) average_window_evict(window);
+
+     average_intervals_reverse(window->intervals, 0, window->tail);
+     average_intervals_reverse(window->intervals, window->tail, window->capacity);
+     average_intervals_reverse(window->intervals, 0, window->capacity);
+
+     window->capacity = capacity;
+     window->tail = 0;
+     window->head = window->count % capacity;
+     window->span_ns = span_ns;
+
+     return 0;
+}
+#else
+/*
+ * Changes span and capacity keeping the samples, the newest ones if fewer fit. Samples beyond a
+ * shorter span are evicted with the next sample. On failure the window is left as it was.
+ */
+int average_window_resize(struct average_window *window, int64_t span_ns, size_t capacity)
+{
+     struct average_interval *intervals = calloc(capacity, sizeof(intervals[0]));
+     if (intervals == NULL) {
+	  fprintf(stderr, "Error: could not allocate averaging window of %zu samples\n", capacity);
+	  fflush(stderr);
+	  return -1;
+     }
+
+     while (window->count > capacity) average_window_evict(window);
+     for (size_t i = 0; i < window->count; ++i)
+	  intervals[i] = window->intervals[(window->tail + i) % window->capacity];
+
+     free(window->intervals);
+     window->intervals = intervals;
+     window->capacity = capacity;
+     window->tail = 0;
+     window->head = window->count % capacity;
+     window->span_ns = span_ns;
+
+     return 0;
+}
+#endif
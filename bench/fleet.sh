@@ -0,0 +1,87 @@
+#!/bin/sh
+#
+# Runs sparkfleet against gridsim instances, each simulating the devices of several sites, and
+# checks its health report: every link up and no cycle overrun on a single core. Reports the CPU
+# time sparkfleet took per site cycle.
+#
+#   BENCH_SECS			measured run time after warm-up (default 60)
+#   BENCH_WARMUP_SECS		time to connect every site (default 10)
+#   BENCH_PROFILE		gridsim profile (default bench/sunny-day.profile)
+#   FLEET_SITES			sites controlled (default 500)
+#   FLEET_SLEEP_SECS		poll period of every site (default 1)
+#
+# Extra gridsim options, e.g. injected latency or loss, can be passed as arguments.
+
+set -eu
+
+dir=$(dirname "$0")
+secs=${BENCH_SECS:-60}
+warmup=${BENCH_WARMUP_SECS:-10}
+profile=${BENCH_PROFILE:-$dir/sunny-day.profile}
+sites=${FLEET_SITES:-500}
+sleep_secs=${FLEET_SLEEP_SECS:-1}
+# Sites per gridsim, each connecting once to either device (SIM_CLIENTS_MAX)
+per_sim=8
+port=$((20000 + $$ % 20000))
+out=$(mktemp -d)
+sims=
+fleet=
+trap 'kill $sims $fleet 2>/dev/null || true; rm -rf "$out"' EXIT
+
+cat > "$out/fleet.conf" <<EOF
+POWER_EXCESS_MIN=3000
+AVERAGING_SECS=30
+HOLD_SECS=20
+SLEEP_SECS=$sleep_secs
+IO_STATS_SECS=0
+SPARKSHIFT_DEBUG=0
+SPARKSHIFT_DRYRUN=0
+EOF
+
+site=0
+while [ $site -lt "$sites" ]; do
+     sim_port=$((port + 2 * (site / per_sim)))
+     if [ $((site % per_sim)) -eq 0 ]; then
+	  "$dir/../gridsim" -g "$sim_port" -e "$((sim_port + 1))" "$@" "$profile" > /dev/null 2>&1 &
+	  sims="$sims $!"
+     fi
+     printf '\n[site%d]\nGX_HOST=127.0.0.1\nGX_PORT=%d\nEVCS_HOST=127.0.0.1\nEVCS_PORT=%d\n' \
+	    $site "$sim_port" $((sim_port + 1)) >> "$out/fleet.conf"
+     site=$((site + 1))
+done
+sleep 1
+
+"$dir/../sparkfleet" "$out/fleet.conf" > "$out/sparkfleet.txt" 2>&1 &
+fleet=$!
+
+cpu_ns() {
+     awk '{ print $1 }' /proc/$fleet/task/*/schedstat | awk '{ sum += $1 } END { printf "%.0f", sum }'
+}
+
+# The loop busy share in the health report is since the last one
+sleep "$warmup"
+kill -USR1 $fleet
+cpu0=$(cpu_ns)
+sleep "$secs"
+kill -USR1 $fleet
+cpu=$(cpu_ns)
+sleep 1
+
+kill -TERM $fleet
+kill -INT $sims
+wait $sims 2>/dev/null || true
+
+grep '^Fleet:' "$out/sparkfleet.txt" | tail -n 1
+
+awk -v cpu_ns=$((cpu - cpu0)) -v sites="$sites" -v secs="$secs" -v sleep_secs="$sleep_secs" '
+     /^Fleet:/ { for (i = 1; i < NF; ++i) {
+	  if ($(i + 1) == "up") up = $i
+	  if ($(i + 1) == "down,") down = $i
+	  if ($(i + 1) == "overruns,") overruns = $i
+     } }
+     END {
+	  printf "CPU per site cycle %.3f ms\n", cpu_ns / (sites * secs / sleep_secs) / 1e6
+	  if (up != 2 * sites) { printf "FAIL: %d of %d links up, %d down\n", up, 2 * sites, down; exit 1 }
+	  if (overruns != 0) { printf "FAIL: %d cycle overruns\n", overruns; exit 1 }
+	  print "PASS"
+     }' "$out/sparkfleet.txt"
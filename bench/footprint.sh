@@ -0,0 +1,68 @@
+#!/bin/sh
+#
+# Runs the small build against gridsim and checks that it fits on the GX: peak RSS, CPU time per
+# control cycle, and that its data segment (VmData, heap and malloc arenas included) does not grow
+# once started, i.e. nothing is allocated in steady state. Fails when a budget is exceeded.
+#
+#   BENCH_SECS			measured run time after warm-up (default 60)
+#   BENCH_WARMUP_SECS		time to connect and fill the averaging window (default 10)
+#   BENCH_PROFILE		gridsim profile (default bench/sunny-day.profile)
+#   BENCH_BINARY		sparkshift binary (default sparkshift-small)
+#   BENCH_MAX_RSS_KB		maximum peak resident set size (default 2048)
+#   BENCH_MAX_CYCLE_CPU_MS	maximum mean CPU time per cycle, all threads (default 2)
+#
+# Extra gridsim options, e.g. injected latency or loss, can be passed as arguments.
+
+set -eu
+
+dir=$(dirname "$0")
+secs=${BENCH_SECS:-60}
+warmup=${BENCH_WARMUP_SECS:-10}
+profile=${BENCH_PROFILE:-$dir/sunny-day.profile}
+binary=${BENCH_BINARY:-$dir/../sparkshift-small}
+max_rss_kb=${BENCH_MAX_RSS_KB:-2048}
+max_cycle_cpu_ms=${BENCH_MAX_CYCLE_CPU_MS:-2}
+port=$((20000 + $$ % 20000))
+out=$(mktemp -d)
+trap 'kill $sim $spark 2>/dev/null || true; rm -rf "$out"' EXIT
+
+"$dir/../gridsim" -g "$port" -e "$((port + 1))" "$@" "$profile" > "$out/gridsim.txt" &
+sim=$!
+sleep 0.5
+
+GX_HOST=127.0.0.1 GX_PORT=$port EVCS_HOST=127.0.0.1 EVCS_PORT=$((port + 1)) \
+POWER_EXCESS_MIN=3000 AVERAGING_SECS=3 HOLD_SECS=2 SLEEP_SECS=0.25 \
+SPARKSHIFT_DEBUG=0 SPARKSHIFT_DRYRUN=0 \
+     "$binary" > "$out/sparkshift.txt" 2>&1 &
+spark=$!
+
+# Cycles logged, CPU nanoseconds of all threads and KiB of data segment
+sample() {
+     cycles=$(grep -c '^M/' "$out/sparkshift.txt" || true)
+     cpu_ns=$(cat /proc/$spark/task/*/schedstat | awk '{ sum += $1 } END { printf "%.0f", sum }')
+     data_kb=$(awk '/^VmData:/ { print $2 }' /proc/$spark/status)
+}
+
+sleep "$warmup"
+sample
+cycles0=$cycles cpu0=$cpu_ns data0=$data_kb
+sleep "$secs"
+sample
+rss_kb=$(awk '/^VmHWM:/ { print $2 }' /proc/$spark/status)
+
+kill -TERM $spark
+kill -INT $sim
+wait $sim || true
+
+echo "cycles $((cycles - cycles0)) peak RSS $rss_kb KiB data $data0 -> $data_kb KiB"
+
+awk -v cycles=$((cycles - cycles0)) -v cpu_ns=$((cpu_ns - cpu0)) -v data0="$data0" -v data="$data_kb" \
+    -v rss="$rss_kb" -v max_rss="$max_rss_kb" -v max_cpu="$max_cycle_cpu_ms" 'BEGIN {
+     if (cycles == 0) { print "FAIL: no cycles logged"; exit 1 }
+     cpu_ms = cpu_ns / cycles / 1e6
+     printf "CPU per cycle %.3f ms\n", cpu_ms
+     if (rss > max_rss) { printf "FAIL: peak RSS %d KiB > %d KiB\n", rss, max_rss; exit 1 }
+     if (cpu_ms > max_cpu) { printf "FAIL: CPU per cycle %.3f ms > %s ms\n", cpu_ms, max_cpu; exit 1 }
+     if (data > data0) { printf "FAIL: data segment grew from %d to %d KiB\n", data0, data; exit 1 }
+     print "PASS"
+}'
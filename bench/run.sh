@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# Runs sparkshift against gridsim and reports the simulator's view of the control loop: round trips
+# and latency per cycle, delay from the charger read to the charge start write, and from the write
+# to the charger reporting the new state. Fails when a threshold is exceeded.
+#
+#   BENCH_SECS			run time (default 60)
+#   BENCH_PROFILE		gridsim profile (default bench/sunny-day.profile)
+#   BENCH_MAX_ROUND_TRIPS	maximum mean round trips per cycle, writes included (default 3.5)
+#   BENCH_MAX_CYCLE_MS		maximum p95 cycle latency in ms (default 50)
+#
+# Extra gridsim options, e.g. injected latency or loss, can be passed as arguments.
+
+set -eu
+
+dir=$(dirname "$0")
+secs=${BENCH_SECS:-60}
+profile=${BENCH_PROFILE:-$dir/sunny-day.profile}
+max_round_trips=${BENCH_MAX_ROUND_TRIPS:-3.5}
+max_cycle_ms=${BENCH_MAX_CYCLE_MS:-50}
+port=$((20000 + $$ % 20000))
+out=$(mktemp -d)
+trap 'kill $sim $spark 2>/dev/null || true; rm -rf "$out"' EXIT
+
+"$dir/../gridsim" -g "$port" -e "$((port + 1))" "$@" "$profile" > "$out/gridsim.txt" &
+sim=$!
+sleep 0.5
+
+GX_HOST=127.0.0.1 GX_PORT=$port EVCS_HOST=127.0.0.1 EVCS_PORT=$((port + 1)) \
+POWER_EXCESS_MIN=3000 AVERAGING_SECS=3 HOLD_SECS=2 SLEEP_SECS=0.25 \
+SPARKSHIFT_DEBUG=0 SPARKSHIFT_DRYRUN=0 \
+     "$dir/../sparkshift" > "$out/sparkshift.txt" 2>&1 &
+spark=$!
+
+sleep "$secs"
+kill -TERM $spark
+kill -INT $sim
+wait $sim || true
+
+cat "$out/gridsim.txt"
+echo "sparkshift cycles logged $(grep -c '^M/' "$out/sparkshift.txt" || true)"
+
+awk -v max_rt="$max_round_trips" -v max_ms="$max_cycle_ms" '
+     /^round trips per cycle/ { rt = $5 }
+     /^cycle latency/ { for (i = 1; i < NF; ++i) if ($i == "p95") ms = $(i + 1) }
+     END {
+	  if (rt == "" || rt > max_rt) { printf "FAIL: round trips per cycle %s > %s\n", rt, max_rt; exit 1 }
+	  if (ms == "" || ms > max_ms) { printf "FAIL: p95 cycle latency %s ms > %s ms\n", ms, max_ms; exit 1 }
+	  print "PASS"
+     }' "$out/gridsim.txt"
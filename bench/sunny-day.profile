@@ -0,0 +1,10 @@
+# SECS PV_W HOUSE_W CAR
+# Compressed day: car arrives, clouds pass, PV drops away and the car leaves
+0	0	400	0
+4	1500	400	1
+10	9000	600	1
+20	2500	800	1
+26	9500	500	1
+40	7000	2500	1
+50	800	700	1
+58	0	400	0
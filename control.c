@@ -0,0 +1,178 @@
+#include "powerplay.h"
+
+/*
+ *
+ * Control
+ *
+ */
+
+int controller_init(struct controller *ctl, const struct config *config, int64_t now_ns)
+{
+     *ctl = (struct controller){0};
+     ctl->started_ns = now_ns;
+
+     if (average_window_init(&ctl->excess, config->averaging_secs * NSECS_PER_SEC, config_window_capacity(config)))
+	  return -1;
+     forecast_init(&ctl->forecast, (int64_t)config->forecast_secs * NSECS_PER_SEC,
+		   (int64_t)config->forecast_smoothing_secs * NSECS_PER_SEC);
+
+     /* Initialize desired state with the charging state first read as we do not yet have a
+      * reason to change without collecting stats */
+     for (size_t c = 0; c < EVCS_MAX; ++c) {
+	  ctl->charger[c].charge_start = EVCS_CHARGING_STOP;
+	  ctl->charger[c].decided_ns = now_ns - config->hold_secs * NSECS_PER_SEC;
+	  modulation_reset(&ctl->charger[c].mod);
+     }
+
+     return 0;
+}
+
+/* Takes over a changed averaging span or period keeping the samples and decisions so far */
+int controller_reconfigure(struct controller *ctl, const struct config *config)
+{
+     int64_t averaging_ns = config->averaging_secs * NSECS_PER_SEC;
+     size_t capacity = config_window_capacity(config);
+
+     forecast_tune(&ctl->forecast, (int64_t)config->forecast_secs * NSECS_PER_SEC,
+		   (int64_t)config->forecast_smoothing_secs * NSECS_PER_SEC);
+
+     if (averaging_ns == ctl->excess.span_ns && capacity == ctl->excess.capacity) return 0;
+     return average_window_resize(&ctl->excess, averaging_ns, capacity);
+}
+
+void controller_free(struct controller *ctl)
+{
+     average_window_free(&ctl->excess);
+}
+
+static void control_decide(struct charger_control *charger, struct charger_command *cmd,
+			   evcs_charging_start_t want, const char *why, int64_t now_ns)
+{
+     charger->charge_start = want;
+     charger->known = 1;
+     charger->decided_ns = now_ns;
+     cmd->decision = why;
+}
+
+/*
+ * One cycle of the control logic on the values in status, which the caller has read. Nothing here
+ * touches a device, prints or looks at the clock: the state lives in ctl and what the chargers
+ * should be told is returned in cmd, one per charger, for the caller to write. That keeps the
+ * step replayable from recorded data at any speed.
+ */
+void control_step(struct controller *ctl, const struct config *config, const struct system_status *status,
+		  int64_t now_ns, struct charger_command *cmd)
+{
+     int64_t stale_ns = config->stale_secs * NSECS_PER_SEC;
+     int64_t hold_ns = config->hold_secs * NSECS_PER_SEC;
+     int32_t share[EVCS_MAX], low[EVCS_MAX], high[EVCS_MAX];
+     int32_t quiet_power = 0;
+     unsigned live = 0;
+
+     ctl->sampled = 0;
+     ctl->forecasting = 0;
+     for (size_t c = 0; c < status->nevcs; ++c) {
+	  cmd[c] = (struct charger_command){0};
+	  if (!ctl->charger[c].known && (status->fresh & ACQUIRED_CHARGER(c))) {
+	       ctl->charger[c].charge_start = status->evcs[c].charge_start;
+	       ctl->charger[c].known = 1;
+	  }
+
+	  /* A charger gone quiet could be drawing anything: it gets no share and what it last drew
+	   * is not counted as excess, while the others carry on */
+	  if (now_ns - status->evcs[c].updated_ns > stale_ns) quiet_power += status->evcs[c].power;
+	  else live |= ACQUIRED_CHARGER(c);
+     }
+
+     /* Without the GX there is no telling whether charging imports from the grid, so the safe
+      * degraded mode is to stop until it is back */
+     if (now_ns - (status->gx_updated_ns ? status->gx_updated_ns : ctl->started_ns) > stale_ns) {
+	  for (size_t c = 0; c < status->nevcs; ++c) {
+	       struct charger_control *charger = &ctl->charger[c];
+	       if (charger->known && charger->charge_start == EVCS_CHARGING_START)
+		    control_decide(charger, &cmd[c], EVCS_CHARGING_STOP, "GX unavailable - refuse charging", now_ns);
+	  }
+	  goto act;
+     }
+
+     /* Excess needs grid and battery from the GX and what the chargers draw; the EVCS power may
+      * lag behind a little. Without a GX reading this cycle the window holds the last sample */
+     if (status->fresh & ACQUIRED_GX) {
+	  average_window_add(&ctl->excess, status->gx_updated_ns, status->power_excess - quiet_power);
+	  forecast_add(&ctl->forecast, status->gx_updated_ns, status->power_excess - quiet_power);
+	  ctl->sampled = 1;
+     }
+     excess_allocate(config, status, live, average_window_mean(&ctl->excess, now_ns), share);
+
+     /* The forecast decides where it is sure the share ends up on one side of the threshold,
+      * which on a ramp is well before the trailing mean gets there */
+     if (ctl->sampled && config->decision_mode == DECISION_FORECAST
+	 && forecast_predict(&ctl->forecast, now_ns, &ctl->excess_forecast, &ctl->forecast_bound)) {
+	  ctl->forecasting = 1;
+	  excess_allocate(config, status, live, ctl->excess_forecast - ctl->forecast_bound, low);
+	  excess_allocate(config, status, live, ctl->excess_forecast + ctl->forecast_bound, high);
+     }
+
+     /* The sliding mean is valid once the window is covered; HOLD_SECS keeps a share hovering
+      * around the threshold from toggling its charger every cycle */
+     for (size_t c = 0; c < status->nevcs; ++c) {
+	  struct charger_control *charger = &ctl->charger[c];
+	  if (!(live & ACQUIRED_CHARGER(c)) || now_ns - charger->decided_ns < hold_ns) continue;
+
+	  if (ctl->forecasting && low[c] > config->power_excess_min) {
+	       if (charger->charge_start != EVCS_CHARGING_START || !charger->known)
+		    control_decide(charger, &cmd[c], EVCS_CHARGING_START, "Forecast excess power high - want charging", now_ns);
+	  } else if (ctl->forecasting && high[c] <= config->power_excess_min) {
+	       if (charger->charge_start != EVCS_CHARGING_STOP || !charger->known)
+		    control_decide(charger, &cmd[c], EVCS_CHARGING_STOP, "Forecast excess power low - refuse charging", now_ns);
+	  } else if (!average_window_full(&ctl->excess, now_ns)) {
+	       continue;
+	  } else if (share[c] > config->power_excess_min) {
+	       if (charger->charge_start != EVCS_CHARGING_START || !charger->known)
+		    control_decide(charger, &cmd[c], EVCS_CHARGING_START, "High excess power - want charging", now_ns);
+	  } else {
+	       if (charger->charge_start != EVCS_CHARGING_STOP || !charger->known)
+		    control_decide(charger, &cmd[c], EVCS_CHARGING_STOP, "Low excess power - refuse charging", now_ns);
+	  }
+     }
+
+act:
+     /* Modulation splits the excess of this cycle the way the decisions split the mean */
+     for (size_t c = 0; c < status->nevcs; ++c) share[c] = 0;
+     if (status->fresh & ACQUIRED_GX) excess_allocate(config, status, live, status->power_excess - quiet_power, share);
+
+     for (size_t c = 0; c < status->nevcs; ++c) {
+	  const struct evcs_charger *evcs = &status->evcs[c];
+	  struct charger_control *charger = &ctl->charger[c];
+
+	  /* Act only on charger state read this cycle, with the EVCS context not in use */
+	  if (!(status->fresh & ACQUIRED_CHARGER(c))) continue;
+
+	  if (evcs->charging_mode == EVCS_CHARGE_MODE_AUTO) {
+	       cmd[c].write_charge_start = 1;
+	       cmd[c].charge_start = charger->charge_start;
+	  }
+
+	  /* The averaged decision keeps the car charging, modulation follows the charger's share
+	   * of the excess of every cycle within it once the charger's maximum is known */
+	  if (config->control_mode == CONTROL_MODULATE) {
+	       if (charger->charge_start != EVCS_CHARGING_START
+		   || evcs->charging_mode != EVCS_CHARGE_MODE_AUTO
+		   || evcs->charger_status != EVCS_CHARGER_STATUS_CHARGING
+		   || evcs->max_current == 0) {
+		    modulation_reset(&charger->mod);
+	       } else if (status->fresh & ACQUIRED_GX) {
+		    cmd[c].write_current = 1;
+		    cmd[c].current = modulation_step(&charger->mod, config, share[c],
+						     evcs->charging_current, evcs->max_current, now_ns);
+	       }
+	  }
+
+	  if (evcs->charging_mode == EVCS_CHARGE_MODE_MANUAL
+	      && evcs->charger_status == EVCS_CHARGER_STATUS_DISCONNECTED) cmd[c].write_auto = 1;
+     }
+
+     ctl->excess_mean = average_window_mean(&ctl->excess, now_ns);
+     excess_allocate(config, status, live, ctl->excess_mean, share);
+     for (size_t c = 0; c < status->nevcs; ++c) ctl->charger[c].share_mean = share[c];
+}
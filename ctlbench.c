@@ -0,0 +1,545 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "powerplay.h"
+
+/*
+  Ctlbench - checks and times the sparkshift control step
+
+  Usage: ctlbench [-b] [-n NSECS] [-a ALLOCS] [-N SAMPLES] [-r SECS] [PROFILE...]
+
+  -b		also time the control path over the first profile and fail on a regression
+  -n NSECS	most nanoseconds a sample may take on average (default 5000)
+  -a ALLOCS	most allocations per cycle (default 0)
+  -N SAMPLES	samples timed (default 1000000)
+  -r SECS	seconds between lines of a recorded sparkshift log profile (default 1)
+
+  Every sample goes the way a cycle of sparkshift does: the simulated GX and EVCS registers are
+  packed as the read plans return them, decoded into the status and stepped through the
+  controller, whose commands are written back to the simulated charger. Time is simulated, one
+  sample per second, so a day replays in well under a second.
+
+  Scripted scenarios come first, each with the charge starts and stops and the switch to auto
+  mode it must produce at exactly the second given. Each PROFILE, scripted lines
+  "SECS PV_W HOUSE_W [CAR]" or a recorded sparkshift log as for gridsim, is then replayed with
+  switched and modulated control. On every cycle of either the decisions must keep HOLD_SECS
+  apart and agree with the averaged share, charge start may only be written in auto mode and
+  auto mode only asked of a disconnected charger in manual mode. With -b the allocations made
+  by the decode and control code are counted by wrapping malloc, calloc and realloc at link
+  time. Prints PASS or what failed and exits 1 then.
+ */
+
+#define CTLBENCH_T0_SECS	1000
+#define CTLBENCH_EVENTS_MAX	64
+#define CTLBENCH_MAX_NSECS_DEFAULT 5000
+#define CTLBENCH_SAMPLES_DEFAULT 1000000
+#define CTLBENCH_CURRENT	16
+#define CTLBENCH_CURRENT_MAX	32
+#define CTLBENCH_SOC		50
+
+typedef enum {
+     EVENT_NONE = 0,
+     EVENT_START,
+     EVENT_STOP,
+     EVENT_AUTO,
+} event_kind_t;
+
+struct event {
+     double secs;
+     event_kind_t kind;
+};
+
+/* What the site does from secs on; a car of -1 is plugged in */
+struct step {
+     double secs;
+     int32_t pv, house;
+     int car;
+     int gx_down;
+};
+
+struct stream {
+     const char *name;
+     struct step *steps;
+     size_t nsteps;
+     int once; /* the last step holds rather than the steps repeating */
+};
+
+struct scenario {
+     const char *name;
+     evcs_charge_mode_t mode;
+     double secs;
+     struct step steps[8];
+     struct event expect[8];
+};
+
+/* One site under test, the registers held by address as the devices would */
+struct run {
+     struct config config;
+     struct system_status status;
+     struct controller ctl;
+     uint16_t gx_image[UINT16_MAX + 1];
+     uint16_t evcs_image[UINT16_MAX + 1];
+     uint16_t gx[REGISTER_VALUES_MAX], evcs[REGISTER_VALUES_MAX];
+     int64_t decided_ns;
+     struct event events[CTLBENCH_EVENTS_MAX];
+     size_t nevents;
+     uint64_t cycles, starts, stops, autos, violations;
+};
+
+static uint64_t allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t n, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+     allocations += 1;
+     return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+     allocations += 1;
+     return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+     allocations += 1;
+     return __real_realloc(ptr, size);
+}
+
+/*
+ * Expectations follow from POWER_EXCESS_MIN=3000, AVERAGING_SECS=30 and HOLD_SECS=20: the
+ * window is full and the first decision due at 30 s, a drop from 5000 W to 500 W takes the mean
+ * below the minimum after 14 s and a GX silent for more than STALE_SECS stops charging.
+ */
+static const struct scenario scenarios[] = {
+     { "start-stop", EVCS_CHARGE_MODE_AUTO, 200,
+       { { 0, 6000, 1000, 1, 0 }, { 120, 1500, 1000, 1, 0 }, { -1, 0, 0, 0, 0 } },
+       { { 30, EVENT_START }, { 134, EVENT_STOP } } },
+     { "hold", EVCS_CHARGE_MODE_AUTO, 100,
+       { { 0, 6000, 1000, 1, 0 }, { 31, 1000, 1000, 1, 0 }, { -1, 0, 0, 0, 0 } },
+       { { 30, EVENT_START }, { 50, EVENT_STOP } } },
+     { "manual-disconnected", EVCS_CHARGE_MODE_MANUAL, 100,
+       { { 0, 6000, 1000, 0, 0 }, { 40, 6000, 1000, 1, 0 }, { -1, 0, 0, 0, 0 } },
+       { { 0, EVENT_AUTO }, { 40, EVENT_START } } },
+     { "manual-connected", EVCS_CHARGE_MODE_MANUAL, 120,
+       { { 0, 6000, 1000, 1, 0 }, { 60, 6000, 1000, 0, 0 }, { 80, 6000, 1000, 1, 0 }, { -1, 0, 0, 0, 0 } },
+       { { 60, EVENT_AUTO }, { 80, EVENT_START } } },
+     { "gx-lost", EVCS_CHARGE_MODE_AUTO, 120,
+       { { 0, 6000, 1000, 1, 0 }, { 60, 6000, 1000, 1, 1 }, { 90, 6000, 1000, 1, 0 }, { -1, 0, 0, 0, 0 } },
+       { { 30, EVENT_START }, { 70, EVENT_STOP }, { 90, EVENT_START } } },
+};
+
+static const char *event_kind_str(event_kind_t kind)
+{
+     switch (kind) {
+     case EVENT_NONE: return "nothing";
+     case EVENT_START: return "start";
+     case EVENT_STOP: return "stop";
+     case EVENT_AUTO: return "auto";
+     }
+     return "?";
+}
+
+/* Last step at or before secs, the steps repeating once exhausted as gridsim's profiles do */
+static const struct step *stream_at(const struct stream *stream, double secs)
+{
+     double period = stream->steps[stream->nsteps - 1].secs + 1;
+     double t = stream->once ? secs : secs - period * (double)(int64_t)(secs / period);
+     size_t lo = 0, hi = stream->nsteps;
+
+     while (hi - lo > 1) {
+	  size_t mid = (lo + hi) / 2;
+	  if (stream->steps[mid].secs <= t) lo = mid;
+	  else hi = mid;
+     }
+
+     return &stream->steps[lo];
+}
+
+static int stream_push(struct stream *stream, size_t *capacity, const struct step *step)
+{
+     if (stream->nsteps == *capacity) {
+	  size_t n = *capacity ? 2 * *capacity : 1024;
+	  struct step *steps = realloc(stream->steps, n * sizeof(steps[0]));
+	  if (steps == NULL) {
+	       fprintf(stderr, "Error: could not allocate %zu profile steps\n", n);
+	       return -1;
+	  }
+	  stream->steps = steps;
+	  *capacity = n;
+     }
+
+     stream->steps[stream->nsteps++] = *step;
+     return 0;
+}
+
+static int profile_parse_recorded(const char *line, struct step *step)
+{
+     const char *pv = status_line_field(line, "P/");
+     const char *consumption = status_line_field(line, "C/");
+     const char *evcs = status_line_field(line, "E/");
+
+     if (pv == NULL || consumption == NULL || evcs == NULL) return -1;
+
+     step->pv = (int32_t)atoi(pv);
+     step->house = (int32_t)(atoi(consumption) - atoi(evcs));
+     return 0;
+}
+
+static int profile_load(struct stream *stream, const char *path, double recorded_secs)
+{
+     char line[256];
+     size_t capacity = 0;
+     FILE *f = fopen(path, "r");
+     if (f == NULL) {
+	  fprintf(stderr, "Error: could not open profile %s: %s\n", path, strerror(errno));
+	  goto error;
+     }
+
+     const char *base = strrchr(path, '/');
+     stream->name = base ? base + 1 : path;
+
+     while (fgets(line, sizeof(line), f)) {
+	  struct step step = { .car = -1 };
+
+	  if (line[0] == '#' || line[0] == '\n') continue;
+
+	  if (!strncmp(line, "M/", 2)) {
+	       if (profile_parse_recorded(line, &step)) continue;
+	       step.secs = (double)stream->nsteps * recorded_secs;
+	  } else if (sscanf(line, "%lf %d %d %d", &step.secs, &step.pv, &step.house, &step.car) < 3) {
+	       fprintf(stderr, "Error: malformed profile line: %s", line);
+	       goto error;
+	  }
+
+	  if (stream_push(stream, &capacity, &step)) goto error;
+     }
+
+     if (stream->nsteps == 0) {
+	  fprintf(stderr, "Error: profile %s is empty\n", path);
+	  goto error;
+     }
+
+     fclose(f);
+     return 0;
+
+error:
+     if (f) fclose(f);
+     fflush(stderr);
+     return -1;
+}
+
+static void run_config(struct config *config, int control_mode)
+{
+     *config = (struct config){0};
+     config->power_excess_min = 3000;
+     config->averaging_secs = 30;
+     config->hold_secs = 20;
+     config->period_ns = config->poll_min_ns = config->poll_max_ns = NSECS_PER_SEC;
+     config->control_mode = control_mode;
+     config->decision_mode = DECISION_MEAN;
+     config->forecast_secs = FORECAST_SECS_DEFAULT;
+     config->forecast_smoothing_secs = FORECAST_SMOOTHING_SECS_DEFAULT;
+     config->sharing_policy = SHARING_PRIORITY;
+     config->evcs_phases = EVCS_PHASES_DEFAULT;
+     config->current_min_amps = CURRENT_MIN_AMPS_DEFAULT;
+     config->current_slew_amps = CURRENT_SLEW_AMPS_DEFAULT;
+     config->current_deadband_watts = CURRENT_DEADBAND_WATTS_DEFAULT;
+     config->stale_secs = STALE_SECS_DEFAULT;
+     config->write_interval_msecs = WRITE_INTERVAL_MSECS_DEFAULT;
+     config->nevcs = 1;
+     config->evcs_priority[0] = 1;
+}
+
+static int run_init(struct run *run, int control_mode, evcs_charge_mode_t mode)
+{
+     run_config(&run->config, control_mode);
+     run->status.config = run->config;
+     if (system_status_init(&run->status)) return -1;
+     if (controller_init(&run->ctl, &run->config, CTLBENCH_T0_SECS * NSECS_PER_SEC)) return -1;
+
+     run->decided_ns = CTLBENCH_T0_SECS * NSECS_PER_SEC - run->config.hold_secs * NSECS_PER_SEC;
+     run->evcs_image[EVCS_REGISTER_CHARGE_MODE] = (uint16_t)mode;
+     run->evcs_image[EVCS_REGISTER_CHARGE_START] = EVCS_CHARGING_STOP;
+     run->evcs_image[EVCS_REGISTER_CHARGING_CURRENT] = CTLBENCH_CURRENT;
+     run->evcs_image[EVCS_REGISTER_MAX_CURRENT] = CTLBENCH_CURRENT_MAX;
+     run->gx_image[GX_REGISTER_BATTERY_SOC] = CTLBENCH_SOC;
+
+     return 0;
+}
+
+static void run_free(struct run *run)
+{
+     controller_free(&run->ctl);
+}
+
+/* Ranges back to back in plan order, as register_plan_read leaves them */
+static void registers_pack(const struct register_plan *plan, const uint16_t *image, uint16_t *values)
+{
+     for (size_t i = 0; i < plan->nranges; ++i) {
+	  memcpy(values, image + plan->ranges[i].addr, plan->ranges[i].count * sizeof(values[0]));
+	  values += plan->ranges[i].count;
+     }
+}
+
+static void phases_set(uint16_t *image, uint16_t addr, int32_t total)
+{
+     for (uint16_t i = 0; i < 3; ++i) image[addr + i] = (uint16_t)(int16_t)(total / 3);
+}
+
+static void run_violation(struct run *run, int64_t now_ns, const char *what)
+{
+     run->violations += 1;
+     if (run->violations <= 10)
+	  printf("Violation at %.0f s: %s\n", (double)(now_ns / NSECS_PER_SEC - CTLBENCH_T0_SECS), what);
+}
+
+static void run_event(struct run *run, int64_t now_ns, event_kind_t kind)
+{
+     if (run->nevents == CTLBENCH_EVENTS_MAX) return;
+     run->events[run->nevents++] = (struct event){ (double)(now_ns / NSECS_PER_SEC - CTLBENCH_T0_SECS), kind };
+}
+
+/* The decision follows from the share of the mean that the controller held this cycle, or stops
+ * charging once the GX is stale */
+static void run_check(struct run *run, const struct charger_command *cmd, int64_t now_ns)
+{
+     const struct config *config = &run->config;
+     const struct evcs_charger *evcs = &run->status.evcs[0];
+     const struct charger_control *charger = &run->ctl.charger[0];
+     int manual_disconnected = evcs->charging_mode == EVCS_CHARGE_MODE_MANUAL
+	  && evcs->charger_status == EVCS_CHARGER_STATUS_DISCONNECTED;
+
+     if (cmd->write_charge_start && evcs->charging_mode != EVCS_CHARGE_MODE_AUTO)
+	  run_violation(run, now_ns, "charge start written outside auto mode");
+     if (cmd->write_auto != manual_disconnected)
+	  run_violation(run, now_ns, manual_disconnected ? "manual mode kept while disconnected"
+			: "auto mode asked of a charger in use");
+     if (cmd->write_current && (cmd->current > evcs->max_current || cmd->current == 0))
+	  run_violation(run, now_ns, "current outside the charger's range");
+
+     if (cmd->decision == NULL) return;
+
+     if (now_ns - run->status.gx_updated_ns > (int64_t)config->stale_secs * NSECS_PER_SEC) {
+	  if (charger->charge_start != EVCS_CHARGING_STOP)
+	       run_violation(run, now_ns, "charging started without the GX");
+     } else {
+	  if (now_ns - run->decided_ns < config->hold_secs * NSECS_PER_SEC)
+	       run_violation(run, now_ns, "decision within HOLD_SECS of the last");
+	  if (config->decision_mode == DECISION_MEAN
+	      && (charger->charge_start == EVCS_CHARGING_START) != (charger->share_mean > config->power_excess_min))
+	       run_violation(run, now_ns, "decision against the averaged share");
+     }
+     run->decided_ns = now_ns;
+}
+
+/* One cycle: the devices take the step, their registers are decoded and the commands written back */
+static void run_cycle(struct run *run, const struct step *step, int64_t now_ns)
+{
+     struct system_status *status = &run->status;
+     struct charger_command cmd[EVCS_MAX];
+     uint16_t *evcs = run->evcs_image;
+     int car = step->car != 0;
+
+     uint16_t charger_status = !car ? EVCS_CHARGER_STATUS_DISCONNECTED
+	  : evcs[EVCS_REGISTER_CHARGE_START] == EVCS_CHARGING_START ? EVCS_CHARGER_STATUS_CHARGING
+	  : EVCS_CHARGER_STATUS_CONNECTED;
+     int32_t power = charger_status == EVCS_CHARGER_STATUS_CHARGING
+	  ? EVCS_VOLTAGE * (int32_t)run->config.evcs_phases * evcs[EVCS_REGISTER_CHARGING_CURRENT] : 0;
+
+     evcs[EVCS_REGISTER_CHARGER_STATUS] = charger_status;
+     evcs[EVCS_REGISTER_TOTAL_POWER] = (uint16_t)power;
+     phases_set(run->gx_image, GX_REGISTER_PV_AC_IN_L1, step->pv);
+     phases_set(run->gx_image, GX_REGISTER_AC_CONSUMPTION_L1, step->house + power);
+     phases_set(run->gx_image, GX_REGISTER_GRID_L1, step->house + power - step->pv);
+
+     status->fresh = 0;
+     if (!step->gx_down) {
+	  registers_pack(&status->gx_plan, run->gx_image, run->gx);
+	  gx_values_decode(status, run->gx);
+	  status->gx_updated_ns = now_ns;
+	  status->fresh |= ACQUIRED_GX;
+     }
+     registers_pack(&status->evcs[0].plan, evcs, run->evcs);
+     status->evcs[0].updated_ns = now_ns;
+     evcs_values_decode(status, 0, run->evcs);
+     status->fresh |= ACQUIRED_CHARGER(0);
+
+     control_step(&run->ctl, &run->config, status, now_ns, cmd);
+     run_check(run, &cmd[0], now_ns);
+     run->cycles += 1;
+
+     if (cmd[0].decision) {
+	  int start = run->ctl.charger[0].charge_start == EVCS_CHARGING_START;
+	  run_event(run, now_ns, start ? EVENT_START : EVENT_STOP);
+	  if (start) run->starts += 1;
+	  else run->stops += 1;
+     }
+     if (cmd[0].write_charge_start) evcs[EVCS_REGISTER_CHARGE_START] = (uint16_t)cmd[0].charge_start;
+     if (cmd[0].write_current) evcs[EVCS_REGISTER_CHARGING_CURRENT] = cmd[0].current;
+     if (cmd[0].write_auto) {
+	  evcs[EVCS_REGISTER_CHARGE_MODE] = EVCS_CHARGE_MODE_AUTO;
+	  run_event(run, now_ns, EVENT_AUTO);
+	  run->autos += 1;
+     }
+}
+
+static void run_stream(struct run *run, const struct stream *stream, uint64_t samples)
+{
+     for (uint64_t i = 0; i < samples; ++i)
+	  run_cycle(run, stream_at(stream, (double)i), (CTLBENCH_T0_SECS + (int64_t)i) * NSECS_PER_SEC);
+}
+
+static int scenario_check(struct run *run, const struct scenario *scenario)
+{
+     struct step steps[sizeof(scenario->steps) / sizeof(scenario->steps[0])];
+     struct stream stream = { scenario->name, steps, 0, 1 };
+     size_t nexpect = 0;
+     int rc = 0;
+
+     memcpy(steps, scenario->steps, sizeof(steps));
+     while (stream.nsteps < sizeof(steps) / sizeof(steps[0]) && steps[stream.nsteps].secs >= 0) stream.nsteps += 1;
+     while (nexpect < sizeof(scenario->expect) / sizeof(scenario->expect[0])
+	    && scenario->expect[nexpect].kind != EVENT_NONE) nexpect += 1;
+
+     run_stream(run, &stream, (uint64_t)scenario->secs);
+
+     for (size_t i = 0; i < nexpect || i < run->nevents; ++i) {
+	  const struct event *want = i < nexpect ? &scenario->expect[i] : NULL;
+	  const struct event *got = i < run->nevents ? &run->events[i] : NULL;
+
+	  if (want && got && want->kind == got->kind && want->secs == got->secs) continue;
+	  printf("FAIL: %s: expected %s at %.0f s, got %s at %.0f s\n", scenario->name,
+		 event_kind_str(want ? want->kind : EVENT_NONE), want ? want->secs : scenario->secs,
+		 event_kind_str(got ? got->kind : EVENT_NONE), got ? got->secs : scenario->secs);
+	  rc = -1;
+	  break;
+     }
+     if (run->violations) {
+	  printf("FAIL: %s: %" PRIu64 " violations\n", scenario->name, run->violations);
+	  rc = -1;
+     }
+     if (rc == 0) printf("%s: %zu events as expected\n", scenario->name, run->nevents);
+
+     return rc;
+}
+
+static void usage(const char *name)
+{
+     fprintf(stderr, "Usage: %s [-b] [-n nsecs] [-a allocs] [-N samples] [-r secs] [profile...]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+     static struct stream streams[16];
+     const char *modes[] = { "switch", "modulate" };
+     long max_nsecs = CTLBENCH_MAX_NSECS_DEFAULT;
+     double max_allocs = 0, recorded_secs = 1.0;
+     long samples = CTLBENCH_SAMPLES_DEFAULT;
+     size_t nstreams = 0;
+     int bench = 0, failed = 0;
+     int opt;
+
+     while ((opt = getopt(argc, argv, "bn:a:N:r:")) != -1) {
+	  switch (opt) {
+	  case 'b': bench = 1; break;
+	  case 'n': max_nsecs = atol(optarg); break;
+	  case 'a': max_allocs = strtod(optarg, NULL); break;
+	  case 'N': samples = atol(optarg); break;
+	  case 'r': recorded_secs = strtod(optarg, NULL); break;
+	  default:
+	       usage(argv[0]);
+	       return 1;
+	  }
+     }
+
+     if (max_nsecs <= 0 || max_allocs < 0 || samples <= 0 || recorded_secs <= 0
+	 || (size_t)(argc - optind) > sizeof(streams) / sizeof(streams[0])) {
+	  usage(argv[0]);
+	  return 1;
+     }
+
+     for (int i = optind; i < argc; ++i)
+	  if (profile_load(&streams[nstreams++], argv[i], recorded_secs)) return 1;
+
+     /* Runs are too large for the stack and reused, the status and controller set up afresh */
+     struct run *run = malloc(sizeof(*run));
+     if (run == NULL) {
+	  fprintf(stderr, "Error: could not allocate run\n");
+	  return 1;
+     }
+
+     for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i) {
+	  *run = (struct run){0};
+	  if (run_init(run, CONTROL_SWITCH, scenarios[i].mode)) return 1;
+	  if (scenario_check(run, &scenarios[i])) failed = 1;
+	  run_free(run);
+     }
+
+     for (size_t s = 0; s < nstreams; ++s) {
+	  for (int m = 0; m < 2; ++m) {
+	       const struct step *last = &streams[s].steps[streams[s].nsteps - 1];
+
+	       *run = (struct run){0};
+	       if (run_init(run, m ? CONTROL_MODULATE : CONTROL_SWITCH, EVCS_CHARGE_MODE_AUTO)) return 1;
+	       run_stream(run, &streams[s], (uint64_t)last->secs + 1);
+	       printf("%s %s: %" PRIu64 " samples, %" PRIu64 " starts, %" PRIu64 " stops, %" PRIu64 " violations\n", streams[s].name, modes[m],
+		      run->cycles, run->starts, run->stops, run->violations);
+	       if (run->violations) {
+		    printf("FAIL: %s %s: %" PRIu64 " violations\n", streams[s].name, modes[m], run->violations);
+		    failed = 1;
+	       }
+	       run_free(run);
+	  }
+     }
+
+     if (bench) {
+	  struct step step = { 0, 6000, 1000, -1, 0 };
+	  struct stream fallback = { "steady", &step, 1, 0 };
+	  const struct stream *stream = nstreams ? &streams[0] : &fallback;
+
+	  *run = (struct run){0};
+	  if (run_init(run, CONTROL_MODULATE, EVCS_CHARGE_MODE_AUTO)) return 1;
+
+	  /* Warms the caches and fills the averaging window before timing */
+	  run_stream(run, stream, 100);
+
+	  uint64_t allocations0 = allocations;
+	  int64_t start_ns = monotonic_ns();
+	  run_stream(run, stream, (uint64_t)samples);
+	  int64_t elapsed_ns = monotonic_ns() - start_ns;
+
+	  double nsecs = (double)elapsed_ns / (double)samples;
+	  double allocs = (double)(allocations - allocations0) / (double)samples;
+
+	  printf("%s: %.0f ns per sample, %.3f allocations per cycle over %ld samples\n", stream->name, nsecs,
+		 allocs, samples);
+	  if (nsecs > (double)max_nsecs) {
+	       printf("FAIL: %.0f ns per sample above %ld\n", nsecs, max_nsecs);
+	       failed = 1;
+	  }
+	  if (allocs > max_allocs) {
+	       printf("FAIL: %.3f allocations per cycle above %.3f\n", allocs, max_allocs);
+	       failed = 1;
+	  }
+	  run_free(run);
+     }
+
+     free(run);
+     for (size_t s = 0; s < nstreams; ++s) free(streams[s].steps);
+
+     if (failed) return 1;
+     printf("PASS\n");
+     return 0;
+}
@@ -57,9 +57,9 @@
                   description = "Power averaging seconds";
                 };
                 sleepSecs = lib.mkOption {
-                  type = lib.types.int;
+                  type = lib.types.either lib.types.int lib.types.float;
                   default = 1;
-                  description = "Control loop sleep seconds";
+                  description = "Control loop period in seconds, fractions allowed";
                 };
                 powerExcessMin = lib.mkOption {
                   type = lib.types.int;
@@ -0,0 +1,90 @@
+#include <math.h>
+
+#include "powerplay.h"
+
+/*
+ *
+ * Forecast
+ *
+ */
+
+void forecast_init(struct forecast *forecast, int64_t horizon_ns, int64_t smoothing_ns)
+{
+     *forecast = (struct forecast){0};
+     forecast_tune(forecast, horizon_ns, smoothing_ns);
+}
+
+/* Takes new parameters keeping level and trend; errors seen at another horizon no longer apply */
+void forecast_tune(struct forecast *forecast, int64_t horizon_ns, int64_t smoothing_ns)
+{
+     if (forecast->horizon_ns != horizon_ns) {
+	  forecast->check_ns = 0;
+	  forecast->error_var = 0;
+	  forecast->checks = 0;
+     }
+
+     forecast->horizon_ns = horizon_ns;
+     forecast->level_ns = smoothing_ns;
+     forecast->trend_ns = smoothing_ns * FORECAST_TREND_FACTOR;
+}
+
+/*
+ * O(1) per sample. The weights dt / (tau + dt) approach the usual constant alpha and beta for a
+ * fixed period and let a sample after a long gap count for more than one right after another.
+ */
+void forecast_add(struct forecast *forecast, int64_t t_ns, int32_t value)
+{
+     double x = value;
+
+     if (!forecast->primed) {
+	  forecast->primed = 1;
+	  forecast->last_ns = t_ns;
+	  forecast->level = x;
+	  forecast->trend = 0;
+	  return;
+     }
+     if (t_ns <= forecast->last_ns) return;
+
+     double dt = (double)(t_ns - forecast->last_ns) / (double)NSECS_PER_SEC;
+     double alpha = dt / ((double)forecast->level_ns / (double)NSECS_PER_SEC + dt);
+     double beta = dt / ((double)forecast->trend_ns / (double)NSECS_PER_SEC + dt);
+     double predicted = forecast->level + forecast->trend * dt;
+     double level = predicted + alpha * (x - predicted);
+
+     forecast->trend += beta * ((level - forecast->level) / dt - forecast->trend);
+     forecast->level = level;
+     forecast->last_ns = t_ns;
+
+     if (forecast->check_ns && t_ns >= forecast->check_ns) {
+	  double error = x - forecast->check_value;
+	  uint32_t n = forecast->checks < FORECAST_CHECKS_MEMORY ? forecast->checks + 1 : FORECAST_CHECKS_MEMORY;
+
+	  forecast->error_var += (error * error - forecast->error_var) / n;
+	  forecast->checks += 1;
+	  forecast->check_ns = 0;
+     }
+
+     if (forecast->check_ns == 0) {
+	  forecast->check_ns = t_ns + forecast->horizon_ns;
+	  forecast->check_value = forecast->level + forecast->trend * (double)forecast->horizon_ns / (double)NSECS_PER_SEC;
+     }
+}
+
+/*
+ * Excess expected at the horizon from now_ns and the bound it is expected within. Returns 0 while
+ * too few forecasts were checked to tell how far off they are.
+ */
+int forecast_predict(const struct forecast *forecast, int64_t now_ns, int32_t *value, int32_t *bound)
+{
+     double ahead = (double)(now_ns - forecast->last_ns + forecast->horizon_ns) / (double)NSECS_PER_SEC;
+     double predicted = forecast->level + forecast->trend * ahead;
+
+     if (!forecast->primed || forecast->checks < FORECAST_CHECKS_MIN) return 0;
+
+     if (predicted > INT32_MAX / 2) predicted = INT32_MAX / 2;
+     if (predicted < INT32_MIN / 2) predicted = INT32_MIN / 2;
+     *value = (int32_t)predicted;
+     *bound = (int32_t)fmin(FORECAST_Z * sqrt(forecast->error_var), INT32_MAX / 2);
+
+     return 1;
+}
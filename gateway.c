@@ -0,0 +1,533 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "powerplay.h"
+
+/*
+ *
+ * Gateway
+ *
+ */
+
+static void gateway_put16(uint8_t *p, uint16_t value)
+{
+     p[0] = (uint8_t)(value >> 8);
+     p[1] = (uint8_t)value;
+}
+
+static uint16_t gateway_get16(const uint8_t *p)
+{
+     return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static void gateway_count(uint64_t *counter)
+{
+     __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void gateway_respond(struct gateway_client *client, uint16_t tid, uint8_t unit, const uint8_t *pdu, size_t len)
+{
+     uint8_t adu[MBTCP_ADU_MAX];
+
+     gateway_put16(adu, tid);
+     gateway_put16(adu + 2, 0);
+     gateway_put16(adu + 4, (uint16_t)(len + 1));
+     adu[6] = unit;
+     memcpy(adu + 7, pdu, len);
+
+     if (send(client->fd, adu, 7 + len, MSG_NOSIGNAL) != (ssize_t)(7 + len)) client->closing = 1;
+}
+
+static void gateway_exception(struct gateway_client *client, uint16_t tid, uint8_t unit, uint8_t function,
+			      uint8_t code)
+{
+     uint8_t pdu[2] = { (uint8_t)(function | 0x80), code };
+
+     gateway_respond(client, tid, unit, pdu, sizeof(pdu));
+}
+
+/* Slot of addr in the plan values, -1 for registers not polled */
+static int gateway_slot(const struct register_plan *plan, uint16_t addr)
+{
+     size_t offset = 0;
+
+     for (size_t i = 0; i < plan->nranges; ++i) {
+	  const struct register_range *r = &plan->ranges[i];
+
+	  if (addr >= r->addr && addr - r->addr < r->count) return (int)(offset + (size_t)(addr - r->addr));
+	  offset += r->count;
+     }
+
+     return -1;
+}
+
+/* Answers a read from the polled values if they hold all of it and are recent enough */
+static int gateway_cached(struct gateway *gw, struct gateway_client *client, uint16_t tid, uint8_t unit,
+			  uint16_t addr, uint16_t count)
+{
+     struct gateway_device *dev = &gw->devices[client->device];
+     uint8_t pdu[2 + 2 * MODBUS_MAX_READ_REGISTERS];
+     int hit = unit == dev->unit;
+
+     pthread_mutex_lock(&gw->lock);
+     hit = hit && dev->read_ns && monotonic_ns() - dev->read_ns <= gw->max_age_ns;
+     for (uint16_t i = 0; hit && i < count; ++i) {
+	  int slot = gateway_slot(&dev->plan, (uint16_t)(addr + i));
+	  if (slot < 0) hit = 0;
+	  else gateway_put16(pdu + 2 + 2 * i, dev->values[slot]);
+     }
+     pthread_mutex_unlock(&gw->lock);
+
+     if (!hit) return 0;
+
+     pdu[0] = MBTCP_READ_REGISTERS;
+     pdu[1] = (uint8_t)(2 * count);
+     gateway_respond(client, tid, unit, pdu, 2 + 2 * (size_t)count);
+     gateway_count(&gw->cached);
+
+     return 1;
+}
+
+/*
+ * Handles one request frame. Returns 1 if it went to the control thread, which leaves further
+ * frames of this client buffered until the response went out.
+ */
+static int gateway_request(struct gateway *gw, struct gateway_client *client, uint16_t tid, uint8_t unit,
+			   const uint8_t *pdu, size_t len)
+{
+     struct mbtcp_request req = { .function = pdu[0], .unit = unit };
+     uint8_t function = pdu[0];
+
+     switch (function) {
+     case MBTCP_READ_REGISTERS:
+	  if (len != 5) goto invalid;
+	  req.addr = gateway_get16(pdu + 1);
+	  req.count = gateway_get16(pdu + 3);
+	  if (req.count == 0 || req.count > MODBUS_MAX_READ_REGISTERS) goto invalid;
+	  if (gateway_cached(gw, client, tid, unit, req.addr, req.count)) return 0;
+	  break;
+     case MBTCP_WRITE_REGISTER:
+	  if (len != 5) goto invalid;
+	  req.write_addr = gateway_get16(pdu + 1);
+	  req.write_count = 1;
+	  client->write_values[0] = gateway_get16(pdu + 3);
+	  break;
+     case MBTCP_WRITE_REGISTERS:
+	  if (len < 6) goto invalid;
+	  req.write_addr = gateway_get16(pdu + 1);
+	  req.write_count = gateway_get16(pdu + 3);
+	  if (req.write_count == 0 || req.write_count > MODBUS_MAX_WRITE_REGISTERS
+	      || pdu[5] != 2 * req.write_count || len != 6 + 2 * (size_t)req.write_count) goto invalid;
+	  for (uint16_t i = 0; i < req.write_count; ++i) client->write_values[i] = gateway_get16(pdu + 6 + 2 * i);
+	  break;
+     case MBTCP_WRITE_READ_REGISTERS:
+	  if (len < 10) goto invalid;
+	  req.addr = gateway_get16(pdu + 1);
+	  req.count = gateway_get16(pdu + 3);
+	  req.write_addr = gateway_get16(pdu + 5);
+	  req.write_count = gateway_get16(pdu + 7);
+	  if (req.count == 0 || req.count > MODBUS_MAX_WR_READ_REGISTERS
+	      || req.write_count == 0 || req.write_count > MODBUS_MAX_WR_WRITE_REGISTERS
+	      || pdu[9] != 2 * req.write_count || len != 10 + 2 * (size_t)req.write_count) goto invalid;
+	  for (uint16_t i = 0; i < req.write_count; ++i) client->write_values[i] = gateway_get16(pdu + 10 + 2 * i);
+	  break;
+     default:
+	  gateway_count(&gw->rejected);
+	  gateway_exception(client, tid, unit, function, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+	  return 0;
+     }
+
+     /* A dry run writes nothing, whoever asks */
+     if (function != MBTCP_READ_REGISTERS && gw->dryrun) {
+	  gateway_count(&gw->rejected);
+	  gateway_exception(client, tid, unit, function, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+	  return 0;
+     }
+
+     /* Writes to a charger go through its shadow, which takes one register and no other read */
+     if (client->device && (req.write_count > 1 || function == MBTCP_WRITE_READ_REGISTERS)) {
+	  gateway_count(&gw->rejected);
+	  gateway_exception(client, tid, unit, function, MODBUS_EXCEPTION_ILLEGAL_FUNCTION);
+	  return 0;
+     }
+
+     req.values = client->values;
+     req.write_values = client->write_values;
+
+     pthread_mutex_lock(&gw->lock);
+     client->tid = tid;
+     client->req = req;
+     client->state = GATEWAY_QUEUED;
+     pthread_mutex_unlock(&gw->lock);
+
+     return 1;
+
+invalid:
+     gateway_count(&gw->rejected);
+     gateway_exception(client, tid, unit, function, MODBUS_EXCEPTION_ILLEGAL_DATA_VALUE);
+     return 0;
+}
+
+/* Works through the buffered frames of an idle client */
+static void gateway_client_process(struct gateway *gw, struct gateway_client *client)
+{
+     size_t offset = 0;
+
+     while (!client->closing && client->state == GATEWAY_IDLE && client->rx_len - offset >= 8) {
+	  const uint8_t *adu = client->rx + offset;
+	  size_t len = gateway_get16(adu + 4);
+
+	  if (gateway_get16(adu + 2) != 0 || len < 2 || len > MBTCP_ADU_MAX - 6) {
+	       client->closing = 1;
+	       break;
+	  }
+	  if (client->rx_len - offset < 6 + len) break;
+
+	  gateway_request(gw, client, gateway_get16(adu), adu[6], adu + 7, len - 1);
+	  offset += 6 + len;
+     }
+
+     memmove(client->rx, client->rx + offset, client->rx_len - offset);
+     client->rx_len -= offset;
+}
+
+/* Sends what the control thread finished; a client gone meanwhile only now frees its slot */
+static void gateway_complete(struct gateway *gw)
+{
+     for (size_t i = 0; i < GATEWAY_CLIENTS_MAX; ++i) {
+	  struct gateway_client *client = &gw->clients[i];
+	  struct mbtcp_request *req = &client->req;
+	  uint8_t pdu[2 + 2 * MODBUS_MAX_READ_REGISTERS];
+	  size_t len = 0;
+
+	  pthread_mutex_lock(&gw->lock);
+	  int done = client->state == GATEWAY_DONE;
+	  pthread_mutex_unlock(&gw->lock);
+	  if (!done) continue;
+
+	  if (client->fd != -1 && !client->closing) {
+	       if (req->result > MODBUS_ENOBASE && req->result < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX) {
+		    gateway_exception(client, client->tid, req->unit, req->function,
+				      (uint8_t)(req->result - MODBUS_ENOBASE));
+	       } else if (req->result) {
+		    gateway_exception(client, client->tid, req->unit, req->function,
+				      MODBUS_EXCEPTION_GATEWAY_TARGET);
+	       } else {
+		    pdu[len++] = req->function;
+		    switch (req->function) {
+		    case MBTCP_WRITE_REGISTER:
+			 gateway_put16(pdu + len, req->write_addr);
+			 gateway_put16(pdu + len + 2, req->write_values[0]);
+			 len += 4;
+			 break;
+		    case MBTCP_WRITE_REGISTERS:
+			 gateway_put16(pdu + len, req->write_addr);
+			 gateway_put16(pdu + len + 2, req->write_count);
+			 len += 4;
+			 break;
+		    case MBTCP_READ_REGISTERS:
+		    case MBTCP_WRITE_READ_REGISTERS:
+		    default:
+			 pdu[len++] = (uint8_t)(2 * req->count);
+			 for (uint16_t r = 0; r < req->count; ++r, len += 2) gateway_put16(pdu + len, req->values[r]);
+			 break;
+		    }
+		    gateway_respond(client, client->tid, req->unit, pdu, len);
+	       }
+	  }
+
+	  pthread_mutex_lock(&gw->lock);
+	  client->state = GATEWAY_IDLE;
+	  pthread_mutex_unlock(&gw->lock);
+
+	  gateway_client_process(gw, client);
+     }
+}
+
+static void gateway_accept(struct gateway *gw, size_t device)
+{
+     int fd = accept4(gw->devices[device].fd, NULL, NULL, SOCK_CLOEXEC);
+     if (fd == -1) return;
+
+     pthread_mutex_lock(&gw->lock);
+     struct gateway_client *client = NULL;
+     for (size_t i = 0; i < GATEWAY_CLIENTS_MAX && client == NULL; ++i)
+	  if (gw->clients[i].fd == -1 && gw->clients[i].state == GATEWAY_IDLE) client = &gw->clients[i];
+     pthread_mutex_unlock(&gw->lock);
+
+     if (client) {
+	  /* A stuck client may hold up other clients but never the control loop */
+	  struct timeval timeout = { .tv_sec = 1 };
+	  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	  client->fd = fd;
+	  client->device = device;
+	  client->closing = 0;
+	  client->rx_len = 0;
+	  return;
+     }
+
+     gateway_count(&gw->rejected);
+     close(fd);
+}
+
+static void gateway_client_read(struct gateway *gw, struct gateway_client *client)
+{
+     ssize_t got = recv(client->fd, client->rx + client->rx_len, sizeof(client->rx) - client->rx_len, MSG_DONTWAIT);
+
+     if (got == 0 || (got == -1 && errno != EAGAIN && errno != EINTR)) client->closing = 1;
+     if (got <= 0) return;
+
+     client->rx_len += (size_t)got;
+     gateway_client_process(gw, client);
+     if (client->rx_len == sizeof(client->rx)) client->closing = 1;
+}
+
+static void *gateway_run(void *arg)
+{
+     struct gateway *gw = arg;
+     struct pollfd pfds[1 + GATEWAY_DEVICES + GATEWAY_CLIENTS_MAX];
+
+     for (;;) {
+	  size_t n = 0;
+
+	  pfds[n++] = (struct pollfd){ .fd = gw->wake[0], .events = POLLIN };
+	  for (size_t d = 0; d < gw->ndevices; ++d) pfds[n++] = (struct pollfd){ .fd = gw->devices[d].fd, .events = POLLIN };
+	  pthread_mutex_lock(&gw->lock);
+	  for (size_t i = 0; i < GATEWAY_CLIENTS_MAX; ++i) {
+	       struct gateway_client *client = &gw->clients[i];
+	       pfds[n++] = (struct pollfd){
+		    .fd = client->fd,
+		    .events = client->state == GATEWAY_IDLE && client->rx_len < sizeof(client->rx) ? POLLIN : 0,
+	       };
+	  }
+	  pthread_mutex_unlock(&gw->lock);
+
+	  if (poll(pfds, n, -1) == -1) {
+	       if (errno == EINTR) continue;
+	       fprintf(stderr, "Error: gateway poll failed: %s\n", strerror(errno));
+	       fflush(stderr);
+	       return NULL;
+	  }
+
+	  if (pfds[0].revents) {
+	       char buf[64];
+	       while (read(gw->wake[0], buf, sizeof(buf)) > 0);
+	       gateway_complete(gw);
+	  }
+
+	  for (size_t d = 0; d < gw->ndevices; ++d)
+	       if (pfds[1 + d].revents & POLLIN) gateway_accept(gw, d);
+
+	  for (size_t i = 0; i < GATEWAY_CLIENTS_MAX; ++i) {
+	       struct gateway_client *client = &gw->clients[i];
+	       short revents = pfds[1 + gw->ndevices + i].revents;
+
+	       if (client->fd == -1) continue;
+	       if (revents & POLLIN) gateway_client_read(gw, client);
+	       else if (revents & (POLLHUP | POLLERR)) client->closing = 1;
+
+	       /* The slot of a request still with the control thread stays taken until it is done */
+	       if (client->closing) {
+		    close(client->fd);
+		    client->fd = -1;
+		    client->rx_len = 0;
+	       }
+	  }
+     }
+}
+
+static int gateway_listen(struct gateway_device *dev, const char *addr, int port)
+{
+     struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons((uint16_t)port) };
+     int one = 1;
+
+     dev->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+     if (dev->fd == -1) {
+	  fprintf(stderr, "Error: could not create gateway socket: %s\n", strerror(errno));
+	  return -1;
+     }
+
+     if (inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+	  fprintf(stderr, "Error: invalid gateway address %s\n", addr);
+	  return -1;
+     }
+
+     setsockopt(dev->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+     if (bind(dev->fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 || listen(dev->fd, 8) == -1) {
+	  fprintf(stderr, "Error: could not listen on %s:%d: %s\n", addr, port, strerror(errno));
+	  return -1;
+     }
+
+     return 0;
+}
+
+/* The GX on GATEWAY_PORT, the chargers on the ports following it in configuration order */
+int gateway_start(struct gateway *gw, const struct system_status *status)
+{
+     const struct config *config = &status->config;
+     int err;
+
+     gw->max_age_ns = config->gateway_max_age_msecs * NSECS_PER_MSEC;
+     gw->dryrun = config->dryrun;
+     for (size_t i = 0; i < GATEWAY_CLIENTS_MAX; ++i) gw->clients[i].fd = -1;
+
+     err = pthread_mutex_init(&gw->lock, NULL);
+     if (err) {
+	  fprintf(stderr, "Error: could not create gateway lock: %s\n", strerror(err));
+	  goto error;
+     }
+
+     if (pipe2(gw->wake, O_CLOEXEC | O_NONBLOCK) == -1) {
+	  fprintf(stderr, "Error: could not create gateway pipe: %s\n", strerror(errno));
+	  goto error;
+     }
+
+     gw->ndevices = 1 + status->nevcs;
+     for (size_t d = 0; d < gw->ndevices; ++d) {
+	  struct gateway_device *dev = &gw->devices[d];
+
+	  dev->name = d ? status->evcs[d - 1].link.name : status->gx_link.name;
+	  dev->plan = d ? status->evcs[d - 1].plan : status->gx_plan;
+	  dev->unit = dev->plan.unit;
+	  if (gateway_listen(dev, config->gateway_addr, config->gateway_port + (int)d)) goto error;
+     }
+
+     err = pthread_create(&gw->thread, NULL, gateway_run, gw);
+     if (err) {
+	  fprintf(stderr, "Error: could not start gateway thread: %s\n", strerror(err));
+	  goto error;
+     }
+
+     return 0;
+
+error:
+     fflush(stderr);
+     return -1;
+}
+
+/* Hands the values of this cycle to the gateway, once per cycle from the control thread */
+void gateway_publish(struct gateway *gw, const struct system_status *status)
+{
+     pthread_mutex_lock(&gw->lock);
+     for (size_t d = 0; d < gw->ndevices; ++d) {
+	  struct gateway_device *dev = &gw->devices[d];
+	  const struct shadow *shadow = d ? &status->evcs[d - 1].shadow : &status->gx_shadow;
+
+	  dev->read_ns = d ? status->evcs[d - 1].updated_ns : status->gx_updated_ns;
+	  memcpy(dev->values, shadow->values, dev->plan.nvalues * sizeof(dev->values[0]));
+     }
+     pthread_mutex_unlock(&gw->lock);
+}
+
+/* The request to send for a client's, SHADOW_WRITTEN unless a charger's shadow holds the write back */
+static int gateway_request_prepare(struct shadow *shadow, const struct mbtcp_request *req, int64_t now_ns,
+				   struct mbtcp_request *out)
+{
+     if (shadow == NULL || req->write_count == 0) {
+	  *out = *req;
+	  return SHADOW_WRITTEN;
+     }
+
+     return shadow_write_request(shadow, req->unit, req->write_addr, req->write_values, now_ns, out);
+}
+
+/*
+ * Runs the queued requests of all clients, one batch per device on sparkshift's own connection,
+ * after the reads of the cycle. A device whose acquisition worker missed the deadline and still
+ * uses the link answers busy, one that is not connected fails its requests at once; reconnecting
+ * is left to the next acquisition. Writes to a charger go through its shadow like sparkshift's
+ * own, one it already holds is answered without sending it and one too soon after the last is
+ * answered busy.
+ */
+void gateway_forward(struct gateway *gw, struct system_status *status, struct acquisition *acq)
+{
+     struct gateway_client *batch[GATEWAY_CLIENTS_MAX];
+     struct mbtcp_request reqs[GATEWAY_CLIENTS_MAX];
+     int sent[GATEWAY_CLIENTS_MAX], result[GATEWAY_CLIENTS_MAX];
+     int64_t now = monotonic_ns();
+     int completed = 0;
+
+     for (size_t d = 0; d < gw->ndevices; ++d) {
+	  struct modbus_link *link = d ? &status->evcs[d - 1].link : &status->gx_link;
+	  struct shadow *shadow = d ? &status->evcs[d - 1].shadow : NULL;
+	  int idle = acquisition_idle(acq, d ? ACQUIRED_CHARGER(d - 1) : ACQUIRED_GX);
+	  int decode = 0;
+	  size_t n = 0, nsent = 0;
+
+	  pthread_mutex_lock(&gw->lock);
+	  for (size_t i = 0; i < GATEWAY_CLIENTS_MAX; ++i) {
+	       struct gateway_client *client = &gw->clients[i];
+	       if (client->state != GATEWAY_QUEUED || client->device != d) continue;
+	       client->state = GATEWAY_RUNNING;
+	       batch[n++] = client;
+	  }
+	  pthread_mutex_unlock(&gw->lock);
+	  if (n == 0) continue;
+
+	  for (size_t i = 0; i < n; ++i) {
+	       int rc = idle ? gateway_request_prepare(shadow, &batch[i]->req, now, &reqs[nsent]) : SHADOW_DEFERRED;
+
+	       sent[i] = rc == SHADOW_WRITTEN ? (int)nsent++ : -1;
+	       result[i] = rc == SHADOW_DEFERRED ? EMBXSBUSY : 0;
+	  }
+
+	  if (nsent && mbtcp_connected(&link->client)) {
+	       mbtcp_batch(&link->client, reqs, nsent);
+	       if (!mbtcp_connected(&link->client)) link_failed(link, monotonic_ns());
+	  } else {
+	       for (size_t i = 0; i < nsent; ++i) reqs[i].result = ENOTCONN;
+	  }
+
+	  for (size_t i = 0; i < n; ++i) {
+	       if (sent[i] < 0) continue;
+	       const struct mbtcp_request *req = &reqs[sent[i]];
+
+	       result[i] = req->result;
+	       if (shadow && batch[i]->req.write_count) {
+		    int rc = shadow_write_result(shadow, req, now);
+		    /* Rejected function 23, asked for anew as function 6 next cycle */
+		    if (rc == 0) result[i] = -1;
+		    if (rc == 1 && req->function == MBTCP_WRITE_READ_REGISTERS) decode = 1;
+	       }
+	  }
+	  if (decode) evcs_values_decode(status, d - 1, shadow->values);
+
+	  pthread_mutex_lock(&gw->lock);
+	  for (size_t i = 0; i < n; ++i) {
+	       if (result[i] == -1) {
+		    batch[i]->state = GATEWAY_QUEUED;
+		    continue;
+	       }
+	       batch[i]->req.result = result[i];
+	       batch[i]->state = GATEWAY_DONE;
+	       gateway_count(&gw->forwarded);
+	       if (result[i]) gateway_count(&gw->failed);
+	  }
+	  pthread_mutex_unlock(&gw->lock);
+	  completed = 1;
+     }
+
+     if (completed && write(gw->wake[1], "", 1) == -1 && errno != EAGAIN) {
+	  fprintf(stderr, "Error: could not wake gateway: %s\n", strerror(errno));
+	  fflush(stderr);
+     }
+}
+
+void gateway_stats_print(const struct gateway *gw)
+{
+     printf("Gateway: %" PRIu64 " cached, %" PRIu64 " forwarded, %" PRIu64 " failed, %" PRIu64 " rejected\n",
+	    __atomic_load_n(&gw->cached, __ATOMIC_RELAXED), __atomic_load_n(&gw->forwarded, __ATOMIC_RELAXED),
+	    __atomic_load_n(&gw->failed, __ATOMIC_RELAXED), __atomic_load_n(&gw->rejected, __ATOMIC_RELAXED));
+     fflush(stdout);
+}
@@ -0,0 +1,554 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "powerplay.h"
+
+/*
+  Gridsim - GX and EVCS Modbus TCP simulator
+
+  Serves the GX (unit 100) and EVCS register maps on localhost so sparkshift can run without
+  Victron hardware. PV and house consumption follow a profile, the battery absorbs what it can,
+  the grid takes the rest. In auto mode the EVCS starts and stops charging on writes to its charge
+  start register, in manual mode, which it starts in, it charges at its set current whenever a
+  car is connected. Both devices run on their own thread so injected latency on one does not delay
+  the other.
+
+  Usage: gridsim [options] PROFILE
+
+  -g PORT	GX port (default 5020)
+  -e PORT	EVCS port (default 5021)
+  -s SPEED	profile seconds per wall-clock second (default 1)
+  -r SECS	seconds between lines of a recorded sparkshift log profile (default 1)
+  -l MSECS	added response latency per request (default 0)
+  -j MSECS	random extra latency per request up to this bound (default 0)
+  -p PERCENT	requests dropped without reply (default 0)
+  -d SECS	drop all client connections every SECS seconds (default never)
+  -c		car connected from the start when the profile does not say otherwise
+  -i MSECS	idle gap that separates two control cycles in the statistics (default 100)
+  -u UNIT	GX unit id (default 100)
+  -o OFFSET	serve the GX registers this far from their listed addresses, as a firmware
+		moving its map would (default 0)
+
+  Profiles are either scripted lines "SECS PV_W HOUSE_W [CAR]" or a recorded sparkshift log whose
+  P/, C/ and E/ fields after R/ provide PV and consumption. The profile repeats once exhausted. A summary of
+  round trips, cycle latency and actuation delays is printed on SIGINT or SIGTERM.
+ */
+
+#define GX_UNIT_ID		100
+#define SIM_PROFILE_MAX		(7 * 24 * 3600)
+#define SIM_CLIENTS_MAX		8
+#define SIM_CYCLES_MAX		65536
+#define SIM_BATTERY_POWER_MAX	5000
+#define SIM_BATTERY_WH		10000.0
+#define SIM_VOLTAGE		230
+#define SIM_PHASES		3
+#define SIM_START_MSECS		2000
+#define SIM_STOP_MSECS		1000
+
+struct sim_step {
+     double secs;
+     int32_t pv, house;
+     int car;
+};
+
+struct sim_device {
+     const char *name;
+     int port;
+     int unit;
+     int offset; /* from the listed register addresses to those served */
+     modbus_t *ctx;
+     modbus_mapping_t *mapping;
+     pthread_t thread;
+     uint64_t requests, dropped, disconnects;
+};
+
+struct sim_cycle {
+     uint32_t requests;
+     int64_t first_ns, last_ns;
+};
+
+static struct {
+     pthread_mutex_t lock;
+
+     double speed;
+     int64_t latency_ns, jitter_ns, disconnect_ns, idle_ns;
+     int drop_percent;
+     int car_default;
+
+     size_t nsteps;
+     struct sim_step *steps;
+
+     int64_t start_ns, model_ns;
+     double soc;
+     uint16_t charger_status;
+     int64_t status_ns;
+
+     struct sim_device gx, evcs;
+
+     struct sim_cycle cycle;
+     size_t ncycles;
+     uint32_t cycle_requests[SIM_CYCLES_MAX];
+     uint32_t cycle_usecs[SIM_CYCLES_MAX];
+
+     int64_t evcs_read_ns, write_ns;
+     uint16_t write_value;
+     size_t nwrites;
+     uint32_t decision_usecs[SIM_CYCLES_MAX];
+     size_t nactuations;
+     uint32_t actuation_usecs[SIM_CYCLES_MAX];
+} sim;
+
+static volatile sig_atomic_t sim_stop;
+
+static void sim_signal(int sig)
+{
+     (void)sig;
+     sim_stop = 1;
+}
+
+static int profile_parse_recorded(const char *line, struct sim_step *step)
+{
+     const char *pv = status_line_field(line, "P/");
+     const char *consumption = status_line_field(line, "C/");
+     const char *evcs = status_line_field(line, "E/");
+
+     if (pv == NULL || consumption == NULL || evcs == NULL) return -1;
+
+     step->pv = (int32_t)atoi(pv);
+     step->house = (int32_t)(atoi(consumption) - atoi(evcs));
+     step->car = -1;
+     return 0;
+}
+
+static int profile_load(const char *path, double recorded_secs)
+{
+     char line[256];
+     FILE *f = fopen(path, "r");
+     if (f == NULL) {
+	  fprintf(stderr, "Error: could not open profile %s: %s\n", path, strerror(errno));
+	  goto error;
+     }
+
+     sim.steps = calloc(SIM_PROFILE_MAX, sizeof(sim.steps[0]));
+     if (sim.steps == NULL) {
+	  fprintf(stderr, "Error: could not allocate profile\n");
+	  goto error;
+     }
+
+     while (fgets(line, sizeof(line), f) && sim.nsteps < SIM_PROFILE_MAX) {
+	  struct sim_step *step = &sim.steps[sim.nsteps];
+
+	  if (line[0] == '#' || line[0] == '\n') continue;
+
+	  if (!strncmp(line, "M/", 2)) {
+	       if (profile_parse_recorded(line, step)) continue;
+	       step->secs = (double)sim.nsteps * recorded_secs;
+	  } else {
+	       step->car = -1;
+	       if (sscanf(line, "%lf %d %d %d", &step->secs, &step->pv, &step->house, &step->car) < 3) {
+		    fprintf(stderr, "Error: malformed profile line: %s", line);
+		    goto error;
+	       }
+	  }
+
+	  sim.nsteps += 1;
+     }
+
+     if (sim.nsteps == 0) {
+	  fprintf(stderr, "Error: profile %s is empty\n", path);
+	  goto error;
+     }
+
+     fclose(f);
+     return 0;
+
+error:
+     if (f) fclose(f);
+     fflush(stderr);
+     return -1;
+}
+
+static const struct sim_step *profile_at(double secs)
+{
+     double period = sim.steps[sim.nsteps - 1].secs + 1;
+     double t = secs - period * (double)(int64_t)(secs / period);
+     size_t lo = 0, hi = sim.nsteps;
+
+     /* Last step at or before t */
+     while (hi - lo > 1) {
+	  size_t mid = (lo + hi) / 2;
+	  if (sim.steps[mid].secs <= t) lo = mid;
+	  else hi = mid;
+     }
+
+     return &sim.steps[lo];
+}
+
+static uint16_t *sim_register(struct sim_device *device, int addr)
+{
+     return &device->mapping->tab_registers[addr + device->offset - device->mapping->start_registers];
+}
+
+static void sim_phases_set(struct sim_device *device, int addr, int32_t total)
+{
+     for (int i = 0; i < SIM_PHASES; ++i) *sim_register(device, addr + i) = (uint16_t)(int16_t)(total / SIM_PHASES);
+}
+
+/* Advances the model to now and refreshes all read-only registers, called with the lock held */
+static void sim_model_update(int64_t now_ns)
+{
+     double secs = (double)(now_ns - sim.start_ns) / (double)NSECS_PER_SEC * sim.speed;
+     double dt = (double)(now_ns - sim.model_ns) / (double)NSECS_PER_SEC * sim.speed;
+     const struct sim_step *step = profile_at(secs);
+     int car = step->car >= 0 ? step->car : sim.car_default;
+
+     uint16_t mode = *sim_register(&sim.evcs, EVCS_REGISTER_CHARGE_MODE);
+     uint16_t charge_start = *sim_register(&sim.evcs, EVCS_REGISTER_CHARGE_START);
+     uint16_t current = *sim_register(&sim.evcs, EVCS_REGISTER_CHARGING_CURRENT);
+     uint16_t current_max = *sim_register(&sim.evcs, EVCS_REGISTER_MAX_CURRENT);
+     uint16_t status = sim.charger_status;
+     int64_t in_status_ns = now_ns - sim.status_ns;
+
+     if (current > current_max) current = current_max;
+     /* Manual holds the set current, charge start writes only count in auto mode */
+     if (mode == EVCS_CHARGE_MODE_MANUAL) charge_start = EVCS_CHARGING_START;
+
+     if (!car) {
+	  status = EVCS_CHARGER_STATUS_DISCONNECTED;
+     } else if (status == EVCS_CHARGER_STATUS_DISCONNECTED) {
+	  status = EVCS_CHARGER_STATUS_CONNECTED;
+     } else if (status == EVCS_CHARGER_STATUS_CONNECTED && charge_start == EVCS_CHARGING_START) {
+	  status = EVCS_CHARGER_STATUS_START_CHARGING;
+     } else if (status == EVCS_CHARGER_STATUS_START_CHARGING && in_status_ns >= SIM_START_MSECS * NSECS_PER_MSEC) {
+	  status = EVCS_CHARGER_STATUS_CHARGING;
+     } else if (status == EVCS_CHARGER_STATUS_CHARGING && charge_start == EVCS_CHARGING_STOP) {
+	  status = EVCS_CHARGER_STATUS_STOP_CHARGING;
+     } else if (status == EVCS_CHARGER_STATUS_STOP_CHARGING && in_status_ns >= SIM_STOP_MSECS * NSECS_PER_MSEC) {
+	  status = EVCS_CHARGER_STATUS_CONNECTED;
+     }
+
+     if (status != sim.charger_status) {
+	  sim.charger_status = status;
+	  sim.status_ns = now_ns;
+     }
+
+     int32_t evcs = status == EVCS_CHARGER_STATUS_CHARGING ? SIM_VOLTAGE * SIM_PHASES * current : 0;
+     int32_t net = step->pv - step->house - evcs;
+     int32_t battery = net;
+
+     if (battery > SIM_BATTERY_POWER_MAX) battery = SIM_BATTERY_POWER_MAX;
+     if (battery < -SIM_BATTERY_POWER_MAX) battery = -SIM_BATTERY_POWER_MAX;
+     if ((battery > 0 && sim.soc >= 100.0) || (battery < 0 && sim.soc <= 10.0)) battery = 0;
+     sim.soc += (double)battery * dt / 3600.0 / SIM_BATTERY_WH * 100.0;
+     sim.model_ns = now_ns;
+
+     sim_phases_set(&sim.gx, GX_REGISTER_PV_AC_IN_L1, step->pv);
+     sim_phases_set(&sim.gx, GX_REGISTER_AC_CONSUMPTION_L1, step->house + evcs);
+     sim_phases_set(&sim.gx, GX_REGISTER_GRID_L1, battery - net);
+     *sim_register(&sim.gx, GX_REGISTER_BATTERY_POWER) = (uint16_t)(int16_t)battery;
+     *sim_register(&sim.gx, GX_REGISTER_BATTERY_SOC) = (uint16_t)sim.soc;
+
+     *sim_register(&sim.evcs, EVCS_REGISTER_TOTAL_POWER) = (uint16_t)evcs;
+     *sim_register(&sim.evcs, EVCS_REGISTER_CHARGER_STATUS) = status;
+}
+
+static void sim_cycle_account(int64_t arrival_ns, int64_t reply_ns)
+{
+     struct sim_cycle *cycle = &sim.cycle;
+
+     if (cycle->requests && arrival_ns - cycle->last_ns > sim.idle_ns) {
+	  if (sim.ncycles < SIM_CYCLES_MAX) {
+	       sim.cycle_requests[sim.ncycles] = cycle->requests;
+	       sim.cycle_usecs[sim.ncycles] = (uint32_t)((cycle->last_ns - cycle->first_ns) / 1000);
+	       sim.ncycles += 1;
+	  }
+	  cycle->requests = 0;
+     }
+
+     if (cycle->requests == 0) cycle->first_ns = arrival_ns;
+     cycle->requests += 1;
+     if (reply_ns > cycle->last_ns) cycle->last_ns = reply_ns;
+}
+
+/* Tracks the delay from the last charger read to a charge start write, and from that write to
+ * the charger reporting the commanded state */
+static void sim_actuation_account(struct sim_device *device, const uint8_t *query, int64_t arrival_ns, int64_t reply_ns)
+{
+     int offset = modbus_get_header_length(device->ctx);
+     int function = query[offset];
+     int addr = (query[offset + 1] << 8) | query[offset + 2];
+
+     int write_addr = -1;
+     uint16_t write_value = 0;
+
+     if (device != &sim.evcs) return;
+
+     if (function == 6) {
+	  write_addr = addr;
+	  write_value = (uint16_t)((query[offset + 3] << 8) | query[offset + 4]);
+     } else if (function == 23) {
+	  write_addr = (query[offset + 5] << 8) | query[offset + 6];
+	  write_value = (uint16_t)((query[offset + 10] << 8) | query[offset + 11]);
+     }
+
+     if (write_addr == EVCS_REGISTER_CHARGE_START) {
+	  if (sim.evcs_read_ns && sim.nwrites < SIM_CYCLES_MAX)
+	       sim.decision_usecs[sim.nwrites++] = (uint32_t)((arrival_ns - sim.evcs_read_ns) / 1000);
+	  sim.write_ns = arrival_ns;
+	  sim.write_value = write_value;
+	  return;
+     }
+
+     if (function == 3 || function == 23) {
+	  sim.evcs_read_ns = reply_ns;
+
+	  int done = sim.write_value == EVCS_CHARGING_START
+	       ? sim.charger_status == EVCS_CHARGER_STATUS_CHARGING
+	       : sim.charger_status == EVCS_CHARGER_STATUS_CONNECTED;
+	  if (sim.write_ns && done && sim.nactuations < SIM_CYCLES_MAX) {
+	       sim.actuation_usecs[sim.nactuations++] = (uint32_t)((reply_ns - sim.write_ns) / 1000);
+	       sim.write_ns = 0;
+	  }
+     }
+}
+
+static void sim_sleep_ns(int64_t ns)
+{
+     struct timespec ts = { .tv_sec = (time_t)(ns / NSECS_PER_SEC), .tv_nsec = (long)(ns % NSECS_PER_SEC) };
+     while (nanosleep(&ts, &ts) == -1 && errno == EINTR && !sim_stop);
+}
+
+/* Serves one request from fd, returns -1 once the client went away */
+static int sim_serve(struct sim_device *device, int fd)
+{
+     uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+     int64_t arrival_ns;
+     int rc;
+
+     modbus_set_socket(device->ctx, fd);
+     rc = modbus_receive(device->ctx, query);
+     if (rc <= 0) return rc;
+     arrival_ns = monotonic_ns();
+
+     int64_t latency_ns = sim.latency_ns;
+     if (sim.jitter_ns) latency_ns += (int64_t)((double)rand() / RAND_MAX * (double)sim.jitter_ns);
+     if (latency_ns) sim_sleep_ns(latency_ns);
+
+     pthread_mutex_lock(&sim.lock);
+     device->requests += 1;
+
+     if (sim.drop_percent && rand() % 100 < sim.drop_percent) {
+	  device->dropped += 1;
+	  pthread_mutex_unlock(&sim.lock);
+	  return 0;
+     }
+
+     sim_model_update(monotonic_ns());
+     if (device->unit >= 0 && query[modbus_get_header_length(device->ctx) - 1] != device->unit) {
+	  modbus_reply_exception(device->ctx, query, MODBUS_EXCEPTION_GATEWAY_TARGET);
+     } else {
+	  modbus_reply(device->ctx, query, rc, device->mapping);
+	  /* Writes take effect on the model right away */
+	  sim_model_update(monotonic_ns());
+     }
+
+     int64_t reply_ns = monotonic_ns();
+     sim_cycle_account(arrival_ns, reply_ns);
+     sim_actuation_account(device, query, arrival_ns, reply_ns);
+     pthread_mutex_unlock(&sim.lock);
+
+     return 0;
+}
+
+static void *sim_device_run(void *arg)
+{
+     struct sim_device *device = arg;
+     struct pollfd fds[SIM_CLIENTS_MAX + 1];
+     size_t nfds = 1;
+     int64_t disconnect_ns = monotonic_ns() + sim.disconnect_ns;
+
+     fds[0].fd = modbus_tcp_listen(device->ctx, SIM_CLIENTS_MAX);
+     fds[0].events = POLLIN;
+     if (fds[0].fd == -1) {
+	  fprintf(stderr, "Error: could not listen on port %d: %s\n", device->port, modbus_strerror(errno));
+	  fflush(stderr);
+	  sim_stop = 1;
+	  return NULL;
+     }
+
+     while (!sim_stop) {
+	  if (poll(fds, nfds, 100) <= 0) goto idle;
+
+	  for (size_t i = nfds; i-- > 1;) {
+	       if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+	       if (sim_serve(device, fds[i].fd) == -1) {
+		    close(fds[i].fd);
+		    fds[i] = fds[--nfds];
+	       }
+	  }
+
+	  if (fds[0].revents & POLLIN) {
+	       int fd = modbus_tcp_accept(device->ctx, &fds[0].fd);
+	       if (fd != -1 && nfds <= SIM_CLIENTS_MAX) {
+		    fds[nfds].fd = fd;
+		    fds[nfds].events = POLLIN;
+		    nfds += 1;
+	       } else if (fd != -1) {
+		    close(fd);
+	       }
+	  }
+
+     idle:
+	  if (sim.disconnect_ns && monotonic_ns() >= disconnect_ns) {
+	       for (size_t i = 1; i < nfds; ++i) close(fds[i].fd);
+	       pthread_mutex_lock(&sim.lock);
+	       device->disconnects += nfds - 1;
+	       pthread_mutex_unlock(&sim.lock);
+	       nfds = 1;
+	       disconnect_ns += sim.disconnect_ns;
+	  }
+     }
+
+     for (size_t i = 0; i < nfds; ++i) close(fds[i].fd);
+     return NULL;
+}
+
+static int sim_device_init(struct sim_device *device, const char *name, int port, int unit, int offset, int start,
+			   int count)
+{
+     device->name = name;
+     device->port = port;
+     device->unit = unit;
+     device->offset = offset;
+     start += offset;
+
+     device->ctx = modbus_new_tcp("127.0.0.1", port);
+     device->mapping = modbus_mapping_new_start_address(0, 0, 0, 0, (unsigned)start, (unsigned)count, 0, 0);
+     if (device->ctx == NULL || device->mapping == NULL) {
+	  fprintf(stderr, "Error: could not create %s device: %s\n", name, modbus_strerror(errno));
+	  fflush(stderr);
+	  return -1;
+     }
+
+     return 0;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+     uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+     return (x > y) - (x < y);
+}
+
+static void summary_print(const char *name, uint32_t *values, size_t n, const char *unit, uint32_t scale)
+{
+     uint64_t sum = 0;
+
+     if (n == 0) {
+	  printf("%-24s n/a\n", name);
+	  return;
+     }
+
+     qsort(values, n, sizeof(values[0]), compare_u32);
+     for (size_t i = 0; i < n; ++i) sum += values[i];
+
+     printf("%-24s n %zu mean %.2f p50 %.2f p95 %.2f max %.2f %s\n", name, n,
+	    (double)sum / (double)n / scale, (double)values[n / 2] / scale,
+	    (double)values[n * 95 / 100] / scale, (double)values[n - 1] / scale, unit);
+}
+
+static void sim_summary_print(void)
+{
+     uint64_t requests = 0;
+
+     for (size_t i = 0; i < sim.ncycles; ++i) requests += sim.cycle_requests[i];
+
+     printf("gx requests %" PRIu64 " dropped %" PRIu64 " disconnects %" PRIu64 "\n", sim.gx.requests, sim.gx.dropped, sim.gx.disconnects);
+     printf("evcs requests %" PRIu64 " dropped %" PRIu64 " disconnects %" PRIu64 "\n", sim.evcs.requests, sim.evcs.dropped, sim.evcs.disconnects);
+     printf("%-24s %.2f\n", "round trips per cycle", sim.ncycles ? (double)requests / (double)sim.ncycles : 0.0);
+     summary_print("cycle latency", sim.cycle_usecs, sim.ncycles, "ms", 1000);
+     summary_print("decision to write", sim.decision_usecs, sim.nwrites, "ms", 1000);
+     summary_print("write to actuation", sim.actuation_usecs, sim.nactuations, "ms", 1000);
+     fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+     int gx_port = 5020, evcs_port = 5021, gx_unit = GX_UNIT_ID, gx_offset = 0;
+     double recorded_secs = 1;
+     int opt;
+
+     sim.speed = 1;
+     sim.idle_ns = 100 * NSECS_PER_MSEC;
+
+     while ((opt = getopt(argc, argv, "g:e:s:r:l:j:p:d:ci:u:o:")) != -1) {
+	  switch (opt) {
+	  case 'g': gx_port = atoi(optarg); break;
+	  case 'e': evcs_port = atoi(optarg); break;
+	  case 's': sim.speed = strtod(optarg, NULL); break;
+	  case 'r': recorded_secs = strtod(optarg, NULL); break;
+	  case 'l': sim.latency_ns = atoi(optarg) * NSECS_PER_MSEC; break;
+	  case 'j': sim.jitter_ns = atoi(optarg) * NSECS_PER_MSEC; break;
+	  case 'p': sim.drop_percent = atoi(optarg); break;
+	  case 'd': sim.disconnect_ns = atoi(optarg) * NSECS_PER_SEC; break;
+	  case 'c': sim.car_default = 1; break;
+	  case 'i': sim.idle_ns = atoi(optarg) * NSECS_PER_MSEC; break;
+	  case 'u': gx_unit = atoi(optarg); break;
+	  case 'o': gx_offset = atoi(optarg); break;
+	  default:
+	       fprintf(stderr, "Usage: %s [-g port] [-e port] [-s speed] [-r secs] [-l ms] [-j ms] [-p percent] [-d secs] [-c] [-i ms] [-u unit] [-o offset] profile\n", argv[0]);
+	       return 1;
+	  }
+     }
+
+     if (optind != argc - 1) {
+	  fprintf(stderr, "Error: profile missing\n");
+	  return 1;
+     }
+
+     if (profile_load(argv[optind], recorded_secs)) return 1;
+
+     if (gx_offset < -800 || gx_offset > UINT16_MAX - 850) {
+	  fprintf(stderr, "Error: GX register offset out of range\n");
+	  return 1;
+     }
+     if (sim_device_init(&sim.gx, "GX", gx_port, gx_unit, gx_offset, 800, 50)) return 1;
+     if (sim_device_init(&sim.evcs, "EVCS", evcs_port, -1, 0, 5000, 100)) return 1;
+
+     pthread_mutex_init(&sim.lock, NULL);
+     sim.start_ns = sim.model_ns = sim.status_ns = monotonic_ns();
+     sim.soc = 50;
+     sim.charger_status = EVCS_CHARGER_STATUS_DISCONNECTED;
+     *sim_register(&sim.evcs, EVCS_REGISTER_CHARGE_MODE) = EVCS_CHARGE_MODE_MANUAL;
+     *sim_register(&sim.evcs, EVCS_REGISTER_CHARGING_CURRENT) = 10;
+     *sim_register(&sim.evcs, EVCS_REGISTER_MAX_CURRENT) = 16;
+     sim_model_update(sim.start_ns);
+
+     struct sigaction sa = { .sa_handler = sim_signal };
+     sigaction(SIGINT, &sa, NULL);
+     sigaction(SIGTERM, &sa, NULL);
+     signal(SIGPIPE, SIG_IGN);
+
+     if (pthread_create(&sim.gx.thread, NULL, sim_device_run, &sim.gx)
+	 || pthread_create(&sim.evcs.thread, NULL, sim_device_run, &sim.evcs)) {
+	  fprintf(stderr, "Error: could not start device threads\n");
+	  return 1;
+     }
+
+     printf("Serving GX on %d and EVCS on %d with %zu profile steps\n", gx_port, evcs_port, sim.nsteps);
+     fflush(stdout);
+
+     pthread_join(sim.gx.thread, NULL);
+     pthread_join(sim.evcs.thread, NULL);
+
+     sim_summary_print();
+
+     return 0;
+}
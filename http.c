@@ -0,0 +1,340 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "powerplay.h"
+
+/*
+ *
+ * Snapshot
+ *
+ */
+
+/*
+ * Seqlock: the control loop is the only writer and never waits. Readers copy the snapshot and
+ * retry when the sequence was odd (write in progress) or changed while they copied.
+ */
+void snapshot_publish(struct snapshot *snap, const struct status_snapshot *data)
+{
+     uint32_t seq = __atomic_load_n(&snap->seq, __ATOMIC_RELAXED);
+
+     __atomic_store_n(&snap->seq, seq + 1, __ATOMIC_RELAXED);
+     __atomic_thread_fence(__ATOMIC_RELEASE);
+     memcpy(&snap->data, data, sizeof(*data));
+     __atomic_store_n(&snap->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void snapshot_read(struct snapshot *snap, struct status_snapshot *data)
+{
+     uint32_t before, after;
+
+     do {
+	  before = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE);
+	  memcpy(data, &snap->data, sizeof(*data));
+	  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+	  after = __atomic_load_n(&snap->seq, __ATOMIC_RELAXED);
+     } while ((before & 1) || before != after);
+}
+
+void status_snapshot_fill(struct status_snapshot *data, const struct system_status *status)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_REALTIME, &ts);
+     data->t_ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+     data->power_grid = status->power_grid;
+     data->power_pv = status->power_pv;
+     data->power_consumption = status->power_consumption;
+     data->power_battery = status->power_battery;
+     data->power_evcs = status->power_evcs;
+     data->power_excess = status->power_excess;
+     memcpy(data->power_grid_phase, status->power_grid_phase, sizeof(data->power_grid_phase));
+     memcpy(data->power_pv_phase, status->power_pv_phase, sizeof(data->power_pv_phase));
+     memcpy(data->power_consumption_phase, status->power_consumption_phase, sizeof(data->power_consumption_phase));
+     data->soc_battery = status->soc_battery;
+
+     data->gx_updated_ns = status->gx_updated_ns;
+     data->gx_link = status->gx_link.state;
+     data->gx_reconnects = status->gx_link.reconnects;
+
+     /* The decision per charger is the control loop's, it fills in desired_charge_start and share_mean */
+     data->nevcs = status->nevcs;
+     for (size_t i = 0; i < status->nevcs; ++i) {
+	  const struct evcs_charger *evcs = &status->evcs[i];
+	  struct charger_snapshot *c = &data->evcs[i];
+
+	  c->power = evcs->power;
+	  c->charge_start = evcs->charge_start;
+	  c->charger_status = evcs->charger_status;
+	  c->charging_mode = evcs->charging_mode;
+	  c->charging_current = evcs->charging_current;
+	  c->max_current = evcs->max_current;
+	  c->updated_ns = evcs->updated_ns;
+	  c->link = evcs->link.state;
+	  c->reconnects = evcs->link.reconnects;
+	  c->writes = evcs->shadow.writes;
+	  c->writes_elided = evcs->shadow.elided;
+	  c->writes_deferred = evcs->shadow.deferred;
+     }
+}
+
+/*
+ *
+ * HTTP
+ *
+ */
+
+static double age_secs(int64_t now_ns, int64_t updated_ns)
+{
+     return updated_ns ? (double)(now_ns - updated_ns) / (double)NSECS_PER_SEC : -1.0;
+}
+
+/* Label of each charger, the first keeps the name used before there were several */
+static const char *const evcs_labels[EVCS_MAX] = { "evcs", "evcs2", "evcs3", "evcs4" };
+
+#define EMIT(...) do {							\
+	  int n = snprintf(buf + len, size - len, __VA_ARGS__);		\
+	  if (n < 0 || (size_t)n >= size - len) return -1;		\
+	  len += (size_t)n;						\
+     } while (0)
+
+static int status_json(char *buf, size_t size, const struct status_snapshot *s)
+{
+     size_t len = 0;
+
+     EMIT("{\"time_ms\":%" PRId64 ",\"cycles\":%" PRIu64 ","
+	  "\"power\":{\"grid\":%d,\"pv\":%d,\"consumption\":%d,\"battery\":%d,\"evcs\":%d,\"excess\":%d,"
+	  "\"grid_phase\":[%d,%d,%d],\"pv_phase\":[%d,%d,%d],\"consumption_phase\":[%d,%d,%d]},"
+	  "\"soc_battery\":%u,\"evcs\":[",
+	  s->t_ms, s->cycles,
+	  s->power_grid, s->power_pv, s->power_consumption, s->power_battery, s->power_evcs, s->power_excess,
+	  s->power_grid_phase[0], s->power_grid_phase[1], s->power_grid_phase[2],
+	  s->power_pv_phase[0], s->power_pv_phase[1], s->power_pv_phase[2],
+	  s->power_consumption_phase[0], s->power_consumption_phase[1], s->power_consumption_phase[2],
+	  s->soc_battery);
+
+     for (size_t i = 0; i < s->nevcs; ++i) {
+	  const struct charger_snapshot *c = &s->evcs[i];
+
+	  EMIT("%s{\"name\":\"%s\",\"power\":%d,\"share_mean\":%d,"
+	       "\"charge_start\":%u,\"desired_charge_start\":%u,\"charger_status\":%u,\"charger_status_str\":\"%s\","
+	       "\"charging_mode\":%u,\"charging_mode_str\":\"%s\",\"charging_current\":%u,\"max_current\":%u,"
+	       "\"link\":{\"state\":\"%s\",\"age_secs\":%.3f,\"reconnects\":%" PRIu64 "},"
+	       "\"writes\":{\"written\":%" PRIu64 ",\"elided\":%" PRIu64 ",\"deferred\":%" PRIu64 "}}",
+	       i ? "," : "", evcs_labels[i], c->power, c->share_mean,
+	       c->charge_start, c->desired_charge_start, c->charger_status, get_charger_status_str(c->charger_status),
+	       c->charging_mode, get_charging_mode_str(c->charging_mode), c->charging_current, c->max_current,
+	       link_state_str(c->link), age_secs(s->now_ns, c->updated_ns), c->reconnects,
+	       c->writes, c->writes_elided, c->writes_deferred);
+     }
+
+     EMIT("],\"averaging\":{\"mean\":%d,\"samples\":%" PRIu64 ",\"full\":%d,\"window_secs\":%" PRId64 "},"
+	  "\"forecast\":{\"valid\":%d,\"excess\":%d,\"bound\":%d},"
+	  "\"links\":{\"gx\":{\"state\":\"%s\",\"age_secs\":%.3f,\"reconnects\":%" PRIu64 "}},"
+	  "\"schedule\":{\"period_ms\":%" PRId64 ",\"overruns\":%" PRIu64 ",\"jitter_max_us\":%" PRId64 "}}\n",
+	  s->excess_mean, s->excess_samples, s->excess_full, (int64_t)s->averaging_secs,
+	  s->forecasting, s->excess_forecast, s->forecast_bound,
+	  link_state_str(s->gx_link), age_secs(s->now_ns, s->gx_updated_ns), s->gx_reconnects,
+	  (int64_t)(s->period_ns / NSECS_PER_MSEC), s->overruns, s->jitter_max_ns / 1000);
+
+     return (int)len;
+}
+
+static int status_prometheus(char *buf, size_t size, const struct status_snapshot *s)
+{
+     static const char *const phases[] = { "L1", "L2", "L3" };
+     size_t len = 0;
+
+     EMIT("# TYPE sparkshift_power_watts gauge\n");
+     EMIT("sparkshift_power_watts{source=\"grid\"} %d\n", s->power_grid);
+     EMIT("sparkshift_power_watts{source=\"pv\"} %d\n", s->power_pv);
+     EMIT("sparkshift_power_watts{source=\"consumption\"} %d\n", s->power_consumption);
+     EMIT("sparkshift_power_watts{source=\"battery\"} %d\n", s->power_battery);
+     EMIT("sparkshift_power_watts{source=\"evcs\"} %d\n", s->power_evcs);
+     EMIT("sparkshift_power_watts{source=\"excess\"} %d\n", s->power_excess);
+     EMIT("# TYPE sparkshift_phase_power_watts gauge\n");
+     for (int i = 0; i < 3; ++i) {
+	  EMIT("sparkshift_phase_power_watts{source=\"grid\",phase=\"%s\"} %d\n", phases[i], s->power_grid_phase[i]);
+	  EMIT("sparkshift_phase_power_watts{source=\"pv\",phase=\"%s\"} %d\n", phases[i], s->power_pv_phase[i]);
+	  EMIT("sparkshift_phase_power_watts{source=\"consumption\",phase=\"%s\"} %d\n", phases[i],
+	       s->power_consumption_phase[i]);
+     }
+     EMIT("# TYPE sparkshift_excess_mean_watts gauge\nsparkshift_excess_mean_watts %d\n", s->excess_mean);
+     EMIT("# TYPE sparkshift_excess_window_full gauge\nsparkshift_excess_window_full %d\n", s->excess_full);
+     if (s->forecasting) {
+	  EMIT("# TYPE sparkshift_excess_forecast_watts gauge\nsparkshift_excess_forecast_watts %d\n",
+	       s->excess_forecast);
+	  EMIT("# TYPE sparkshift_excess_forecast_bound_watts gauge\nsparkshift_excess_forecast_bound_watts %d\n",
+	       s->forecast_bound);
+     }
+     EMIT("# TYPE sparkshift_battery_soc_percent gauge\nsparkshift_battery_soc_percent %u\n", s->soc_battery);
+     EMIT("# TYPE sparkshift_charger_power_watts gauge\n");
+     for (size_t i = 0; i < s->nevcs; ++i)
+	  EMIT("sparkshift_charger_power_watts{device=\"%s\"} %d\n", evcs_labels[i], s->evcs[i].power);
+     EMIT("# TYPE sparkshift_excess_share_watts gauge\n");
+     for (size_t i = 0; i < s->nevcs; ++i)
+	  EMIT("sparkshift_excess_share_watts{device=\"%s\"} %d\n", evcs_labels[i], s->evcs[i].share_mean);
+     EMIT("# TYPE sparkshift_charge_start gauge\n");
+     for (size_t i = 0; i < s->nevcs; ++i)
+	  EMIT("sparkshift_charge_start{device=\"%s\"} %u\n", evcs_labels[i], s->evcs[i].charge_start);
+     EMIT("# TYPE sparkshift_charge_start_desired gauge\n");
+     for (size_t i = 0; i < s->nevcs; ++i)
+	  EMIT("sparkshift_charge_start_desired{device=\"%s\"} %u\n", evcs_labels[i], s->evcs[i].desired_charge_start);
+     EMIT("# TYPE sparkshift_charger_status gauge\n");
+     for (size_t i = 0; i < s->nevcs; ++i)
+	  EMIT("sparkshift_charger_status{device=\"%s\"} %u\n", evcs_labels[i], s->evcs[i].charger_status);
+     EMIT("# TYPE sparkshift_charging_mode gauge\n");
+     for (size_t i = 0; i < s->nevcs; ++i)
+	  EMIT("sparkshift_charging_mode{device=\"%s\"} %u\n", evcs_labels[i], s->evcs[i].charging_mode);
+     EMIT("# TYPE sparkshift_charging_current_amps gauge\n");
+     for (size_t i = 0; i < s->nevcs; ++i)
+	  EMIT("sparkshift_charging_current_amps{device=\"%s\"} %u\n", evcs_labels[i], s->evcs[i].charging_current);
+     EMIT("# TYPE sparkshift_link_up gauge\n");
+     EMIT("sparkshift_link_up{device=\"gx\"} %d\n", s->gx_link == LINK_UP);
+     for (size_t i = 0; i < s->nevcs; ++i)
+	  EMIT("sparkshift_link_up{device=\"%s\"} %d\n", evcs_labels[i], s->evcs[i].link == LINK_UP);
+     EMIT("# TYPE sparkshift_data_age_seconds gauge\n");
+     EMIT("sparkshift_data_age_seconds{device=\"gx\"} %.3f\n", age_secs(s->now_ns, s->gx_updated_ns));
+     for (size_t i = 0; i < s->nevcs; ++i)
+	  EMIT("sparkshift_data_age_seconds{device=\"%s\"} %.3f\n", evcs_labels[i],
+	       age_secs(s->now_ns, s->evcs[i].updated_ns));
+     EMIT("# TYPE sparkshift_reconnects_total counter\n");
+     EMIT("sparkshift_reconnects_total{device=\"gx\"} %" PRIu64 "\n", s->gx_reconnects);
+     for (size_t i = 0; i < s->nevcs; ++i)
+	  EMIT("sparkshift_reconnects_total{device=\"%s\"} %" PRIu64 "\n", evcs_labels[i], s->evcs[i].reconnects);
+     EMIT("# TYPE sparkshift_writes_total counter\n");
+     for (size_t i = 0; i < s->nevcs; ++i) {
+	  const struct charger_snapshot *c = &s->evcs[i];
+	  EMIT("sparkshift_writes_total{device=\"%s\",outcome=\"written\"} %" PRIu64 "\n", evcs_labels[i], c->writes);
+	  EMIT("sparkshift_writes_total{device=\"%s\",outcome=\"elided\"} %" PRIu64 "\n", evcs_labels[i], c->writes_elided);
+	  EMIT("sparkshift_writes_total{device=\"%s\",outcome=\"deferred\"} %" PRIu64 "\n", evcs_labels[i], c->writes_deferred);
+     }
+     EMIT("# TYPE sparkshift_cycles_total counter\nsparkshift_cycles_total %" PRIu64 "\n", s->cycles);
+     EMIT("# TYPE sparkshift_poll_period_seconds gauge\nsparkshift_poll_period_seconds %.3f\n",
+	  (double)s->period_ns / (double)NSECS_PER_SEC);
+     EMIT("# TYPE sparkshift_overruns_total counter\nsparkshift_overruns_total %" PRIu64 "\n", s->overruns);
+
+     return (int)len;
+}
+
+#undef EMIT
+
+static void http_respond(int fd, const char *status, const char *type, const char *body, size_t len)
+{
+     char header[256];
+     int n = snprintf(header, sizeof(header),
+		      "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+		      status, type, len);
+
+     if (send(fd, header, (size_t)n, MSG_NOSIGNAL) == n && len) send(fd, body, len, MSG_NOSIGNAL);
+}
+
+static void http_serve(struct http_server *server, int fd)
+{
+     static char body[HTTP_BODY_MAX];
+     struct status_snapshot data;
+     char request[1024];
+     ssize_t n = recv(fd, request, sizeof(request) - 1, 0);
+     int len;
+
+     if (n <= 0) return;
+     request[n] = '\0';
+
+     if (strncmp(request, "GET ", 4)) {
+	  http_respond(fd, "405 Method Not Allowed", "text/plain", "", 0);
+	  return;
+     }
+
+     snapshot_read(server->snap, &data);
+     data.now_ns = monotonic_ns();
+
+     if (!strncmp(request + 4, "/status ", 8) || !strncmp(request + 4, "/ ", 2)) {
+	  len = status_json(body, sizeof(body), &data);
+	  if (len >= 0 && (size_t)len < sizeof(body)) {
+	       http_respond(fd, "200 OK", "application/json", body, (size_t)len);
+	       return;
+	  }
+     } else if (!strncmp(request + 4, "/metrics ", 9)) {
+	  len = status_prometheus(body, sizeof(body), &data);
+	  if (len >= 0) {
+	       http_respond(fd, "200 OK", "text/plain; version=0.0.4", body, (size_t)len);
+	       return;
+	  }
+     } else {
+	  http_respond(fd, "404 Not Found", "text/plain", "", 0);
+	  return;
+     }
+
+     http_respond(fd, "500 Internal Server Error", "text/plain", "", 0);
+}
+
+static void *http_run(void *arg)
+{
+     struct http_server *server = arg;
+
+     for (;;) {
+	  int fd = accept(server->fd, NULL, NULL);
+	  if (fd == -1) {
+	       if (errno == EINTR || errno == ECONNABORTED) continue;
+	       fprintf(stderr, "Error: HTTP accept failed: %s\n", strerror(errno));
+	       fflush(stderr);
+	       return NULL;
+	  }
+
+	  /* A stuck client may hold up other scrapers but never the control loop */
+	  struct timeval timeout = { .tv_sec = 1 };
+	  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	  http_serve(server, fd);
+	  close(fd);
+     }
+}
+
+int http_start(struct http_server *server, struct snapshot *snap, const char *addr, int port)
+{
+     struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons((uint16_t)port) };
+     int one = 1;
+     int err;
+
+     server->snap = snap;
+     server->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+     if (server->fd == -1) {
+	  fprintf(stderr, "Error: could not create HTTP socket: %s\n", strerror(errno));
+	  goto error;
+     }
+
+     if (inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+	  fprintf(stderr, "Error: invalid HTTP address %s\n", addr);
+	  goto error;
+     }
+
+     setsockopt(server->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+     if (bind(server->fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 || listen(server->fd, 8) == -1) {
+	  fprintf(stderr, "Error: could not listen on %s:%d: %s\n", addr, port, strerror(errno));
+	  goto error;
+     }
+
+     err = pthread_create(&server->thread, NULL, http_run, server);
+     if (err) {
+	  fprintf(stderr, "Error: could not start HTTP thread: %s\n", strerror(err));
+	  goto error;
+     }
+
+     return 0;
+
+error:
+     if (server->fd != -1) close(server->fd);
+     server->fd = -1;
+     fflush(stderr);
+     return -1;
+}
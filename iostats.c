@@ -0,0 +1,173 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "powerplay.h"
+
+/*
+ *
+ * I/O statistics
+ *
+ */
+
+void iostats_add(uint64_t *counter)
+{
+     __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t iostats_get(const uint64_t *counter)
+{
+     return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static uint64_t iostats_bucket_usecs(size_t bucket)
+{
+     return (uint64_t)IOSTATS_BUCKET_MIN_USECS << bucket;
+}
+
+/* Writes are tracked by the registers they write, FC23 included, reads by the ones they read */
+static struct iostats_range *iostats_range_find(struct iostats *stats, const struct mbtcp_request *req)
+{
+     uint8_t function = (uint8_t)req->function;
+     uint16_t addr = req->addr, count = req->count;
+
+     if (req->function != MBTCP_READ_REGISTERS) {
+	  addr = req->write_addr;
+	  count = req->function == MBTCP_WRITE_REGISTER ? 1 : req->write_count;
+     }
+
+     for (size_t i = 0; i < IOSTATS_RANGES_MAX; ++i) {
+	  struct iostats_range *range = &stats->ranges[i];
+	  uint8_t used = __atomic_load_n(&range->function, __ATOMIC_ACQUIRE);
+
+	  if (used == 0) {
+	       /* Only the owning thread claims slots, the function published last marks it used */
+	       range->addr = addr;
+	       range->count = count;
+	       __atomic_store_n(&range->function, function, __ATOMIC_RELEASE);
+	       return range;
+	  }
+	  if (used == function && range->addr == addr && range->count == count) return range;
+     }
+
+     return NULL;
+}
+
+/* Accounts a request completed by mbtcp_batch, with its latency if it was sent */
+void iostats_request(struct iostats *stats, const struct mbtcp_request *req)
+{
+     struct iostats_range *range = iostats_range_find(stats, req);
+
+     if (range == NULL) {
+	  iostats_add(&stats->untracked);
+     } else {
+	  iostats_add(&range->requests);
+	  if (req->result == 0) iostats_add(&range->ok);
+	  else if (req->result == ETIMEDOUT) iostats_add(&range->timeouts);
+	  else if (req->result > MODBUS_ENOBASE && req->result < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX)
+	       iostats_add(&range->exceptions);
+	  else iostats_add(&range->errors);
+
+	  if (req->sent_ns && req->result != ETIMEDOUT) {
+	       uint64_t usecs = (uint64_t)(req->done_ns - req->sent_ns) / NSECS_PER_USEC;
+	       size_t bucket = 0;
+
+	       while (bucket < IOSTATS_BUCKETS - 1 && usecs >= iostats_bucket_usecs(bucket)) bucket += 1;
+	       iostats_add(&range->histogram[bucket]);
+	       __atomic_add_fetch(&range->latency_sum_usecs, usecs, __ATOMIC_RELAXED);
+	       if (usecs > iostats_get(&range->latency_max_usecs))
+		    __atomic_store_n(&range->latency_max_usecs, usecs, __ATOMIC_RELAXED);
+	  }
+     }
+
+     switch (req->result) {
+     case 0:
+	  break;
+     case ETIMEDOUT:
+	  iostats_add(&stats->timeouts);
+	  break;
+     case EMBBADDATA:
+     case EMBBADEXC:
+     case EMBBADSLAVE:
+     case EMBMDATA:
+	  iostats_add(&stats->protocol);
+	  break;
+     default:
+	  if (req->result > MODBUS_ENOBASE && req->result < MODBUS_ENOBASE + MODBUS_EXCEPTION_MAX) {
+	       iostats_add(&stats->exceptions);
+	       iostats_add(&stats->exception_codes[req->result - MODBUS_ENOBASE]);
+	  } else {
+	       iostats_add(&stats->connection);
+	  }
+	  break;
+     }
+}
+
+/* Upper bound of the bucket holding the given fraction of the samples, 0 for the open bucket */
+static uint64_t iostats_quantile_usecs(const uint64_t *histogram, uint64_t total, double q)
+{
+     uint64_t rank = (uint64_t)((double)total * q + 0.5), seen = 0;
+
+     for (size_t b = 0; b < IOSTATS_BUCKETS - 1; ++b) {
+	  seen += histogram[b];
+	  if (seen >= rank) return iostats_bucket_usecs(b);
+     }
+
+     return 0;
+}
+
+static void iostats_print_usecs(const char *label, uint64_t usecs)
+{
+     if (usecs == 0) printf(" %s >%.1fms", label, (double)iostats_bucket_usecs(IOSTATS_BUCKETS - 2) / 1000.0);
+     else printf(" %s <%.2fms", label, (double)usecs / 1000.0);
+}
+
+/*
+ * Prints the counters of one device, one line per register range with latency quantiles taken
+ * from the histogram, so they are bucket bounds rather than exact values.
+ */
+void iostats_print(const struct iostats *stats, const char *name)
+{
+     printf("%s I/O: %" PRIu64 " timeouts, %" PRIu64 " exceptions, %" PRIu64 " protocol errors, %" PRIu64 " connection errors, %" PRIu64 " stray; "
+	    "%" PRIu64 " connects, %" PRIu64 " failed, %" PRIu64 " drops\n", name,
+	    iostats_get(&stats->timeouts), iostats_get(&stats->exceptions), iostats_get(&stats->protocol),
+	    iostats_get(&stats->connection), iostats_get(&stats->stray),
+	    iostats_get(&stats->connects), iostats_get(&stats->connect_failures), iostats_get(&stats->drops));
+
+     for (size_t i = 0; i < IOSTATS_RANGES_MAX; ++i) {
+	  const struct iostats_range *range = &stats->ranges[i];
+	  uint8_t function = __atomic_load_n(&range->function, __ATOMIC_ACQUIRE);
+	  uint64_t histogram[IOSTATS_BUCKETS], timed = 0;
+
+	  if (function == 0) break;
+
+	  for (size_t b = 0; b < IOSTATS_BUCKETS; ++b) {
+	       histogram[b] = iostats_get(&range->histogram[b]);
+	       timed += histogram[b];
+	  }
+
+	  printf("%s I/O FC%u %u-%u: %" PRIu64 " requests, %" PRIu64 " ok, %" PRIu64 " timeouts, %" PRIu64 " exceptions, %" PRIu64 " errors",
+		 name, (unsigned)function, (unsigned)range->addr, (unsigned)range->addr + range->count - 1,
+		 iostats_get(&range->requests), iostats_get(&range->ok), iostats_get(&range->timeouts),
+		 iostats_get(&range->exceptions), iostats_get(&range->errors));
+	  if (timed) {
+	       printf(", mean %.2fms max %.2fms",
+		      (double)iostats_get(&range->latency_sum_usecs) / (double)timed / 1000.0,
+		      (double)iostats_get(&range->latency_max_usecs) / 1000.0);
+	       iostats_print_usecs("p50", iostats_quantile_usecs(histogram, timed, 0.50));
+	       iostats_print_usecs("p95", iostats_quantile_usecs(histogram, timed, 0.95));
+	       iostats_print_usecs("p99", iostats_quantile_usecs(histogram, timed, 0.99));
+	  }
+	  printf("\n");
+     }
+
+     for (int code = 1; code < MODBUS_EXCEPTION_MAX; ++code) {
+	  uint64_t count = iostats_get(&stats->exception_codes[code]);
+	  if (count) printf("%s I/O exception %d: %" PRIu64 " (%s)\n", name, code, count, modbus_strerror(MODBUS_ENOBASE + code));
+     }
+
+     if (iostats_get(&stats->untracked))
+	  printf("%s I/O: %" PRIu64 " requests to further ranges not tracked\n", name, iostats_get(&stats->untracked));
+
+     fflush(stdout);
+}
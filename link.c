@@ -0,0 +1,184 @@
+#include <errno.h>
+#include <stdio.h>
+
+#include "powerplay.h"
+
+/*
+ *
+ * Link
+ *
+ */
+
+/*
+ * A link is only ever touched by the thread that currently owns its device, so it needs no
+ * locking of its own. Connecting happens lazily on first use and on retries, which lets both
+ * acquisition workers connect in parallel instead of the control loop waiting on each in turn.
+ */
+void link_init(struct modbus_link *link, const char *name, struct modbus_device device)
+{
+     *link = (struct modbus_link){0};
+     link->name = name;
+     link->device = device;
+     mbtcp_init(&link->client);
+     link->client.stats = &link->stats;
+     link->state = LINK_DOWN;
+     link->seed = (uint32_t)monotonic_ns() ^ (uint32_t)(uintptr_t)link;
+     if (link->seed == 0) link->seed = 1;
+}
+
+const char *link_state_str(link_state_t state)
+{
+     switch (state) {
+     case LINK_DOWN:
+	  return "down";
+     case LINK_CONNECTING:
+	  return "connecting";
+     case LINK_UP:
+	  return "up";
+     case LINK_DEGRADED:
+	  return "degraded";
+     default:
+	  return "unknown";
+     }
+}
+
+static void link_state_set(struct modbus_link *link, link_state_t state)
+{
+     if (link->state == state) return;
+
+     report(stdout, "%s link %s -> %s\n", link->name, link_state_str(link->state), link_state_str(state));
+     link->state = state;
+}
+
+void link_close(struct modbus_link *link)
+{
+     if (link->state != LINK_DOWN) iostats_add(&link->stats.drops);
+     mbtcp_close(&link->client);
+     link_state_set(link, LINK_DOWN);
+}
+
+/* Exponential backoff with +-25% jitter so devices coming back together are not hit in lockstep */
+static void link_backoff(struct modbus_link *link, int64_t now_ns)
+{
+     int64_t delay_ns = LINK_BACKOFF_MIN_MSECS * NSECS_PER_MSEC;
+
+     for (uint32_t i = 0; i < link->attempts && delay_ns < LINK_BACKOFF_MAX_MSECS * NSECS_PER_MSEC; ++i)
+	  delay_ns *= 2;
+     if (delay_ns > LINK_BACKOFF_MAX_MSECS * NSECS_PER_MSEC) delay_ns = LINK_BACKOFF_MAX_MSECS * NSECS_PER_MSEC;
+
+     link->seed ^= link->seed << 13;
+     link->seed ^= link->seed >> 17;
+     link->seed ^= link->seed << 5;
+     delay_ns = delay_ns * (768 + (int64_t)(link->seed % 512)) / 1024;
+
+     link->attempts += 1;
+     link->retry_ns = now_ns + delay_ns;
+}
+
+static void link_connect_failed(struct modbus_link *link, int64_t now_ns)
+{
+     iostats_add(&link->stats.connect_failures);
+     link_state_set(link, LINK_DOWN);
+     link_backoff(link, now_ns);
+}
+
+static void link_connected(struct modbus_link *link)
+{
+     if (link->connects++) link->reconnects += 1;
+     iostats_add(&link->stats.connects);
+     link->attempts = 0;
+     link->failures = 0;
+     link_state_set(link, LINK_UP);
+}
+
+/*
+ * Makes sure the link has a connected context, connecting if it is down and the backoff expired.
+ * Returns -1 without blocking while a retry is not due yet.
+ */
+int link_ready(struct modbus_link *link, int64_t now_ns)
+{
+     if (mbtcp_connected(&link->client)) return 0;
+     if (now_ns < link->retry_ns) return -1;
+
+     link_state_set(link, LINK_CONNECTING);
+     if (modbus_device_connect(link->device, &link->client)) {
+	  link_connect_failed(link, now_ns);
+	  return -1;
+     }
+
+     link_connected(link);
+     return 0;
+}
+
+/*
+ * link_ready() for a caller that must not block: a connect that does not complete at once is left
+ * in progress. Returns 0 when connected, 1 while connecting, to be finished with
+ * link_connect_finish() when the socket turns writable or the timeout passed, and -1 if the
+ * connect failed or a retry is not due yet.
+ */
+int link_connect_start(struct modbus_link *link, int64_t now_ns)
+{
+     if (mbtcp_connected(&link->client)) return 0;
+     if (link->client.connecting) return 1;
+     if (now_ns < link->retry_ns) return -1;
+
+     link_state_set(link, LINK_CONNECTING);
+     int rc = mbtcp_connect_start(&link->client, &link->device);
+     if (rc == -1) {
+	  link_connect_failed(link, now_ns);
+	  return -1;
+     }
+     if (rc == 0) link_connected(link);
+
+     return rc;
+}
+
+/* Returns 0 once connected and -1 if the connect failed or timed_out */
+int link_connect_finish(struct modbus_link *link, int timed_out, int64_t now_ns)
+{
+     int rc = -1;
+
+     if (timed_out) errno = ETIMEDOUT;
+     else rc = mbtcp_connect_finish(&link->client);
+
+     if (rc == -1) {
+	  report(stderr, "Error: connection failed to %s:%d: %s\n", link->device.host, link->device.port,
+		 modbus_strerror(errno));
+	  mbtcp_close(&link->client);
+	  link_connect_failed(link, now_ns);
+	  return -1;
+     }
+
+     link_connected(link);
+     return 0;
+}
+
+void link_succeeded(struct modbus_link *link)
+{
+     link->failures = 0;
+     link_state_set(link, LINK_UP);
+}
+
+/*
+ * A few failed requests only degrade the link; after LINK_FAILURES_MAX it is dropped and retried.
+ * A connection the client gave up on, because the peer closed it or the stream lost framing, is
+ * reconnected on the next request, which is what a GX reboot or an EVCS Wi-Fi blip looks like.
+ */
+void link_failed(struct modbus_link *link, int64_t now_ns)
+{
+     if (link->state != LINK_DOWN && !mbtcp_connected(&link->client)) {
+	  link_close(link);
+	  link->retry_ns = now_ns;
+	  return;
+     }
+
+     link->failures += 1;
+
+     if (link->failures < LINK_FAILURES_MAX) {
+	  link_state_set(link, LINK_DEGRADED);
+	  return;
+     }
+
+     link_close(link);
+     link_backoff(link, now_ns);
+}
@@ -0,0 +1,172 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "powerplay.h"
+
+/*
+ *
+ * Logger
+ *
+ */
+
+static void logger_io_stats_print(const struct logger *log, const struct scheduler *sched)
+{
+     const struct system_status *status = log->status;
+
+     if (status) {
+	  iostats_print(&status->gx_link.stats, status->gx_link.name);
+	  for (size_t c = 0; c < status->nevcs; ++c) {
+	       iostats_print(&status->evcs[c].link.stats, status->evcs[c].link.name);
+	       actuation_print(&status->evcs[c].actuation, status->evcs[c].link.name);
+	  }
+     }
+     if (log->gw) gateway_stats_print(log->gw);
+     scheduler_stats_print(sched);
+     printf("Log: %" PRIu64 " entries dropped, at most %" PRIu64 " of %d queued\n",
+	    __atomic_load_n(&log->ring.dropped, __ATOMIC_RELAXED),
+	    __atomic_load_n(&log->ring.high_water, __ATOMIC_RELAXED), LOG_ENTRIES);
+}
+
+static void logger_write(struct logger *log, const struct log_entry *entry)
+{
+     switch (entry->kind) {
+     case LOG_LINE:
+	  fputs(entry->u.line, stdout);
+	  break;
+     case LOG_TELEMETRY:
+	  if (log->tlm) telemetry_append(log->tlm, &entry->u.rec);
+	  break;
+     case LOG_SCHEDULE:
+	  scheduler_stats_print(&entry->u.sched);
+	  break;
+     case LOG_IO_STATS:
+	  logger_io_stats_print(log, &entry->u.sched);
+	  break;
+     }
+}
+
+static void *logger_run(void *arg)
+{
+     struct logger *log = arg;
+     struct pollfd pfd = { .fd = log->wake[0], .events = POLLIN };
+     char buf[64];
+
+     for (;;) {
+	  const struct log_entry *entry;
+
+	  while ((entry = ring_peek(&log->ring))) {
+	       logger_write(log, entry);
+	       ring_pop(&log->ring);
+	  }
+	  fflush(stdout);
+
+	  if (__atomic_load_n(&log->stop, __ATOMIC_ACQUIRE)) break;
+	  if (poll(&pfd, 1, -1) == -1 && errno != EINTR) break;
+	  while (read(log->wake[0], buf, sizeof(buf)) > 0);
+     }
+
+     return NULL;
+}
+
+/*
+ * Starts the thread writing the log and telemetry. tlm, if not NULL, is written only by that
+ * thread from now on. The device statistics of status and gw, if not NULL, are read for the I/O
+ * summary; their counters are atomic.
+ */
+int logger_start(struct logger *log, struct telemetry *tlm, const struct system_status *status,
+		 const struct gateway *gw)
+{
+     int err;
+
+     ring_init(&log->ring, log->entries, sizeof(log->entries[0]), LOG_ENTRIES);
+     log->tlm = tlm;
+     log->status = status;
+     log->gw = gw;
+     log->stop = 0;
+
+     if (pipe2(log->wake, O_CLOEXEC | O_NONBLOCK) == -1) {
+	  fprintf(stderr, "Error: could not create log pipe: %s\n", strerror(errno));
+	  goto error;
+     }
+
+     err = pthread_create(&log->thread, NULL, logger_run, log);
+     if (err) {
+	  fprintf(stderr, "Error: could not start log thread: %s\n", strerror(err));
+	  goto error;
+     }
+
+     return 0;
+
+error:
+     fflush(stderr);
+     return -1;
+}
+
+void logger_printf(struct logger *log, const char *fmt, ...)
+{
+     struct log_entry *entry = ring_reserve(&log->ring);
+     va_list ap;
+
+     if (entry == NULL) return;
+
+     entry->kind = LOG_LINE;
+     va_start(ap, fmt);
+     vsnprintf(entry->u.line, sizeof(entry->u.line), fmt, ap);
+     va_end(ap);
+     ring_push(&log->ring);
+}
+
+/* A report sink for the thread feeding the ring */
+void logger_report(void *log, const char *line)
+{
+     logger_printf(log, "%s", line);
+}
+
+void logger_telemetry(struct logger *log, const struct telemetry_record *rec)
+{
+     struct log_entry *entry = ring_reserve(&log->ring);
+
+     if (entry == NULL) return;
+
+     entry->kind = LOG_TELEMETRY;
+     entry->u.rec = *rec;
+     ring_push(&log->ring);
+}
+
+/* The scheduler is copied, the I/O counters are read when the summary is written */
+void logger_stats(struct logger *log, const struct scheduler *sched, int io)
+{
+     struct log_entry *entry = ring_reserve(&log->ring);
+
+     if (entry == NULL) return;
+
+     entry->kind = io ? LOG_IO_STATS : LOG_SCHEDULE;
+     entry->u.sched = *sched;
+     ring_push(&log->ring);
+}
+
+/* Once per cycle after queueing its entries; never blocks, a full pipe already means awake */
+void logger_wake(struct logger *log)
+{
+     if (write(log->wake[1], "", 1) == -1 && errno != EAGAIN) {
+	  fprintf(stderr, "Error: could not wake log thread: %s\n", strerror(errno));
+	  fflush(stderr);
+     }
+}
+
+/* Writes what is queued and ends the thread */
+void logger_stop(struct logger *log)
+{
+     __atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
+     logger_wake(log);
+     pthread_join(log->thread, NULL);
+     close(log->wake[0]);
+     close(log->wake[1]);
+}
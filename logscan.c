@@ -0,0 +1,749 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "powerplay.h"
+
+/*
+  Logscan - daily aggregates over the status lines of sparkshift logs
+
+  Usage: logscan [-p SECS] [-s START] [-j THREADS] [-o DIR] FILE...
+
+  -p SECS	period between status lines without a timestamp (default: such lines are skipped)
+  -s START	time of the first line without a timestamp, epoch seconds or UTC
+		YYYY-MM-DD[THH:MM[:SS]] (default 1970-01-01)
+  -j THREADS	chunks scanned in parallel (default one per online CPU)
+  -o DIR	also write the samples to a telemetry store in DIR, for tlmquery and replay
+
+  Reads the lines sparkshift prints, as they are or exported with journalctl -o short-iso,
+  short-iso-precise or short-unix, which carry the time of every line. Files are memory-mapped
+  and cut into chunks at line boundaries that are scanned in parallel; lines are found 16 bytes
+  at a time with SSE2 where available and fields are parsed by hand, not with scanf.
+
+  Per UTC day it prints the status lines and the hours they cover, the energy from PV, to
+  consumption, imported, exported, into and out of the battery and to the chargers in kWh, the
+  hours chargers were charging summed over chargers, the charge starts and stops decided, and the
+  mean, minimum, 10th, 50th and 90th percentile and maximum excess. Power holds from one line to
+  the next except across gaps longer than TELEMETRY_GAP_MS, and an interval counts for the day
+  it starts in.
+ */
+
+#define LOGSCAN_CHUNK_BYTES	(16 << 20)
+#define LOGSCAN_EXCESS_MIN	-30000
+#define LOGSCAN_EXCESS_BIN	100
+#define LOGSCAN_EXCESS_BINS	600
+#define LOGSCAN_DAY_MS		(86400 * 1000)
+
+struct sample {
+     int64_t t_ms;
+     int32_t pv, consumption, grid, battery, evcs, excess, excess_mean;
+     uint16_t soc_battery;
+     unsigned charging; /* chargers charging */
+     unsigned desired; /* bit per charger sparkshift wants charging */
+     size_t nevcs;
+     char mode[EVCS_MAX], status[EVCS_MAX];
+     uint16_t charge_start[EVCS_MAX];
+};
+
+struct day {
+     uint64_t samples, covered_ms;
+     double pv_wh, consumption_wh, import_wh, export_wh, battery_in_wh, battery_out_wh, evcs_wh, charging_h;
+     uint64_t starts, stops;
+     int64_t excess_sum;
+     int32_t excess_min, excess_max;
+     uint32_t excess[LOGSCAN_EXCESS_BINS];
+};
+
+/* Contiguous days from first on */
+struct days {
+     int64_t first;
+     size_t count;
+     struct day *days;
+};
+
+struct chunk {
+     const char *begin, *end;
+     int64_t t0_ms; /* of the first line without a timestamp */
+     uint64_t untimed, lines, skipped;
+
+     struct days days;
+     int sampled;
+     struct sample first, last;
+
+     struct telemetry_record *recs;
+     size_t nrecs, capacity;
+     int error;
+};
+
+struct scan {
+     struct chunk *chunks;
+     size_t nchunks, next;
+     int64_t period_ms;
+     int count_only, convert;
+};
+
+/* The next newline at or after p, end if there is none */
+static const char *line_end(const char *p, const char *end)
+{
+#ifdef __SSE2__
+     const __m128i newline = _mm_set1_epi8('\n');
+
+     while (end - p >= 16) {
+	  int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), newline));
+	  if (mask) return p + __builtin_ctz((unsigned)mask);
+	  p += 16;
+     }
+#endif
+     while (p < end && *p != '\n') ++p;
+
+     return p;
+}
+
+/* Exactly n digits, p may lie past end */
+static int64_t digits_parse(const char *p, const char *end, size_t n)
+{
+     int64_t value = 0;
+
+     if (end - p < (ptrdiff_t)n) return -1;
+     for (size_t i = 0; i < n; ++i) {
+	  if (p[i] < '0' || p[i] > '9') return -1;
+	  value = value * 10 + (p[i] - '0');
+     }
+
+     return value;
+}
+
+/* A decimal integer after optional spaces, at most 18 digits; NULL if there is none */
+static const char *int_parse(const char *p, const char *end, int64_t *value)
+{
+     int64_t v = 0;
+     int negative = 0, n = 0;
+
+     while (p < end && *p == ' ') ++p;
+     if (p < end && *p == '-') {
+	  negative = 1;
+	  ++p;
+     }
+     for (; p < end && *p >= '0' && *p <= '9' && n < 18; ++p, ++n) v = v * 10 + (*p - '0');
+     if (n == 0) return NULL;
+
+     *value = negative ? -v : v;
+     return p;
+}
+
+static int32_t int32_clamp(int64_t value)
+{
+     if (value > INT32_MAX) return INT32_MAX;
+     if (value < INT32_MIN) return INT32_MIN;
+     return (int32_t)value;
+}
+
+/* Days since the epoch of a proleptic Gregorian date */
+static int64_t days_from_civil(int64_t y, int64_t m, int64_t d)
+{
+     y -= m <= 2;
+     int64_t era = (y >= 0 ? y : y - 399) / 400;
+     int64_t yoe = y - era * 400;
+     int64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+     int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+     return era * 146097 + doe - 719468;
+}
+
+/*
+ * The journal's timestamp at the start of a line, SECS.USECS or YYYY-MM-DDTHH:MM:SS[.FRAC] with
+ * Z, +HHMM or +HH:MM. Returns what follows it, NULL if the line does not start with one.
+ */
+static const char *timestamp_parse(const char *p, const char *end, int64_t *t_ms)
+{
+     int64_t secs, ms = 0;
+     const char *q = int_parse(p, end, &secs);
+
+     if (q == NULL) return NULL;
+
+     if (q < end && *q == '.') {
+	  int64_t scale = 100;
+	  for (++q; q < end && *q >= '0' && *q <= '9'; ++q, scale /= 10) ms += (*q - '0') * scale;
+	  if (q < end && *q == ' ') {
+	       *t_ms = secs * 1000 + ms;
+	       return q;
+	  }
+	  return NULL;
+     }
+
+     /* YYYY-MM-DDTHH:MM:SS is read field by field, the line must hold all of it */
+     if (end - p < 19) return NULL;
+
+     int64_t year = digits_parse(p, end, 4), month = digits_parse(p + 5, end, 2), day = digits_parse(p + 8, end, 2);
+     int64_t hour = digits_parse(p + 11, end, 2), min = digits_parse(p + 14, end, 2), sec = digits_parse(p + 17, end, 2);
+     if (year < 0 || month < 1 || month > 12 || day < 1 || hour < 0 || min < 0 || sec < 0
+	 || p[4] != '-' || p[7] != '-' || p[10] != 'T' || p[13] != ':' || p[16] != ':') return NULL;
+
+     secs = (days_from_civil(year, month, day) * 24 + hour) * 3600 + min * 60 + sec;
+     q = p + 19;
+     if (q < end && *q == '.') {
+	  int64_t scale = 100;
+	  for (++q; q < end && *q >= '0' && *q <= '9'; ++q, scale /= 10) ms += (*q - '0') * scale;
+     }
+
+     if (q < end && *q == 'Z') {
+	  ++q;
+     } else if (q < end && (*q == '+' || *q == '-')) {
+	  int64_t sign = *q == '-' ? -1 : 1;
+	  int64_t zh = digits_parse(q + 1, end, 2);
+	  const char *zm = q + 3 < end && q[3] == ':' ? q + 4 : q + 3;
+	  int64_t zmin = digits_parse(zm, end, 2);
+
+	  if (zh < 0 || zmin < 0) return NULL;
+	  secs -= sign * (zh * 3600 + zmin * 60);
+	  q = zm + 2;
+     }
+
+     *t_ms = secs * 1000 + ms;
+     return q;
+}
+
+/* The fields of a status line from its first charger's M/ on; the time is left as it is */
+static int status_parse(const char *p, const char *end, struct sample *s)
+{
+     size_t charger = 0;
+     int totals = 0, grid = 0, excess = 0;
+     int64_t v;
+
+     while (p < end) {
+	  while (p < end && *p == ' ') ++p;
+
+	  const char *tag = p;
+	  while (p < end && *p != '/' && *p != ' ') ++p;
+	  if (p == end) break;
+	  if (*p != '/' || p - tag > 2) continue;
+
+	  unsigned key = (unsigned char)tag[0] | (p - tag == 2 ? (unsigned)(unsigned char)tag[1] << 8 : 0);
+	  ++p;
+
+	  /* M/ S/ C/ D/ repeat per charger until R/, after which C/ is the consumption */
+	  if (!totals && (key == 'M' || key == 'S')) {
+	       if (p == end) return -1;
+	       if (key == 'M') {
+		    charger += 1;
+		    if (charger <= EVCS_MAX) s->mode[charger - 1] = *p;
+	       } else {
+		    if (charger >= 1 && charger <= EVCS_MAX) s->status[charger - 1] = *p;
+		    if (*p == get_charger_status_char(EVCS_CHARGER_STATUS_CHARGING)) s->charging += 1;
+	       }
+	       ++p;
+	       continue;
+	  }
+
+	  const char *q = int_parse(p, end, &v);
+	  if (q == NULL) continue;
+	  p = q;
+
+	  switch (key) {
+	  case 'C':
+	       if (totals) s->consumption = int32_clamp(v);
+	       else if (charger >= 1 && charger <= EVCS_MAX) s->charge_start[charger - 1] = (uint16_t)(v != 0);
+	       break;
+	  case 'D':
+	       if (v && charger >= 1 && charger <= EVCS_MAX) s->desired |= 1u << (charger - 1);
+	       break;
+	  case 'R': totals = 1; break;
+	  case 'A': s->excess_mean = int32_clamp(v); break;
+	  case 'X': s->excess = int32_clamp(v); excess = 1; break;
+	  case 'G': s->grid = int32_clamp(v); grid = 1; break;
+	  case 'B': s->battery = int32_clamp(v); break;
+	  case 'P': s->pv = int32_clamp(v); break;
+	  case 'E': s->evcs = int32_clamp(v); break;
+	  case 'B' | 'S' << 8: s->soc_battery = (uint16_t)(v < 0 ? 0 : v > 100 ? 100 : v); break;
+	  default: break;
+	  }
+     }
+
+     s->nevcs = charger < EVCS_MAX ? charger : EVCS_MAX;
+     return charger && totals && grid && excess ? 0 : -1;
+}
+
+/* A status line, possibly behind a journal prefix; timed tells whether it carried a timestamp */
+static int line_parse(const char *line, const char *end, struct sample *s, int *timed)
+{
+     const char *p = line;
+
+     *s = (struct sample){0};
+     *timed = 0;
+     if (p < end && *p >= '0' && *p <= '9' && (p = timestamp_parse(line, end, &s->t_ms)) != NULL) *timed = 1;
+     else p = line;
+
+     for (;;) {
+	  p = memchr(p, 'M', (size_t)(end - p));
+	  if (p == NULL || end - p < 2) return -1;
+	  if (p[1] == '/' && (p == line || p[-1] == ' ')) break;
+	  ++p;
+     }
+
+     return status_parse(p, end, s);
+}
+
+static struct day *days_get(struct days *days, int64_t day)
+{
+     if (days->count == 0 || day < days->first || day >= days->first + (int64_t)days->count) {
+	  int64_t first = days->count == 0 || day < days->first ? day : days->first;
+	  int64_t last = days->count == 0 || day >= days->first + (int64_t)days->count
+	       ? day : days->first + (int64_t)days->count - 1;
+	  size_t count = (size_t)(last - first + 1);
+	  struct day *grown = realloc(days->days, count * sizeof(grown[0]));
+
+	  if (grown == NULL) {
+	       fprintf(stderr, "Error: could not allocate %zu days\n", count);
+	       return NULL;
+	  }
+
+	  /* Existing days move up by how far the range grew at the front */
+	  size_t shift = days->count ? (size_t)(days->first - first) : 0;
+	  memmove(grown + shift, grown, days->count * sizeof(grown[0]));
+	  memset(grown, 0, shift * sizeof(grown[0]));
+	  memset(grown + shift + days->count, 0, (count - shift - days->count) * sizeof(grown[0]));
+
+	  days->days = grown;
+	  days->first = first;
+	  days->count = count;
+     }
+
+     return &days->days[day - days->first];
+}
+
+/* Holds prev up to cur, and counts the decisions between the two at cur */
+static int interval_add(struct days *days, const struct sample *prev, const struct sample *cur)
+{
+     int64_t dt_ms = cur->t_ms - prev->t_ms;
+     struct day *day = days_get(days, cur->t_ms / LOGSCAN_DAY_MS);
+
+     if (day == NULL) return -1;
+     day->starts += (uint64_t)__builtin_popcount(cur->desired & ~prev->desired);
+     day->stops += (uint64_t)__builtin_popcount(prev->desired & ~cur->desired);
+
+     if (dt_ms <= 0 || dt_ms > TELEMETRY_GAP_MS) return 0;
+
+     day = days_get(days, prev->t_ms / LOGSCAN_DAY_MS);
+     if (day == NULL) return -1;
+
+     double hours = (double)dt_ms / 3600000.0;
+     day->covered_ms += (uint64_t)dt_ms;
+     day->pv_wh += prev->pv * hours;
+     day->consumption_wh += prev->consumption * hours;
+     day->import_wh += (prev->grid > 0 ? prev->grid : 0) * hours;
+     day->export_wh += (prev->grid < 0 ? -prev->grid : 0) * hours;
+     day->battery_in_wh += (prev->battery > 0 ? prev->battery : 0) * hours;
+     day->battery_out_wh += (prev->battery < 0 ? -prev->battery : 0) * hours;
+     day->evcs_wh += prev->evcs * hours;
+     day->charging_h += prev->charging * hours;
+
+     return 0;
+}
+
+static int sample_add(struct chunk *chunk, const struct sample *s)
+{
+     struct day *day = days_get(&chunk->days, s->t_ms / LOGSCAN_DAY_MS);
+     if (day == NULL) return -1;
+
+     int64_t bin = ((int64_t)s->excess - LOGSCAN_EXCESS_MIN) / LOGSCAN_EXCESS_BIN;
+     if (bin < 0) bin = 0;
+     if (bin >= LOGSCAN_EXCESS_BINS) bin = LOGSCAN_EXCESS_BINS - 1;
+
+     if (day->samples == 0 || s->excess < day->excess_min) day->excess_min = s->excess;
+     if (day->samples == 0 || s->excess > day->excess_max) day->excess_max = s->excess;
+     day->samples += 1;
+     day->excess_sum += s->excess;
+     day->excess[bin] += 1;
+
+     if (chunk->sampled && interval_add(&chunk->days, &chunk->last, s)) return -1;
+     if (!chunk->sampled) chunk->first = *s;
+     chunk->sampled = 1;
+     chunk->last = *s;
+
+     return 0;
+}
+
+/* The first status shown as the letter, the line has no more */
+static uint16_t charger_status_parse(char c)
+{
+     for (int status = EVCS_CHARGER_STATUS_DISCONNECTED; status <= EVCS_CHARGER_STATUS_STOP_CHARGING; ++status)
+	  if (get_charger_status_char((evcs_charger_status_t)status) == c) return (uint16_t)status;
+
+     return EVCS_CHARGER_STATUS_CONNECTED;
+}
+
+static uint16_t charging_mode_parse(char c)
+{
+     for (int mode = EVCS_CHARGE_MODE_MANUAL; mode <= EVCS_CHARGE_MODE_SCHED; ++mode)
+	  if (get_charging_mode_char((evcs_charge_mode_t)mode) == c) return (uint16_t)mode;
+
+     return EVCS_CHARGE_MODE_MANUAL;
+}
+
+/* Totals go across the phases in thirds, so they add up again and fit the 16 bit fields thrice over */
+static void phases_split(int32_t *phases, int32_t total)
+{
+     int32_t third = total / 3;
+
+     for (int i = 0; i < 3; ++i) phases[i] = i == 0 ? total - 2 * third : third;
+}
+
+static int record_push(struct chunk *chunk, const struct sample *s)
+{
+     if (chunk->nrecs == chunk->capacity) {
+	  size_t capacity = chunk->capacity ? 2 * chunk->capacity : 65536;
+	  struct telemetry_record *recs = realloc(chunk->recs, capacity * sizeof(recs[0]));
+	  if (recs == NULL) {
+	       fprintf(stderr, "Error: could not allocate %zu records\n", capacity);
+	       return -1;
+	  }
+	  chunk->recs = recs;
+	  chunk->capacity = capacity;
+     }
+
+     struct telemetry_record *rec = &chunk->recs[chunk->nrecs++];
+     *rec = (struct telemetry_record){0};
+     rec->t_ms = s->t_ms;
+     phases_split(rec->pv, s->pv);
+     phases_split(rec->consumption, s->consumption);
+     phases_split(rec->grid, s->grid);
+     rec->battery = s->battery;
+     rec->evcs = s->evcs;
+     rec->soc_battery = s->soc_battery;
+     rec->nevcs = (uint16_t)s->nevcs;
+     for (size_t c = 0; c < s->nevcs; ++c) {
+	  rec->charger[c].charge_start = s->charge_start[c];
+	  rec->charger[c].charger_status = charger_status_parse(s->status[c]);
+	  rec->charger[c].charging_mode = charging_mode_parse(s->mode[c]);
+	  rec->charger[c].desired = (uint16_t)(s->desired >> c & 1);
+     }
+     rec->excess = s->excess;
+     rec->excess_mean = s->excess_mean;
+
+     return 0;
+}
+
+static void chunk_scan(const struct scan *scan, struct chunk *chunk)
+{
+     uint64_t untimed = 0;
+
+     for (const char *p = chunk->begin; p < chunk->end;) {
+	  const char *eol = line_end(p, chunk->end);
+	  struct sample s;
+	  int timed;
+
+	  if (line_parse(p, eol, &s, &timed) == 0) {
+	       if (!timed && scan->period_ms) s.t_ms = chunk->t0_ms + (int64_t)untimed * scan->period_ms;
+	       if (!timed) untimed += 1;
+
+	       if (scan->count_only) {
+		    /* Only the lines without a timestamp matter to where the next chunk starts */
+	       } else if (!timed && !scan->period_ms) {
+		    chunk->skipped += 1;
+	       } else if (sample_add(chunk, &s) || (scan->convert && record_push(chunk, &s))) {
+		    chunk->error = 1;
+		    return;
+	       } else {
+		    chunk->lines += 1;
+	       }
+	  }
+
+	  p = eol + 1;
+     }
+
+     chunk->untimed = untimed;
+}
+
+static void *scan_worker(void *arg)
+{
+     struct scan *scan = arg;
+
+     for (;;) {
+	  size_t k = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED);
+	  if (k >= scan->nchunks) break;
+	  chunk_scan(scan, &scan->chunks[k]);
+     }
+
+     return NULL;
+}
+
+/* Runs a pass over all chunks on up to threads threads, the calling thread included */
+static void scan_run(struct scan *scan, pthread_t *workers, long threads)
+{
+     long started = 0;
+
+     scan->next = 0;
+     for (; started < threads - 1; ++started) {
+	  int err = pthread_create(&workers[started], NULL, scan_worker, scan);
+	  if (err) {
+	       fprintf(stderr, "Error: could not start scan thread: %s\n", strerror(err));
+	       break;
+	  }
+     }
+     scan_worker(scan);
+     for (long i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+}
+
+static int days_merge(struct days *into, const struct days *from)
+{
+     for (size_t i = 0; i < from->count; ++i) {
+	  const struct day *src = &from->days[i];
+	  if (src->samples == 0 && src->starts == 0 && src->stops == 0 && src->covered_ms == 0) continue;
+
+	  struct day *dst = days_get(into, from->first + (int64_t)i);
+	  if (dst == NULL) return -1;
+
+	  if (src->samples && (dst->samples == 0 || src->excess_min < dst->excess_min)) dst->excess_min = src->excess_min;
+	  if (src->samples && (dst->samples == 0 || src->excess_max > dst->excess_max)) dst->excess_max = src->excess_max;
+	  dst->samples += src->samples;
+	  dst->covered_ms += src->covered_ms;
+	  dst->pv_wh += src->pv_wh;
+	  dst->consumption_wh += src->consumption_wh;
+	  dst->import_wh += src->import_wh;
+	  dst->export_wh += src->export_wh;
+	  dst->battery_in_wh += src->battery_in_wh;
+	  dst->battery_out_wh += src->battery_out_wh;
+	  dst->evcs_wh += src->evcs_wh;
+	  dst->charging_h += src->charging_h;
+	  dst->starts += src->starts;
+	  dst->stops += src->stops;
+	  dst->excess_sum += src->excess_sum;
+	  for (size_t b = 0; b < LOGSCAN_EXCESS_BINS; ++b) dst->excess[b] += src->excess[b];
+     }
+
+     return 0;
+}
+
+/* Middle of the bin holding the given fraction of the day's samples, within what was seen */
+static int32_t excess_quantile(const struct day *day, double q)
+{
+     uint64_t rank = (uint64_t)((double)day->samples * q + 0.5), seen = 0;
+     size_t b = 0;
+
+     for (; b < LOGSCAN_EXCESS_BINS - 1; ++b) {
+	  seen += day->excess[b];
+	  if (seen >= rank) break;
+     }
+
+     int32_t value = LOGSCAN_EXCESS_MIN + (int32_t)b * LOGSCAN_EXCESS_BIN + LOGSCAN_EXCESS_BIN / 2;
+     return value < day->excess_min ? day->excess_min : value > day->excess_max ? day->excess_max : value;
+}
+
+static void days_print(const struct days *days)
+{
+     printf("day samples covered_h pv_kwh consumption_kwh import_kwh export_kwh battery_in_kwh battery_out_kwh "
+	    "evcs_kwh charging_h starts stops excess_mean excess_min excess_p10 excess_p50 excess_p90 excess_max\n");
+
+     for (size_t i = 0; i < days->count; ++i) {
+	  const struct day *day = &days->days[i];
+	  time_t secs = (time_t)((days->first + (int64_t)i) * 86400);
+	  struct tm tm;
+	  char date[16];
+
+	  if (day->samples == 0) continue;
+
+	  gmtime_r(&secs, &tm);
+	  strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+	  printf("%s %" PRIu64 " %.2f %.3f %.3f %.3f %.3f %.3f %.3f %.3f %.2f %" PRIu64 " %" PRIu64 " %.0f %d %d %d %d %d\n",
+		 date, day->samples, (double)day->covered_ms / 3600000.0,
+		 day->pv_wh / 1000, day->consumption_wh / 1000, day->import_wh / 1000, day->export_wh / 1000,
+		 day->battery_in_wh / 1000, day->battery_out_wh / 1000, day->evcs_wh / 1000, day->charging_h,
+		 day->starts, day->stops, (double)day->excess_sum / (double)day->samples, day->excess_min,
+		 excess_quantile(day, 0.10), excess_quantile(day, 0.50), excess_quantile(day, 0.90), day->excess_max);
+     }
+}
+
+static int64_t time_parse(const char *str)
+{
+     struct tm tm = {0};
+     char *end;
+     long long secs = strtoll(str, &end, 10);
+
+     if (*end == '\0') return secs * 1000;
+
+     end = strptime(str, "%Y-%m-%dT%H:%M:%S", &tm);
+     if (end == NULL || *end) {
+	  tm = (struct tm){0};
+	  end = strptime(str, "%Y-%m-%dT%H:%M", &tm);
+     }
+     if (end == NULL || *end) {
+	  tm = (struct tm){0};
+	  end = strptime(str, "%Y-%m-%d", &tm);
+     }
+     if (end == NULL || *end) return -1;
+
+     return (int64_t)timegm(&tm) * 1000;
+}
+
+/* Maps a file and cuts it into chunks at line boundaries, appended to the scan's */
+static int file_chunk(struct scan *scan, const char *path, size_t *bytes)
+{
+     struct stat st;
+     int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+     if (fd == -1) {
+	  fprintf(stderr, "Error: could not open %s: %s\n", path, strerror(errno));
+	  return -1;
+     }
+     if (fstat(fd, &st) == -1) {
+	  fprintf(stderr, "Error: could not stat %s: %s\n", path, strerror(errno));
+	  close(fd);
+	  return -1;
+     }
+     if (st.st_size == 0) {
+	  close(fd);
+	  return 0;
+     }
+
+     size_t size = (size_t)st.st_size;
+     const char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+     close(fd);
+     if (base == MAP_FAILED) {
+	  fprintf(stderr, "Error: could not map %s: %s\n", path, strerror(errno));
+	  return -1;
+     }
+     madvise((void *)(uintptr_t)base, size, MADV_SEQUENTIAL);
+     *bytes += size;
+
+     /* The mapping stays until exit, the chunks point into it */
+     for (const char *p = base, *end = base + size; p < end;) {
+	  const char *cut = end - p > LOGSCAN_CHUNK_BYTES ? line_end(p + LOGSCAN_CHUNK_BYTES, end) : end;
+	  struct chunk *chunks = realloc(scan->chunks, (scan->nchunks + 1) * sizeof(chunks[0]));
+
+	  if (chunks == NULL) {
+	       fprintf(stderr, "Error: could not allocate %zu chunks\n", scan->nchunks + 1);
+	       return -1;
+	  }
+	  scan->chunks = chunks;
+	  scan->chunks[scan->nchunks++] = (struct chunk){ .begin = p, .end = cut };
+	  p = cut < end ? cut + 1 : end;
+     }
+
+     return 0;
+}
+
+static int64_t clock_ms(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void usage(const char *name)
+{
+     fprintf(stderr, "Usage: %s [-p secs] [-s start] [-j threads] [-o dir] file...\n", name);
+}
+
+int main(int argc, char **argv)
+{
+     long threads = sysconf(_SC_NPROCESSORS_ONLN);
+     double period_secs = 0;
+     int64_t start_ms = 0;
+     const char *out = NULL;
+     struct scan scan = {0};
+     struct days total = {0};
+     size_t bytes = 0;
+     int opt;
+
+     while ((opt = getopt(argc, argv, "p:s:j:o:")) != -1) {
+	  switch (opt) {
+	  case 'p': period_secs = strtod(optarg, NULL); break;
+	  case 's': start_ms = time_parse(optarg); break;
+	  case 'j': threads = atol(optarg); break;
+	  case 'o': out = optarg; break;
+	  default:
+	       usage(argv[0]);
+	       return 1;
+	  }
+     }
+
+     if (optind == argc || period_secs < 0 || start_ms < 0 || threads <= 0) {
+	  usage(argv[0]);
+	  return 1;
+     }
+
+     int64_t began_ms = clock_ms();
+     for (int i = optind; i < argc; ++i)
+	  if (file_chunk(&scan, argv[i], &bytes)) return 1;
+
+     pthread_t *workers = calloc((size_t)threads, sizeof(workers[0]));
+     if (workers == NULL) {
+	  fprintf(stderr, "Error: could not allocate %ld threads\n", threads);
+	  return 1;
+     }
+
+     /* Lines without a timestamp are timed by their position, so a first pass counts them per
+      * chunk to tell where each chunk starts */
+     scan.period_ms = (int64_t)(period_secs * 1000.0);
+     if (scan.period_ms) {
+	  scan.count_only = 1;
+	  scan_run(&scan, workers, threads);
+	  scan.count_only = 0;
+
+	  uint64_t untimed = 0;
+	  for (size_t k = 0; k < scan.nchunks; ++k) {
+	       scan.chunks[k].t0_ms = start_ms + (int64_t)untimed * scan.period_ms;
+	       untimed += scan.chunks[k].untimed;
+	  }
+     }
+
+     scan.convert = out != NULL;
+     scan_run(&scan, workers, threads);
+
+     /* Chunks are joined in order, the interval across each cut is added here */
+     const struct sample *last = NULL;
+     uint64_t lines = 0, skipped = 0;
+     for (size_t k = 0; k < scan.nchunks; ++k) {
+	  const struct chunk *chunk = &scan.chunks[k];
+
+	  if (chunk->error || days_merge(&total, &chunk->days)) return 1;
+	  if (chunk->sampled) {
+	       if (last && interval_add(&total, last, &chunk->first)) return 1;
+	       last = &chunk->last;
+	  }
+	  lines += chunk->lines;
+	  skipped += chunk->skipped;
+     }
+
+     if (out) {
+	  struct telemetry tlm;
+
+	  if (telemetry_open(&tlm, out)) return 1;
+	  for (size_t k = 0; k < scan.nchunks; ++k)
+	       for (size_t i = 0; i < scan.chunks[k].nrecs; ++i)
+		    if (telemetry_append(&tlm, &scan.chunks[k].recs[i])) return 1;
+	  telemetry_close(&tlm);
+     }
+
+     int64_t took_ms = clock_ms() - began_ms;
+     fprintf(stderr, "Scanned %.1f MB with %" PRIu64 " status lines in %zu chunks on %ld threads in %.2f s (%.0f MB/s)\n",
+	     (double)bytes / 1e6, lines, scan.nchunks, threads, (double)took_ms / 1000.0,
+	     took_ms ? (double)bytes / 1e3 / (double)took_ms : 0.0);
+     if (skipped)
+	  fprintf(stderr, "Skipped %" PRIu64 " status lines without a timestamp, -p gives them one\n", skipped);
+
+     days_print(&total);
+
+     for (size_t k = 0; k < scan.nchunks; ++k) {
+	  free(scan.chunks[k].days.days);
+	  free(scan.chunks[k].recs);
+     }
+     free(scan.chunks);
+     free(total.days);
+     free(workers);
+
+     return 0;
+}
@@ -0,0 +1,114 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "powerplay.h"
+
+/*
+  Mbcheck - checks the pipelined Modbus TCP client against a scripted device
+
+  Usage: mbcheck
+
+  Each case hands the client one end of a socketpair and plays the device on the other, answering
+  requests on time, late or not at all. A reply that arrives after its request timed out, between
+  batches, must be counted as stray and dropped, and the next batch must go on as usual on the
+  same connection. Prints PASS or what failed and exits 1 then.
+ */
+
+#define MBCHECK_TIMEOUT_MSECS	20
+#define MBCHECK_UNIT		1
+#define MBCHECK_ADDR		100
+
+static int failures;
+
+static void check(int ok, const char *what)
+{
+     if (ok) return;
+     printf("FAIL: %s\n", what);
+     failures += 1;
+}
+
+/* Reads one read registers request off the device end, returns its transaction id or -1 */
+static int device_request(int fd)
+{
+     uint8_t adu[12];
+
+     if (recv(fd, adu, sizeof(adu), MSG_WAITALL) != (ssize_t)sizeof(adu) || adu[7] != MBTCP_READ_REGISTERS) return -1;
+     return adu[0] << 8 | adu[1];
+}
+
+static void device_reply(int fd, int tid, uint16_t value)
+{
+     uint8_t adu[11] = {
+	  (uint8_t)(tid >> 8), (uint8_t)tid, 0, 0, 0, 5, MBCHECK_UNIT,
+	  MBTCP_READ_REGISTERS, 2, (uint8_t)(value >> 8), (uint8_t)value,
+     };
+
+     if (send(fd, adu, sizeof(adu), MSG_NOSIGNAL) != (ssize_t)sizeof(adu)) check(0, "device reply sent");
+}
+
+static struct mbtcp_request read_request(uint16_t *value)
+{
+     return (struct mbtcp_request){
+	  .function = MBTCP_READ_REGISTERS,
+	  .unit = MBCHECK_UNIT,
+	  .addr = MBCHECK_ADDR,
+	  .count = 1,
+	  .values = value,
+     };
+}
+
+/* A reply after the timeout arrives while no batch runs, as in sparkfleet's idle polling */
+static void check_late_reply(void)
+{
+     struct mbtcp client;
+     uint16_t value = 0;
+     int fds[2];
+
+     if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+	  check(0, "socketpair created");
+	  return;
+     }
+
+     mbtcp_init(&client);
+     client.fd = fds[0];
+     client.depth = 1;
+     client.timeout_msecs = MBCHECK_TIMEOUT_MSECS;
+
+     struct mbtcp_request req = read_request(&value);
+     check(mbtcp_batch(&client, &req, 1) == -1 && req.result == ETIMEDOUT, "unanswered request times out");
+
+     int tid = device_request(fds[1]);
+     check(tid >= 0, "device got the request");
+     device_reply(fds[1], tid, 1);
+
+     check(mbtcp_poll(&client, monotonic_ns()) == 1, "idle poll has nothing open");
+     check(client.stray == 1, "late reply counted as stray");
+     check(mbtcp_connected(&client), "late reply leaves the connection up");
+     check(client.rx_len == 0, "late reply dropped");
+
+     /* The next batch is answered on time on the same connection */
+     req = read_request(&value);
+     int done = mbtcp_submit(&client, &req, 1, monotonic_ns());
+     tid = device_request(fds[1]);
+     device_reply(fds[1], tid, 42);
+     for (int64_t start_ns = monotonic_ns(); !done && monotonic_ns() - start_ns < NSECS_PER_SEC;)
+	  done = mbtcp_poll(&client, monotonic_ns());
+     check(done && req.result == 0 && value == 42, "next batch answered");
+     check(client.stray == 1, "answer of the next batch not stray");
+
+     mbtcp_close(&client);
+     close(fds[1]);
+}
+
+int main(void)
+{
+     check_late_reply();
+
+     if (failures) return 1;
+     printf("PASS\n");
+     return 0;
+}
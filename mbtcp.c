@@ -0,0 +1,521 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "powerplay.h"
+
+/*
+ *
+ * Modbus TCP client
+ *
+ */
+
+#define MBTCP_HEADER_LENGTH	7
+
+typedef enum {
+     MBTCP_QUEUED					= 0,
+     MBTCP_IN_FLIGHT					= 1,
+     MBTCP_DONE						= 2,
+} mbtcp_state_t;
+
+void mbtcp_init(struct mbtcp *client)
+{
+     *client = (struct mbtcp){0};
+     client->fd = -1;
+}
+
+int mbtcp_connected(const struct mbtcp *client)
+{
+     return client->fd != -1 && !client->connecting;
+}
+
+void mbtcp_close(struct mbtcp *client)
+{
+     if (client->fd != -1) close(client->fd);
+     client->fd = -1;
+     client->connecting = 0;
+     client->rx_len = 0;
+}
+
+/* Takes the result of a connect that went on in the background, 0 or -1 with errno set */
+static int mbtcp_connect_result(int fd)
+{
+     socklen_t len = sizeof(int);
+     int err = 0;
+
+     if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1) return -1;
+     if (err) {
+	  errno = err;
+	  return -1;
+     }
+
+     return 0;
+}
+
+/*
+ * Connects to one address. Waiting, the socket is made blocking once connected; receives poll on
+ * their own deadlines, sends are small and only block on a full window. Not waiting, the socket
+ * stays non-blocking and *pending tells whether the connect is still in progress.
+ */
+static int mbtcp_connect_addr(const struct addrinfo *ai, uint32_t timeout_msecs, int wait, int *pending)
+{
+     struct timeval tv = { .tv_sec = timeout_msecs / 1000, .tv_usec = timeout_msecs % 1000 * 1000 };
+     struct pollfd pfd;
+     int one = 1, err;
+     int fd;
+
+     *pending = 0;
+     fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, ai->ai_protocol);
+     if (fd == -1) return -1;
+     setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+     if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+	  if (errno != EINPROGRESS) goto error;
+	  if (!wait) {
+	       *pending = 1;
+	       return fd;
+	  }
+
+	  pfd = (struct pollfd){ .fd = fd, .events = POLLOUT };
+	  int rc = poll(&pfd, 1, (int)timeout_msecs);
+	  if (rc == 0) errno = ETIMEDOUT;
+	  if (rc <= 0) goto error;
+	  if (mbtcp_connect_result(fd)) goto error;
+     }
+
+     if (wait) {
+	  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) == -1) goto error;
+	  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+     }
+
+     return fd;
+
+error:
+     err = errno;
+     close(fd);
+     errno = err;
+     return -1;
+}
+
+#ifdef POWERPLAY_SMALL
+/*
+ * The small build takes numeric addresses only: a static binary cannot load the resolver's
+ * modules, and getaddrinfo would allocate on every reconnect.
+ */
+static int mbtcp_open(struct mbtcp *client, const struct modbus_device *device, int wait)
+{
+     struct sockaddr_in6 sin6 = { .sin6_family = AF_INET6, .sin6_port = htons((uint16_t)device->port) };
+     struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons((uint16_t)device->port) };
+     struct addrinfo ai = { .ai_socktype = SOCK_STREAM };
+
+     mbtcp_close(client);
+     client->timeout_msecs = device->timeout_msecs;
+     client->depth = device->pipeline_depth ? device->pipeline_depth : 1;
+
+     if (inet_pton(AF_INET, device->host, &sin.sin_addr) == 1) {
+	  ai.ai_family = AF_INET;
+	  ai.ai_addr = (struct sockaddr *)&sin;
+	  ai.ai_addrlen = sizeof(sin);
+     } else if (inet_pton(AF_INET6, device->host, &sin6.sin6_addr) == 1) {
+	  ai.ai_family = AF_INET6;
+	  ai.ai_addr = (struct sockaddr *)&sin6;
+	  ai.ai_addrlen = sizeof(sin6);
+     } else {
+	  errno = EHOSTUNREACH;
+	  return -1;
+     }
+
+     client->fd = mbtcp_connect_addr(&ai, client->timeout_msecs, wait, &client->connecting);
+
+     return client->fd == -1 ? -1 : 0;
+}
+#else
+static int mbtcp_open(struct mbtcp *client, const struct modbus_device *device, int wait)
+{
+     struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+     struct addrinfo *res, *ai;
+     char port[16];
+     int rc;
+
+     mbtcp_close(client);
+     client->timeout_msecs = device->timeout_msecs;
+     client->depth = device->pipeline_depth ? device->pipeline_depth : 1;
+
+     snprintf(port, sizeof(port), "%d", device->port);
+     rc = getaddrinfo(device->host, port, &hints, &res);
+     if (rc) {
+	  errno = rc == EAI_SYSTEM ? errno : EHOSTUNREACH;
+	  return -1;
+     }
+
+     for (ai = res; ai && client->fd == -1; ai = ai->ai_next)
+	  client->fd = mbtcp_connect_addr(ai, client->timeout_msecs, wait, &client->connecting);
+
+     rc = errno;
+     freeaddrinfo(res);
+     errno = rc;
+
+     return client->fd == -1 ? -1 : 0;
+}
+#endif
+
+int mbtcp_connect(struct mbtcp *client, const struct modbus_device *device)
+{
+     return mbtcp_open(client, device, 1);
+}
+
+/*
+ * Starts connecting without waiting, the socket stays non-blocking. Returns 1 while the connect
+ * is in progress, to be finished with mbtcp_connect_finish() once the socket is writable, 0 if
+ * it connected right away and -1 with errno set if it failed. Names are still resolved here, so
+ * callers that must never block give addresses.
+ */
+int mbtcp_connect_start(struct mbtcp *client, const struct modbus_device *device)
+{
+     if (mbtcp_open(client, device, 0) == -1) return -1;
+
+     return client->connecting;
+}
+
+/* Returns 0 once connected, -1 with errno set and the client closed if the connect failed */
+int mbtcp_connect_finish(struct mbtcp *client)
+{
+     if (client->fd == -1) {
+	  errno = ENOTCONN;
+	  return -1;
+     }
+     if (mbtcp_connect_result(client->fd)) {
+	  int err = errno;
+	  mbtcp_close(client);
+	  errno = err;
+	  return -1;
+     }
+
+     client->connecting = 0;
+     return 0;
+}
+
+static void mbtcp_put16(uint8_t *p, uint16_t value)
+{
+     p[0] = (uint8_t)(value >> 8);
+     p[1] = (uint8_t)value;
+}
+
+static uint16_t mbtcp_get16(const uint8_t *p)
+{
+     return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static int mbtcp_request_valid(const struct mbtcp_request *req)
+{
+     switch (req->function) {
+     case MBTCP_READ_REGISTERS:
+	  return req->count >= 1 && req->count <= MODBUS_MAX_READ_REGISTERS;
+     case MBTCP_WRITE_REGISTER:
+	  return req->write_count == 1;
+     case MBTCP_WRITE_REGISTERS:
+	  return req->write_count >= 1 && req->write_count <= MODBUS_MAX_WRITE_REGISTERS;
+     case MBTCP_WRITE_READ_REGISTERS:
+	  return req->count >= 1 && req->count <= MODBUS_MAX_WR_READ_REGISTERS
+	       && req->write_count >= 1 && req->write_count <= MODBUS_MAX_WR_WRITE_REGISTERS;
+     default:
+	  return 0;
+     }
+}
+
+static size_t mbtcp_request_encode(const struct mbtcp_request *req, uint8_t *adu)
+{
+     uint8_t *pdu = adu + MBTCP_HEADER_LENGTH;
+     size_t len = 0;
+
+     pdu[len++] = (uint8_t)req->function;
+
+     switch (req->function) {
+     case MBTCP_READ_REGISTERS:
+	  mbtcp_put16(pdu + len, req->addr);
+	  mbtcp_put16(pdu + len + 2, req->count);
+	  len += 4;
+	  break;
+     case MBTCP_WRITE_REGISTER:
+	  mbtcp_put16(pdu + len, req->write_addr);
+	  mbtcp_put16(pdu + len + 2, req->write_values[0]);
+	  len += 4;
+	  break;
+     case MBTCP_WRITE_READ_REGISTERS:
+	  mbtcp_put16(pdu + len, req->addr);
+	  mbtcp_put16(pdu + len + 2, req->count);
+	  len += 4;
+	  /* fall through */
+     case MBTCP_WRITE_REGISTERS:
+	  mbtcp_put16(pdu + len, req->write_addr);
+	  mbtcp_put16(pdu + len + 2, req->write_count);
+	  pdu[len + 4] = (uint8_t)(req->write_count * 2);
+	  len += 5;
+	  for (uint16_t i = 0; i < req->write_count; ++i, len += 2) mbtcp_put16(pdu + len, req->write_values[i]);
+	  break;
+     }
+
+     mbtcp_put16(adu, req->tid);
+     mbtcp_put16(adu + 2, 0);
+     mbtcp_put16(adu + 4, (uint16_t)(len + 1));
+     adu[6] = req->unit;
+
+     return MBTCP_HEADER_LENGTH + len;
+}
+
+/* Checks a response PDU against its request and stores read values, returns 0 or an errno */
+static int mbtcp_response_decode(struct mbtcp_request *req, uint8_t unit, const uint8_t *pdu, size_t len)
+{
+     if (unit != req->unit) return EMBBADSLAVE;
+
+     if (len == 2 && pdu[0] == (req->function | 0x80)) {
+	  if (pdu[1] == 0 || pdu[1] >= MODBUS_EXCEPTION_MAX) return EMBBADEXC;
+	  return MODBUS_ENOBASE + pdu[1];
+     }
+
+     if (pdu[0] != req->function) return EMBBADDATA;
+
+     switch (req->function) {
+     case MBTCP_READ_REGISTERS:
+     case MBTCP_WRITE_READ_REGISTERS:
+	  if (len != 2 + 2 * (size_t)req->count || pdu[1] != req->count * 2) return EMBBADDATA;
+	  for (uint16_t i = 0; i < req->count; ++i) req->values[i] = mbtcp_get16(pdu + 2 + 2 * i);
+	  return 0;
+     case MBTCP_WRITE_REGISTER:
+	  if (len != 5 || mbtcp_get16(pdu + 1) != req->write_addr || mbtcp_get16(pdu + 3) != req->write_values[0])
+	       return EMBBADDATA;
+	  return 0;
+     case MBTCP_WRITE_REGISTERS:
+	  if (len != 5 || mbtcp_get16(pdu + 1) != req->write_addr || mbtcp_get16(pdu + 3) != req->write_count)
+	       return EMBBADDATA;
+	  return 0;
+     default:
+	  return EMBBADDATA;
+     }
+}
+
+static void mbtcp_complete(struct mbtcp_request *req, int result)
+{
+     req->state = MBTCP_DONE;
+     req->result = result;
+     req->done_ns = monotonic_ns();
+}
+
+/* The connection is unusable, fail everything still open and leave reconnecting to the caller */
+static void mbtcp_abort(struct mbtcp *client, int err)
+{
+     for (size_t i = 0; i < client->nreqs; ++i)
+	  if (client->reqs[i].state != MBTCP_DONE) mbtcp_complete(&client->reqs[i], err);
+     client->inflight = 0;
+     client->remaining = 0;
+     mbtcp_close(client);
+}
+
+/*
+ * Matches complete frames in the receive buffer to in-flight requests by transaction id.
+ * Responses to requests that already timed out are dropped. Returns the number of requests
+ * completed or -1 if the stream lost framing.
+ */
+static int mbtcp_receive(struct mbtcp *client, struct mbtcp_request *reqs, size_t n)
+{
+     size_t offset = 0;
+     int completed = 0;
+
+     while (client->rx_len - offset >= MBTCP_HEADER_LENGTH) {
+	  const uint8_t *adu = client->rx + offset;
+	  uint16_t tid = mbtcp_get16(adu);
+	  size_t len = mbtcp_get16(adu + 4);
+
+	  if (mbtcp_get16(adu + 2) != 0 || len < 2 || len > MBTCP_ADU_MAX - 6) return -1;
+	  if (client->rx_len - offset < 6 + len) break;
+
+	  struct mbtcp_request *req = NULL;
+	  for (size_t i = 0; i < n && req == NULL; ++i)
+	       if (reqs[i].state == MBTCP_IN_FLIGHT && reqs[i].tid == tid) req = &reqs[i];
+
+	  if (req) {
+	       mbtcp_complete(req, mbtcp_response_decode(req, adu[6], adu + MBTCP_HEADER_LENGTH, len - 1));
+	       completed += 1;
+	  } else {
+	       client->stray += 1;
+	       if (client->stats) iostats_add(&client->stats->stray);
+	  }
+
+	  offset += 6 + len;
+     }
+
+     memmove(client->rx, client->rx + offset, client->rx_len - offset);
+     client->rx_len -= offset;
+
+     return completed;
+}
+
+/* Reads what arrived and completes the requests it answers, until nothing more is there */
+static void mbtcp_drain(struct mbtcp *client)
+{
+     while (mbtcp_connected(client)) {
+	  ssize_t got = recv(client->fd, client->rx + client->rx_len, sizeof(client->rx) - client->rx_len,
+			     MSG_DONTWAIT);
+	  if (got == 0 || (got == -1 && errno != EAGAIN && errno != EINTR)) {
+	       mbtcp_abort(client, got == 0 ? ECONNRESET : errno);
+	       return;
+	  }
+	  if (got == -1 && errno == EINTR) continue;
+	  if (got == -1) return;
+	  client->rx_len += (size_t)got;
+
+	  int rc = mbtcp_receive(client, client->reqs, client->next);
+	  if (rc == -1) {
+	       mbtcp_abort(client, EMBBADDATA);
+	       return;
+	  }
+	  client->received += (uint64_t)rc;
+	  client->inflight -= (size_t)rc;
+	  client->remaining -= (size_t)rc;
+     }
+}
+
+/* Times out the requests past their deadline and sends queued ones while the pipeline has room */
+static void mbtcp_send(struct mbtcp *client, int64_t now_ns)
+{
+     struct mbtcp_request *reqs = client->reqs;
+
+     for (size_t i = 0; i < client->next; ++i) {
+	  if (reqs[i].state != MBTCP_IN_FLIGHT || reqs[i].deadline_ns > now_ns) continue;
+	  mbtcp_complete(&reqs[i], ETIMEDOUT);
+	  client->inflight -= 1;
+	  client->remaining -= 1;
+     }
+
+     for (; client->fd != -1 && client->next < client->nreqs && client->inflight < client->depth; ++client->next) {
+	  struct mbtcp_request *req = &reqs[client->next];
+	  uint8_t adu[MBTCP_ADU_MAX];
+
+	  if (req->state == MBTCP_DONE) continue;
+	  if (req->deadline_ns <= now_ns) {
+	       mbtcp_complete(req, ETIMEDOUT);
+	       client->remaining -= 1;
+	       continue;
+	  }
+
+	  req->tid = client->tid++;
+	  size_t len = mbtcp_request_encode(req, adu);
+	  ssize_t sent = send(client->fd, adu, len, MSG_NOSIGNAL);
+	  if (sent != (ssize_t)len) {
+	       if (sent >= 0 || errno == EAGAIN) errno = ETIMEDOUT;
+	       mbtcp_abort(client, errno);
+	       return;
+	  }
+
+	  req->state = MBTCP_IN_FLIGHT;
+	  req->sent_ns = now_ns;
+	  client->sent += 1;
+	  client->inflight += 1;
+     }
+}
+
+/*
+ * Starts a batch of requests on one connection with up to the device's pipeline depth in flight,
+ * without waiting for any of them. Each request completes on its own: with its response, a Modbus
+ * exception, or ETIMEDOUT once its deadline_ns (CLOCK_MONOTONIC, 0 for the device timeout from
+ * now) passed. A timed out request leaves the connection up; connection errors and lost framing
+ * close it and fail the rest of the batch. The requests must stay in place until the batch is
+ * done. Returns 1 if it already is, else 0, and mbtcp_poll() carries it on.
+ */
+int mbtcp_submit(struct mbtcp *client, struct mbtcp_request *reqs, size_t n, int64_t now_ns)
+{
+     client->reqs = reqs;
+     client->nreqs = n;
+     client->next = 0;
+     client->inflight = 0;
+     client->remaining = n;
+
+     for (size_t i = 0; i < n; ++i) {
+	  reqs[i].state = MBTCP_QUEUED;
+	  reqs[i].result = 0;
+	  reqs[i].sent_ns = 0;
+	  if (reqs[i].deadline_ns == 0) reqs[i].deadline_ns = now_ns + client->timeout_msecs * NSECS_PER_MSEC;
+	  if (!mbtcp_request_valid(&reqs[i])) {
+	       mbtcp_complete(&reqs[i], EMBMDATA);
+	       client->remaining -= 1;
+	  }
+     }
+
+     if (!mbtcp_connected(client)) mbtcp_abort(client, ENOTCONN);
+
+     return mbtcp_poll(client, now_ns);
+}
+
+/*
+ * Carries on the batch once the connection is readable or a deadline passed, and reads away
+ * whatever arrives between batches, noticing a peer that closed. Returns 1 once every request of
+ * the batch is done, 0 while some are open.
+ */
+int mbtcp_poll(struct mbtcp *client, int64_t now_ns)
+{
+     if (client->reqs == NULL) {
+	  mbtcp_drain(client);
+	  return 1;
+     }
+
+     mbtcp_drain(client);
+     if (client->remaining) mbtcp_send(client, now_ns);
+     if (client->remaining) return 0;
+
+     /* Replies still to come for timed out requests find nothing in flight and count as stray */
+     for (size_t i = 0; client->stats && i < client->nreqs; ++i) iostats_request(client->stats, &client->reqs[i]);
+     client->reqs = NULL;
+     client->nreqs = client->next = client->inflight = client->remaining = 0;
+
+     return 1;
+}
+
+/* Earliest deadline of the requests in flight, INT64_MAX if there are none */
+int64_t mbtcp_deadline(const struct mbtcp *client)
+{
+     int64_t deadline_ns = INT64_MAX;
+
+     for (size_t i = 0; client->reqs && i < client->next; ++i)
+	  if (client->reqs[i].state == MBTCP_IN_FLIGHT && client->reqs[i].deadline_ns < deadline_ns)
+	       deadline_ns = client->reqs[i].deadline_ns;
+
+     return deadline_ns;
+}
+
+/*
+ * Runs a batch as mbtcp_submit() does and waits for it. Returns 0 if every request succeeded,
+ * otherwise -1 with errno set from the first failed request.
+ */
+int mbtcp_batch(struct mbtcp *client, struct mbtcp_request *reqs, size_t n)
+{
+     int64_t now_ns = monotonic_ns();
+     int done = mbtcp_submit(client, reqs, n, now_ns);
+
+     while (!done) {
+	  int64_t deadline_ns = mbtcp_deadline(client);
+	  struct pollfd pfd = { .fd = client->fd, .events = POLLIN };
+	  int timeout_ms = deadline_ns <= now_ns ? 0 : (int)((deadline_ns - now_ns + NSECS_PER_MSEC - 1) / NSECS_PER_MSEC);
+
+	  if (poll(&pfd, 1, timeout_ms) == -1 && errno != EINTR) mbtcp_abort(client, errno);
+	  now_ns = monotonic_ns();
+	  done = mbtcp_poll(client, now_ns);
+     }
+
+     for (size_t i = 0; i < n; ++i) {
+	  if (reqs[i].result) {
+	       errno = reqs[i].result;
+	       return -1;
+	  }
+     }
+
+     return 0;
+}
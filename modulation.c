@@ -0,0 +1,50 @@
+#include "powerplay.h"
+
+/*
+ *
+ * Modulation
+ *
+ */
+
+void modulation_reset(struct modulation *mod)
+{
+     *mod = (struct modulation){0};
+}
+
+/*
+ * Picks the charging current for the excess power measured this cycle. Excess already includes
+ * what the car draws, so the target is the largest current the excess covers, rounded down so
+ * tracking never imports. Export within the deadband keeps the setpoint, any import lowers it.
+ * Changes are limited to the slew rate and the result is clamped to the configured floor and the
+ * charger's maximum, which the caller has read.
+ * Stopping below the floor is left to the on/off decision on the averaging window.
+ */
+uint16_t modulation_step(struct modulation *mod, const struct config *config, int32_t excess,
+			 uint16_t current, uint16_t current_max, int64_t now_ns)
+{
+     int32_t watts_per_amp = EVCS_VOLTAGE * (int32_t)config->evcs_phases;
+     int32_t setpoint = mod->setpoint ? mod->setpoint : current;
+     int32_t target = excess / watts_per_amp;
+
+     if (excess < 0) target = 0;
+
+     int32_t error = excess - setpoint * watts_per_amp;
+     if (error >= 0 && error <= (int32_t)config->current_deadband_watts) target = setpoint;
+
+     /* At least one amp per step so a short period still converges */
+     int32_t step = 1;
+     if (mod->updated_ns) {
+	  int64_t slew = (int64_t)config->current_slew_amps * (now_ns - mod->updated_ns) / NSECS_PER_SEC;
+	  if (slew > step) step = slew > INT16_MAX ? INT16_MAX : (int32_t)slew;
+     }
+     if (target > setpoint + step) target = setpoint + step;
+     if (target < setpoint - step) target = setpoint - step;
+
+     if (target < (int32_t)config->current_min_amps) target = (int32_t)config->current_min_amps;
+     if (target > current_max) target = current_max;
+
+     mod->setpoint = (uint16_t)target;
+     mod->updated_ns = now_ns;
+
+     return mod->setpoint;
+}
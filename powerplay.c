@@ -1,8 +1,10 @@
 #include <assert.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "powerplay.h"
 
@@ -12,9 +14,84 @@
  *
  */
 
+/* A comma separated list of registers and FIRST-LAST ranges, appended to regs */
+static int config_registers_parse(const char *name, const char *str, uint16_t *regs, size_t *nregs)
+{
+     for (const char *p = str; *p;) {
+	  char *end;
+	  unsigned long first = strtoul(p, &end, 10), last = first;
+
+	  if (end != p && *end == '-') last = strtoul(end + 1, &end, 10);
+	  if (end == p || (*end && *end != ',') || last < first || last > UINT16_MAX) {
+	       fprintf(stderr, "Error: %s environment variable not a list of registers\n", name);
+	       return -1;
+	  }
+	  if (*nregs + (last - first) >= REGISTER_VALUES_MAX) {
+	       fprintf(stderr, "Error: %s environment variable lists too many registers\n", name);
+	       return -1;
+	  }
+
+	  for (unsigned long r = first; r <= last; ++r) regs[(*nregs)++] = (uint16_t)r;
+	  p = *end ? end + 1 : end;
+     }
+
+     return 0;
+}
+
+/*
+ * Settings from the file named by SPARKSHIFT_CONFIG, looked up before the environment. They are
+ * kept apart from it as setenv() is not safe while other threads run. A value replaced on a reload
+ * is not freed, the running configuration may still point at it.
+ */
+static struct config_setting {
+     char *key, *value;
+} config_settings[CONFIG_SETTINGS_MAX];
+static size_t nconfig_settings;
+
+static const char *config_getenv(const char *key)
+{
+     for (size_t i = 0; i < nconfig_settings; ++i)
+	  if (!strcmp(config_settings[i].key, key)) return config_settings[i].value;
+
+     return getenv(key);
+}
+
+static int config_setting_set(const char *key, const char *value)
+{
+     size_t i = 0;
+
+     while (i < nconfig_settings && strcmp(config_settings[i].key, key)) ++i;
+     if (i < nconfig_settings && !strcmp(config_settings[i].value, value)) return 0;
+
+     if (i == CONFIG_SETTINGS_MAX) {
+	  fprintf(stderr, "Error: more than %d settings\n", CONFIG_SETTINGS_MAX);
+	  return -1;
+     }
+
+     char *copy = strdup(value);
+     if (copy == NULL || (i == nconfig_settings && (config_settings[i].key = strdup(key)) == NULL)) {
+	  fprintf(stderr, "Error: could not allocate setting %s\n", key);
+	  free(copy);
+	  return -1;
+     }
+
+     config_settings[i].value = copy;
+     if (i == nconfig_settings) nconfig_settings += 1;
+     return 0;
+}
+
+/* Environment prefix and link name of each charger */
+static const char *const evcs_names[EVCS_MAX] = { "EVCS", "EVCS2", "EVCS3", "EVCS4" };
+
+/* Sized for twice the nominal sample count so a faster period never drops samples */
+size_t config_window_capacity(const struct config *config)
+{
+     return (size_t)(2 * config->averaging_secs * NSECS_PER_SEC / config->poll_min_ns) + 16;
+}
+
 int config_from_env(struct config *config)
 {
-     const char *config_debug = getenv("SPARKSHIFT_DEBUG");
+     const char *config_debug = config_getenv("SPARKSHIFT_DEBUG");
      if (config_debug == NULL) {
 	  fprintf(stderr, "Error: %s environment variable not set\n", "SPARKSHIFT_DEBUG");
 	  goto error;
@@ -24,7 +101,7 @@ int config_from_env(struct config *config)
 	  config->debug = 1;
      }
 
-     const char *config_dryrun = getenv("SPARKSHIFT_DRYRUN");
+     const char *config_dryrun = config_getenv("SPARKSHIFT_DRYRUN");
      if (config_dryrun == NULL) {
 	  fprintf(stderr, "Error: %s environment variable not set\n", "SPARKSHIFT_DRYRUN");
 	  goto error;
@@ -34,7 +111,7 @@ int config_from_env(struct config *config)
 	  config->dryrun = 1;
      }
 
-     const char *config_averaging_secs = getenv("AVERAGING_SECS");
+     const char *config_averaging_secs = config_getenv("AVERAGING_SECS");
      if (config_averaging_secs == NULL) {
 	  fprintf(stderr, "Error: %s environment variable not set\n", "AVERAGING_SECS");
 	  goto error;
@@ -46,19 +123,183 @@ int config_from_env(struct config *config)
 	  goto error;
      }
 
-     const char *config_sleep_secs = getenv("SLEEP_SECS");
+     const char *config_sleep_secs = config_getenv("SLEEP_SECS");
      if (config_sleep_secs == NULL) {
 	  fprintf(stderr, "Error: %s environment variable not set\n", "SLEEP_SECS");
 	  goto error;
      }
 
-     config->sleep_secs = (uint32_t)atoi(config_sleep_secs);
-     if (config->sleep_secs == 0) {
-	  fprintf(stderr, "Error: %s environment variable not an integer\n", "SLEEP_SECS");
+     /* Fractional seconds allow sub-second periods, e.g. 0.5 */
+     config->period_ns = (int64_t)(strtod(config_sleep_secs, NULL) * (double)NSECS_PER_SEC);
+     if (config->period_ns < NSECS_PER_MSEC) {
+	  fprintf(stderr, "Error: %s environment variable not a number of seconds\n", "SLEEP_SECS");
 	  goto error;
      }
 
-     const char *config_power_excess_min = getenv("POWER_EXCESS_MIN");
+     /* Without limits the period stays at SLEEP_SECS */
+     config->poll_min_ns = config->poll_max_ns = config->period_ns;
+     const char *config_poll_min = config_getenv("POLL_MIN_SECS");
+     if (config_poll_min != NULL) {
+	  config->poll_min_ns = (int64_t)(strtod(config_poll_min, NULL) * (double)NSECS_PER_SEC);
+	  if (config->poll_min_ns < NSECS_PER_MSEC || config->poll_min_ns > config->period_ns) {
+	       fprintf(stderr, "Error: %s environment variable not between 0.001 and SLEEP_SECS\n", "POLL_MIN_SECS");
+	       goto error;
+	  }
+     }
+
+#ifdef POWERPLAY_SMALL
+     if (config_window_capacity(config) > AVERAGE_INTERVALS_MAX) {
+	  fprintf(stderr, "Error: %s needs %zu samples at the shortest poll period, the small build holds %d\n",
+		  "AVERAGING_SECS", config_window_capacity(config), AVERAGE_INTERVALS_MAX);
+	  goto error;
+     }
+#endif
+
+     const char *config_poll_max = config_getenv("POLL_MAX_SECS");
+     if (config_poll_max != NULL) {
+	  config->poll_max_ns = (int64_t)(strtod(config_poll_max, NULL) * (double)NSECS_PER_SEC);
+	  if (config->poll_max_ns < config->period_ns) {
+	       fprintf(stderr, "Error: %s environment variable less than SLEEP_SECS\n", "POLL_MAX_SECS");
+	       goto error;
+	  }
+     }
+
+     config->poll_near_watts = POLL_NEAR_WATTS_DEFAULT;
+     const char *config_poll_near = config_getenv("POLL_NEAR_WATTS");
+     if (config_poll_near != NULL) {
+	  int near = atoi(config_poll_near);
+	  if (near < 0) {
+	       fprintf(stderr, "Error: %s environment variable out of range\n", "POLL_NEAR_WATTS");
+	       goto error;
+	  }
+	  config->poll_near_watts = (uint32_t)near;
+     }
+
+     config->poll_boost_secs = POLL_BOOST_SECS_DEFAULT;
+     const char *config_poll_boost = config_getenv("POLL_BOOST_SECS");
+     if (config_poll_boost != NULL) {
+	  int boost = atoi(config_poll_boost);
+	  if (boost < 0) {
+	       fprintf(stderr, "Error: %s environment variable out of range\n", "POLL_BOOST_SECS");
+	       goto error;
+	  }
+	  config->poll_boost_secs = (uint32_t)boost;
+     }
+
+     config->schedule_policy = SCHEDULE_SKIP;
+     const char *config_schedule_policy = config_getenv("SCHEDULE_POLICY");
+     if (config_schedule_policy != NULL) {
+	  if (!strcmp("skip", config_schedule_policy)) {
+	       config->schedule_policy = SCHEDULE_SKIP;
+	  } else if (!strcmp("catchup", config_schedule_policy)) {
+	       config->schedule_policy = SCHEDULE_CATCH_UP;
+	  } else {
+	       fprintf(stderr, "Error: %s environment variable not skip or catchup\n", "SCHEDULE_POLICY");
+	       goto error;
+	  }
+     }
+
+     config->control_mode = CONTROL_SWITCH;
+     const char *config_control_mode = config_getenv("CONTROL_MODE");
+     if (config_control_mode != NULL) {
+	  if (!strcmp("switch", config_control_mode)) {
+	       config->control_mode = CONTROL_SWITCH;
+	  } else if (!strcmp("modulate", config_control_mode)) {
+	       config->control_mode = CONTROL_MODULATE;
+	  } else {
+	       fprintf(stderr, "Error: %s environment variable not switch or modulate\n", "CONTROL_MODE");
+	       goto error;
+	  }
+     }
+
+     config->decision_mode = DECISION_MEAN;
+     const char *config_decision_mode = config_getenv("DECISION_MODE");
+     if (config_decision_mode != NULL) {
+	  if (!strcmp("mean", config_decision_mode)) {
+	       config->decision_mode = DECISION_MEAN;
+	  } else if (!strcmp("forecast", config_decision_mode)) {
+	       config->decision_mode = DECISION_FORECAST;
+	  } else {
+	       fprintf(stderr, "Error: %s environment variable not mean or forecast\n", "DECISION_MODE");
+	       goto error;
+	  }
+     }
+
+     config->forecast_secs = FORECAST_SECS_DEFAULT;
+     const char *config_forecast_secs = config_getenv("FORECAST_SECS");
+     if (config_forecast_secs != NULL) {
+	  config->forecast_secs = (uint32_t)atoi(config_forecast_secs);
+	  if (config->forecast_secs == 0) {
+	       fprintf(stderr, "Error: %s environment variable not an integer\n", "FORECAST_SECS");
+	       goto error;
+	  }
+     }
+
+     config->forecast_smoothing_secs = FORECAST_SMOOTHING_SECS_DEFAULT;
+     const char *config_forecast_smoothing = config_getenv("FORECAST_SMOOTHING_SECS");
+     if (config_forecast_smoothing != NULL) {
+	  config->forecast_smoothing_secs = (uint32_t)atoi(config_forecast_smoothing);
+	  if (config->forecast_smoothing_secs == 0) {
+	       fprintf(stderr, "Error: %s environment variable not an integer\n", "FORECAST_SMOOTHING_SECS");
+	       goto error;
+	  }
+     }
+
+     config->sharing_policy = SHARING_PRIORITY;
+     const char *config_sharing_policy = config_getenv("EVCS_SHARING");
+     if (config_sharing_policy != NULL) {
+	  if (!strcmp("priority", config_sharing_policy)) {
+	       config->sharing_policy = SHARING_PRIORITY;
+	  } else if (!strcmp("fair", config_sharing_policy)) {
+	       config->sharing_policy = SHARING_FAIR;
+	  } else {
+	       fprintf(stderr, "Error: %s environment variable not priority or fair\n", "EVCS_SHARING");
+	       goto error;
+	  }
+     }
+
+     config->evcs_phases = EVCS_PHASES_DEFAULT;
+     const char *config_evcs_phases = config_getenv("EVCS_PHASES");
+     if (config_evcs_phases != NULL) {
+	  config->evcs_phases = (uint32_t)atoi(config_evcs_phases);
+	  if (config->evcs_phases != 1 && config->evcs_phases != 3) {
+	       fprintf(stderr, "Error: %s environment variable not 1 or 3\n", "EVCS_PHASES");
+	       goto error;
+	  }
+     }
+
+     config->current_min_amps = CURRENT_MIN_AMPS_DEFAULT;
+     const char *config_current_min = config_getenv("CURRENT_MIN_AMPS");
+     if (config_current_min != NULL) {
+	  config->current_min_amps = (uint32_t)atoi(config_current_min);
+	  if (config->current_min_amps == 0 || config->current_min_amps > UINT16_MAX) {
+	       fprintf(stderr, "Error: %s environment variable out of range\n", "CURRENT_MIN_AMPS");
+	       goto error;
+	  }
+     }
+
+     config->current_slew_amps = CURRENT_SLEW_AMPS_DEFAULT;
+     const char *config_current_slew = config_getenv("CURRENT_SLEW_AMPS");
+     if (config_current_slew != NULL) {
+	  config->current_slew_amps = (uint32_t)atoi(config_current_slew);
+	  if (config->current_slew_amps == 0) {
+	       fprintf(stderr, "Error: %s environment variable not an integer\n", "CURRENT_SLEW_AMPS");
+	       goto error;
+	  }
+     }
+
+     config->current_deadband_watts = CURRENT_DEADBAND_WATTS_DEFAULT;
+     const char *config_current_deadband = config_getenv("CURRENT_DEADBAND_WATTS");
+     if (config_current_deadband != NULL) {
+	  int deadband = atoi(config_current_deadband);
+	  if (deadband < 0) {
+	       fprintf(stderr, "Error: %s environment variable out of range\n", "CURRENT_DEADBAND_WATTS");
+	       goto error;
+	  }
+	  config->current_deadband_watts = (uint32_t)deadband;
+     }
+
+     const char *config_power_excess_min = config_getenv("POWER_EXCESS_MIN");
      if (config_power_excess_min == NULL) {
 	  fprintf(stderr, "Error: %s environment variable not set\n", "POWER_EXCESS_MIN");
 	  goto error;
@@ -70,13 +311,13 @@ int config_from_env(struct config *config)
 	  goto error;
      }
 
-     config->gx.host = getenv("GX_HOST");
+     config->gx.host = config_getenv("GX_HOST");
      if (config->gx.host == NULL) {
 	  fprintf(stderr, "Error: %s environment variable not set\n", "GX_HOST");
 	  goto error;
      }
 
-     const char *gx_port_str = getenv("GX_PORT");
+     const char *gx_port_str = config_getenv("GX_PORT");
      if (gx_port_str == NULL) {
 	  fprintf(stderr, "Error: %s environment variable not set\n", "GX_PORT");
 	  goto error;
@@ -87,23 +328,212 @@ int config_from_env(struct config *config)
 	  goto error;
      }
 
-     config->evcs.host = getenv("EVCS_HOST");
-     if (config->evcs.host == NULL) {
-	  fprintf(stderr, "Error: %s environment variable not set\n", "EVCS_HOST");
-	  goto error;
+     /* The first charger is required, further ones are taken up to the first missing host */
+     config->nevcs = 0;
+     for (size_t i = 0; i < EVCS_MAX; ++i) {
+	  char var[32];
+
+	  snprintf(var, sizeof(var), "%s_HOST", evcs_names[i]);
+	  config->evcs[i].host = config_getenv(var);
+	  if (config->evcs[i].host == NULL) {
+	       if (i > 0) break;
+	       fprintf(stderr, "Error: %s environment variable not set\n", var);
+	       goto error;
+	  }
+
+	  snprintf(var, sizeof(var), "%s_PORT", evcs_names[i]);
+	  const char *evcs_port_str = config_getenv(var);
+	  if (evcs_port_str == NULL) {
+	       fprintf(stderr, "Error: %s environment variable not set\n", var);
+	       goto error;
+	  }
+	  config->evcs[i].port = atoi(evcs_port_str);
+	  if (config->evcs[i].port == 0) {
+	       fprintf(stderr, "Error: %s environment variable not an integer\n", var);
+	       goto error;
+	  }
+
+	  /* Lower values are served first, by default in the order the chargers are configured */
+	  snprintf(var, sizeof(var), "%s_PRIORITY", evcs_names[i]);
+	  config->evcs_priority[i] = (uint32_t)i + 1;
+	  const char *evcs_priority_str = config_getenv(var);
+	  if (evcs_priority_str != NULL) {
+	       config->evcs_priority[i] = (uint32_t)atoi(evcs_priority_str);
+	       if (config->evcs_priority[i] == 0) {
+		    fprintf(stderr, "Error: %s environment variable not a positive integer\n", var);
+		    goto error;
+	       }
+	  }
+
+	  config->nevcs = i + 1;
      }
 
-     const char *evcs_port_str = getenv("EVCS_PORT");
-     if (evcs_port_str == NULL) {
-	  fprintf(stderr, "Error: %s environment variable not set\n", "EVCS_PORT");
-	  goto error;
+     config->gx.timeout_msecs = LINK_TIMEOUT_MSECS_DEFAULT;
+     const char *gx_timeout_str = config_getenv("GX_TIMEOUT_MSECS");
+     if (gx_timeout_str != NULL) {
+	  config->gx.timeout_msecs = (uint32_t)atoi(gx_timeout_str);
+	  if (config->gx.timeout_msecs == 0) {
+	       fprintf(stderr, "Error: %s environment variable not an integer\n", "GX_TIMEOUT_MSECS");
+	       goto error;
+	  }
      }
-     config->evcs.port = atoi(evcs_port_str);
-     if (config->evcs.port == 0) {
-	  fprintf(stderr, "Error: %s environment variable not an integer\n", "EVCS_PORT");
-	  goto error;
+
+     uint32_t evcs_timeout_msecs = LINK_TIMEOUT_MSECS_DEFAULT;
+     const char *evcs_timeout_str = config_getenv("EVCS_TIMEOUT_MSECS");
+     if (evcs_timeout_str != NULL) {
+	  evcs_timeout_msecs = (uint32_t)atoi(evcs_timeout_str);
+	  if (evcs_timeout_msecs == 0) {
+	       fprintf(stderr, "Error: %s environment variable not an integer\n", "EVCS_TIMEOUT_MSECS");
+	       goto error;
+	  }
      }
 
+     config->gx.pipeline_depth = MBTCP_PIPELINE_DEFAULT;
+     const char *gx_pipeline_str = config_getenv("GX_PIPELINE_DEPTH");
+     if (gx_pipeline_str != NULL) {
+	  config->gx.pipeline_depth = (uint32_t)atoi(gx_pipeline_str);
+	  if (config->gx.pipeline_depth == 0 || config->gx.pipeline_depth > MBTCP_PIPELINE_MAX) {
+	       fprintf(stderr, "Error: %s environment variable out of range\n", "GX_PIPELINE_DEPTH");
+	       goto error;
+	  }
+     }
+
+     uint32_t evcs_pipeline_depth = MBTCP_PIPELINE_DEFAULT;
+     const char *evcs_pipeline_str = config_getenv("EVCS_PIPELINE_DEPTH");
+     if (evcs_pipeline_str != NULL) {
+	  evcs_pipeline_depth = (uint32_t)atoi(evcs_pipeline_str);
+	  if (evcs_pipeline_depth == 0 || evcs_pipeline_depth > MBTCP_PIPELINE_MAX) {
+	       fprintf(stderr, "Error: %s environment variable out of range\n", "EVCS_PIPELINE_DEPTH");
+	       goto error;
+	  }
+     }
+
+     for (size_t i = 0; i < config->nevcs; ++i) {
+	  config->evcs[i].timeout_msecs = evcs_timeout_msecs;
+	  config->evcs[i].pipeline_depth = evcs_pipeline_depth;
+     }
+
+     config->hold_secs = HOLD_SECS_DEFAULT;
+     const char *config_hold_secs = config_getenv("HOLD_SECS");
+     if (config_hold_secs != NULL) {
+	  config->hold_secs = atoi(config_hold_secs);
+	  if (config->hold_secs < 0) {
+	       fprintf(stderr, "Error: %s environment variable out of range\n", "HOLD_SECS");
+	       goto error;
+	  }
+     }
+
+     config->deadline_msecs = DEADLINE_MSECS_DEFAULT;
+     const char *config_deadline_msecs = config_getenv("DEADLINE_MSECS");
+     if (config_deadline_msecs != NULL) {
+	  config->deadline_msecs = (uint32_t)atoi(config_deadline_msecs);
+	  if (config->deadline_msecs == 0) {
+	       fprintf(stderr, "Error: %s environment variable not an integer\n", "DEADLINE_MSECS");
+	       goto error;
+	  }
+     }
+
+     config->stale_secs = STALE_SECS_DEFAULT;
+     const char *config_stale_secs = config_getenv("STALE_SECS");
+     if (config_stale_secs != NULL) {
+	  config->stale_secs = (uint32_t)atoi(config_stale_secs);
+	  if (config->stale_secs == 0) {
+	       fprintf(stderr, "Error: %s environment variable not an integer\n", "STALE_SECS");
+	       goto error;
+	  }
+     }
+
+     config->write_interval_msecs = WRITE_INTERVAL_MSECS_DEFAULT;
+     const char *config_write_interval = config_getenv("WRITE_INTERVAL_MSECS");
+     if (config_write_interval != NULL) {
+	  int interval = atoi(config_write_interval);
+	  if (interval < 0) {
+	       fprintf(stderr, "Error: %s environment variable out of range\n", "WRITE_INTERVAL_MSECS");
+	       goto error;
+	  }
+	  config->write_interval_msecs = (uint32_t)interval;
+     }
+
+     config->io_stats_secs = IO_STATS_SECS_DEFAULT;
+     const char *config_io_stats_secs = config_getenv("IO_STATS_SECS");
+     if (config_io_stats_secs != NULL) {
+	  int secs = atoi(config_io_stats_secs);
+	  if (secs < 0) {
+	       fprintf(stderr, "Error: %s environment variable out of range\n", "IO_STATS_SECS");
+	       goto error;
+	  }
+	  config->io_stats_secs = (uint32_t)secs;
+     }
+
+     config->telemetry_dir = config_getenv("TELEMETRY_DIR");
+
+     config->state_file = config_getenv("STATE_FILE");
+     config->state_max_age_secs = STATE_MAX_AGE_SECS_DEFAULT;
+     const char *config_state_max_age = config_getenv("STATE_MAX_AGE_SECS");
+     if (config_state_max_age != NULL) {
+	  int secs = atoi(config_state_max_age);
+	  if (secs < 0) {
+	       fprintf(stderr, "Error: %s environment variable out of range\n", "STATE_MAX_AGE_SECS");
+	       goto error;
+	  }
+	  config->state_max_age_secs = (uint32_t)secs;
+     }
+
+     config->http_addr = config_getenv("HTTP_ADDR");
+     if (config->http_addr == NULL) config->http_addr = HTTP_ADDR_DEFAULT;
+     const char *config_http_port = config_getenv("HTTP_PORT");
+     if (config_http_port != NULL) {
+	  config->http_port = atoi(config_http_port);
+	  if (config->http_port <= 0 || config->http_port > 65535) {
+	       fprintf(stderr, "Error: %s environment variable out of range\n", "HTTP_PORT");
+	       goto error;
+	  }
+     }
+
+     config->gateway_addr = config_getenv("GATEWAY_ADDR");
+     if (config->gateway_addr == NULL) config->gateway_addr = GATEWAY_ADDR_DEFAULT;
+     const char *config_gateway_port = config_getenv("GATEWAY_PORT");
+     if (config_gateway_port != NULL) {
+	  config->gateway_port = atoi(config_gateway_port);
+	  if (config->gateway_port <= 0 || config->gateway_port > 65535 - EVCS_MAX) {
+	       fprintf(stderr, "Error: %s environment variable out of range\n", "GATEWAY_PORT");
+	       goto error;
+	  }
+     }
+
+     config->gateway_max_age_msecs = GATEWAY_MAX_AGE_MSECS_DEFAULT;
+     const char *config_gateway_max_age = config_getenv("GATEWAY_MAX_AGE_MSECS");
+     if (config_gateway_max_age != NULL) {
+	  int msecs = atoi(config_gateway_max_age);
+	  if (msecs < 0) {
+	       fprintf(stderr, "Error: %s environment variable out of range\n", "GATEWAY_MAX_AGE_MSECS");
+	       goto error;
+	  }
+	  config->gateway_max_age_msecs = (uint32_t)msecs;
+     }
+
+     const char *config_gx_cache = config_getenv("GX_CACHE_REGISTERS");
+     if (config_gx_cache != NULL
+	 && config_registers_parse("GX_CACHE_REGISTERS", config_gx_cache, config->gx_cache_registers,
+				   &config->ngx_cache_registers)) goto error;
+     const char *config_evcs_cache = config_getenv("EVCS_CACHE_REGISTERS");
+     if (config_evcs_cache != NULL
+	 && config_registers_parse("EVCS_CACHE_REGISTERS", config_evcs_cache, config->evcs_cache_registers,
+				   &config->nevcs_cache_registers)) goto error;
+
+     config->register_gap_max = REGISTER_GAP_DEFAULT;
+     const char *config_register_gap_max = config_getenv("REGISTER_GAP_MAX");
+     if (config_register_gap_max != NULL) {
+	  int gap = atoi(config_register_gap_max);
+	  if (gap < 0 || gap > MODBUS_MAX_READ_REGISTERS) {
+	       fprintf(stderr, "Error: %s environment variable out of range\n", "REGISTER_GAP_MAX");
+	       goto error;
+	  }
+	  config->register_gap_max = (uint16_t)gap;
+     }
+
+     config->register_map = config_getenv("REGISTER_MAP");
+
      return 0;
 
 error:
@@ -112,30 +542,152 @@ error:
 
 }
 
-int modbus_device_connect(struct modbus_device device, modbus_t **ctx)
+/*
+ * Splits a KEY=VALUE line in place, with the surrounding blanks, an export prefix and quotes
+ * around the value taken off. Returns 1 for a setting, 0 for a blank line or comment and -1 for
+ * anything else.
+ */
+int config_line_parse(char *line, char **key, char **value)
 {
-     *ctx = modbus_new_tcp(device.host, device.port);
-     if (*ctx == NULL) {
-	  fprintf(stderr, "Error: Failed to create modbus context for %s:%d: %s\n",
-		  device.host, device.port, modbus_strerror(errno));
-	  goto error;
+     char *end;
+
+     *key = line;
+     while (**key == ' ' || **key == '\t') ++*key;
+     end = *key + strlen(*key);
+     while (end > *key && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) *--end = '\0';
+     if (**key == '\0' || **key == '#') return 0;
+     if (!strncmp(*key, "export ", 7)) *key += 7;
+
+     *value = strchr(*key, '=');
+     if (*value == NULL || *value == *key) return -1;
+     *(*value)++ = '\0';
+     if (end - *value >= 2 && (**value == '"' || **value == '\'') && end[-1] == **value) {
+	  end[-1] = '\0';
+	  *value += 1;
      }
 
-     if (modbus_set_error_recovery(*ctx, MODBUS_ERROR_RECOVERY_LINK|MODBUS_ERROR_RECOVERY_PROTOCOL) == -1) {
-	  fprintf(stderr, "Error: failed to set error recovery for %s:%d: %s\n",
-		  device.host, device.port, modbus_strerror(errno));
+     return 1;
+}
+
+/*
+ * Reads a file of KEY=VALUE lines in the format of a systemd EnvironmentFile into the settings
+ * config_from_env() takes before the environment, so it picks up edits to it on a reload.
+ * Settings removed from the file keep their value.
+ */
+int config_file_load(const char *path)
+{
+     char line[512];
+     size_t lineno = 0;
+
+     FILE *file = fopen(path, "r");
+     if (file == NULL) {
+	  fprintf(stderr, "Error: could not open config file %s: %s\n", path, strerror(errno));
 	  goto error;
      }
 
-     if (modbus_set_response_timeout(*ctx, 5, 0) == -1) {
-	  fprintf(stderr, "Error: failed to set timeout for %s:%d: %s\n",
-		  device.host, device.port, modbus_strerror(errno));
+     while (fgets(line, sizeof(line), file)) {
+	  char *key, *value;
+
+	  lineno += 1;
+	  int rc = config_line_parse(line, &key, &value);
+	  if (rc == 0) continue;
+	  if (rc == -1) {
+	       fprintf(stderr, "Error: %s:%zu: expected KEY=VALUE\n", path, lineno);
+	       goto error;
+	  }
+
+	  if (config_setting_set(key, value)) goto error;
+     }
+
+     fclose(file);
+     return 0;
+
+error:
+     if (file) fclose(file);
+     fflush(stderr);
+     return -1;
+}
+
+int modbus_device_connect(struct modbus_device device, struct mbtcp *client)
+{
+     if (mbtcp_connect(client, &device) == -1) {
+	  report(stderr, "Error: connection failed to %s:%d: %s\n", device.host, device.port, modbus_strerror(errno));
+	  return -1;
+     }
+
+     return 0;
+}
+
+int64_t monotonic_ns(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (int64_t)ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
+}
+
+/* Registers the control loop needs from each device, in no particular order */
+static const uint16_t gx_status_registers[] = {
+     GX_REGISTER_PV_AC_IN_L1, GX_REGISTER_PV_AC_IN_L2, GX_REGISTER_PV_AC_IN_L3,
+     GX_REGISTER_AC_CONSUMPTION_L1, GX_REGISTER_AC_CONSUMPTION_L2, GX_REGISTER_AC_CONSUMPTION_L3,
+     GX_REGISTER_GRID_L1, GX_REGISTER_GRID_L2, GX_REGISTER_GRID_L3,
+     GX_REGISTER_BATTERY_POWER, GX_REGISTER_BATTERY_SOC,
+};
+
+static const uint16_t evcs_status_registers[] = {
+     EVCS_REGISTER_TOTAL_POWER, EVCS_REGISTER_CHARGE_START,
+     EVCS_REGISTER_CHARGER_STATUS, EVCS_REGISTER_CHARGE_MODE,
+     EVCS_REGISTER_CHARGING_CURRENT, EVCS_REGISTER_MAX_CURRENT,
+};
+
+int register_plan_build(struct register_plan *plan, const uint16_t *regs, size_t nregs, uint16_t gap_max)
+{
+     uint16_t sorted[REGISTER_VALUES_MAX];
+
+     if (nregs == 0 || nregs > REGISTER_VALUES_MAX) {
+	  fprintf(stderr, "Error: cannot plan %zu registers\n", nregs);
 	  goto error;
      }
 
-     if (modbus_connect(*ctx) == -1) {
-	  fprintf(stderr, "Error: connection failed to %s:%d: %s\n",
-		  device.host, device.port, modbus_strerror(errno));
+     /* Tables are tiny, insertion sort keeps this free of qsort callbacks */
+     for (size_t i = 0; i < nregs; ++i) {
+	  size_t j = i;
+	  for (; j > 0 && sorted[j - 1] > regs[i]; --j) sorted[j] = sorted[j - 1];
+	  sorted[j] = regs[i];
+     }
+
+     plan->nranges = 0;
+     plan->nvalues = 0;
+
+     for (size_t i = 0; i < nregs; ++i) {
+	  struct register_range *last = plan->nranges ? &plan->ranges[plan->nranges - 1] : NULL;
+
+	  if (last != NULL) {
+	       uint32_t end = (uint32_t)last->addr + last->count;
+	       uint32_t count = (uint32_t)sorted[i] - last->addr + 1;
+
+	       if (sorted[i] < end) continue;
+
+	       if (sorted[i] - end <= gap_max && count <= MODBUS_MAX_READ_REGISTERS) {
+		    plan->nvalues += count - last->count;
+		    last->count = (uint16_t)count;
+		    continue;
+	       }
+	  }
+
+	  if (plan->nranges == REGISTER_RANGES_MAX) {
+	       fprintf(stderr, "Error: register plan needs more than %d reads\n", REGISTER_RANGES_MAX);
+	       goto error;
+	  }
+
+	  plan->ranges[plan->nranges].addr = sorted[i];
+	  plan->ranges[plan->nranges].count = 1;
+	  plan->nranges += 1;
+	  plan->nvalues += 1;
+     }
+
+     if (plan->nvalues > REGISTER_VALUES_MAX) {
+	  fprintf(stderr, "Error: register plan spans more than %d registers\n", REGISTER_VALUES_MAX);
 	  goto error;
      }
 
@@ -146,61 +698,243 @@ error:
      return -1;
 }
 
-int system_status_update(struct system_status *status)
+/* One read per range of the plan into values, packed back to back in plan order */
+size_t register_plan_requests(uint8_t unit, const struct register_plan *plan, uint16_t *values,
+			      struct mbtcp_request *reqs)
 {
-     uint16_t pv[3];
-     int16_t consumption[3];
-     int16_t grid[3];
+     for (size_t i = 0; i < plan->nranges; ++i) {
+	  const struct register_range *range = &plan->ranges[i];
 
-     int16_t power_battery;
-     uint16_t soc_battery;
+	  reqs[i] = (struct mbtcp_request){
+	       .function = MBTCP_READ_REGISTERS,
+	       .unit = unit,
+	       .addr = range->addr,
+	       .count = range->count,
+	       .values = values,
+	  };
+	  values += range->count;
+     }
 
-     uint16_t power_evcs;
-     uint16_t charge_start, charger_status, charging_mode;
+     return plan->nranges;
+}
 
-     if ((modbus_set_slave(status->gx_ctx, 100) == -1)
-	 || (modbus_read_registers(status->gx_ctx, GX_REGISTER_PV_AC_IN_L1, 3, (uint16_t *)&pv) == -1)
-	 || (modbus_read_registers(status->gx_ctx, GX_REGISTER_AC_CONSUMPTION_L1, 3, (uint16_t *)&consumption) == -1)
-	 || (modbus_read_registers(status->gx_ctx, GX_REGISTER_GRID_L1, 3, (uint16_t *)&grid) == -1)
-	 || (modbus_read_registers(status->gx_ctx, GX_REGISTER_BATTERY_POWER, 1, (uint16_t *)&power_battery) == -1)
-	 || (modbus_read_registers(status->gx_ctx, GX_REGISTER_BATTERY_SOC, 1, (uint16_t *)&soc_battery) == -1)) {
-	  fprintf(stderr, "Error: could not read GX value: %s\n", modbus_strerror(errno));
-	  goto error;
+/* Reads all ranges of the plan into values, packed back to back in plan order. They go out as one
+ * batch, so a pipelining device answers them all in about one RTT */
+int register_plan_read(struct mbtcp *client, uint8_t unit, const struct register_plan *plan, uint16_t *values)
+{
+     struct mbtcp_request reqs[REGISTER_RANGES_MAX];
+
+     return mbtcp_batch(client, reqs, register_plan_requests(unit, plan, values, reqs));
+}
+
+uint16_t register_plan_value(const struct register_plan *plan, const uint16_t *values, uint16_t addr)
+{
+     for (size_t i = 0; i < plan->nranges; ++i) {
+	  const struct register_range *range = &plan->ranges[i];
+
+	  if (addr >= range->addr && addr - range->addr < range->count) return values[addr - range->addr];
+	  values += range->count;
      }
 
-     if ((modbus_read_registers(status->evcs_ctx, EVCS_REGISTER_TOTAL_POWER, 1, &power_evcs) == -1)
-	 || (modbus_read_registers(status->evcs_ctx, EVCS_REGISTER_CHARGE_START, 1, &charge_start) == -1)
-	 || (modbus_read_registers(status->evcs_ctx, EVCS_REGISTER_CHARGER_STATUS, 1, &charger_status) == -1)
-	 || (modbus_read_registers(status->evcs_ctx, EVCS_REGISTER_CHARGE_MODE, 1, &charging_mode) == -1)) {
-	  fprintf(stderr, "Error: could not read EVCS value: %s\n", modbus_strerror(errno));
+     /* Only registers from the tables above are ever looked up */
+     assert(0 && "register not in plan");
+     return 0;
+}
+
+/* Plausible values are generous bounds for a home installation, catching registers that moved */
+static const struct register_info register_infos[] = {
+     { "GX_REGISTER_PV_AC_IN_L1", REGISTER_DEVICE_GX, GX_REGISTER_PV_AC_IN_L1, 0, 0, 20000 },
+     { "GX_REGISTER_PV_AC_IN_L2", REGISTER_DEVICE_GX, GX_REGISTER_PV_AC_IN_L2, 0, 0, 20000 },
+     { "GX_REGISTER_PV_AC_IN_L3", REGISTER_DEVICE_GX, GX_REGISTER_PV_AC_IN_L3, 0, 0, 20000 },
+     { "GX_REGISTER_AC_CONSUMPTION_L1", REGISTER_DEVICE_GX, GX_REGISTER_AC_CONSUMPTION_L1, 1, 0, 20000 },
+     { "GX_REGISTER_AC_CONSUMPTION_L2", REGISTER_DEVICE_GX, GX_REGISTER_AC_CONSUMPTION_L2, 1, 0, 20000 },
+     { "GX_REGISTER_AC_CONSUMPTION_L3", REGISTER_DEVICE_GX, GX_REGISTER_AC_CONSUMPTION_L3, 1, 0, 20000 },
+     { "GX_REGISTER_GRID_L1", REGISTER_DEVICE_GX, GX_REGISTER_GRID_L1, 1, -20000, 20000 },
+     { "GX_REGISTER_GRID_L2", REGISTER_DEVICE_GX, GX_REGISTER_GRID_L2, 1, -20000, 20000 },
+     { "GX_REGISTER_GRID_L3", REGISTER_DEVICE_GX, GX_REGISTER_GRID_L3, 1, -20000, 20000 },
+     { "GX_REGISTER_BATTERY_POWER", REGISTER_DEVICE_GX, GX_REGISTER_BATTERY_POWER, 1, -30000, 30000 },
+     { "GX_REGISTER_BATTERY_SOC", REGISTER_DEVICE_GX, GX_REGISTER_BATTERY_SOC, 0, 0, 100 },
+     { "EVCS_REGISTER_CHARGE_MODE", REGISTER_DEVICE_EVCS, EVCS_REGISTER_CHARGE_MODE, 0, 0, EVCS_CHARGE_MODE_SCHED },
+     { "EVCS_REGISTER_CHARGE_START", REGISTER_DEVICE_EVCS, EVCS_REGISTER_CHARGE_START, 0, 0, EVCS_CHARGING_START },
+     { "EVCS_REGISTER_TOTAL_POWER", REGISTER_DEVICE_EVCS, EVCS_REGISTER_TOTAL_POWER, 0, 0, 22000 },
+     { "EVCS_REGISTER_CHARGER_STATUS", REGISTER_DEVICE_EVCS, EVCS_REGISTER_CHARGER_STATUS, 0, 0,
+       EVCS_CHARGER_STATUS_STOP_CHARGING },
+     { "EVCS_REGISTER_CHARGING_CURRENT", REGISTER_DEVICE_EVCS, EVCS_REGISTER_CHARGING_CURRENT, 0, 0, 80 },
+     { "EVCS_REGISTER_MAX_CURRENT", REGISTER_DEVICE_EVCS, EVCS_REGISTER_MAX_CURRENT, 0, 0, 80 },
+};
+
+const struct register_info *register_info_table(size_t *n)
+{
+     *n = sizeof(register_infos) / sizeof(register_infos[0]);
+     return register_infos;
+}
+
+void register_map_init(struct register_map *map, uint8_t unit)
+{
+     map->unit = unit;
+     map->nmoves = 0;
+}
+
+/* Where the device serves the register listed at addr */
+uint16_t register_map_addr(const struct register_map *map, uint16_t addr)
+{
+     for (size_t i = 0; i < map->nmoves; ++i)
+	  if (map->moves[i].addr == addr) return map->moves[i].moved;
+
+     return addr;
+}
+
+static int register_map_value(const char *path, size_t lineno, const char *value, unsigned long max,
+			      unsigned long *result)
+{
+     char *end;
+
+     errno = 0;
+     *result = strtoul(value, &end, 10);
+     if (errno || end == value || *end || *result > max) {
+	  fprintf(stderr, "Error: %s:%zu: %s is not a number up to %lu\n", path, lineno, value, max);
+	  return -1;
+     }
+
+     return 0;
+}
+
+/*
+ * Reads a map of GX_UNIT, EVCS_UNIT and register name lines as regscan writes it. Registers not
+ * named keep their listed address, so a map only needs what moved.
+ */
+int register_map_load(const char *path, struct register_map *gx, struct register_map *evcs)
+{
+     char line[512];
+     size_t lineno = 0;
+
+     FILE *file = fopen(path, "r");
+     if (file == NULL) {
+	  fprintf(stderr, "Error: could not open register map %s: %s\n", path, strerror(errno));
 	  goto error;
      }
 
-     status->power_grid = (int32_t)grid[0] + (int32_t)grid[1] + (int32_t)grid[2];
-     status->power_pv = (int32_t)pv[0] + (int32_t)pv[1] + (int32_t)pv[2];
-     status->power_consumption = (int32_t)consumption[0] + (int32_t)consumption[1] + (int32_t)consumption[2];
-     status->power_battery = (int32_t)power_battery;
-     status->power_evcs = (int32_t)power_evcs;
-     status->power_excess = status->power_battery - status->power_grid + status->power_evcs;
+     while (fgets(line, sizeof(line), file)) {
+	  char *key, *value;
+	  unsigned long number;
 
-     status->soc_battery = soc_battery;
-     status->soc_ev = 999;
+	  lineno += 1;
+	  int rc = config_line_parse(line, &key, &value);
+	  if (rc == 0) continue;
+	  if (rc == -1) {
+	       fprintf(stderr, "Error: %s:%zu: expected KEY=VALUE\n", path, lineno);
+	       goto error;
+	  }
 
-     status->evcs_charge_start = charge_start;
-     status->evcs_charger_status = charger_status;
-     status->evcs_charging_mode = charging_mode;
+	  if (!strcmp(key, "GX_UNIT") || !strcmp(key, "EVCS_UNIT")) {
+	       if (register_map_value(path, lineno, value, UINT8_MAX, &number)) goto error;
+	       (key[0] == 'G' ? gx : evcs)->unit = (uint8_t)number;
+	       continue;
+	  }
 
+	  const struct register_info *info = NULL;
+	  for (size_t i = 0; i < sizeof(register_infos) / sizeof(register_infos[0]) && info == NULL; ++i)
+	       if (!strcmp(key, register_infos[i].name)) info = &register_infos[i];
+	  if (info == NULL) {
+	       fprintf(stderr, "Error: %s:%zu: unknown register %s\n", path, lineno, key);
+	       goto error;
+	  }
+	  if (register_map_value(path, lineno, value, UINT16_MAX, &number)) goto error;
+	  if (number == info->addr) continue;
+
+	  struct register_map *map = info->device == REGISTER_DEVICE_GX ? gx : evcs;
+	  if (map->nmoves == REGISTER_MAP_MAX) {
+	       fprintf(stderr, "Error: %s:%zu: more than %d registers moved\n", path, lineno, REGISTER_MAP_MAX);
+	       goto error;
+	  }
+	  map->moves[map->nmoves++] = (struct register_move){ info->addr, (uint16_t)number };
+     }
+
+     fclose(file);
      return 0;
 
 error:
+     if (file) fclose(file);
      fflush(stderr);
      return -1;
 }
 
-int evcs_charging_start_set(const struct system_status *status, evcs_charging_start_t start)
+static void register_plan_debug_print(const char *device, const struct register_plan *plan)
+{
+     for (size_t i = 0; i < plan->nranges; ++i) {
+	  unsigned first = plan->ranges[i].addr;
+	  unsigned last = first + plan->ranges[i].count - 1;
+	  printf("%s read %u-%u\n", device, first, last);
+     }
+}
+
+/* The registers a device is polled for where its map puts them, those configured to be cached for
+ * the gateway included */
+static int register_plan_build_with(struct register_plan *plan, const struct register_map *map,
+				    const uint16_t *regs, size_t nregs, const uint16_t *extra, size_t nextra,
+				    uint16_t gap_max)
+{
+     uint16_t all[REGISTER_VALUES_MAX];
+
+     if (nregs + nextra > REGISTER_VALUES_MAX) {
+	  fprintf(stderr, "Error: cannot plan %zu registers\n", nregs + nextra);
+	  fflush(stderr);
+	  return -1;
+     }
+
+     for (size_t i = 0; i < nregs; ++i) all[i] = register_map_addr(map, regs[i]);
+     memcpy(all + nregs, extra, nextra * sizeof(extra[0]));
+
+     plan->unit = map->unit;
+     return register_plan_build(plan, all, nregs + nextra, gap_max);
+}
+
+int system_status_init(struct system_status *status)
+{
+     const struct config *config = &status->config;
+     int64_t write_interval_ns = config->write_interval_msecs * NSECS_PER_MSEC;
+
+     register_map_init(&status->gx_map, GX_UNIT);
+     register_map_init(&status->evcs_map, MODBUS_TCP_SLAVE);
+     if (config->register_map && register_map_load(config->register_map, &status->gx_map, &status->evcs_map))
+	  return -1;
+
+     link_init(&status->gx_link, "GX", status->config.gx);
+
+     if (register_plan_build_with(&status->gx_plan, &status->gx_map, gx_status_registers,
+				  sizeof(gx_status_registers) / sizeof(gx_status_registers[0]),
+				  config->gx_cache_registers, config->ngx_cache_registers,
+				  config->register_gap_max)) return -1;
+
+     shadow_init(&status->gx_shadow, &status->gx_plan, write_interval_ns);
+
+     if (status->config.debug) register_plan_debug_print("GX", &status->gx_plan);
+
+     status->nevcs = status->config.nevcs;
+     for (size_t i = 0; i < status->nevcs; ++i) {
+	  struct evcs_charger *evcs = &status->evcs[i];
+
+	  link_init(&evcs->link, evcs_names[i], status->config.evcs[i]);
+
+	  if (register_plan_build_with(&evcs->plan, &status->evcs_map, evcs_status_registers,
+				       sizeof(evcs_status_registers) / sizeof(evcs_status_registers[0]),
+				       config->evcs_cache_registers, config->nevcs_cache_registers,
+				       config->register_gap_max)) return -1;
+
+	  shadow_init(&evcs->shadow, &evcs->plan, write_interval_ns);
+
+	  if (status->config.debug) register_plan_debug_print(evcs_names[i], &evcs->plan);
+     }
+
+     return 0;
+}
+
+int gx_values_read(struct mbtcp *client, const struct register_plan *plan, uint16_t *values)
 {
-     if (modbus_write_register(status->evcs_ctx, EVCS_REGISTER_CHARGE_START, start) == -1) {
-	  fprintf(stderr, "Error: could not set EVCS charge start value to %u: %s\n", start, modbus_strerror(errno));
+     if (register_plan_read(client, plan->unit, plan, values) == -1) {
+	  int err = errno;
+	  fprintf(stderr, "Error: could not read GX value: %s\n", modbus_strerror(err));
+	  errno = err;
 	  goto error;
      }
 
@@ -211,10 +945,12 @@ error:
      return -1;
 }
 
-int evcs_charge_mode_set(const struct system_status *status, evcs_charge_mode_t mode)
+int evcs_values_read(struct mbtcp *client, const struct register_plan *plan, uint16_t *values)
 {
-     if (modbus_write_register(status->evcs_ctx, EVCS_REGISTER_CHARGE_MODE, mode) == -1) {
-	  fprintf(stderr, "Error: could not set EVCS charge mode to %u: %s\n", mode, modbus_strerror(errno));
+     if (register_plan_read(client, plan->unit, plan, values) == -1) {
+	  int err = errno;
+	  fprintf(stderr, "Error: could not read EVCS value: %s\n", modbus_strerror(err));
+	  errno = err;
 	  goto error;
      }
 
@@ -225,6 +961,172 @@ error:
      return -1;
 }
 
+/* The value of a listed GX register, wherever the map puts it */
+static uint16_t gx_value(const struct system_status *status, const uint16_t *gx, uint16_t addr)
+{
+     return register_plan_value(&status->gx_plan, gx, register_map_addr(&status->gx_map, addr));
+}
+
+void gx_values_decode(struct system_status *status, const uint16_t *gx)
+{
+     for (int i = 0; i < 3; ++i) {
+	  uint16_t phase = (uint16_t)i;
+	  status->power_grid_phase[i] = (int16_t)gx_value(status, gx, GX_REGISTER_GRID_L1 + phase);
+	  status->power_pv_phase[i] = gx_value(status, gx, GX_REGISTER_PV_AC_IN_L1 + phase);
+	  status->power_consumption_phase[i] = (int16_t)gx_value(status, gx, GX_REGISTER_AC_CONSUMPTION_L1 + phase);
+     }
+
+     status->power_grid = status->power_grid_phase[0] + status->power_grid_phase[1] + status->power_grid_phase[2];
+     status->power_pv = status->power_pv_phase[0] + status->power_pv_phase[1] + status->power_pv_phase[2];
+     status->power_consumption = status->power_consumption_phase[0] + status->power_consumption_phase[1]
+	  + status->power_consumption_phase[2];
+     status->power_battery = (int16_t)gx_value(status, gx, GX_REGISTER_BATTERY_POWER);
+     status->soc_battery = gx_value(status, gx, GX_REGISTER_BATTERY_SOC);
+
+     status->power_excess = status->power_battery - status->power_grid + status->power_evcs;
+}
+
+static uint16_t evcs_value(const struct system_status *status, size_t charger, const uint16_t *evcs, uint16_t addr)
+{
+     return register_plan_value(&status->evcs[charger].plan, evcs, register_map_addr(&status->evcs_map, addr));
+}
+
+void evcs_values_decode(struct system_status *status, size_t charger, const uint16_t *evcs)
+{
+     struct evcs_charger *c = &status->evcs[charger];
+
+     c->power = (int32_t)evcs_value(status, charger, evcs, EVCS_REGISTER_TOTAL_POWER);
+     c->charge_start = evcs_value(status, charger, evcs, EVCS_REGISTER_CHARGE_START);
+     c->charger_status = evcs_value(status, charger, evcs, EVCS_REGISTER_CHARGER_STATUS);
+     c->charging_mode = evcs_value(status, charger, evcs, EVCS_REGISTER_CHARGE_MODE);
+     c->charging_current = evcs_value(status, charger, evcs, EVCS_REGISTER_CHARGING_CURRENT);
+     c->max_current = evcs_value(status, charger, evcs, EVCS_REGISTER_MAX_CURRENT);
+
+     /* What the cars draw is excess too, so the site excess counts every charger */
+     status->power_evcs = 0;
+     for (size_t i = 0; i < status->nevcs; ++i) status->power_evcs += status->evcs[i].power;
+     status->soc_ev = 999;
+
+     status->power_excess = status->power_battery - status->power_grid + status->power_evcs;
+}
+
+int system_status_update(struct system_status *status)
+{
+     uint16_t gx[REGISTER_VALUES_MAX];
+     uint16_t evcs[EVCS_MAX][REGISTER_VALUES_MAX];
+
+     /* A link not ready is down and already backing off, only a failed request counts against it */
+     if (link_ready(&status->gx_link, monotonic_ns())) return -1;
+     if (gx_values_read(&status->gx_link.client, &status->gx_plan, gx)) {
+	  link_failed(&status->gx_link, monotonic_ns());
+	  return -1;
+     }
+     link_succeeded(&status->gx_link);
+
+     for (size_t i = 0; i < status->nevcs; ++i) {
+	  struct evcs_charger *c = &status->evcs[i];
+
+	  if (link_ready(&c->link, monotonic_ns())) return -1;
+	  if (evcs_values_read(&c->link.client, &c->plan, evcs[i])) {
+	       link_failed(&c->link, monotonic_ns());
+	       return -1;
+	  }
+	  link_succeeded(&c->link);
+     }
+
+     status->gx_updated_ns = monotonic_ns();
+     shadow_update(&status->gx_shadow, gx, status->gx_updated_ns);
+     gx_values_decode(status, gx);
+     status->fresh = ACQUIRED_GX;
+
+     for (size_t i = 0; i < status->nevcs; ++i) {
+	  status->evcs[i].updated_ns = status->gx_updated_ns;
+	  shadow_update(&status->evcs[i].shadow, evcs[i], status->evcs[i].updated_ns);
+	  evcs_values_decode(status, i, evcs[i]);
+	  status->fresh |= ACQUIRED_CHARGER(i);
+     }
+
+     return 0;
+}
+
+/* Writes through the charger's shadow, a readback that came with the write is decoded right away */
+static int evcs_register_write(struct system_status *status, size_t charger, uint16_t addr, uint16_t value)
+{
+     struct evcs_charger *c = &status->evcs[charger];
+     int rc = shadow_write(&c->shadow, &c->link.client, c->plan.unit, register_map_addr(&status->evcs_map, addr),
+			   value, monotonic_ns());
+
+     if (rc == SHADOW_WRITTEN) evcs_values_decode(status, charger, c->shadow.values);
+
+     return rc;
+}
+
+int evcs_charging_start_set(struct system_status *status, size_t charger, evcs_charging_start_t start)
+{
+     struct modbus_link *link = &status->evcs[charger].link;
+
+     if (link_ready(link, monotonic_ns())) return -1;
+
+     int rc = evcs_register_write(status, charger, EVCS_REGISTER_CHARGE_START, (uint16_t)start);
+     if (rc == -1) {
+	  int err = errno;
+	  report(stderr, "Error: could not set %s charge start value to %u: %s\n", link->name, start,
+		 modbus_strerror(err));
+	  errno = err;
+	  goto error;
+     }
+
+     return rc;
+
+error:
+     link_failed(link, monotonic_ns());
+     return -1;
+}
+
+int evcs_charge_mode_set(struct system_status *status, size_t charger, evcs_charge_mode_t mode)
+{
+     struct modbus_link *link = &status->evcs[charger].link;
+
+     if (link_ready(link, monotonic_ns())) return -1;
+
+     int rc = evcs_register_write(status, charger, EVCS_REGISTER_CHARGE_MODE, (uint16_t)mode);
+     if (rc == -1) {
+	  int err = errno;
+	  report(stderr, "Error: could not set %s charge mode to %u: %s\n", link->name, mode,
+		 modbus_strerror(err));
+	  errno = err;
+	  goto error;
+     }
+
+     return rc;
+
+error:
+     link_failed(link, monotonic_ns());
+     return -1;
+}
+
+int evcs_charging_current_set(struct system_status *status, size_t charger, uint16_t current)
+{
+     struct modbus_link *link = &status->evcs[charger].link;
+
+     if (link_ready(link, monotonic_ns())) return -1;
+
+     int rc = evcs_register_write(status, charger, EVCS_REGISTER_CHARGING_CURRENT, current);
+     if (rc == -1) {
+	  int err = errno;
+	  report(stderr, "Error: could not set %s charging current to %u: %s\n", link->name, current,
+		 modbus_strerror(err));
+	  errno = err;
+	  goto error;
+     }
+
+     return rc;
+
+error:
+     link_failed(link, monotonic_ns());
+     return -1;
+}
+
 char get_charger_status_char(evcs_charger_status_t status)
 {
      switch (status) {
@@ -393,3 +1295,59 @@ const char *get_watchdog_reason_str(uint16_t code)
 	  return "Unknown watchdog reason";
      }
 }
+
+static __thread report_sink_t *report_sink;
+static __thread void *report_ctx;
+
+/* Sends the reports of the calling thread to sink, NULL for stdout and stderr */
+void report_sink_set(report_sink_t *sink, void *ctx)
+{
+     report_sink = sink;
+     report_ctx = ctx;
+}
+
+void report(FILE *stream, const char *fmt, ...)
+{
+     va_list ap;
+
+     va_start(ap, fmt);
+     if (report_sink) {
+	  char line[LOG_LINE_MAX];
+	  vsnprintf(line, sizeof(line), fmt, ap);
+	  report_sink(report_ctx, line);
+     } else {
+	  vfprintf(stream, fmt, ap);
+	  fflush(stream);
+     }
+     va_end(ap);
+}
+
+/* Appends to a log line of LOG_LINE_MAX, cutting it off where it gets too long */
+size_t line_printf(char *line, size_t len, const char *fmt, ...)
+{
+     va_list ap;
+     int n;
+
+     if (len >= LOG_LINE_MAX) return len;
+
+     va_start(ap, fmt);
+     n = vsnprintf(line + len, LOG_LINE_MAX - len, fmt, ap);
+     va_end(ap);
+
+     return n < 0 ? len : len + (size_t)n;
+}
+
+/*
+ * The value of field tag, e.g. "C/", of a status line, NULL if it has none. Only fields after R/
+ * are looked at: before it every charger has its M/ S/ C/ D/ of its own.
+ */
+const char *status_line_field(const char *line, const char *tag)
+{
+     const char *p = strstr(line, " R/");
+     size_t len = strlen(tag);
+
+     while (p && (p = strstr(p + 1, tag)) != NULL)
+	  if (p[-1] == ' ') return p + len;
+
+     return NULL;
+}
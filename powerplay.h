@@ -1,7 +1,10 @@
 #ifndef INCLUDE_POWERPLAY_H
 #define INCLUDE_POWERPLAY_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
 #include <modbus/modbus.h>
 
 /*
@@ -13,50 +16,940 @@
 struct modbus_device {
      const char *host;
      int port;
+     uint32_t timeout_msecs;
+     uint32_t pipeline_depth;
 };
 
+/*
+ *
+ * Modbus TCP client
+ *
+ */
+
+/*
+ * Asynchronous Modbus TCP client. The requests of a batch are sent back to back on one
+ * connection with up to pipeline_depth of them in flight, and responses are matched to requests
+ * by their MBAP transaction id in whatever order they arrive. A depth of 1 is plain
+ * request/response for devices that do not queue requests. Errors are reported through errno
+ * using the libmodbus codes, so modbus_strerror() describes exceptions too. mbtcp_batch() waits
+ * for its batch; mbtcp_submit() and mbtcp_poll() run one without blocking, for a caller
+ * multiplexing many connections on one thread.
+ */
+#define MBTCP_ADU_MAX		MODBUS_TCP_MAX_ADU_LENGTH
+#define MBTCP_PIPELINE_DEFAULT	1
+#define MBTCP_PIPELINE_MAX	16
+
+typedef enum {
+     MBTCP_READ_REGISTERS				= 0x03,
+     MBTCP_WRITE_REGISTER				= 0x06,
+     MBTCP_WRITE_REGISTERS				= 0x10,
+     MBTCP_WRITE_READ_REGISTERS				= 0x17,
+} mbtcp_function_t;
+
+/* addr, count and values describe what is read, write_* what is written; FC23 uses both */
+struct mbtcp_request {
+     mbtcp_function_t function;
+     uint8_t unit;
+     uint16_t addr, count;
+     uint16_t *values;
+     uint16_t write_addr, write_count;
+     const uint16_t *write_values;
+     int64_t deadline_ns;
+
+     uint16_t tid;
+     int state;
+     int result;
+     int64_t sent_ns, done_ns;
+};
+
+struct mbtcp {
+     int fd;
+     int connecting; /* fd is a non-blocking connect in progress */
+     uint16_t tid;
+     uint32_t timeout_msecs, depth;
+     size_t rx_len;
+     uint8_t rx[2 * MBTCP_ADU_MAX];
+
+     /* The batch in progress, reqs is NULL between batches */
+     struct mbtcp_request *reqs;
+     size_t nreqs, next, inflight, remaining;
+
+     uint64_t sent, received, stray;
+     struct iostats *stats;
+};
+
+void mbtcp_init(struct mbtcp *client);
+int mbtcp_connect(struct mbtcp *client, const struct modbus_device *device);
+int mbtcp_connect_start(struct mbtcp *client, const struct modbus_device *device);
+int mbtcp_connect_finish(struct mbtcp *client);
+int mbtcp_connected(const struct mbtcp *client);
+void mbtcp_close(struct mbtcp *client);
+int mbtcp_batch(struct mbtcp *client, struct mbtcp_request *reqs, size_t n);
+int mbtcp_submit(struct mbtcp *client, struct mbtcp_request *reqs, size_t n, int64_t now_ns);
+int mbtcp_poll(struct mbtcp *client, int64_t now_ns);
+int64_t mbtcp_deadline(const struct mbtcp *client);
+
+/*
+ *
+ * I/O statistics
+ *
+ */
+
+/*
+ * Fixed-memory request statistics per device, kept per function and register range as the
+ * requests are sent. Latencies go into log2 buckets starting at IOSTATS_BUCKET_MIN_USECS, the last
+ * bucket holding everything slower. Only the thread owning a device records, but counters are
+ * updated atomically so the control thread can print them at any time.
+ */
+#define IOSTATS_RANGES_MAX	16
+#define IOSTATS_BUCKETS		16
+#define IOSTATS_BUCKET_MIN_USECS 250
+#define IO_STATS_SECS_DEFAULT	3600
+
+struct iostats_range {
+     uint8_t function; /* 0 while the slot is unused */
+     uint16_t addr, count;
+     uint64_t requests, ok, timeouts, exceptions, errors;
+     uint64_t latency_sum_usecs, latency_max_usecs;
+     uint64_t histogram[IOSTATS_BUCKETS];
+};
+
+struct iostats {
+     struct iostats_range ranges[IOSTATS_RANGES_MAX];
+     uint64_t untracked;
+
+     /* Failed requests by cause; exceptions also by exception code */
+     uint64_t timeouts, exceptions, protocol, connection;
+     uint64_t exception_codes[MODBUS_EXCEPTION_MAX];
+     uint64_t stray;
+
+     uint64_t connects, connect_failures, drops;
+};
+
+void iostats_request(struct iostats *stats, const struct mbtcp_request *req);
+void iostats_add(uint64_t *counter);
+void iostats_print(const struct iostats *stats, const char *name);
+
+/*
+ *
+ * Actuation
+ *
+ */
+
+/*
+ * Dead time of every charge start change, followed from the decision through the write and the
+ * charger status to the power it reports. All latencies count from the decision and are only
+ * as fine as the poll period. ACK is the charger taking up the change (START_CHARGING or
+ * STOP_CHARGING), STATUS it settling (CHARGING, or out of the charging states) and POWER its
+ * power crossing ACTUATION_POWER_WATTS. Buckets double from ACTUATION_BUCKET_MIN_MSECS, the
+ * last holding everything slower; counters are atomic for the log thread to print.
+ */
+#define ACTUATION_POWER_WATTS	500
+#define ACTUATION_TIMEOUT_SECS	300
+#define ACTUATION_BUCKETS	12
+#define ACTUATION_BUCKET_MIN_MSECS 100
+
+typedef enum {
+     ACTUATION_WRITE					= 0,
+     ACTUATION_ACK					= 1,
+     ACTUATION_STATUS					= 2,
+     ACTUATION_POWER					= 3,
+     ACTUATION_EVENTS					= 4,
+} actuation_event_t;
+
+struct actuation_latency {
+     uint64_t sum_msecs, max_msecs;
+     uint64_t histogram[ACTUATION_BUCKETS];
+};
+
+/* Per direction, stopping first */
+struct actuation_stats {
+     uint64_t completed, timeouts, superseded;
+     struct actuation_latency latency[ACTUATION_EVENTS];
+};
+
+struct actuation {
+     /* The change being followed, times 0 until seen */
+     int active;
+     uint16_t start;
+     int64_t decided_ns, seen_ns[ACTUATION_EVENTS];
+
+     struct actuation_stats stats[2];
+};
+
+struct logger;
+struct evcs_charger;
+
+void actuation_decided(struct actuation *act, uint16_t start, int64_t now_ns);
+void actuation_written(struct actuation *act, int outcome, int64_t now_ns);
+void actuation_observe(struct actuation *act, struct logger *log, const struct evcs_charger *evcs, int fresh,
+		       int64_t now_ns);
+void actuation_print(const struct actuation *act, const char *name);
+
+/*
+ * Connection state of one device. A link is UP after a successful request, DEGRADED while
+ * requests fail but the connection is kept, and DOWN once it was dropped after
+ * LINK_FAILURES_MAX consecutive failures or a failed connect. DOWN links are retried with
+ * exponential backoff.
+ */
+typedef enum {
+     LINK_DOWN						= 0,
+     LINK_CONNECTING					= 1,
+     LINK_UP						= 2,
+     LINK_DEGRADED					= 3,
+} link_state_t;
+
+#define LINK_FAILURES_MAX	3
+#define LINK_BACKOFF_MIN_MSECS	500
+#define LINK_BACKOFF_MAX_MSECS	60000
+#define LINK_TIMEOUT_MSECS_DEFAULT 5000
+
+struct modbus_link {
+     const char *name;
+     struct modbus_device device;
+     struct mbtcp client;
+     struct iostats stats;
+     link_state_t state;
+
+     uint32_t failures, attempts;
+     int64_t retry_ns;
+     uint64_t connects, reconnects;
+     uint32_t seed;
+};
+
+
+/*
+ * A contiguous block of holding registers fetched with a single read. Plans are built once from
+ * the register tables and merge neighbouring registers into as few reads as the gap tolerance
+ * allows. Registers inside a gap are read and discarded, so the tolerance must only span
+ * addresses the device actually serves.
+ */
+struct register_range {
+     uint16_t addr;
+     uint16_t count;
+};
+
+#define REGISTER_RANGES_MAX	8
+#define REGISTER_VALUES_MAX	256
+#define REGISTER_GAP_DEFAULT	8
+
+#define NSECS_PER_SEC		1000000000LL
+#define NSECS_PER_MSEC		1000000LL
+#define NSECS_PER_USEC		1000LL
+#define DEADLINE_MSECS_DEFAULT	2000
+#define STALE_SECS_DEFAULT	10
+#define HOLD_SECS_DEFAULT	30
+#define WRITE_INTERVAL_MSECS_DEFAULT 1000
+#define POLL_NEAR_WATTS_DEFAULT	1000
+#define POLL_BOOST_SECS_DEFAULT	60
+#define STATE_MAX_AGE_SECS_DEFAULT 120
+
+#define EVCS_VOLTAGE		230
+#define EVCS_PHASES_DEFAULT	3
+#define CURRENT_MIN_AMPS_DEFAULT 6
+#define CURRENT_SLEW_AMPS_DEFAULT 2
+#define CURRENT_DEADBAND_WATTS_DEFAULT 300
+
+typedef enum {
+     CONTROL_SWITCH					= 0,
+     CONTROL_MODULATE					= 1,
+} control_mode_t;
+
+typedef enum {
+     DECISION_MEAN					= 0,
+     DECISION_FORECAST					= 1,
+} decision_mode_t;
+
+#define FORECAST_SECS_DEFAULT	120
+#define FORECAST_SMOOTHING_SECS_DEFAULT 60
+
+/* Chargers per site, configured as EVCS_HOST, EVCS2_HOST, ... */
+#define EVCS_MAX		4
+
+typedef enum {
+     SHARING_PRIORITY					= 0,
+     SHARING_FAIR					= 1,
+} sharing_policy_t;
+
+struct register_plan {
+     uint8_t unit;
+     size_t nranges;
+     size_t nvalues;
+     struct register_range ranges[REGISTER_RANGES_MAX];
+};
+
+/*
+ * Where a device serves the registers the control loop uses: its unit id and the registers found
+ * at another address than in the register lists below, none for a device matching them. Regscan
+ * writes a map from what it finds on a site, loaded from REGISTER_MAP at startup, so a firmware
+ * moving a register is a map away from being read again.
+ */
+#define REGISTER_MAP_MAX	16
+
+typedef enum {
+     REGISTER_DEVICE_GX					= 0,
+     REGISTER_DEVICE_EVCS				= 1,
+} register_device_t;
+
+/* A register the control loop uses by its name in a map, with the values a working device reports */
+struct register_info {
+     const char *name;
+     register_device_t device;
+     uint16_t addr;
+     int is_signed;
+     int32_t min, max;
+};
+
+struct register_move {
+     uint16_t addr, moved;
+};
+
+struct register_map {
+     uint8_t unit;
+     size_t nmoves;
+     struct register_move moves[REGISTER_MAP_MAX];
+};
+
+/* Register cache per device, slots follow the values of the device's plan */
+struct shadow {
+     const struct register_plan *plan;
+     uint16_t values[REGISTER_VALUES_MAX];
+     int64_t read_ns[REGISTER_VALUES_MAX];
+     uint16_t written[REGISTER_VALUES_MAX];
+     int64_t written_ns[REGISTER_VALUES_MAX];
+     int64_t write_interval_ns;
+     int write_read_unsupported;
+     uint64_t writes, elided, deferred;
+};
+
+/* What became of a shadow write that did not fail */
+typedef enum {
+     SHADOW_ELIDED					= 0,
+     SHADOW_WRITTEN					= 1,
+     SHADOW_DEFERRED					= 2,
+} shadow_outcome_t;
 
 struct config {
      int32_t power_excess_min;
      time_t averaging_secs;
-     uint32_t sleep_secs;
+     time_t hold_secs;
+     int64_t period_ns;
+     int64_t poll_min_ns, poll_max_ns;
+     uint32_t poll_near_watts;
+     uint32_t poll_boost_secs;
+     int schedule_policy;
+     int control_mode;
+     int decision_mode;
+     uint32_t forecast_secs;
+     uint32_t forecast_smoothing_secs;
+     int sharing_policy;
+     uint32_t evcs_phases;
+     uint32_t current_min_amps;
+     uint32_t current_slew_amps;
+     uint32_t current_deadband_watts;
      int debug;
      int dryrun;
+     uint16_t register_gap_max;
+     uint32_t deadline_msecs;
+     uint32_t stale_secs;
+     uint32_t write_interval_msecs;
+     uint32_t io_stats_secs;
+     const char *telemetry_dir;
+     const char *state_file;
+     uint32_t state_max_age_secs;
+     const char *http_addr;
+     int http_port;
+     const char *register_map;
+     const char *gateway_addr;
+     int gateway_port;
+     uint32_t gateway_max_age_msecs;
+     uint16_t gx_cache_registers[REGISTER_VALUES_MAX];
+     size_t ngx_cache_registers;
+     uint16_t evcs_cache_registers[REGISTER_VALUES_MAX];
+     size_t nevcs_cache_registers;
      struct modbus_device gx;
-     struct modbus_device evcs;
+     struct modbus_device evcs[EVCS_MAX];
+     uint32_t evcs_priority[EVCS_MAX];
+     size_t nevcs;
+};
+
+/* One charger of the site with its own connection, plan and shadow */
+struct evcs_charger {
+     struct modbus_link link;
+     struct register_plan plan;
+     struct shadow shadow;
+     struct actuation actuation;
+     int64_t updated_ns;
+
+     int32_t power;
+     uint16_t charge_start;
+     uint16_t charger_status;
+     uint16_t charging_mode;
+     uint16_t charging_current;
+     uint16_t max_current;
 };
 
 struct system_status {
      struct config config;
 
-     modbus_t *gx_ctx, *evcs_ctx;
+     struct register_map gx_map, evcs_map;
+     struct modbus_link gx_link;
+     struct register_plan gx_plan;
+     struct shadow gx_shadow;
+     struct evcs_charger evcs[EVCS_MAX];
+     size_t nevcs;
+
+     /* Monotonic time of the last successful GX read and which devices delivered fresh values in
+      * the last cycle. GX fields and the fields of every charger age independently. */
+     int64_t gx_updated_ns;
+     unsigned fresh;
 
      int32_t power_grid;
      int32_t power_pv;
      int32_t power_consumption;
+     int32_t power_grid_phase[3];
+     int32_t power_pv_phase[3];
+     int32_t power_consumption_phase[3];
      int32_t power_battery;
-     int32_t power_evcs;
+     int32_t power_evcs; /* all chargers */
      int32_t power_excess;
 
      uint16_t soc_battery;
      uint16_t soc_ev;
-
-     uint16_t evcs_charge_start;
-     uint16_t evcs_charger_status;
-     uint16_t evcs_charging_mode;
 };
 
+typedef enum {
+     ACQUIRED_GX					= 1 << 0,
+     ACQUIRED_EVCS					= 1 << 1,
+} acquired_t;
+
+/* Fresh flag of a charger, the first one is ACQUIRED_EVCS */
+#define ACQUIRED_CHARGER(i)	((unsigned)ACQUIRED_EVCS << (i))
+
+#define CONFIG_SETTINGS_MAX	256
+
+size_t config_window_capacity(const struct config *config);
 int config_from_env(struct config *config);
-int modbus_device_connect(struct modbus_device device, modbus_t **ctx);
+int config_file_load(const char *path);
+int config_line_parse(char *line, char **key, char **value);
+int modbus_device_connect(struct modbus_device device, struct mbtcp *client);
+void link_init(struct modbus_link *link, const char *name, struct modbus_device device);
+int link_ready(struct modbus_link *link, int64_t now_ns);
+int link_connect_start(struct modbus_link *link, int64_t now_ns);
+int link_connect_finish(struct modbus_link *link, int timed_out, int64_t now_ns);
+void link_succeeded(struct modbus_link *link);
+void link_failed(struct modbus_link *link, int64_t now_ns);
+void link_close(struct modbus_link *link);
+const char *link_state_str(link_state_t state);
+int register_plan_build(struct register_plan *plan, const uint16_t *regs, size_t nregs, uint16_t gap_max);
+size_t register_plan_requests(uint8_t unit, const struct register_plan *plan, uint16_t *values,
+			      struct mbtcp_request *reqs);
+int register_plan_read(struct mbtcp *client, uint8_t unit, const struct register_plan *plan, uint16_t *values);
+uint16_t register_plan_value(const struct register_plan *plan, const uint16_t *values, uint16_t addr);
+const struct register_info *register_info_table(size_t *n);
+void register_map_init(struct register_map *map, uint8_t unit);
+int register_map_load(const char *path, struct register_map *gx, struct register_map *evcs);
+uint16_t register_map_addr(const struct register_map *map, uint16_t addr);
+void shadow_init(struct shadow *shadow, const struct register_plan *plan, int64_t write_interval_ns);
+void shadow_update(struct shadow *shadow, const uint16_t *values, int64_t now_ns);
+int shadow_write(struct shadow *shadow, struct mbtcp *client, uint8_t unit, uint16_t addr, uint16_t value,
+		 int64_t now_ns);
+int shadow_write_request(struct shadow *shadow, uint8_t unit, uint16_t addr, const uint16_t *value, int64_t now_ns,
+			 struct mbtcp_request *req);
+int shadow_write_result(struct shadow *shadow, const struct mbtcp_request *req, int64_t now_ns);
+int gx_values_read(struct mbtcp *client, const struct register_plan *plan, uint16_t *values);
+int evcs_values_read(struct mbtcp *client, const struct register_plan *plan, uint16_t *values);
+void gx_values_decode(struct system_status *status, const uint16_t *gx);
+void evcs_values_decode(struct system_status *status, size_t charger, const uint16_t *evcs);
+int system_status_init(struct system_status *status);
 int system_status_update(struct system_status *status);
+int64_t monotonic_ns(void);
 void system_status_debug_print(const struct system_status *status);
 
+/*
+ *
+ * Acquisition
+ *
+ */
+
+/*
+ * One worker thread per device owns that device's connection while a read is in flight, so
+ * a slow EVCS never holds back the GX snapshot or another charger. A cycle hands every worker a
+ * request and waits until all answered or the deadline passed. A worker still busy at the
+ * deadline is left to finish and is not asked again until it has; its link must not be used
+ * meanwhile. The GX is read once per cycle however many chargers share its excess.
+ */
+struct acquisition_worker {
+     const char *name;
+     struct modbus_link *link;
+     const struct register_plan *plan;
+     struct shadow *shadow;
+     int (*read)(struct mbtcp *client, const struct register_plan *plan, uint16_t *values);
+     size_t charger;
+     unsigned flag;
+
+     struct acquisition *acq;
+     pthread_t thread;
+     uint64_t requested, completed, consumed;
+     int result;
+     int64_t completed_ns;
+     uint16_t values[REGISTER_VALUES_MAX];
+};
+
+struct acquisition {
+     pthread_mutex_t lock;
+     pthread_cond_t request, done;
+     int stop;
+     /* The GX first, then the chargers */
+     struct acquisition_worker workers[1 + EVCS_MAX];
+     size_t nworkers;
+     /* Devices that missed the deadline of the last cycle */
+     unsigned missed;
+};
+
+int acquisition_start(struct acquisition *acq, struct system_status *status);
+unsigned acquisition_cycle(struct acquisition *acq, struct system_status *status, int64_t deadline_ns);
+int acquisition_idle(struct acquisition *acq, unsigned device);
+void acquisition_stop(struct acquisition *acq);
+
+/*
+ *
+ * Scheduler
+ *
+ */
+
+typedef enum {
+     SCHEDULE_SKIP					= 0,
+     SCHEDULE_CATCH_UP					= 1,
+} schedule_policy_t;
+
+#define SCHEDULER_BUCKETS	8
+#define SCHEDULER_CATCH_UP_MAX	10
+
+struct scheduler {
+     int64_t period_ns;
+     schedule_policy_t policy;
+     int64_t next_ns;
+     int64_t last_ns;
+
+     uint64_t ticks, overruns, skipped;
+     int64_t jitter_sum_ns, jitter_max_ns;
+     uint64_t histogram[SCHEDULER_BUCKETS];
+};
+
+void scheduler_init(struct scheduler *sched, int64_t period_ns, schedule_policy_t policy);
+int64_t scheduler_wait(struct scheduler *sched);
+void scheduler_stats_print(const struct scheduler *sched);
+void scheduler_period_set(struct scheduler *sched, int64_t period_ns);
+void scheduler_tick(struct scheduler *sched, int64_t now_ns);
+int64_t scheduler_next(struct scheduler *sched, int64_t now_ns);
+
+struct poll_rate {
+     int64_t period_ns;
+     uint16_t charger_status[EVCS_MAX];
+     int64_t connected_ns[EVCS_MAX];
+};
+
+struct charger_control;
+
+void poll_rate_init(struct poll_rate *poll, const struct config *config);
+int64_t poll_rate_period(struct poll_rate *poll, const struct config *config, const struct system_status *status,
+			 const struct charger_control *control, int64_t now_ns);
+
+/*
+ *
+ * Averaging
+ *
+ */
+
+struct average_interval {
+     int64_t start_ns, end_ns;
+     int32_t value;
+};
+
+/* The small build keeps the intervals in the window itself instead of allocating, which covers an
+ * averaging span of about 2000 poll periods; config_from_env() rejects longer ones */
+#define AVERAGE_INTERVALS_MAX	4096
+
+struct average_window {
+     int64_t span_ns;
+     size_t capacity, head, tail, count;
+     struct average_interval *intervals;
+     int64_t integral;
+
+     int primed;
+     int64_t first_ns, last_ns;
+     int32_t last_value;
+     uint64_t overflows;
+#ifdef POWERPLAY_SMALL
+     struct average_interval storage[AVERAGE_INTERVALS_MAX];
+#endif
+};
+
+int average_window_init(struct average_window *window, int64_t span_ns, size_t capacity);
+void average_window_free(struct average_window *window);
+void average_window_add(struct average_window *window, int64_t t_ns, int32_t value);
+int average_window_full(const struct average_window *window, int64_t now_ns);
+int32_t average_window_mean(const struct average_window *window, int64_t now_ns);
+int average_window_resize(struct average_window *window, int64_t span_ns, size_t capacity);
+
+/*
+ *
+ * Forecast
+ *
+ */
+
+/*
+ * Holt's linear trend on the excess, with the smoothing weights derived from the time between
+ * samples so an irregular poll period does not skew it. Every forecast is checked against the
+ * sample arriving at its horizon, one at a time, and the spread of those errors gives the bound.
+ */
+#define FORECAST_TREND_FACTOR	2 /* trend smoothing time over level smoothing time */
+#define FORECAST_CHECKS_MIN	4 /* checked forecasts before the bound is trusted */
+#define FORECAST_CHECKS_MEMORY	32
+#define FORECAST_Z		2.0 /* bound in standard deviations of the error, about 95% */
+
+struct forecast {
+     int64_t horizon_ns, level_ns, trend_ns;
+
+     int primed;
+     int64_t last_ns;
+     double level, trend; /* W and W/s */
+
+     int64_t check_ns;
+     double check_value;
+     double error_var;
+     uint32_t checks;
+};
+
+void forecast_init(struct forecast *forecast, int64_t horizon_ns, int64_t smoothing_ns);
+void forecast_tune(struct forecast *forecast, int64_t horizon_ns, int64_t smoothing_ns);
+void forecast_add(struct forecast *forecast, int64_t t_ns, int32_t value);
+int forecast_predict(const struct forecast *forecast, int64_t now_ns, int32_t *value, int32_t *bound);
+
+/*
+ *
+ * Modulation
+ *
+ */
+
+struct modulation {
+     uint16_t setpoint;
+     int64_t updated_ns;
+};
+
+void modulation_reset(struct modulation *mod);
+uint16_t modulation_step(struct modulation *mod, const struct config *config, int32_t excess,
+			 uint16_t current, uint16_t current_max, int64_t now_ns);
+
+/*
+ *
+ * Telemetry
+ *
+ */
+
+#define TELEMETRY_MAGIC		0x4c545050 /* "PPTL" */
+#define TELEMETRY_VERSION	3
+#define TELEMETRY_GAP_MS	10000
+
+typedef enum {
+     TELEMETRY_KIND_RAW					= 0,
+     TELEMETRY_KIND_MINUTE				= 1,
+     TELEMETRY_KIND_HOUR				= 2,
+} telemetry_kind_t;
+
+struct telemetry_header {
+     uint32_t magic;
+     uint16_t version;
+     uint16_t kind;
+     uint32_t record_size;
+     uint32_t reserved;
+};
+
+struct telemetry_charger {
+     uint16_t charge_start, charger_status, charging_mode, desired;
+};
+
+/* One sample as read, per phase where the GX reports phases. 96 bytes, host byte order. evcs is
+ * the power of all chargers, the first nevcs entries of charger hold their state and desired. */
+struct telemetry_record {
+     int64_t t_ms;
+     int32_t pv[3], consumption[3], grid[3];
+     int32_t battery, evcs;
+     int32_t excess, excess_mean;
+     uint16_t soc_battery, nevcs;
+     struct telemetry_charger charger[EVCS_MAX];
+};
+
+/* Means over the covered_ms of a minute or hour bucket, which excludes outages, charging_ms is the
+ * part of it with any charger charging. excess is the mean of the count samples. */
+struct telemetry_rollup {
+     int64_t t_ms;
+     uint32_t count, covered_ms;
+     int32_t pv[3], consumption[3], grid[3];
+     int32_t grid_import, grid_export;
+     int32_t battery, evcs;
+     int32_t excess, excess_min, excess_max;
+     uint16_t soc_battery, reserved;
+     uint32_t charging_ms;
+};
+
+/* Powers are summed in W ms over the covered time, each sample held up to the next one in last */
+struct telemetry_accum {
+     int64_t span_ms, bucket_ms;
+     struct telemetry_record last;
+     uint32_t count, covered_ms, charging_ms;
+     int64_t pv[3], consumption[3], grid[3];
+     int64_t grid_import, grid_export, battery, evcs;
+     int64_t excess;
+     int32_t excess_min, excess_max;
+     uint16_t soc_battery;
+};
+
+struct telemetry {
+     const char *dir;
+     int raw_fd, minute_fd, hour_fd;
+     int64_t raw_day;
+     struct telemetry_accum minute, hour;
+     uint64_t write_errors;
+};
+
+int telemetry_open(struct telemetry *tlm, const char *dir);
+void telemetry_close(struct telemetry *tlm);
+int telemetry_append(struct telemetry *tlm, const struct telemetry_record *rec);
+void telemetry_record_fill(struct telemetry_record *rec, const struct system_status *status,
+			   int32_t excess_mean, const struct charger_control *desired);
+
+/*
+ *
+ * HTTP
+ *
+ */
+
+#define HTTP_ADDR_DEFAULT	"127.0.0.1"
+#define HTTP_BODY_MAX		16384
+
+/* What the control loop publishes once per cycle, copied out of the status without pointers.
+ * now_ns is filled in by the reader so data ages keep growing while the loop is stuck. */
+struct status_snapshot {
+     int64_t t_ms, now_ns;
+     uint64_t cycles, overruns;
+     int64_t jitter_max_ns, period_ns;
+
+     int32_t power_grid, power_pv, power_consumption, power_battery, power_evcs, power_excess;
+     int32_t power_grid_phase[3], power_pv_phase[3], power_consumption_phase[3];
+     uint16_t soc_battery;
+
+     int32_t excess_mean;
+     uint64_t excess_samples;
+     int excess_full;
+     time_t averaging_secs;
+     int forecasting;
+     int32_t excess_forecast, forecast_bound;
+
+     int64_t gx_updated_ns;
+     link_state_t gx_link;
+     uint64_t gx_reconnects;
+
+     size_t nevcs;
+     struct charger_snapshot {
+	  int32_t power, share_mean;
+	  uint16_t charge_start, charger_status, charging_mode;
+	  uint16_t charging_current, max_current;
+	  uint16_t desired_charge_start;
+
+	  int64_t updated_ns;
+	  link_state_t link;
+	  uint64_t reconnects;
+	  uint64_t writes, writes_elided, writes_deferred;
+     } evcs[EVCS_MAX];
+};
+
+struct snapshot {
+     uint32_t seq;
+     struct status_snapshot data;
+};
+
+struct http_server {
+     int fd;
+     struct snapshot *snap;
+     pthread_t thread;
+};
+
+void snapshot_publish(struct snapshot *snap, const struct status_snapshot *data);
+void snapshot_read(struct snapshot *snap, struct status_snapshot *data);
+void status_snapshot_fill(struct status_snapshot *data, const struct system_status *status);
+int http_start(struct http_server *server, struct snapshot *snap, const char *addr, int port);
+
+/*
+ *
+ * Gateway
+ *
+ */
+
+/*
+ * Local Modbus TCP endpoints, one per device, for other tools to read through sparkshift instead
+ * of opening connections of their own. Reads of registers sparkshift polls are answered from the
+ * values of the last cycle; other reads, reads of values older than GATEWAY_MAX_AGE_MSECS and
+ * writes are forwarded on sparkshift's connection by the control thread after the reads of its
+ * next cycle, or answered busy while the device's reader is still on the link. Writes to a
+ * charger go one register at a time through its shadow. One thread serves all clients, each with
+ * one request at a time.
+ */
+#define GATEWAY_ADDR_DEFAULT	"127.0.0.1"
+#define GATEWAY_MAX_AGE_MSECS_DEFAULT 5000
+#define GATEWAY_CLIENTS_MAX	16
+#define GATEWAY_DEVICES		(1 + EVCS_MAX)
+
+typedef enum {
+     GATEWAY_IDLE					= 0,
+     GATEWAY_QUEUED					= 1,
+     GATEWAY_RUNNING					= 2,
+     GATEWAY_DONE					= 3,
+} gateway_forward_state_t;
+
+struct gateway_client {
+     int fd;
+     size_t device;
+     int closing;
+     size_t rx_len;
+     uint8_t rx[2 * MBTCP_ADU_MAX];
+
+     /* The request waiting for the control thread, state under the gateway lock */
+     gateway_forward_state_t state;
+     uint16_t tid;
+     struct mbtcp_request req;
+     uint16_t values[MODBUS_MAX_READ_REGISTERS];
+     uint16_t write_values[MODBUS_MAX_WRITE_REGISTERS];
+};
+
+struct gateway_device {
+     const char *name;
+     uint8_t unit;
+     int fd;
+
+     /* The polled values, under the gateway lock */
+     struct register_plan plan;
+     uint16_t values[REGISTER_VALUES_MAX];
+     int64_t read_ns;
+};
+
+struct gateway {
+     pthread_mutex_t lock;
+     int wake[2];
+     int64_t max_age_ns;
+     int dryrun;
+
+     struct gateway_device devices[GATEWAY_DEVICES];
+     size_t ndevices;
+     struct gateway_client clients[GATEWAY_CLIENTS_MAX];
+     pthread_t thread;
+
+     uint64_t cached, forwarded, failed, rejected;
+};
+
+int gateway_start(struct gateway *gw, const struct system_status *status);
+void gateway_publish(struct gateway *gw, const struct system_status *status);
+void gateway_forward(struct gateway *gw, struct system_status *status, struct acquisition *acq);
+void gateway_stats_print(const struct gateway *gw);
+
+/*
+ *
+ * Ring
+ *
+ */
+
+/*
+ * Lock-free single producer, single consumer queue of fixed-size slots. The producer never
+ * waits: an entry that finds the ring full is dropped and counted, and high_water keeps the most
+ * entries ever queued, so a consumer falling behind shows before anything is lost.
+ */
+struct ring {
+     void *slots;
+     size_t size, capacity;
+
+     /* head is only written by the producer, tail only by the consumer */
+     uint64_t head, tail;
+     uint64_t dropped, high_water;
+};
+
+void ring_init(struct ring *ring, void *slots, size_t size, size_t capacity);
+void *ring_reserve(struct ring *ring);
+void ring_push(struct ring *ring);
+void *ring_peek(struct ring *ring);
+void ring_pop(struct ring *ring);
+
+/*
+ *
+ * Logger
+ *
+ */
+
+/*
+ * Log lines, telemetry records and statistics go from the control thread through a ring to a
+ * thread of their own, which does the writing and flushing. A stdout backed up behind journald or
+ * a slow disk holds up that thread only; the control loop drops what does not fit.
+ */
+#define LOG_ENTRIES		256
+#define LOG_LINE_MAX		512
+
+typedef enum {
+     LOG_LINE						= 0,
+     LOG_TELEMETRY					= 1,
+     LOG_SCHEDULE					= 2,
+     LOG_IO_STATS					= 3,
+} log_kind_t;
+
+struct log_entry {
+     log_kind_t kind;
+     union {
+	  char line[LOG_LINE_MAX];
+	  struct telemetry_record rec;
+	  struct scheduler sched;
+     } u;
+};
+
+struct logger {
+     struct ring ring;
+     struct log_entry entries[LOG_ENTRIES];
+     int wake[2];
+     int stop;
+
+     struct telemetry *tlm;
+     const struct system_status *status;
+     const struct gateway *gw;
+     pthread_t thread;
+};
+
+int logger_start(struct logger *log, struct telemetry *tlm, const struct system_status *status,
+		 const struct gateway *gw);
+void logger_printf(struct logger *log, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void logger_report(void *log, const char *line);
+size_t line_printf(char *line, size_t len, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+/*
+ * Link changes and device errors are reported from whichever thread runs the device, through a
+ * sink of that thread's own: the control thread sets its logger, so a stdout or stderr that
+ * does not drain cannot hold up its decisions. Without one they are written and flushed at once.
+ */
+typedef void report_sink_t(void *ctx, const char *line);
+void report_sink_set(report_sink_t *sink, void *ctx);
+void report(FILE *stream, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+const char *status_line_field(const char *line, const char *tag);
+void logger_telemetry(struct logger *log, const struct telemetry_record *rec);
+void logger_stats(struct logger *log, const struct scheduler *sched, int io);
+void logger_wake(struct logger *log);
+void logger_stop(struct logger *log);
+
 /*
  *
  * GX
  *
  */
 
+/* Unit id of com.victronenergy.system, which holds all GX values read */
+#define GX_UNIT			100
+
 /* CCGX Modbus TCP register list 3.50 */
 typedef enum {
      GX_REGISTER_SWITCH_POSITION			= 33,  /* uint16, com.victronenergy.vebus */
@@ -135,8 +1028,9 @@ typedef enum {
     EVCS_CHARGER_STATUS_STOP_CHARGING			= 24,
 } evcs_charger_status_t;
 
-int evcs_charging_start_set(const struct system_status *status, evcs_charging_start_t start);
-int evcs_charge_mode_set(const struct system_status *status, evcs_charge_mode_t start);
+int evcs_charging_start_set(struct system_status *status, size_t charger, evcs_charging_start_t start);
+int evcs_charge_mode_set(struct system_status *status, size_t charger, evcs_charge_mode_t start);
+int evcs_charging_current_set(struct system_status *status, size_t charger, uint16_t current);
 char get_charger_status_char(evcs_charger_status_t status);
 const char *get_charger_status_str(evcs_charger_status_t status);
 char get_charging_mode_char(evcs_charge_mode_t mode);
@@ -144,4 +1038,118 @@ const char *get_charging_mode_str(evcs_charge_mode_t mode);
 const char *get_watchdog_reason_str(uint16_t code);
 const char *get_reset_reason_str(uint16_t code);
 
+/*
+ *
+ * Allocation
+ *
+ */
+
+/* What the control loop decided for one charger and the share of the excess it was given */
+struct charger_control {
+     evcs_charging_start_t charge_start;
+     int known;
+     int64_t decided_ns;
+     int32_t share_mean;
+     struct modulation mod;
+};
+
+void excess_allocate(const struct config *config, const struct system_status *status, unsigned live,
+		     int32_t excess, int32_t *share);
+
+/*
+ *
+ * Control
+ *
+ */
+
+/* What one cycle asks of a charger; writes of values it already holds are elided by its shadow */
+struct charger_command {
+     const char *decision; /* why the desired charge start changed this cycle, NULL if it did not */
+     int write_charge_start;
+     evcs_charging_start_t charge_start;
+     int write_current;
+     uint16_t current;
+     int write_auto;
+};
+
+struct controller {
+     struct average_window excess;
+     struct forecast forecast;
+     struct charger_control charger[EVCS_MAX];
+     int64_t started_ns;
+     int32_t excess_mean;
+     int forecasting; /* excess_forecast and forecast_bound are valid */
+     int32_t excess_forecast, forecast_bound;
+     int sampled; /* the last step took a sample, i.e. GX and all chargers were fresh */
+};
+
+int controller_init(struct controller *ctl, const struct config *config, int64_t now_ns);
+int controller_reconfigure(struct controller *ctl, const struct config *config);
+void controller_free(struct controller *ctl);
+void control_step(struct controller *ctl, const struct config *config, const struct system_status *status,
+		  int64_t now_ns, struct charger_command *cmd);
+
+/*
+ *
+ * State
+ *
+ */
+
+/*
+ * Control state checkpointed every cycle to a memory-mapped file, so a restarted sparkshift picks
+ * up the averaging window, the desired charge start and what it wrote to the chargers instead of
+ * starting from nothing. The file only has to outlive the process, /run is a good place for it.
+ * Times are stored on the monotonic clock of the writer together with the wall clock of the
+ * checkpoint, which maps them onto the clock of the reader even across a reboot.
+ */
+#define STATE_MAGIC		0x54535053 /* "SPST" */
+#define STATE_VERSION		2
+#define STATE_INTERVALS_MAX	8192
+#define STATE_HOST_MAX		64
+
+struct state_charger {
+     char host[STATE_HOST_MAX];
+     int32_t port;
+
+     uint16_t charge_start, known;
+     int64_t decided_ns;
+     uint16_t setpoint;
+     int64_t setpoint_ns;
+
+     /* Shadow writes, only used again with an identical register plan */
+     int32_t write_read_unsupported;
+     uint32_t nvalues;
+     struct register_range ranges[REGISTER_RANGES_MAX];
+     uint32_t nranges;
+     uint16_t written[REGISTER_VALUES_MAX];
+     int64_t written_ns[REGISTER_VALUES_MAX];
+};
+
+struct state_image {
+     uint32_t magic, version;
+     uint32_t seq; /* odd while a checkpoint is being written */
+     uint32_t nevcs;
+     int64_t saved_ns, saved_realtime_ns;
+
+     int32_t primed, last_value;
+     int64_t first_ns, last_ns;
+     uint32_t nintervals;
+     struct forecast forecast;
+
+     struct state_charger evcs[EVCS_MAX];
+     struct average_interval intervals[STATE_INTERVALS_MAX];
+};
+
+struct state {
+     const char *path;
+     int fd;
+     struct state_image *image;
+};
+
+int state_open(struct state *state, const char *path);
+void state_close(struct state *state);
+int state_restore(const struct state *state, const struct config *config, struct controller *ctl,
+		  struct system_status *status);
+void state_save(struct state *state, const struct controller *ctl, const struct system_status *status);
+
 #endif
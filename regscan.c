@@ -0,0 +1,706 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "powerplay.h"
+
+/*
+  Regscan - Modbus register discovery and register map validation
+
+  Usage: regscan [options] [-g HOST[:PORT]] [-e HOST[:PORT]]
+
+  -g HOST[:PORT]	GX to scan (port default 502)
+  -e HOST[:PORT]	EVCS to scan (port default 502)
+  -u UNITS		GX unit ids swept, e.g. 100,246 or 0-247 (default 0-247)
+  -U UNITS		EVCS unit ids swept (default 255)
+  -r RANGES		GX registers swept, e.g. 800-899,2600-2700 (default 0-9999)
+  -R RANGES		EVCS registers swept (default 5000-5199)
+  -c CONNECTIONS	connections per device (default 8)
+  -d DEPTH		requests in flight per connection (default 1)
+  -b REGISTERS		registers per read to start with (default 125)
+  -t MSECS		response timeout (default 1000)
+  -o FILE		write the register map for REGISTER_MAP to FILE
+  -v			list every range of registers found
+
+  Every unit is probed with one read first; units the device answers with a gateway exception
+  or not at all are skipped. The registers of the others are read in blocks, and a block answered
+  with an exception is split in halves until the registers the device serves are told from those
+  it does not, so a sparse map takes a few thousand reads instead of one per register. The reads
+  of all connections are multiplexed on one thread.
+
+  The registers sparkshift uses are then looked up on the unit and at the offset from their
+  listed addresses where most of them are present with plausible values, the listed ones if they
+  qualify. Each is reported with its value, and the map names the unit and address of those
+  found. Registers missing or implausible, or moved by an offset the values do not pin down, are
+  left out of the map and make regscan exit with status 1, and sparkshift keeps their listed
+  addresses.
+ */
+
+#define SCAN_PORT_DEFAULT	502
+#define SCAN_CONNECTIONS_MAX	16
+#define SCAN_TRIES		3
+#define SCAN_RANGES_MAX		64
+#define SCAN_UNITS		256
+
+typedef enum {
+     UNIT_UNKNOWN					= 0,
+     UNIT_PRESENT					= 1,
+     UNIT_ABSENT					= 2, /* answered with a gateway exception */
+     UNIT_SILENT					= 3, /* did not answer its probe */
+} unit_state_t;
+
+struct scan_range {
+     uint16_t first, last;
+};
+
+struct scan_block {
+     uint16_t addr, count;
+     uint8_t unit;
+     uint8_t tries;
+     uint8_t probe; /* first read of the unit, the rest of it is queued once it answers */
+};
+
+/* What a unit answered: a bit per register it serves or refused and the value read */
+struct scan_unit {
+     uint8_t present[(UINT16_MAX + 1) / 8];
+     uint8_t absent[(UINT16_MAX + 1) / 8];
+     uint16_t values[UINT16_MAX + 1];
+     size_t nregisters, nabsent;
+};
+
+struct scan_conn {
+     struct mbtcp client;
+     int busy, dead;
+     size_t n;
+     struct scan_block blocks[MBTCP_PIPELINE_MAX];
+     struct mbtcp_request reqs[MBTCP_PIPELINE_MAX];
+     uint16_t values[MBTCP_PIPELINE_MAX][MODBUS_MAX_READ_REGISTERS];
+};
+
+struct scan_device {
+     const char *name;
+     register_device_t type;
+     uint8_t unit_default;
+     char host[256];
+     struct modbus_device device;
+     int failed;
+
+     uint8_t units[SCAN_UNITS]; /* swept */
+     struct scan_range ranges[SCAN_RANGES_MAX];
+     size_t nranges;
+     uint16_t block;
+
+     /* Blocks still to read, taken from the end */
+     struct scan_block *queue;
+     size_t nqueue, capacity;
+
+     size_t nconns;
+     struct scan_conn *conns;
+
+     unit_state_t state[SCAN_UNITS];
+     struct scan_unit *found[SCAN_UNITS];
+     uint64_t requests, exceptions, timeouts, unanswered, reconnects;
+};
+
+static int scan_push(struct scan_device *dev, struct scan_block block)
+{
+     if (dev->nqueue == dev->capacity) {
+	  size_t capacity = dev->capacity ? 2 * dev->capacity : 1024;
+	  struct scan_block *queue = realloc(dev->queue, capacity * sizeof(queue[0]));
+
+	  if (queue == NULL) {
+	       fprintf(stderr, "Error: could not allocate %s scan queue\n", dev->name);
+	       fflush(stderr);
+	       return -1;
+	  }
+	  dev->queue = queue;
+	  dev->capacity = capacity;
+     }
+
+     dev->queue[dev->nqueue++] = block;
+     return 0;
+}
+
+/* Queues the blocks of every range of a unit that answered, but the probe it answered */
+static int scan_unit_queue(struct scan_device *dev, uint8_t unit)
+{
+     /* Pushed backwards so they are read from the lowest address on */
+     for (size_t r = dev->nranges; r-- > 0;) {
+	  const struct scan_range *range = &dev->ranges[r];
+	  uint32_t blocks = ((uint32_t)range->last - range->first) / dev->block + 1;
+
+	  for (uint32_t b = blocks; b-- > 0;) {
+	       uint32_t addr = range->first + b * dev->block;
+	       uint32_t count = range->last - addr + 1;
+
+	       if (r == 0 && b == 0) continue;
+	       if (count > dev->block) count = dev->block;
+	       if (scan_push(dev, (struct scan_block){ (uint16_t)addr, (uint16_t)count, unit, 0, 0 })) return -1;
+	  }
+     }
+
+     return 0;
+}
+
+static int scan_unit_found(struct scan_device *dev, uint8_t unit)
+{
+     if (dev->state[unit] == UNIT_PRESENT) return 0;
+
+     dev->state[unit] = UNIT_PRESENT;
+     dev->found[unit] = calloc(1, sizeof(*dev->found[unit]));
+     if (dev->found[unit] == NULL) {
+	  fprintf(stderr, "Error: could not allocate %s unit %u\n", dev->name, unit);
+	  fflush(stderr);
+	  return -1;
+     }
+
+     return scan_unit_queue(dev, unit);
+}
+
+static int scan_exception(int err)
+{
+     return err >= EMBXILFUN && err <= EMBXGTAR;
+}
+
+/* What a read answered: values, registers to split further, or a unit to skip */
+static int scan_result(struct scan_device *dev, struct scan_block *block, const struct mbtcp_request *req)
+{
+     int err = req->result;
+
+     dev->requests += 1;
+     if (scan_exception(err)) dev->exceptions += 1;
+     if (err == ETIMEDOUT) dev->timeouts += 1;
+
+     if (block->probe) {
+	  if (err == EMBXGPATH || err == EMBXGTAR) {
+	       dev->state[block->unit] = UNIT_ABSENT;
+	       return 0;
+	  }
+	  if (err == ETIMEDOUT && block->tries + 1 >= SCAN_TRIES) {
+	       dev->state[block->unit] = UNIT_SILENT;
+	       return 0;
+	  }
+	  if (err != ETIMEDOUT && !(err && !scan_exception(err))) {
+	       if (scan_unit_found(dev, block->unit)) return -1;
+	       block->probe = 0;
+	  }
+     }
+
+     if (err == 0) {
+	  struct scan_unit *unit = dev->found[block->unit];
+
+	  for (uint16_t i = 0; i < block->count; ++i) {
+	       uint16_t addr = (uint16_t)(block->addr + i);
+
+	       if (!(unit->present[addr / 8] & (1 << (addr % 8)))) unit->nregisters += 1;
+	       unit->present[addr / 8] |= (uint8_t)(1 << (addr % 8));
+	       unit->values[addr] = req->values[i];
+	  }
+	  return 0;
+     }
+
+     if (scan_exception(err)) {
+	  struct scan_unit *unit = dev->found[block->unit];
+	  uint16_t addr = block->addr, half = block->count / 2;
+
+	  if (block->count == 1) {
+	       unit->absent[addr / 8] |= (uint8_t)(1 << (addr % 8));
+	       unit->nabsent += 1;
+	       return 0;
+	  }
+
+	  /*
+	   * Only a read of the register alone tells it is absent. Halving costs two reads per
+	   * register where none is served, so once the unit turned out sparse, or right after an
+	   * absent register, the block is read register by register.
+	   */
+	  if (unit->nabsent > unit->nregisters
+	      || (addr > 0 && (unit->absent[(addr - 1) / 8] & (1 << ((addr - 1) % 8))))) {
+	       for (uint16_t i = block->count; i-- > 0;)
+		    if (scan_push(dev, (struct scan_block){ (uint16_t)(addr + i), 1, block->unit, 0, 0 })) return -1;
+	       return 0;
+	  }
+
+	  if (scan_push(dev, (struct scan_block){ (uint16_t)(addr + half), (uint16_t)(block->count - half),
+					       block->unit, 0, 0 })) return -1;
+	  return scan_push(dev, (struct scan_block){ addr, half, block->unit, 0, 0 });
+     }
+
+     /* Timeouts and broken connections are asked again, the latter without counting */
+     if (err == ETIMEDOUT || err == EMBBADDATA || err == EMBBADSLAVE) block->tries += 1;
+     if (block->tries >= SCAN_TRIES) {
+	  dev->unanswered += block->count;
+	  return 0;
+     }
+
+     return scan_push(dev, *block);
+}
+
+/* Takes the next batch of blocks from the queue and sends it, connecting first if needed */
+static int scan_conn_start(struct scan_device *dev, struct scan_conn *conn, int64_t now_ns)
+{
+     if (!mbtcp_connected(&conn->client)) {
+	  if (conn->client.sent) dev->reconnects += 1;
+	  if (mbtcp_connect(&conn->client, &dev->device) == -1) {
+	       conn->dead = 1;
+	       fprintf(stderr, "Error: connection failed to %s %s:%d: %s\n", dev->name, dev->device.host,
+		       dev->device.port, modbus_strerror(errno));
+	       fflush(stderr);
+	       return -1;
+	  }
+     }
+
+     /* No more than are in flight at once, a request waiting behind another could time out unsent */
+     for (conn->n = 0; conn->n < dev->device.pipeline_depth && dev->nqueue; ++conn->n) {
+	  struct scan_block *block = &conn->blocks[conn->n];
+
+	  *block = dev->queue[--dev->nqueue];
+	  conn->reqs[conn->n] = (struct mbtcp_request){
+	       .function = MBTCP_READ_REGISTERS,
+	       .unit = block->unit,
+	       .addr = block->addr,
+	       .count = block->count,
+	       .values = conn->values[conn->n],
+	  };
+     }
+
+     conn->busy = 1;
+     return mbtcp_submit(&conn->client, conn->reqs, conn->n, now_ns);
+}
+
+static int scan_conn_done(struct scan_device *dev, struct scan_conn *conn)
+{
+     conn->busy = 0;
+     for (size_t i = 0; i < conn->n; ++i)
+	  if (scan_result(dev, &conn->blocks[i], &conn->reqs[i])) return -1;
+
+     return 0;
+}
+
+/* Keeps every connection of every device busy until all blocks are read */
+static int scan_run(struct scan_device *devs, size_t ndevs)
+{
+     struct pollfd pfds[2 * SCAN_CONNECTIONS_MAX];
+     struct scan_conn *polled[2 * SCAN_CONNECTIONS_MAX];
+
+     for (;;) {
+	  int64_t now_ns = monotonic_ns(), deadline_ns = INT64_MAX;
+	  size_t npfds = 0;
+
+	  for (size_t d = 0; d < ndevs; ++d) {
+	       struct scan_device *dev = &devs[d];
+
+	       for (size_t c = 0; c < dev->nconns && !dev->failed; ++c) {
+		    struct scan_conn *conn = &dev->conns[c];
+
+		    while (!conn->busy && !conn->dead && dev->nqueue) {
+			 int rc = scan_conn_start(dev, conn, now_ns);
+
+			 if (rc == -1) {
+			      /* Another connection carries on, the device is given up once none can */
+			      int up = 0;
+			      for (size_t o = 0; o < dev->nconns; ++o) up |= mbtcp_connected(&dev->conns[o].client);
+			      if (!up) dev->failed = 1;
+			      break;
+			 }
+			 if (rc == 1 && scan_conn_done(dev, conn)) return -1;
+		    }
+		    if (!conn->busy) continue;
+
+		    int64_t conn_deadline_ns = mbtcp_deadline(&conn->client);
+		    if (conn_deadline_ns < deadline_ns) deadline_ns = conn_deadline_ns;
+		    pfds[npfds] = (struct pollfd){ .fd = conn->client.fd, .events = POLLIN };
+		    polled[npfds++] = conn;
+	       }
+	  }
+
+	  if (npfds == 0) return 0;
+
+	  int timeout_ms = deadline_ns <= now_ns ? 0
+	       : deadline_ns == INT64_MAX ? -1 : (int)((deadline_ns - now_ns + NSECS_PER_MSEC - 1) / NSECS_PER_MSEC);
+	  if (poll(pfds, (nfds_t)npfds, timeout_ms) == -1 && errno != EINTR) {
+	       fprintf(stderr, "Error: could not wait for responses: %s\n", strerror(errno));
+	       fflush(stderr);
+	       return -1;
+	  }
+
+	  now_ns = monotonic_ns();
+	  for (size_t i = 0; i < npfds; ++i) {
+	       struct scan_conn *conn = polled[i];
+	       struct scan_device *dev = NULL;
+
+	       for (size_t d = 0; d < ndevs && dev == NULL; ++d)
+		    if (conn >= devs[d].conns && conn < devs[d].conns + devs[d].nconns) dev = &devs[d];
+	       if (mbtcp_poll(&conn->client, now_ns) && scan_conn_done(dev, conn)) return -1;
+	  }
+     }
+}
+
+static int scan_present(const struct scan_unit *unit, uint32_t addr)
+{
+     return addr <= UINT16_MAX && (unit->present[addr / 8] & (1 << (addr % 8)));
+}
+
+static int32_t scan_value(const struct register_info *info, uint16_t value)
+{
+     return info->is_signed ? (int32_t)(int16_t)value : (int32_t)value;
+}
+
+/* A register sparkshift uses, present where the offset puts it with a value in its range */
+static int scan_plausible(const struct scan_unit *unit, const struct register_info *info, int32_t offset)
+{
+     int32_t addr = (int32_t)info->addr + offset;
+
+     if (addr < 0 || !scan_present(unit, (uint32_t)addr)) return 0;
+
+     int32_t value = scan_value(info, unit->values[addr]);
+     return value >= info->min && value <= info->max;
+}
+
+static size_t scan_score(const struct scan_device *dev, const struct scan_unit *unit, int32_t offset)
+{
+     const struct register_info *infos;
+     size_t n, score = 0;
+
+     infos = register_info_table(&n);
+     for (size_t i = 0; i < n; ++i)
+	  if (infos[i].device == dev->type) score += (size_t)scan_plausible(unit, &infos[i], offset);
+
+     return score;
+}
+
+/* Where the registers sparkshift uses were found, with the range of offsets that fit as well */
+struct scan_choice {
+     int unit;
+     int32_t offset;
+     int ambiguous;
+     int32_t tie_min, tie_max;
+};
+
+/*
+ * Picks the unit and offset where most registers sparkshift uses are present and plausible. The
+ * listed addresses win a tie, then the listed unit. Another offset must win alone: tying with a
+ * different offset means the values do not tell where the map moved, reported as ambiguous.
+ */
+static void scan_resolve(const struct scan_device *dev, struct scan_choice *choice)
+{
+     const struct register_info *infos;
+     size_t n, best = 0;
+
+     infos = register_info_table(&n);
+     *choice = (struct scan_choice){ .unit = -1 };
+
+     for (int u = 0; u < SCAN_UNITS; ++u) {
+	  const struct scan_unit *unit = dev->found[u];
+	  if (unit == NULL) continue;
+
+	  size_t score = scan_score(dev, unit, 0);
+	  if (score > best || (score == best && score && u == dev->unit_default)) {
+	       best = score;
+	       choice->unit = u;
+	  }
+     }
+
+     size_t total = 0;
+     for (size_t i = 0; i < n; ++i) total += infos[i].device == dev->type;
+     if (best == total) return;
+
+     /* Offsets are tried that put a register at an address the device serves */
+     for (int u = 0; u < SCAN_UNITS; ++u) {
+	  const struct scan_unit *unit = dev->found[u];
+	  if (unit == NULL) continue;
+
+	  for (size_t i = 0; i < n; ++i) {
+	       if (infos[i].device != dev->type) continue;
+
+	       for (uint32_t addr = 0; addr <= UINT16_MAX; ++addr) {
+		    int32_t offset = (int32_t)addr - infos[i].addr;
+		    if (offset == 0 || !scan_present(unit, addr) || !scan_plausible(unit, &infos[i], offset)) continue;
+
+		    size_t score = scan_score(dev, unit, offset);
+		    if (score > best) {
+			 best = score;
+			 *choice = (struct scan_choice){ u, offset, 0, offset, offset };
+		    } else if (score == best && choice->offset != 0
+			       && (u != choice->unit || offset != choice->offset)) {
+			 choice->ambiguous = 1;
+			 if (offset < choice->tie_min) choice->tie_min = offset;
+			 if (offset > choice->tie_max) choice->tie_max = offset;
+		    }
+	       }
+	  }
+     }
+}
+
+static void scan_ranges_print(const struct scan_device *dev, int u, int verbose)
+{
+     const struct scan_unit *unit = dev->found[u];
+     size_t nranges = 0;
+     char line[LOG_LINE_MAX];
+     size_t len = 0;
+
+     line[0] = '\0';
+     for (uint32_t addr = 0; addr <= UINT16_MAX; ++addr) {
+	  if (!scan_present(unit, addr)) continue;
+
+	  uint32_t last = addr;
+	  while (scan_present(unit, last + 1)) last += 1;
+	  if (len < sizeof(line) - 32) {
+	       int w = last == addr ? snprintf(line + len, sizeof(line) - len, " %u", addr)
+		    : snprintf(line + len, sizeof(line) - len, " %u-%u", addr, last);
+	       if (w > 0) len += (size_t)w;
+	       if (len >= sizeof(line) - 32) strcat(line, " ...");
+	  }
+	  nranges += 1;
+	  addr = last;
+     }
+
+     printf("%s unit %d: %zu registers in %zu range%s%s\n", dev->name, u, unit->nregisters, nranges,
+	    nranges == 1 ? "" : "s", verbose || nranges <= 8 ? line : "");
+}
+
+/* Reports the registers sparkshift uses and writes them to the map; returns those not found */
+static size_t scan_report(const struct scan_device *dev, FILE *map, int verbose)
+{
+     const struct register_info *infos;
+     size_t n, missing = 0;
+     struct scan_choice choice;
+
+     size_t units = 0;
+     for (int i = 0; i < SCAN_UNITS; ++i) units += dev->units[i];
+     size_t answering = 0, absent = 0, silent = 0;
+     for (int i = 0; i < SCAN_UNITS; ++i) {
+	  answering += dev->state[i] == UNIT_PRESENT;
+	  absent += dev->state[i] == UNIT_ABSENT;
+	  silent += dev->state[i] == UNIT_SILENT;
+     }
+
+     printf("%s %s:%d: %zu units swept, %zu answering, %zu absent, %zu silent; %" PRIu64 " reads, %" PRIu64 " exceptions, "
+	    "%" PRIu64 " timeouts, %" PRIu64 " reconnects, %" PRIu64 " registers unanswered\n", dev->name, dev->device.host,
+	    dev->device.port, units, answering, absent, silent, dev->requests, dev->exceptions, dev->timeouts,
+	    dev->reconnects, dev->unanswered);
+     for (int i = 0; i < SCAN_UNITS; ++i)
+	  if (dev->found[i]) scan_ranges_print(dev, i, verbose);
+
+     infos = register_info_table(&n);
+     scan_resolve(dev, &choice);
+     int u = choice.unit;
+     int32_t offset = choice.offset;
+
+     if (u >= 0 && offset && choice.ambiguous) {
+	  printf("%s registers not at their listed addresses, values fit as well moved by %+d to %+d\n", dev->name,
+		 choice.tie_min, choice.tie_max);
+	  u = -1;
+     } else if (u >= 0 && offset) {
+	  printf("%s registers moved by %+d\n", dev->name, offset);
+     }
+
+     if (map && u >= 0) fprintf(map, "%s_UNIT=%d\n", dev->type == REGISTER_DEVICE_GX ? "GX" : "EVCS", u);
+
+     for (size_t i = 0; i < n; ++i) {
+	  const struct register_info *info = &infos[i];
+	  if (info->device != dev->type) continue;
+
+	  if (u < 0 || !scan_plausible(dev->found[u], info, offset)) {
+	       int32_t addr = (int32_t)info->addr + offset;
+
+	       if (u < 0 || addr < 0 || !scan_present(dev->found[u], (uint32_t)addr))
+		    printf("%-32s missing\n", info->name);
+	       else
+		    printf("%-32s unit %d %5d = %d implausible, expected %d to %d\n", info->name, u, addr,
+			   scan_value(info, dev->found[u]->values[addr]), info->min, info->max);
+	       if (map) fprintf(map, "# %s not found\n", info->name);
+	       missing += 1;
+	       continue;
+	  }
+
+	  uint16_t addr = (uint16_t)(info->addr + offset);
+	  printf("%-32s unit %d %5u = %d\n", info->name, u, addr, scan_value(info, dev->found[u]->values[addr]));
+	  if (map) fprintf(map, "%s=%u\n", info->name, addr);
+     }
+
+     return missing;
+}
+
+/* A comma separated list of numbers and FIRST-LAST ranges up to max */
+static int scan_list_parse(const char *str, unsigned long max, struct scan_range *ranges, size_t *nranges)
+{
+     *nranges = 0;
+
+     for (const char *p = str; *p;) {
+	  char *end;
+	  unsigned long first = strtoul(p, &end, 10), last = first;
+
+	  if (end != p && *end == '-') last = strtoul(end + 1, &end, 10);
+	  if (end == p || (*end && *end != ',') || last < first || last > max || *nranges == SCAN_RANGES_MAX) {
+	       fprintf(stderr, "Error: %s is not a list of numbers and ranges up to %lu\n", str, max);
+	       fflush(stderr);
+	       return -1;
+	  }
+
+	  ranges[(*nranges)++] = (struct scan_range){ (uint16_t)first, (uint16_t)last };
+	  p = *end ? end + 1 : end;
+     }
+
+     return 0;
+}
+
+static int scan_host_parse(struct scan_device *dev, const char *str)
+{
+     const char *colon = strrchr(str, ':');
+     size_t len = colon ? (size_t)(colon - str) : strlen(str);
+
+     if (len == 0 || len >= sizeof(dev->host)) goto error;
+     memcpy(dev->host, str, len);
+     dev->host[len] = '\0';
+     dev->device.host = dev->host;
+     dev->device.port = SCAN_PORT_DEFAULT;
+
+     if (colon) {
+	  char *end;
+	  long port = strtol(colon + 1, &end, 10);
+	  if (end == colon + 1 || *end || port <= 0 || port > UINT16_MAX) goto error;
+	  dev->device.port = (int)port;
+     }
+
+     return 0;
+
+error:
+     fprintf(stderr, "Error: %s is not HOST[:PORT]\n", str);
+     fflush(stderr);
+     return -1;
+}
+
+static int scan_device_init(struct scan_device *dev, const char *units, const char *ranges, size_t nconns,
+			    uint32_t depth, uint16_t block, uint32_t timeout_msecs)
+{
+     struct scan_range unit_ranges[SCAN_RANGES_MAX];
+     size_t nunit_ranges;
+
+     if (scan_list_parse(units, UINT8_MAX, unit_ranges, &nunit_ranges)) return -1;
+     if (scan_list_parse(ranges, UINT16_MAX, dev->ranges, &dev->nranges)) return -1;
+
+     dev->block = block;
+     dev->device.timeout_msecs = timeout_msecs;
+     dev->device.pipeline_depth = depth;
+     dev->nconns = nconns;
+     dev->conns = calloc(nconns, sizeof(dev->conns[0]));
+     if (dev->conns == NULL) {
+	  fprintf(stderr, "Error: could not allocate %s connections\n", dev->name);
+	  fflush(stderr);
+	  return -1;
+     }
+     for (size_t c = 0; c < nconns; ++c) mbtcp_init(&dev->conns[c].client);
+
+     /* Probes are pushed backwards so the lowest unit is read first */
+     for (size_t r = nunit_ranges; r-- > 0;)
+	  for (uint32_t u = unit_ranges[r].last + 1; u-- > unit_ranges[r].first;)
+	       dev->units[u] = 1;
+     for (uint32_t u = SCAN_UNITS; u-- > 0;) {
+	  uint32_t count = (uint32_t)dev->ranges[0].last - dev->ranges[0].first + 1;
+
+	  if (!dev->units[u]) continue;
+	  if (count > block) count = block;
+	  if (scan_push(dev, (struct scan_block){ dev->ranges[0].first, (uint16_t)count, (uint8_t)u, 0, 1 }))
+	       return -1;
+     }
+
+     return 0;
+}
+
+static void usage(const char *name)
+{
+     fprintf(stderr, "Usage: %s [-g host[:port]] [-e host[:port]] [-u units] [-U units] [-r ranges] [-R ranges] "
+	     "[-c connections] [-d depth] [-b registers] [-t msecs] [-o file] [-v]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+     struct scan_device devs[2] = {
+	  { .name = "GX", .type = REGISTER_DEVICE_GX, .unit_default = GX_UNIT },
+	  { .name = "EVCS", .type = REGISTER_DEVICE_EVCS, .unit_default = MODBUS_TCP_SLAVE },
+     };
+     const char *hosts[2] = { NULL, NULL };
+     const char *units[2] = { "0-247", "255" };
+     const char *ranges[2] = { "0-9999", "5000-5199" };
+     long nconns = 8, depth = 1, block = MODBUS_MAX_READ_REGISTERS, timeout_msecs = 1000;
+     const char *out = NULL;
+     int verbose = 0;
+     int opt;
+
+     while ((opt = getopt(argc, argv, "g:e:u:U:r:R:c:d:b:t:o:v")) != -1) {
+	  switch (opt) {
+	  case 'g': hosts[0] = optarg; break;
+	  case 'e': hosts[1] = optarg; break;
+	  case 'u': units[0] = optarg; break;
+	  case 'U': units[1] = optarg; break;
+	  case 'r': ranges[0] = optarg; break;
+	  case 'R': ranges[1] = optarg; break;
+	  case 'c': nconns = atol(optarg); break;
+	  case 'd': depth = atol(optarg); break;
+	  case 'b': block = atol(optarg); break;
+	  case 't': timeout_msecs = atol(optarg); break;
+	  case 'o': out = optarg; break;
+	  case 'v': verbose = 1; break;
+	  default:
+	       usage(argv[0]);
+	       return 1;
+	  }
+     }
+
+     if (optind != argc || (hosts[0] == NULL && hosts[1] == NULL) || nconns < 1 || nconns > SCAN_CONNECTIONS_MAX
+	 || depth < 1 || depth > MBTCP_PIPELINE_MAX || block < 1 || block > MODBUS_MAX_READ_REGISTERS
+	 || timeout_msecs < 1) {
+	  usage(argv[0]);
+	  return 1;
+     }
+
+     struct scan_device *scanned = hosts[0] ? devs : devs + 1;
+     size_t nscanned = 0;
+     for (size_t d = 0; d < 2; ++d) {
+	  if (hosts[d] == NULL) continue;
+	  if (scan_host_parse(&devs[d], hosts[d])
+	      || scan_device_init(&devs[d], units[d], ranges[d], (size_t)nconns, (uint32_t)depth, (uint16_t)block,
+				  (uint32_t)timeout_msecs)) return 1;
+	  nscanned += 1;
+     }
+
+     int64_t start_ns = monotonic_ns();
+     if (scan_run(scanned, nscanned)) return 1;
+     double secs = (double)(monotonic_ns() - start_ns) / (double)NSECS_PER_SEC;
+
+     FILE *map = NULL;
+     if (out) {
+	  map = fopen(out, "w");
+	  if (map == NULL) {
+	       fprintf(stderr, "Error: could not create register map %s: %s\n", out, strerror(errno));
+	       return 1;
+	  }
+	  fprintf(map, "# Register map written by regscan, REGISTER_MAP for sparkshift\n");
+     }
+
+     size_t missing = 0;
+     for (size_t d = 0; d < nscanned; ++d) {
+	  if (scanned[d].failed) {
+	       printf("%s %s:%d: not reachable\n", scanned[d].name, scanned[d].device.host, scanned[d].device.port);
+	       missing += 1;
+	       continue;
+	  }
+	  missing += scan_report(&scanned[d], map, verbose);
+     }
+
+     uint64_t requests = 0;
+     for (size_t d = 0; d < nscanned; ++d) requests += scanned[d].requests;
+     printf("Scanned in %.2fs, %" PRIu64 " reads\n", secs, requests);
+
+     if (map && fclose(map)) {
+	  fprintf(stderr, "Error: could not write register map %s: %s\n", out, strerror(errno));
+	  return 1;
+     }
+
+     return missing ? 1 : 0;
+}
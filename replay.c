@@ -0,0 +1,491 @@
+#include <errno.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "powerplay.h"
+
+/*
+  Replay - backtests the sparkshift control step on recorded data
+
+  Usage: replay -m MIN -a SECS [-H SECS] [-f SECS] [-c switch|modulate] [-A AMPS] [-P PHASES]
+		[-p SECS] [-j THREADS] SOURCE
+
+  -m MIN	POWER_EXCESS_MIN values to try
+  -a SECS	AVERAGING_SECS values to try
+  -H SECS	HOLD_SECS values to try (default 30)
+  -f SECS	FORECAST_SECS values to try with DECISION_MODE=forecast, 0 for mean (default 0)
+  -c MODE	CONTROL_MODE (default switch)
+  -A AMPS	charging current the car draws, the ceiling when modulating (default 16)
+  -P PHASES	EVCS_PHASES (default 3)
+  -p SECS	period between the lines of a log (default 1)
+  -j THREADS	parameter sets replayed in parallel (default one per online CPU)
+
+  Values are a comma separated list or FIRST:LAST:STEP; every combination is replayed. SOURCE is
+  a TELEMETRY_DIR, whose raw files are read in order, or a file with the status lines sparkshift
+  prints, - for stdin. Only the first charger of a line is used.
+
+  The data is loaded once and each combination runs the control step over all of it. The excess
+  does not depend on what the car draws, so the recorded excess is replayed as is while the car
+  is simulated: plugged in whenever it was, charging at once when started and drawing AMPS or
+  the modulated current. Per combination it reports the charge starts and stops, the energy the
+  car took, how much of it the excess covered and how much came from the grid or battery, the
+  excess left over for the battery or export, and the share of the excess the car used.
+ */
+
+#define REPLAY_VALUES_MAX	4096
+
+struct sample {
+     uint32_t dt_ms; /* since the previous sample */
+     int32_t excess;
+     uint16_t charger_status;
+};
+
+struct series {
+     struct sample *samples;
+     size_t count, capacity;
+     int64_t start_ms, last_ms;
+};
+
+struct result {
+     uint64_t starts, stops;
+     double charging_h, car_wh, covered_wh, import_wh, excess_wh, export_wh;
+     int error;
+};
+
+struct sweep {
+     const struct series *series;
+     struct config base;
+     uint16_t amps;
+
+     const long *excess_min, *averaging_secs, *hold_secs, *forecast_secs;
+     size_t nexcess_min, naveraging_secs, nhold_secs, nforecast_secs;
+
+     size_t ncombos, next;
+     struct result *results;
+};
+
+static int series_push(struct series *series, int64_t t_ms, int32_t excess, uint16_t charger_status)
+{
+     if (series->count == series->capacity) {
+	  size_t capacity = series->capacity ? 2 * series->capacity : 65536;
+	  struct sample *samples = realloc(series->samples, capacity * sizeof(samples[0]));
+	  if (samples == NULL) {
+	       fprintf(stderr, "Error: could not allocate %zu samples\n", capacity);
+	       return -1;
+	  }
+	  series->samples = samples;
+	  series->capacity = capacity;
+     }
+
+     if (series->count == 0) series->start_ms = series->last_ms = t_ms;
+     if (t_ms < series->last_ms) return 0;
+
+     int64_t dt_ms = t_ms - series->last_ms;
+     struct sample *s = &series->samples[series->count++];
+     s->dt_ms = dt_ms > UINT32_MAX ? UINT32_MAX : (uint32_t)dt_ms;
+     s->excess = excess;
+     s->charger_status = charger_status;
+     series->last_ms = t_ms;
+
+     return 0;
+}
+
+static int dt_compare(const void *a, const void *b)
+{
+     uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+     return (x > y) - (x < y);
+}
+
+/* Median gap between samples, fallback_ms if there is none; -1 on failure */
+static int64_t series_period_ms(const struct series *series, int64_t fallback_ms)
+{
+     uint32_t *dts = malloc(series->count * sizeof(dts[0]));
+     size_t n = 0;
+
+     if (dts == NULL) {
+	  fprintf(stderr, "Error: could not allocate %zu gaps\n", series->count);
+	  return -1;
+     }
+
+     for (size_t i = 1; i < series->count; ++i)
+	  if (series->samples[i].dt_ms) dts[n++] = series->samples[i].dt_ms;
+     qsort(dts, n, sizeof(dts[0]), dt_compare);
+
+     int64_t period_ms = n ? dts[n / 2] : fallback_ms;
+     free(dts);
+
+     return period_ms;
+}
+
+static int series_load_telemetry(struct series *series, const char *dir)
+{
+     char pattern[PATH_MAX];
+     glob_t files;
+
+     snprintf(pattern, sizeof(pattern), "%s/raw-*.tlm", dir);
+     if (glob(pattern, 0, NULL, &files)) {
+	  fprintf(stderr, "Error: no raw telemetry files in %s\n", dir);
+	  return -1;
+     }
+
+     /* Day files sort by name in time order */
+     for (size_t f = 0; f < files.gl_pathc; ++f) {
+	  const char *path = files.gl_pathv[f];
+	  struct telemetry_header header;
+	  struct telemetry_record recs[4096];
+	  size_t n;
+
+	  FILE *file = fopen(path, "r");
+	  if (file == NULL) {
+	       fprintf(stderr, "Error: could not open %s: %s\n", path, strerror(errno));
+	       goto error;
+	  }
+
+	  if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TELEMETRY_MAGIC
+	      || header.version != TELEMETRY_VERSION || header.kind != TELEMETRY_KIND_RAW
+	      || header.record_size != sizeof(recs[0])) {
+	       fprintf(stderr, "Error: %s has an unexpected format\n", path);
+	       fclose(file);
+	       goto error;
+	  }
+
+	  while ((n = fread(recs, sizeof(recs[0]), sizeof(recs) / sizeof(recs[0]), file)) > 0) {
+	       for (size_t i = 0; i < n; ++i) {
+		    if (series_push(series, recs[i].t_ms, recs[i].excess, recs[i].charger[0].charger_status)) {
+			 fclose(file);
+			 goto error;
+		    }
+	       }
+	  }
+	  fclose(file);
+     }
+
+     globfree(&files);
+     return 0;
+
+error:
+     globfree(&files);
+     return -1;
+}
+
+/* The status line only has the charger status as a letter, which is all that matters here */
+static uint16_t charger_status_parse(char c)
+{
+     if (c == get_charger_status_char(EVCS_CHARGER_STATUS_DISCONNECTED)) return EVCS_CHARGER_STATUS_DISCONNECTED;
+     if (c == get_charger_status_char(EVCS_CHARGER_STATUS_CHARGED)) return EVCS_CHARGER_STATUS_CHARGED;
+     return EVCS_CHARGER_STATUS_CONNECTED;
+}
+
+static int series_load_log(struct series *series, const char *path, int64_t period_ms)
+{
+     FILE *file = strcmp(path, "-") ? fopen(path, "r") : stdin;
+     char *line = NULL;
+     size_t size = 0;
+     int64_t t_ms = 0;
+     int rc = 0;
+
+     if (file == NULL) {
+	  fprintf(stderr, "Error: could not open %s: %s\n", path, strerror(errno));
+	  return -1;
+     }
+
+     while (getline(&line, &size, file) != -1) {
+	  char mode, status;
+	  const char *x;
+
+	  if (sscanf(line, "M/%c S/%c", &mode, &status) != 2 || (x = status_line_field(line, "X/")) == NULL) continue;
+
+	  int32_t excess = (int32_t)strtol(x, NULL, 10);
+	  if (series_push(series, t_ms, excess, charger_status_parse(status))) {
+	       rc = -1;
+	       break;
+	  }
+	  t_ms += period_ms;
+     }
+
+     free(line);
+     if (file != stdin) fclose(file);
+
+     return rc;
+}
+
+/*
+ * Runs the control step over the whole series for one configuration. The state the car is in
+ * holds until the next sample, except across outages longer than TELEMETRY_GAP_MS.
+ */
+static void replay_run(const struct series *series, const struct config *config, uint16_t amps_max,
+		       struct result *res)
+{
+     struct system_status status = {0};
+     struct controller ctl;
+     struct charger_command cmd[EVCS_MAX];
+     struct evcs_charger *evcs = &status.evcs[0];
+     int32_t watts_per_amp = EVCS_VOLTAGE * (int32_t)config->evcs_phases;
+     int64_t t_ns = series->start_ms * NSECS_PER_MSEC;
+     evcs_charging_start_t start = EVCS_CHARGING_STOP;
+     uint16_t amps = amps_max;
+
+     *res = (struct result){0};
+     if (controller_init(&ctl, config, t_ns)) {
+	  res->error = 1;
+	  return;
+     }
+
+     status.nevcs = 1;
+     evcs->charging_mode = EVCS_CHARGE_MODE_AUTO;
+     evcs->max_current = amps_max;
+
+     for (size_t i = 0; i < series->count; ++i) {
+	  const struct sample *s = &series->samples[i];
+	  int car = s->charger_status != EVCS_CHARGER_STATUS_DISCONNECTED
+	       && s->charger_status != EVCS_CHARGER_STATUS_CHARGED;
+	  int charging = car && start == EVCS_CHARGING_START;
+
+	  t_ns += s->dt_ms * NSECS_PER_MSEC;
+
+	  evcs->charge_start = start;
+	  evcs->charger_status = !car ? s->charger_status
+	       : charging ? EVCS_CHARGER_STATUS_CHARGING : EVCS_CHARGER_STATUS_WAITING_FOR_START;
+	  evcs->charging_current = amps;
+	  evcs->power = charging ? amps * watts_per_amp : 0;
+	  evcs->updated_ns = status.gx_updated_ns = t_ns;
+	  status.power_evcs = evcs->power;
+	  status.power_excess = s->excess;
+	  status.fresh = ACQUIRED_GX | ACQUIRED_EVCS;
+
+	  control_step(&ctl, config, &status, t_ns, cmd);
+
+	  if (cmd[0].write_charge_start) {
+	       if (car && cmd[0].charge_start != start) {
+		    if (cmd[0].charge_start == EVCS_CHARGING_START) res->starts += 1;
+		    else res->stops += 1;
+	       }
+	       start = cmd[0].charge_start;
+	  }
+	  if (cmd[0].write_current) amps = cmd[0].current;
+
+	  double hours = 0;
+	  if (i + 1 < series->count && series->samples[i + 1].dt_ms <= TELEMETRY_GAP_MS)
+	       hours = series->samples[i + 1].dt_ms / 3600000.0;
+
+	  int32_t draw = car && start == EVCS_CHARGING_START ? amps * watts_per_amp : 0;
+	  int32_t surplus = s->excess > 0 ? s->excess : 0;
+	  int32_t covered = draw < surplus ? draw : surplus;
+
+	  if (draw) res->charging_h += hours;
+	  res->car_wh += draw * hours;
+	  res->covered_wh += covered * hours;
+	  res->import_wh += (draw - covered) * hours;
+	  res->excess_wh += surplus * hours;
+	  res->export_wh += (surplus - covered) * hours;
+     }
+
+     controller_free(&ctl);
+}
+
+static void *sweep_worker(void *arg)
+{
+     struct sweep *sweep = arg;
+
+     for (;;) {
+	  size_t k = __atomic_fetch_add(&sweep->next, 1, __ATOMIC_RELAXED);
+	  if (k >= sweep->ncombos) break;
+
+	  struct config config = sweep->base;
+	  config.power_excess_min = (int32_t)sweep->excess_min[k % sweep->nexcess_min];
+	  config.averaging_secs = (time_t)sweep->averaging_secs[k / sweep->nexcess_min % sweep->naveraging_secs];
+	  config.hold_secs = (time_t)sweep->hold_secs[k / sweep->nexcess_min / sweep->naveraging_secs % sweep->nhold_secs];
+	  config.forecast_secs = (uint32_t)sweep->forecast_secs[k / sweep->nexcess_min / sweep->naveraging_secs
+								/ sweep->nhold_secs];
+	  config.decision_mode = config.forecast_secs ? DECISION_FORECAST : DECISION_MEAN;
+	  if (!config.forecast_secs) config.forecast_secs = FORECAST_SECS_DEFAULT;
+
+	  replay_run(sweep->series, &config, sweep->amps, &sweep->results[k]);
+     }
+
+     return NULL;
+}
+
+/* A comma separated list or FIRST:LAST:STEP, returns the number of values or -1 */
+static long values_parse(const char *str, long *values)
+{
+     long first, last, step;
+     char c;
+     long n = 0;
+
+     if (sscanf(str, "%ld:%ld:%ld%c", &first, &last, &step, &c) == 3) {
+	  if (step <= 0 || last < first || (last - first) / step >= REPLAY_VALUES_MAX) return -1;
+	  for (long v = first; v <= last; v += step) values[n++] = v;
+	  return n;
+     }
+
+     for (const char *p = str; *p;) {
+	  char *end;
+
+	  if (n == REPLAY_VALUES_MAX) return -1;
+	  values[n++] = strtol(p, &end, 10);
+	  if (end == p || (*end && *end != ',')) return -1;
+	  p = *end ? end + 1 : end;
+     }
+
+     return n;
+}
+
+static void usage(const char *name)
+{
+     fprintf(stderr, "Usage: %s -m min -a secs [-H secs] [-f secs] [-c switch|modulate] [-A amps] [-P phases] "
+	     "[-p secs] [-j threads] source\n", name);
+}
+
+int main(int argc, char **argv)
+{
+     static long excess_min[REPLAY_VALUES_MAX], averaging_secs[REPLAY_VALUES_MAX], hold_secs[REPLAY_VALUES_MAX];
+     static long forecast_secs[REPLAY_VALUES_MAX];
+     long nexcess_min = 0, naveraging_secs = 0, nhold_secs = 1, nforecast_secs = 1;
+     long threads = sysconf(_SC_NPROCESSORS_ONLN);
+     double period_secs = 1.0;
+     struct series series = {0};
+     struct sweep sweep = {0};
+     struct config *base = &sweep.base;
+     long amps = 16;
+     int opt;
+
+     hold_secs[0] = HOLD_SECS_DEFAULT;
+     base->control_mode = CONTROL_SWITCH;
+     base->forecast_smoothing_secs = FORECAST_SMOOTHING_SECS_DEFAULT;
+     base->sharing_policy = SHARING_PRIORITY;
+     base->evcs_phases = EVCS_PHASES_DEFAULT;
+     base->current_min_amps = CURRENT_MIN_AMPS_DEFAULT;
+     base->current_slew_amps = CURRENT_SLEW_AMPS_DEFAULT;
+     base->current_deadband_watts = CURRENT_DEADBAND_WATTS_DEFAULT;
+     base->stale_secs = STALE_SECS_DEFAULT;
+     base->nevcs = 1;
+     base->evcs_priority[0] = 1;
+
+     while ((opt = getopt(argc, argv, "m:a:H:f:c:A:P:p:j:")) != -1) {
+	  switch (opt) {
+	  case 'm': nexcess_min = values_parse(optarg, excess_min); break;
+	  case 'a': naveraging_secs = values_parse(optarg, averaging_secs); break;
+	  case 'H': nhold_secs = values_parse(optarg, hold_secs); break;
+	  case 'f': nforecast_secs = values_parse(optarg, forecast_secs); break;
+	  case 'c':
+	       if (!strcmp(optarg, "switch")) base->control_mode = CONTROL_SWITCH;
+	       else if (!strcmp(optarg, "modulate")) base->control_mode = CONTROL_MODULATE;
+	       else nexcess_min = -1;
+	       break;
+	  case 'A': amps = atol(optarg); break;
+	  case 'P': base->evcs_phases = (uint32_t)atoi(optarg); break;
+	  case 'p': period_secs = strtod(optarg, NULL); break;
+	  case 'j': threads = atol(optarg); break;
+	  default:
+	       usage(argv[0]);
+	       return 1;
+	  }
+     }
+
+     if (optind != argc - 1 || nexcess_min <= 0 || naveraging_secs <= 0 || nhold_secs <= 0 || nforecast_secs <= 0
+	 || amps <= 0 || amps > UINT16_MAX || (base->evcs_phases != 1 && base->evcs_phases != 3)
+	 || period_secs < 0.001 || threads <= 0) {
+	  usage(argv[0]);
+	  return 1;
+     }
+
+     for (long i = 0; i < naveraging_secs; ++i) {
+	  if (averaging_secs[i] <= 0) {
+	       fprintf(stderr, "Error: averaging seconds must be positive\n");
+	       return 1;
+	  }
+     }
+     for (long i = 0; i < nforecast_secs; ++i) {
+	  if (forecast_secs[i] < 0) {
+	       fprintf(stderr, "Error: forecast seconds must not be negative\n");
+	       return 1;
+	  }
+     }
+
+     const char *source = argv[optind];
+     int64_t period_ms = (int64_t)(period_secs * 1000.0);
+     struct stat st;
+     int is_dir = strcmp(source, "-") && stat(source, &st) == 0 && S_ISDIR(st.st_mode);
+
+     if (is_dir ? series_load_telemetry(&series, source) : series_load_log(&series, source, period_ms)) return 1;
+     if (series.count < 2) {
+	  fprintf(stderr, "Error: %s holds too few samples to replay\n", source);
+	  return 1;
+     }
+
+     /* The averaging window is sized for the period the data was mostly recorded at, a stray short
+      * gap does not blow it up for every parameter set */
+     int64_t dt_ms = series_period_ms(&series, period_ms);
+     if (dt_ms < 0) return 1;
+     base->period_ns = base->poll_min_ns = base->poll_max_ns = dt_ms * NSECS_PER_MSEC;
+
+     sweep.series = &series;
+     sweep.amps = (uint16_t)amps;
+     sweep.excess_min = excess_min;
+     sweep.averaging_secs = averaging_secs;
+     sweep.hold_secs = hold_secs;
+     sweep.nexcess_min = (size_t)nexcess_min;
+     sweep.naveraging_secs = (size_t)naveraging_secs;
+     sweep.forecast_secs = forecast_secs;
+     sweep.nhold_secs = (size_t)nhold_secs;
+     sweep.nforecast_secs = (size_t)nforecast_secs;
+     sweep.ncombos = sweep.nexcess_min * sweep.naveraging_secs * sweep.nhold_secs * sweep.nforecast_secs;
+     sweep.results = calloc(sweep.ncombos, sizeof(sweep.results[0]));
+     if (sweep.results == NULL) {
+	  fprintf(stderr, "Error: could not allocate %zu results\n", sweep.ncombos);
+	  return 1;
+     }
+
+     fprintf(stderr, "Replaying %zu samples over %.1f h with %zu parameter sets on %ld threads\n",
+	     series.count, (double)(series.last_ms - series.start_ms) / 3600000.0, sweep.ncombos, threads);
+
+     if ((size_t)threads > sweep.ncombos) threads = (long)sweep.ncombos;
+     pthread_t *workers = calloc((size_t)threads, sizeof(workers[0]));
+     if (workers == NULL) {
+	  fprintf(stderr, "Error: could not allocate %ld threads\n", threads);
+	  return 1;
+     }
+
+     long started = 0;
+     for (; started < threads; ++started) {
+	  int err = pthread_create(&workers[started], NULL, sweep_worker, &sweep);
+	  if (err) {
+	       fprintf(stderr, "Error: could not start replay thread: %s\n", strerror(err));
+	       break;
+	  }
+     }
+     /* The calling thread helps out, so the sweep finishes even if no thread could be started */
+     sweep_worker(&sweep);
+     for (long i = 0; i < started; ++i) pthread_join(workers[i], NULL);
+
+     printf("excess_min averaging_secs hold_secs forecast_secs starts stops charging_h car_kwh covered_kwh import_kwh "
+	    "excess_kwh export_kwh self_consumption\n");
+     for (size_t k = 0; k < sweep.ncombos; ++k) {
+	  const struct result *r = &sweep.results[k];
+
+	  if (r->error) return 1;
+	  printf("%ld %ld %ld %ld %" PRIu64 " %" PRIu64 " %.2f %.3f %.3f %.3f %.3f %.3f %.3f\n",
+		 excess_min[k % sweep.nexcess_min],
+		 averaging_secs[k / sweep.nexcess_min % sweep.naveraging_secs],
+		 hold_secs[k / sweep.nexcess_min / sweep.naveraging_secs % sweep.nhold_secs],
+		 forecast_secs[k / sweep.nexcess_min / sweep.naveraging_secs / sweep.nhold_secs],
+		 r->starts, r->stops, r->charging_h,
+		 r->car_wh / 1000, r->covered_wh / 1000, r->import_wh / 1000,
+		 r->excess_wh / 1000, r->export_wh / 1000,
+		 r->excess_wh > 0 ? r->covered_wh / r->excess_wh : 0.0);
+     }
+
+     free(workers);
+     free(sweep.results);
+     free(series.samples);
+
+     return 0;
+}
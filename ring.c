@@ -0,0 +1,56 @@
+#include "powerplay.h"
+
+/*
+ *
+ * Ring
+ *
+ */
+
+void ring_init(struct ring *ring, void *slots, size_t size, size_t capacity)
+{
+     *ring = (struct ring){ .slots = slots, .size = size, .capacity = capacity };
+}
+
+static void *ring_slot(const struct ring *ring, uint64_t index)
+{
+     return (char *)ring->slots + (size_t)(index % ring->capacity) * ring->size;
+}
+
+/* The slot to fill next, NULL if the consumer is a whole ring behind; the entry is then dropped */
+void *ring_reserve(struct ring *ring)
+{
+     uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+     if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= ring->capacity) {
+	  __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+	  return NULL;
+     }
+
+     return ring_slot(ring, head);
+}
+
+/* Hands the reserved slot to the consumer */
+void ring_push(struct ring *ring)
+{
+     uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED) + 1;
+     uint64_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+     if (used > __atomic_load_n(&ring->high_water, __ATOMIC_RELAXED))
+	  __atomic_store_n(&ring->high_water, used, __ATOMIC_RELAXED);
+     __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+/* The oldest entry, NULL if there is none; it stays in place until ring_pop */
+void *ring_peek(struct ring *ring)
+{
+     uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+     if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) return NULL;
+
+     return ring_slot(ring, tail);
+}
+
+void ring_pop(struct ring *ring)
+{
+     __atomic_store_n(&ring->tail, __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,176 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "powerplay.h"
+
+/*
+ *
+ * Scheduler
+ *
+ */
+
+/* Upper bounds of the period histogram buckets in permille of the nominal period */
+static const int64_t scheduler_bucket_permille[SCHEDULER_BUCKETS - 1] = {
+     500, 900, 990, 1010, 1100, 1500, 2000,
+};
+
+void scheduler_init(struct scheduler *sched, int64_t period_ns, schedule_policy_t policy)
+{
+     *sched = (struct scheduler){0};
+     sched->period_ns = period_ns;
+     sched->policy = policy;
+     sched->next_ns = monotonic_ns();
+}
+
+/* Accounts a cycle starting at now_ns, for a caller waiting for next_ns on its own */
+void scheduler_tick(struct scheduler *sched, int64_t now_ns)
+{
+     int64_t late_ns = now_ns - sched->next_ns;
+
+     sched->ticks += 1;
+     sched->jitter_sum_ns += late_ns;
+     if (late_ns > sched->jitter_max_ns) sched->jitter_max_ns = late_ns;
+
+     if (sched->last_ns) {
+	  int64_t permille = (now_ns - sched->last_ns) * 1000 / sched->period_ns;
+	  size_t bucket = 0;
+
+	  while (bucket < SCHEDULER_BUCKETS - 1 && permille >= scheduler_bucket_permille[bucket]) ++bucket;
+	  sched->histogram[bucket] += 1;
+     }
+
+     sched->last_ns = now_ns;
+}
+
+/*
+ * Advances to the deadline of the next cycle after one that ended at now_ns and returns it.
+ * Deadlines advance by exactly one period so the time spent working in a cycle does not add up
+ * as drift. When a cycle overran the following deadline, SCHEDULE_SKIP drops the missed ticks
+ * and realigns to the period grid while SCHEDULE_CATCH_UP runs them back to back, giving up
+ * after SCHEDULER_CATCH_UP_MAX periods.
+ */
+int64_t scheduler_next(struct scheduler *sched, int64_t now_ns)
+{
+     sched->next_ns += sched->period_ns;
+
+     if (now_ns > sched->next_ns) {
+	  int64_t missed = (now_ns - sched->next_ns) / sched->period_ns + 1;
+
+	  sched->overruns += 1;
+
+	  if (sched->policy == SCHEDULE_SKIP || missed > SCHEDULER_CATCH_UP_MAX) {
+	       sched->skipped += (uint64_t)missed;
+	       sched->next_ns += missed * sched->period_ns;
+	  }
+     }
+
+     return sched->next_ns;
+}
+
+/* Sleeps until the next absolute deadline from scheduler_next() and returns the wake-up time */
+int64_t scheduler_wait(struct scheduler *sched)
+{
+     scheduler_next(sched, monotonic_ns());
+
+     struct timespec deadline = {
+	  .tv_sec = (time_t)(sched->next_ns / NSECS_PER_SEC),
+	  .tv_nsec = (long)(sched->next_ns % NSECS_PER_SEC),
+     };
+
+     while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+
+     int64_t now_ns = monotonic_ns();
+     scheduler_tick(sched, now_ns);
+
+     return now_ns;
+}
+
+void scheduler_stats_print(const struct scheduler *sched)
+{
+     printf("Schedule: ticks %" PRIu64 " overruns %" PRIu64 " skipped %" PRIu64 " jitter mean %" PRId64 "us max %" PRId64 "us\n",
+	    sched->ticks, sched->overruns, sched->skipped,
+	    sched->ticks ? sched->jitter_sum_ns / (int64_t)sched->ticks / 1000 : 0,
+	    sched->jitter_max_ns / 1000);
+
+     printf("Schedule: period");
+     for (size_t i = 0; i < SCHEDULER_BUCKETS; ++i) {
+	  if (i < SCHEDULER_BUCKETS - 1) printf(" <%" PRId64 "%%:%" PRIu64 "", scheduler_bucket_permille[i] / 10, sched->histogram[i]);
+	  else printf(" >=%" PRId64 "%%:%" PRIu64 "", scheduler_bucket_permille[i - 1] / 10, sched->histogram[i]);
+     }
+     printf("\n");
+}
+
+/* Changes the period from the next deadline on, the deadline already slept to stays in place */
+void scheduler_period_set(struct scheduler *sched, int64_t period_ns)
+{
+     sched->period_ns = period_ns;
+}
+
+void poll_rate_init(struct poll_rate *poll, const struct config *config)
+{
+     *poll = (struct poll_rate){0};
+     poll->period_ns = config->period_ns;
+     for (size_t i = 0; i < EVCS_MAX; ++i) poll->charger_status[i] = EVCS_CHARGER_STATUS_DISCONNECTED;
+}
+
+static int poll_rate_transitioning(uint16_t charger_status)
+{
+     return charger_status == EVCS_CHARGER_STATUS_START_CHARGING
+	  || charger_status == EVCS_CHARGER_STATUS_STOP_CHARGING
+	  || charger_status == EVCS_CHARGER_STATUS_SWITCHING_TO_3_PHASE
+	  || charger_status == EVCS_CHARGER_STATUS_SWITCHING_TO_1_PHASE;
+}
+
+/*
+ * Polls at POLL_MIN_SECS while a decision or an actuation is close at any charger: its share of
+ * the mean excess is within POLL_NEAR_WATTS of the threshold, it is switching, a car was connected
+ * to it in the last POLL_BOOST_SECS, a commanded charge start is not reflected yet or its current
+ * is modulated. Polls at POLL_MAX_SECS when nothing can happen at any charger: no PV, or no car
+ * that could charge. Everything else runs at SLEEP_SECS, as does a cycle without fresh EVCS values
+ * to judge by.
+ */
+int64_t poll_rate_period(struct poll_rate *poll, const struct config *config, const struct system_status *status,
+			 const struct charger_control *control, int64_t now_ns)
+{
+     int fast = 0, slow = 1, fresh = 0;
+
+     for (size_t i = 0; i < status->nevcs; ++i) {
+	  const struct evcs_charger *evcs = &status->evcs[i];
+	  uint16_t charger_status = evcs->charger_status;
+	  int32_t distance = control[i].share_mean - config->power_excess_min;
+
+	  if (!(status->fresh & ACQUIRED_CHARGER(i))) continue;
+	  fresh = 1;
+
+	  if (poll->charger_status[i] == EVCS_CHARGER_STATUS_DISCONNECTED
+	      && charger_status != EVCS_CHARGER_STATUS_DISCONNECTED)
+	       poll->connected_ns[i] = now_ns;
+	  poll->charger_status[i] = charger_status;
+
+	  if (distance < 0) distance = -distance;
+
+	  int car = charger_status != EVCS_CHARGER_STATUS_DISCONNECTED && charger_status != EVCS_CHARGER_STATUS_CHARGED;
+	  int charging = charger_status == EVCS_CHARGER_STATUS_CHARGING;
+
+	  if (poll_rate_transitioning(charger_status)
+	      || (poll->connected_ns[i] && now_ns - poll->connected_ns[i] < (int64_t)config->poll_boost_secs * NSECS_PER_SEC)
+	      || (car && evcs->charge_start != control[i].charge_start)
+	      || (car && distance < (int32_t)config->poll_near_watts)
+	      || (charging && config->control_mode == CONTROL_MODULATE)) fast = 1;
+	  if (car && (status->power_pv != 0 || charging)) slow = 0;
+     }
+
+     if (!fresh) {
+	  poll->period_ns = config->period_ns;
+     } else if (fast) {
+	  poll->period_ns = config->poll_min_ns;
+     } else if (slow) {
+	  poll->period_ns = config->poll_max_ns;
+     } else {
+	  poll->period_ns = config->period_ns;
+     }
+
+     return poll->period_ns;
+}
@@ -0,0 +1,150 @@
+#include <errno.h>
+#include <string.h>
+
+#include "powerplay.h"
+
+/*
+ *
+ * Shadow
+ *
+ */
+
+/*
+ * Last known and last written values of a device's registers, laid out like the values of its
+ * register plan. Only the control thread touches a shadow: reads are merged in when the
+ * acquisition results are consumed and writes go through shadow_write().
+ */
+void shadow_init(struct shadow *shadow, const struct register_plan *plan, int64_t write_interval_ns)
+{
+     *shadow = (struct shadow){0};
+     shadow->plan = plan;
+     shadow->write_interval_ns = write_interval_ns;
+}
+
+void shadow_update(struct shadow *shadow, const uint16_t *values, int64_t now_ns)
+{
+     memcpy(shadow->values, values, shadow->plan->nvalues * sizeof(values[0]));
+     for (size_t i = 0; i < shadow->plan->nvalues; ++i) shadow->read_ns[i] = now_ns;
+}
+
+/* Slot of addr in the plan values and the range holding it, -1 for registers not in the plan */
+static int shadow_slot(const struct shadow *shadow, uint16_t addr, size_t *range, size_t *first)
+{
+     size_t offset = 0;
+
+     for (size_t i = 0; i < shadow->plan->nranges; ++i) {
+	  const struct register_range *r = &shadow->plan->ranges[i];
+
+	  if (addr >= r->addr && addr - r->addr < r->count) {
+	       *range = i;
+	       *first = offset;
+	       return (int)(offset + (size_t)(addr - r->addr));
+	  }
+	  offset += r->count;
+     }
+
+     return -1;
+}
+
+/*
+ * Decides how value gets written to addr: not at all if the device already holds it or a write of
+ * it is still unconfirmed, and not more often than the write interval. Registers in the plan are
+ * written with function 23 together with a readback of their whole range, so the shadow holds the
+ * device's answer right after the write; devices rejecting function 23 get function 6. Returns
+ * SHADOW_ELIDED, SHADOW_DEFERRED or SHADOW_WRITTEN with the request in req; value must outlive it.
+ */
+int shadow_write_request(struct shadow *shadow, uint8_t unit, uint16_t addr, const uint16_t *value, int64_t now_ns,
+			 struct mbtcp_request *req)
+{
+     size_t range = 0, first = 0;
+     int slot = shadow_slot(shadow, addr, &range, &first);
+
+     if (slot >= 0) {
+	  size_t i = (size_t)slot;
+
+	  if (shadow->read_ns[i] && shadow->values[i] == *value && shadow->read_ns[i] >= shadow->written_ns[i]) {
+	       shadow->elided += 1;
+	       return SHADOW_ELIDED;
+	  }
+	  if (shadow->written_ns[i] > shadow->read_ns[i] && shadow->written[i] == *value) {
+	       shadow->elided += 1;
+	       return SHADOW_ELIDED;
+	  }
+	  if (shadow->written_ns[i] && now_ns - shadow->written_ns[i] < shadow->write_interval_ns) {
+	       shadow->deferred += 1;
+	       return SHADOW_DEFERRED;
+	  }
+     }
+
+     if (slot >= 0 && !shadow->write_read_unsupported) {
+	  const struct register_range *r = &shadow->plan->ranges[range];
+	  *req = (struct mbtcp_request){
+	       .function = MBTCP_WRITE_READ_REGISTERS,
+	       .unit = unit,
+	       .addr = r->addr,
+	       .count = r->count,
+	       .values = shadow->values + first,
+	       .write_addr = addr,
+	       .write_count = 1,
+	       .write_values = value,
+	  };
+	  return SHADOW_WRITTEN;
+     }
+
+     *req = (struct mbtcp_request){
+	  .function = MBTCP_WRITE_REGISTER,
+	  .unit = unit,
+	  .write_addr = addr,
+	  .write_count = 1,
+	  .write_values = value,
+     };
+     return SHADOW_WRITTEN;
+}
+
+/*
+ * Takes the outcome of a request from shadow_write_request() asked for at now_ns. Returns 1 when
+ * written, -1 with errno set on failure and 0 when the device rejected function 23, which is not
+ * tried on it again: the write is to be requested anew.
+ */
+int shadow_write_result(struct shadow *shadow, const struct mbtcp_request *req, int64_t now_ns)
+{
+     size_t range = 0, first = 0;
+     int slot = shadow_slot(shadow, req->write_addr, &range, &first);
+
+     if (req->result) {
+	  if (req->function == MBTCP_WRITE_READ_REGISTERS && req->result == EMBXILFUN) {
+	       shadow->write_read_unsupported = 1;
+	       return 0;
+	  }
+	  errno = req->result;
+	  return -1;
+     }
+
+     if (req->function == MBTCP_WRITE_READ_REGISTERS)
+	  for (size_t i = first; i < first + req->count; ++i) shadow->read_ns[i] = req->done_ns;
+
+     if (slot >= 0) {
+	  shadow->written[slot] = req->write_values[0];
+	  shadow->written_ns[slot] = now_ns;
+     }
+     shadow->writes += 1;
+
+     return 1;
+}
+
+/* Writes as shadow_write_request() decides and waits for it. Returns its outcome, -1 with errno set
+ * on failure. */
+int shadow_write(struct shadow *shadow, struct mbtcp *client, uint8_t unit, uint16_t addr, uint16_t value,
+		 int64_t now_ns)
+{
+     struct mbtcp_request req;
+     int rc;
+
+     do {
+	  rc = shadow_write_request(shadow, unit, addr, &value, now_ns, &req);
+	  if (rc != SHADOW_WRITTEN) return rc;
+	  mbtcp_batch(client, &req, 1);
+     } while ((rc = shadow_write_result(shadow, &req, now_ns)) == 0);
+
+     return rc;
+}
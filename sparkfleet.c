@@ -0,0 +1,740 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "powerplay.h"
+
+/*
+  Sparkfleet - sparkshift for many sites in one process
+
+  Usage: sparkfleet FILE
+
+  FILE holds sparkshift settings as KEY=VALUE lines, see sparkshift.c. Lines before the first
+  [SITE] header apply to every site, the lines under a header to that site only, usually its
+  GX_HOST, GX_PORT, EVCS_HOST and EVCS_PORT:
+
+	POWER_EXCESS_MIN=3000
+	AVERAGING_SECS=300
+	SLEEP_SECS=5
+	SPARKSHIFT_DEBUG=0
+	SPARKSHIFT_DRYRUN=0
+
+	[garage-12]
+	GX_HOST=10.8.0.12
+	GX_PORT=502
+	EVCS_HOST=10.8.0.13
+	EVCS_PORT=502
+
+  Each site is controlled the way a sparkshift of its own would, with its own connections,
+  averaging window, decisions and poll period, but all of them run on one thread: every device
+  connection is non-blocking in one epoll set, and the cycles of the sites are spread over their
+  period so they do not all poll at once. Hosts are best given as addresses, a name is resolved
+  on the loop. TELEMETRY_DIR, STATE_FILE, HTTP_PORT and GATEWAY_PORT are not supported.
+
+  The health of every site, its link states, cycles, overruns, cycles without fresh values from
+  every device and the age of its data, is logged after a summary of the loop every
+  IO_STATS_SECS of the first site and on SIGUSR1.
+ */
+
+#define FLEET_SITES_MAX		4096
+#define FLEET_SETTINGS_MAX	64
+#define FLEET_EVENTS		256
+#define FLEET_WRITES_MAX	3
+#define FLEET_NAME_MAX		64
+
+typedef enum {
+     FLEET_IDLE						= 0,
+     FLEET_CONNECTING					= 1,
+     FLEET_READING					= 2,
+     FLEET_WRITING					= 3,
+} fleet_op_t;
+
+struct fleet_write {
+     const char *what;
+     uint16_t addr, value;
+     int charge_start; /* the actuation of charge start changes is traced */
+};
+
+struct fleet_site;
+
+/* One device connection of a site; it does one thing at a time */
+struct fleet_device {
+     struct fleet_site *site;
+     const char *label;
+     char name[FLEET_NAME_MAX];
+     struct modbus_link *link;
+     const struct register_plan *plan;
+     struct shadow *shadow;
+     unsigned flag;
+     size_t charger;
+
+     int fd; /* in the epoll set, -1 if none is */
+     uint32_t events;
+
+     fleet_op_t op;
+     int64_t connect_deadline_ns;
+     struct mbtcp_request reqs[REGISTER_RANGES_MAX];
+     uint16_t values[REGISTER_VALUES_MAX];
+
+     /* What the last cycle asked of a charger, written one after the other */
+     struct fleet_write writes[FLEET_WRITES_MAX];
+     size_t nwrites, written;
+     int64_t write_ns;
+     uint16_t write_value;
+};
+
+struct fleet_site {
+     char *name;
+     struct system_status status;
+     struct controller ctl;
+     struct scheduler sched;
+     struct poll_rate poll;
+     struct fleet_device devices[1 + EVCS_MAX];
+     size_t ndevices;
+
+     /* The reads of the cycle running, by device flag */
+     int cycling;
+     int64_t cycle_ns, deadline_ns;
+     unsigned asked, answered;
+     uint64_t cycles, short_cycles;
+
+     int64_t wake_ns;
+     size_t heap;
+};
+
+struct fleet_setting {
+     char *key, *value;
+};
+
+struct fleet_section {
+     char *name;
+     struct fleet_setting settings[FLEET_SETTINGS_MAX];
+     size_t nsettings;
+};
+
+struct fleet {
+     int epfd;
+     struct logger log;
+
+     struct fleet_site *sites;
+     size_t nsites;
+     /* Sites by the time they next need attention, soonest first */
+     struct fleet_site **heap;
+
+     size_t health_next; /* site the health report continues with, nsites when none is due */
+     int64_t health_ns, busy_ns;
+};
+
+static volatile sig_atomic_t health_requested;
+
+static void health_signal(int sig)
+{
+     (void)sig;
+     health_requested = 1;
+}
+
+static void fleet_heap_swap(struct fleet *fleet, size_t a, size_t b)
+{
+     struct fleet_site *site = fleet->heap[a];
+
+     fleet->heap[a] = fleet->heap[b];
+     fleet->heap[b] = site;
+     fleet->heap[a]->heap = a;
+     fleet->heap[b]->heap = b;
+}
+
+/* Restores the order of the heap after the wake-up time of the site at i changed */
+static void fleet_heap_fix(struct fleet *fleet, size_t i)
+{
+     while (i > 0 && fleet->heap[(i - 1) / 2]->wake_ns > fleet->heap[i]->wake_ns) {
+	  fleet_heap_swap(fleet, i, (i - 1) / 2);
+	  i = (i - 1) / 2;
+     }
+
+     for (;;) {
+	  size_t first = i, left = 2 * i + 1, right = 2 * i + 2;
+
+	  if (left < fleet->nsites && fleet->heap[left]->wake_ns < fleet->heap[first]->wake_ns) first = left;
+	  if (right < fleet->nsites && fleet->heap[right]->wake_ns < fleet->heap[first]->wake_ns) first = right;
+	  if (first == i) break;
+	  fleet_heap_swap(fleet, i, first);
+	  i = first;
+     }
+}
+
+/* Keeps the epoll set in line with the device's socket; closing one took it out of the set */
+static void fleet_device_sync(struct fleet *fleet, struct fleet_device *dev)
+{
+     const struct mbtcp *client = &dev->link->client;
+     struct epoll_event ev = { .events = client->connecting ? EPOLLOUT : EPOLLIN, .data.ptr = dev };
+
+     if (client->fd == -1) {
+	  dev->fd = -1;
+	  return;
+     }
+     if (client->fd == dev->fd && ev.events == dev->events) return;
+
+     if (epoll_ctl(fleet->epfd, client->fd == dev->fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, client->fd, &ev) == -1) {
+	  fprintf(stderr, "Error: could not watch %s connection: %s\n", dev->name, strerror(errno));
+	  fflush(stderr);
+	  return;
+     }
+     dev->fd = client->fd;
+     dev->events = ev.events;
+}
+
+/* The cycle running asked the device for values it has not delivered yet */
+static int fleet_device_pending(const struct fleet_device *dev)
+{
+     const struct fleet_site *site = dev->site;
+
+     return site->cycling && (site->asked & dev->flag) && !(site->answered & dev->flag);
+}
+
+static void fleet_device_done(struct fleet *fleet, struct fleet_device *dev, int64_t now_ns);
+
+/* Reads the device's plan for the cycle running, once it is connected and idle */
+static void fleet_device_read(struct fleet *fleet, struct fleet_device *dev, int64_t now_ns)
+{
+     struct fleet_site *site = dev->site;
+
+     site->asked |= dev->flag;
+     if (dev->op != FLEET_IDLE) return;
+
+     int rc = link_connect_start(dev->link, now_ns);
+     fleet_device_sync(fleet, dev);
+     if (rc == -1) {
+	  site->answered |= dev->flag;
+	  return;
+     }
+     if (rc == 1) {
+	  dev->op = FLEET_CONNECTING;
+	  dev->connect_deadline_ns = now_ns + dev->link->device.timeout_msecs * NSECS_PER_MSEC;
+	  return;
+     }
+
+     size_t n = register_plan_requests(dev->plan->unit, dev->plan, dev->values, dev->reqs);
+     for (size_t i = 0; i < n; ++i) dev->reqs[i].deadline_ns = site->deadline_ns;
+
+     dev->op = FLEET_READING;
+     if (mbtcp_submit(&dev->link->client, dev->reqs, n, now_ns)) fleet_device_done(fleet, dev, now_ns);
+}
+
+/* Starts the next write the last cycle asked for; writes the shadow elides are done right away */
+static void fleet_write_next(struct fleet *fleet, struct fleet_device *dev, int64_t now_ns)
+{
+     struct system_status *status = &dev->site->status;
+
+     while (dev->written < dev->nwrites) {
+	  const struct fleet_write *write = &dev->writes[dev->written];
+
+	  if (!mbtcp_connected(&dev->link->client)) {
+	       fprintf(stderr, "Error: could not set %s %s to %u: %s\n", dev->name, write->what, write->value,
+		       modbus_strerror(ENOTCONN));
+	       fflush(stderr);
+	       dev->written = dev->nwrites;
+	       return;
+	  }
+
+	  dev->write_value = write->value;
+	  int rc = shadow_write_request(dev->shadow, dev->plan->unit, write->addr, &dev->write_value, dev->write_ns,
+					&dev->reqs[0]);
+	  if (rc != SHADOW_WRITTEN) {
+	       if (write->charge_start) actuation_written(&status->evcs[dev->charger].actuation, rc, now_ns);
+	       dev->written += 1;
+	       continue;
+	  }
+
+	  dev->op = FLEET_WRITING;
+	  if (mbtcp_submit(&dev->link->client, dev->reqs, 1, now_ns)) fleet_device_done(fleet, dev, now_ns);
+	  return;
+     }
+}
+
+/* A write failing leaves the rest to the next cycle, as sparkshift does */
+static void fleet_write_done(struct fleet *fleet, struct fleet_device *dev, int64_t now_ns)
+{
+     struct system_status *status = &dev->site->status;
+     const struct fleet_write *write = &dev->writes[dev->written];
+     int rc = shadow_write_result(dev->shadow, &dev->reqs[0], dev->write_ns);
+
+     /* Rejected function 23, asked again with function 6 */
+     if (rc == 0) return;
+
+     if (rc == -1) {
+	  fprintf(stderr, "Error: could not set %s %s to %u: %s\n", dev->name, write->what, write->value,
+		  modbus_strerror(errno));
+	  fflush(stderr);
+	  link_failed(dev->link, now_ns);
+	  dev->written = dev->nwrites;
+	  return;
+     }
+
+     evcs_values_decode(status, dev->charger, dev->shadow->values);
+     if (write->charge_start) actuation_written(&status->evcs[dev->charger].actuation, SHADOW_WRITTEN, now_ns);
+     if (status->config.debug) logger_printf(&fleet->log, "%s: Set %s to: %u\n", dev->name, write->what, write->value);
+     dev->written += 1;
+}
+
+static void fleet_device_done(struct fleet *fleet, struct fleet_device *dev, int64_t now_ns)
+{
+     struct fleet_site *site = dev->site;
+     struct system_status *status = &site->status;
+     fleet_op_t op = dev->op;
+
+     dev->op = FLEET_IDLE;
+
+     if (op == FLEET_READING) {
+	  int err = 0;
+
+	  for (size_t i = 0; i < dev->plan->nranges && !err; ++i) err = dev->reqs[i].result;
+
+	  if (err) {
+	       if (status->config.debug)
+		    logger_printf(&fleet->log, "%s: could not read values: %s\n", dev->name, modbus_strerror(err));
+	       link_failed(dev->link, now_ns);
+	  } else {
+	       link_succeeded(dev->link);
+	       shadow_update(dev->shadow, dev->values, now_ns);
+	       status->fresh |= dev->flag;
+	       if (dev->flag == ACQUIRED_GX) {
+		    gx_values_decode(status, dev->values);
+		    status->gx_updated_ns = now_ns;
+	       } else {
+		    evcs_values_decode(status, dev->charger, dev->values);
+		    status->evcs[dev->charger].updated_ns = now_ns;
+	       }
+	  }
+	  site->answered |= dev->flag;
+     } else if (op == FLEET_WRITING) {
+	  fleet_write_done(fleet, dev, now_ns);
+     }
+     fleet_device_sync(fleet, dev);
+
+     /* A read asked for while busy comes before further writes */
+     if (fleet_device_pending(dev)) fleet_device_read(fleet, dev, now_ns);
+     else fleet_write_next(fleet, dev, now_ns);
+}
+
+/* Carries on with what the device does, once its socket is ready or a deadline may have passed */
+static void fleet_device_run(struct fleet *fleet, struct fleet_device *dev, int ready, int64_t now_ns)
+{
+     struct mbtcp *client = &dev->link->client;
+
+     switch (dev->op) {
+     case FLEET_CONNECTING:
+	  if (!ready && now_ns < dev->connect_deadline_ns) break;
+	  dev->op = FLEET_IDLE;
+	  if (link_connect_finish(dev->link, !ready, now_ns) == -1 && fleet_device_pending(dev))
+	       dev->site->answered |= dev->flag;
+	  fleet_device_sync(fleet, dev);
+	  if (fleet_device_pending(dev)) fleet_device_read(fleet, dev, now_ns);
+	  break;
+     case FLEET_READING:
+     case FLEET_WRITING:
+	  if (!ready && now_ns < mbtcp_deadline(client)) break;
+	  if (mbtcp_poll(client, now_ns)) fleet_device_done(fleet, dev, now_ns);
+	  else fleet_device_sync(fleet, dev);
+	  break;
+     case FLEET_IDLE:
+	  /* Nothing is expected, but a peer closing between cycles shows up here */
+	  if (!ready) break;
+	  mbtcp_poll(client, now_ns);
+	  if (!mbtcp_connected(client) && dev->link->state != LINK_DOWN) link_failed(dev->link, now_ns);
+	  fleet_device_sync(fleet, dev);
+	  break;
+     }
+}
+
+static void fleet_cycle_start(struct fleet *fleet, struct fleet_site *site, int64_t now_ns)
+{
+     /* Reads must not run into the next period */
+     int64_t deadline_ns = site->status.config.deadline_msecs * NSECS_PER_MSEC;
+     if (deadline_ns > site->sched.period_ns) deadline_ns = site->sched.period_ns;
+
+     scheduler_tick(&site->sched, now_ns);
+     site->cycling = 1;
+     site->cycle_ns = now_ns;
+     site->deadline_ns = now_ns + deadline_ns;
+     site->asked = site->answered = 0;
+     site->status.fresh = 0;
+
+     for (size_t d = 0; d < site->ndevices; ++d) fleet_device_read(fleet, &site->devices[d], now_ns);
+}
+
+static void fleet_write_queue(struct fleet_device *dev, const char *what, uint16_t addr, uint16_t value,
+			      int charge_start)
+{
+     addr = register_map_addr(&dev->site->status.evcs_map, addr);
+     dev->writes[dev->nwrites++] = (struct fleet_write){ what, addr, value, charge_start };
+}
+
+/* The control step of sparkshift on what the cycle read, its writes queued on the chargers */
+static void fleet_cycle_end(struct fleet *fleet, struct fleet_site *site, int64_t now_ns)
+{
+     struct system_status *status = &site->status;
+     const struct config *config = &status->config;
+     struct charger_command cmd[EVCS_MAX];
+
+     site->cycling = 0;
+     site->cycles += 1;
+     if (status->fresh != (ACQUIRED_GX | (ACQUIRED_CHARGER(status->nevcs) - ACQUIRED_EVCS)))
+	  site->short_cycles += 1;
+
+     for (size_t c = 0; c < status->nevcs; ++c)
+	  actuation_observe(&status->evcs[c].actuation, &fleet->log, &status->evcs[c],
+			    (status->fresh & ACQUIRED_CHARGER(c)) != 0, site->cycle_ns);
+
+     control_step(&site->ctl, config, status, site->cycle_ns, cmd);
+
+     for (size_t c = 0; c < status->nevcs; ++c) {
+	  struct fleet_device *dev = &site->devices[1 + c];
+
+	  if (cmd[c].decision) {
+	       actuation_decided(&status->evcs[c].actuation, site->ctl.charger[c].charge_start, site->cycle_ns);
+	       if (config->debug) logger_printf(&fleet->log, "%s: %s\n", dev->name, cmd[c].decision);
+	  }
+	  if (config->dryrun || dev->op != FLEET_IDLE) continue;
+
+	  dev->nwrites = dev->written = 0;
+	  dev->write_ns = now_ns;
+	  if (cmd[c].write_charge_start)
+	       fleet_write_queue(dev, "charge start", EVCS_REGISTER_CHARGE_START, (uint16_t)cmd[c].charge_start, 1);
+	  if (cmd[c].write_current)
+	       fleet_write_queue(dev, "charging current", EVCS_REGISTER_CHARGING_CURRENT, cmd[c].current, 0);
+	  if (cmd[c].write_auto) {
+	       if (config->debug) logger_printf(&fleet->log, "%s: Manual and disconnected - change to Auto\n", dev->name);
+	       fleet_write_queue(dev, "charge mode", EVCS_REGISTER_CHARGE_MODE, EVCS_CHARGE_MODE_AUTO, 0);
+	  }
+	  fleet_write_next(fleet, dev, now_ns);
+     }
+
+     int64_t period_ns = poll_rate_period(&site->poll, config, status, site->ctl.charger, site->cycle_ns);
+     if (period_ns != site->sched.period_ns) scheduler_period_set(&site->sched, period_ns);
+     scheduler_next(&site->sched, now_ns);
+}
+
+/* When the site next needs attention: its next cycle or the end of the one running, or a deadline
+ * of one of its devices */
+static int64_t fleet_site_wake(const struct fleet_site *site)
+{
+     int64_t wake_ns = site->cycling ? site->deadline_ns : site->sched.next_ns;
+
+     for (size_t d = 0; d < site->ndevices; ++d) {
+	  const struct fleet_device *dev = &site->devices[d];
+	  int64_t deadline_ns = INT64_MAX;
+
+	  if (dev->op == FLEET_CONNECTING) deadline_ns = dev->connect_deadline_ns;
+	  else if (dev->op != FLEET_IDLE) deadline_ns = mbtcp_deadline(&dev->link->client);
+	  if (deadline_ns < wake_ns) wake_ns = deadline_ns;
+     }
+
+     return wake_ns;
+}
+
+static void fleet_site_run(struct fleet *fleet, struct fleet_site *site, int64_t now_ns)
+{
+     for (size_t d = 0; d < site->ndevices; ++d) fleet_device_run(fleet, &site->devices[d], 0, now_ns);
+
+     if (!site->cycling && now_ns >= site->sched.next_ns) fleet_cycle_start(fleet, site, now_ns);
+     if (site->cycling && (site->answered == site->asked || now_ns >= site->deadline_ns))
+	  fleet_cycle_end(fleet, site, now_ns);
+
+     site->wake_ns = fleet_site_wake(site);
+     fleet_heap_fix(fleet, site->heap);
+}
+
+static void fleet_site_health(struct fleet *fleet, const struct fleet_site *site, int64_t now_ns)
+{
+     const struct system_status *status = &site->status;
+     char line[LOG_LINE_MAX];
+     size_t len = 0;
+     unsigned wanted = 0;
+
+     len = line_printf(line, len, "%s:", site->name);
+     for (size_t d = 0; d < site->ndevices; ++d)
+	  len = line_printf(line, len, " %s %s", site->devices[d].label, link_state_str(site->devices[d].link->state));
+     for (size_t c = 0; c < status->nevcs; ++c) wanted += site->ctl.charger[c].charge_start == EVCS_CHARGING_START;
+
+     if (status->gx_updated_ns)
+	  len = line_printf(line, len, ", data %.1fs old", (double)(now_ns - status->gx_updated_ns) / (double)NSECS_PER_SEC);
+     else
+	  len = line_printf(line, len, ", no data");
+     line_printf(line, len, ", %" PRIu64 " cycles, %" PRIu64 " short, %" PRIu64 " overruns, late by at most %.1fms, mean excess %d W, "
+		 "charging wanted on %u of %zu\n", site->cycles, site->short_cycles, site->sched.overruns,
+		 (double)site->sched.jitter_max_ns / (double)NSECS_PER_MSEC, site->ctl.excess_mean, wanted, status->nevcs);
+
+     logger_printf(&fleet->log, "%s", line);
+}
+
+/* Starts a health report: the summary now, the sites a few at a time as the log ring has room */
+static void fleet_health_start(struct fleet *fleet, int64_t now_ns)
+{
+     size_t states[LINK_DEGRADED + 1] = {0};
+     uint64_t cycles = 0, short_cycles = 0, overruns = 0;
+     int64_t late_ns = 0;
+
+     for (size_t s = 0; s < fleet->nsites; ++s) {
+	  const struct fleet_site *site = &fleet->sites[s];
+
+	  for (size_t d = 0; d < site->ndevices; ++d) states[site->devices[d].link->state] += 1;
+	  cycles += site->cycles;
+	  short_cycles += site->short_cycles;
+	  overruns += site->sched.overruns;
+	  if (site->sched.jitter_max_ns > late_ns) late_ns = site->sched.jitter_max_ns;
+     }
+
+     logger_printf(&fleet->log, "Fleet: %zu sites, links %zu up %zu degraded %zu down, %" PRIu64 " cycles, %" PRIu64 " short, "
+		   "%" PRIu64 " overruns, late by at most %.1fms, loop busy %.1f%%\n", fleet->nsites,
+		   states[LINK_UP], states[LINK_DEGRADED], states[LINK_DOWN] + states[LINK_CONNECTING],
+		   cycles, short_cycles, overruns, (double)late_ns / (double)NSECS_PER_MSEC,
+		   now_ns > fleet->health_ns ? 100.0 * (double)fleet->busy_ns / (double)(now_ns - fleet->health_ns) : 0.0);
+
+     fleet->health_ns = now_ns;
+     fleet->busy_ns = 0;
+     fleet->health_next = 0;
+}
+
+static void fleet_health_continue(struct fleet *fleet, int64_t now_ns)
+{
+     const struct ring *ring = &fleet->log.ring;
+
+     while (fleet->health_next < fleet->nsites
+	    && ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) < ring->capacity / 2)
+	  fleet_site_health(fleet, &fleet->sites[fleet->health_next++], now_ns);
+}
+
+/* The file's settings per section, the first section holding those before any header */
+static int fleet_file_load(const char *path, struct fleet_section **sections, size_t *nsections)
+{
+     char line[512];
+     size_t lineno = 0;
+     struct fleet_section *section;
+
+     *nsections = 0;
+     *sections = calloc(FLEET_SITES_MAX + 1, sizeof(**sections));
+     if (*sections == NULL) {
+	  fprintf(stderr, "Error: could not allocate fleet configuration\n");
+	  goto error;
+     }
+     section = &(*sections)[(*nsections)++];
+
+     FILE *file = fopen(path, "r");
+     if (file == NULL) {
+	  fprintf(stderr, "Error: could not open fleet file %s: %s\n", path, strerror(errno));
+	  goto error;
+     }
+
+     while (fgets(line, sizeof(line), file)) {
+	  char *key = line + strspn(line, " \t"), *value;
+
+	  lineno += 1;
+	  if (*key == '[') {
+	       char *end = strchr(key, ']');
+	       if (end == NULL || end == key + 1) {
+		    fprintf(stderr, "Error: %s:%zu: expected [SITE]\n", path, lineno);
+		    goto error_file;
+	       }
+	       if (*nsections == FLEET_SITES_MAX + 1) {
+		    fprintf(stderr, "Error: %s:%zu: more than %d sites\n", path, lineno, FLEET_SITES_MAX);
+		    goto error_file;
+	       }
+	       *end = '\0';
+	       section = &(*sections)[(*nsections)++];
+	       section->name = strdup(key + 1);
+	       continue;
+	  }
+
+	  int rc = config_line_parse(line, &key, &value);
+	  if (rc == 0) continue;
+	  if (rc == -1) {
+	       fprintf(stderr, "Error: %s:%zu: expected KEY=VALUE\n", path, lineno);
+	       goto error_file;
+	  }
+	  if (section->nsettings == FLEET_SETTINGS_MAX) {
+	       fprintf(stderr, "Error: %s:%zu: more than %d settings\n", path, lineno, FLEET_SETTINGS_MAX);
+	       goto error_file;
+	  }
+	  section->settings[section->nsettings].key = strdup(key);
+	  section->settings[section->nsettings].value = strdup(value);
+	  section->nsettings += 1;
+     }
+
+     fclose(file);
+     return 0;
+
+error_file:
+     fclose(file);
+error:
+     fflush(stderr);
+     return -1;
+}
+
+static void fleet_section_setenv(const struct fleet_section *section)
+{
+     for (size_t i = 0; i < section->nsettings; ++i) setenv(section->settings[i].key, section->settings[i].value, 1);
+}
+
+static void fleet_section_unsetenv(const struct fleet_section *section)
+{
+     for (size_t i = 0; i < section->nsettings; ++i) unsetenv(section->settings[i].key);
+}
+
+/* A site configured as sparkshift is from the environment, the common settings and its own set */
+static int fleet_site_init(struct fleet_site *site, const struct fleet_section *common,
+			   const struct fleet_section *section, int64_t now_ns)
+{
+     struct system_status *status = &site->status;
+     struct config *config = &status->config;
+
+     site->name = section->name;
+     fleet_section_setenv(common);
+     fleet_section_setenv(section);
+     int rc = config_from_env(config);
+     fleet_section_unsetenv(section);
+     if (rc) goto error;
+
+     config->gx.host = strdup(config->gx.host);
+     for (size_t c = 0; c < config->nevcs; ++c) config->evcs[c].host = strdup(config->evcs[c].host);
+
+     if (system_status_init(status)) goto error;
+     if (controller_init(&site->ctl, config, now_ns)) goto error;
+     scheduler_init(&site->sched, config->period_ns, config->schedule_policy);
+     poll_rate_init(&site->poll, config);
+
+     site->ndevices = 1 + status->nevcs;
+     for (size_t d = 0; d < site->ndevices; ++d) {
+	  struct fleet_device *dev = &site->devices[d];
+	  struct modbus_link *link = d ? &status->evcs[d - 1].link : &status->gx_link;
+
+	  dev->site = site;
+	  dev->link = link;
+	  dev->label = link->name;
+	  dev->fd = -1;
+	  snprintf(dev->name, sizeof(dev->name), "%s %s", site->name, dev->label);
+	  link->name = dev->name;
+
+	  if (d == 0) {
+	       dev->plan = &status->gx_plan;
+	       dev->shadow = &status->gx_shadow;
+	       dev->flag = ACQUIRED_GX;
+	  } else {
+	       dev->plan = &status->evcs[d - 1].plan;
+	       dev->shadow = &status->evcs[d - 1].shadow;
+	       dev->flag = ACQUIRED_CHARGER(d - 1);
+	       dev->charger = d - 1;
+	  }
+     }
+
+     return 0;
+
+error:
+     fprintf(stderr, "Error: site %s not configured\n", section->name);
+     fflush(stderr);
+     return -1;
+}
+
+int main(int argc, char **argv)
+{
+     static struct fleet fleet;
+     struct fleet_section *sections;
+     size_t nsections;
+
+     if (argc != 2) {
+	  fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+	  return 1;
+     }
+     if (fleet_file_load(argv[1], &sections, &nsections)) return 1;
+     if (nsections < 2) {
+	  fprintf(stderr, "Error: %s configures no [SITE]\n", argv[1]);
+	  return 1;
+     }
+
+     fleet.nsites = nsections - 1;
+     fleet.sites = calloc(fleet.nsites, sizeof(fleet.sites[0]));
+     fleet.heap = calloc(fleet.nsites, sizeof(fleet.heap[0]));
+     if (fleet.sites == NULL || fleet.heap == NULL) {
+	  fprintf(stderr, "Error: could not allocate %zu sites\n", fleet.nsites);
+	  return 1;
+     }
+
+     int64_t now_ns = monotonic_ns();
+     for (size_t s = 0; s < fleet.nsites; ++s)
+	  if (fleet_site_init(&fleet.sites[s], &sections[0], &sections[1 + s], now_ns)) return 1;
+
+     fleet.epfd = epoll_create1(EPOLL_CLOEXEC);
+     if (fleet.epfd == -1) {
+	  fprintf(stderr, "Error: could not create epoll set: %s\n", strerror(errno));
+	  return 1;
+     }
+
+     struct sigaction sa = { .sa_handler = health_signal, .sa_flags = SA_RESTART };
+     sigaction(SIGUSR1, &sa, NULL);
+
+     if (logger_start(&fleet.log, NULL, NULL, NULL)) return 1;
+     report_sink_set(logger_report, &fleet.log);
+
+     /* The first cycles are spread over the period so the sites do not poll in lockstep */
+     now_ns = monotonic_ns();
+     for (size_t s = 0; s < fleet.nsites; ++s) {
+	  struct fleet_site *site = &fleet.sites[s];
+
+	  site->sched.next_ns = now_ns + site->sched.period_ns * (int64_t)s / (int64_t)fleet.nsites;
+	  site->wake_ns = site->sched.next_ns;
+	  site->heap = s;
+	  fleet.heap[s] = site;
+     }
+
+     const struct config *config = &fleet.sites[0].status.config;
+     printf("Controlling %zu sites\n", fleet.nsites);
+     if (config->dryrun) printf("Dry run configure - ignoring all actions\n");
+     fflush(stdout);
+
+     fleet.health_next = fleet.nsites;
+     fleet.health_ns = now_ns;
+     int64_t woken_ns = now_ns;
+     uint64_t head = fleet.log.ring.head;
+
+     for (;;) {
+	  struct epoll_event events[FLEET_EVENTS];
+
+	  now_ns = monotonic_ns();
+	  while (fleet.heap[0]->wake_ns <= now_ns) fleet_site_run(&fleet, fleet.heap[0], now_ns);
+
+	  if (health_requested || (config->io_stats_secs
+				   && now_ns - fleet.health_ns >= config->io_stats_secs * NSECS_PER_SEC)) {
+	       health_requested = 0;
+	       fleet_health_start(&fleet, now_ns);
+	  }
+	  fleet_health_continue(&fleet, now_ns);
+	  if (fleet.log.ring.head != head) {
+	       head = fleet.log.ring.head;
+	       logger_wake(&fleet.log);
+	  }
+
+	  /* A report in progress comes back as soon as the log thread made room */
+	  int64_t wait_ns = fleet.heap[0]->wake_ns - now_ns;
+	  int timeout_ms = fleet.health_next < fleet.nsites ? 1
+	       : (int)((wait_ns + NSECS_PER_MSEC - 1) / NSECS_PER_MSEC);
+
+	  fleet.busy_ns += now_ns - woken_ns;
+	  int n = epoll_wait(fleet.epfd, events, FLEET_EVENTS, timeout_ms);
+	  woken_ns = monotonic_ns();
+	  if (n == -1 && errno != EINTR) {
+	       fprintf(stderr, "Error: could not wait for events: %s\n", strerror(errno));
+	       return 1;
+	  }
+
+	  for (int i = 0; i < n; ++i) {
+	       struct fleet_device *dev = events[i].data.ptr;
+
+	       fleet_device_run(&fleet, dev, 1, woken_ns);
+	       fleet_site_run(&fleet, dev->site, woken_ns);
+	  }
+     }
+}
@@ -1,6 +1,9 @@
 #include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
 #include <stdio.h>
-#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "powerplay.h"
 
@@ -12,82 +15,380 @@
 
   EVCS_HOST		: IP address of EVCS device
   ECVS_PORT		: Modbus TCP port of EVCS device
+  EVCS2_HOST ...	: Optional, further chargers sharing the excess as EVCS2_HOST/EVCS2_PORT
+			  up to EVCS4_HOST/EVCS4_PORT
+  EVCS_PRIORITY ...	: Optional, order chargers are served in, lower first (default the
+			  order they are configured in), EVCS2_PRIORITY etc. for further chargers
+  EVCS_SHARING		: Optional, priority serves chargers in priority order up to their
+			  maximum, fair splits the excess evenly between the cars connected
+			  (default priority)
 
   POWER_EXCESS_MIN	: Minimum excess power to start charging
 
   AVERAGING_SECS	: Seconds to average excess power over
-  SLEEP_SECS		: Seconds to sleep in control loop
+  HOLD_SECS		: Optional, minimum seconds between charge decisions (default 30)
+  SLEEP_SECS		: Control loop period in seconds, fractions allowed (e.g. 0.5)
+  SCHEDULE_POLICY	: Optional, skip or catchup missed periods after an overrun (default skip)
+  POLL_MIN_SECS		: Optional, period while a decision or actuation is close (default SLEEP_SECS)
+  POLL_MAX_SECS		: Optional, period while there is no PV or no car to charge (default SLEEP_SECS)
+  POLL_NEAR_WATTS	: Optional, distance of the mean excess from POWER_EXCESS_MIN that counts
+			  as close to a decision (default 1000)
+  POLL_BOOST_SECS	: Optional, seconds to poll fast after a car was connected (default 60)
+
+  DECISION_MODE		: Optional, mean starts and stops charging on the excess averaged over
+			  AVERAGING_SECS, forecast also as soon as the excess forecast
+			  FORECAST_SECS ahead is clearly above or below POWER_EXCESS_MIN (default mean)
+  FORECAST_SECS		: Optional, horizon of the excess forecast (default 120)
+  FORECAST_SMOOTHING_SECS: Optional, time constant of the forecast level, the trend takes twice
+			  as long (default 60)
+
+  CONTROL_MODE		: Optional, switch only starts and stops charging on the averaged excess,
+			  modulate also sets the charging current to the excess every period
+			  while charging (default switch)
+  EVCS_PHASES		: Optional, phases the car charges on, 1 or 3 (default 3)
+  CURRENT_MIN_AMPS	: Optional, lowest charging current set when modulating (default 6)
+  CURRENT_SLEW_AMPS	: Optional, maximum current change per second when modulating (default 2)
+  CURRENT_DEADBAND_WATTS: Optional, excess error tolerated before changing the current (default 300)
+
+  DEADLINE_MSECS	: Optional, time to wait for device reads per cycle (default 2000)
+  STALE_SECS		: Optional, maximum age of EVCS values used for a sample (default 10)
+
+  GX_TIMEOUT_MSECS	: Optional, Modbus response and connect timeout for the GX (default 5000)
+  EVCS_TIMEOUT_MSECS	: Optional, Modbus response and connect timeout for the EVCS (default 5000)
+  GX_PIPELINE_DEPTH	: Optional, Modbus requests kept in flight on the GX connection (default 1)
+  EVCS_PIPELINE_DEPTH	: Optional, Modbus requests kept in flight on the EVCS connection (default 1)
+
+  TELEMETRY_DIR		: Optional, directory for the binary telemetry store; the per-cycle status
+			  line is then only printed in debug mode
+
+  REGISTER_GAP_MAX	: Optional, unused registers tolerated between merged reads (default 8)
+  REGISTER_MAP		: Optional, register map written by regscan with the unit ids and register
+			  addresses of the devices, e.g. after a firmware update moved one
+  WRITE_INTERVAL_MSECS	: Optional, minimum time between writes to the same register (default 1000)
+  STATE_FILE		: Optional, file the control state is checkpointed to every cycle and
+			  restored from at startup, e.g. in /run
+  STATE_MAX_AGE_SECS	: Optional, oldest checkpoint restored (default 120)
+
+  SPARKSHIFT_CONFIG	: Optional, file of KEY=VALUE lines setting any of the above; read at
+			  startup and again on SIGHUP, which applies all but the device, telemetry,
+			  state, HTTP and gateway settings without reconnecting
+
+  IO_STATS_SECS		: Optional, seconds between Modbus request statistics in the log, 0 to
+			  only print them on SIGUSR1 (default 3600)
+
+  HTTP_PORT		: Optional, serve the latest status as JSON on /status and in Prometheus
+			  text format on /metrics
+  HTTP_ADDR		: Optional, address the HTTP listener binds to (default 127.0.0.1)
+
+  GATEWAY_PORT		: Optional, serve the GX as a caching Modbus TCP gateway on this port and
+			  the chargers on the ports following it
+  GATEWAY_ADDR		: Optional, address the gateway binds to (default 127.0.0.1)
+  GATEWAY_MAX_AGE_MSECS	: Optional, oldest polled values the gateway answers reads with, older
+			  values and registers not polled are read from the device (default 5000)
+  GX_CACHE_REGISTERS	: Optional, further GX registers to poll for the gateway every cycle,
+			  e.g. 840-846,851
+  EVCS_CACHE_REGISTERS	: Optional, further registers to poll on every charger
 
  */
 
 
+static volatile sig_atomic_t io_stats_requested;
+static volatile sig_atomic_t reload_requested;
+
+static void io_stats_signal(int sig)
+{
+     (void)sig;
+     io_stats_requested = 1;
+}
+
+static void reload_signal(int sig)
+{
+     (void)sig;
+     reload_requested = 1;
+}
+
+static int config_str_differs(const char *a, const char *b)
+{
+     if (a == NULL || b == NULL) return a != b;
+     return strcmp(a, b) != 0;
+}
+
+static int config_device_differs(const struct modbus_device *a, const struct modbus_device *b)
+{
+     return config_str_differs(a->host, b->host) || a->port != b->port
+	  || a->timeout_msecs != b->timeout_msecs || a->pipeline_depth != b->pipeline_depth;
+}
+
+/*
+ * Rereads the configuration on SIGHUP. The devices, their register plans, the telemetry store,
+ * the state file and the HTTP listener stay as started, everything else applies from the next
+ * cycle on with the connections, the averaging window and the decisions so far kept. A
+ * configuration that does not parse leaves the running one untouched.
+ */
+static void config_reload(struct system_status *status, struct controller *ctl, struct scheduler *sched,
+			  struct logger *log, const char *path)
+{
+     struct config *config = &status->config;
+     struct config next = {0};
+     int fixed = 0;
+
+     if (path && config_file_load(path)) goto error;
+     if (config_from_env(&next)) goto error;
+
+     fixed |= next.nevcs != config->nevcs || config_device_differs(&next.gx, &config->gx);
+     for (size_t c = 0; c < config->nevcs && c < next.nevcs; ++c)
+	  fixed |= config_device_differs(&next.evcs[c], &config->evcs[c]);
+     fixed |= next.register_gap_max != config->register_gap_max
+	  || next.ngx_cache_registers != config->ngx_cache_registers
+	  || memcmp(next.gx_cache_registers, config->gx_cache_registers, sizeof(config->gx_cache_registers))
+	  || next.nevcs_cache_registers != config->nevcs_cache_registers
+	  || memcmp(next.evcs_cache_registers, config->evcs_cache_registers, sizeof(config->evcs_cache_registers))
+	  || config_str_differs(next.register_map, config->register_map)
+	  || config_str_differs(next.gateway_addr, config->gateway_addr) || next.gateway_port != config->gateway_port
+	  || next.gateway_max_age_msecs != config->gateway_max_age_msecs
+	  || config_str_differs(next.telemetry_dir, config->telemetry_dir)
+	  || config_str_differs(next.state_file, config->state_file)
+	  || config_str_differs(next.http_addr, config->http_addr) || next.http_port != config->http_port;
+
+     next.gx = config->gx;
+     for (size_t c = 0; c < EVCS_MAX; ++c) next.evcs[c] = config->evcs[c];
+     next.nevcs = config->nevcs;
+     next.register_gap_max = config->register_gap_max;
+     memcpy(next.gx_cache_registers, config->gx_cache_registers, sizeof(next.gx_cache_registers));
+     next.ngx_cache_registers = config->ngx_cache_registers;
+     memcpy(next.evcs_cache_registers, config->evcs_cache_registers, sizeof(next.evcs_cache_registers));
+     next.nevcs_cache_registers = config->nevcs_cache_registers;
+     next.register_map = config->register_map;
+     next.gateway_addr = config->gateway_addr;
+     next.gateway_port = config->gateway_port;
+     next.gateway_max_age_msecs = config->gateway_max_age_msecs;
+     next.telemetry_dir = config->telemetry_dir;
+     next.state_file = config->state_file;
+     next.http_addr = config->http_addr;
+     next.http_port = config->http_port;
+
+     if (controller_reconfigure(ctl, &next)) goto error;
+
+     int64_t write_interval_ns = next.write_interval_msecs * NSECS_PER_MSEC;
+     status->gx_shadow.write_interval_ns = write_interval_ns;
+     for (size_t c = 0; c < status->nevcs; ++c) status->evcs[c].shadow.write_interval_ns = write_interval_ns;
+     sched->policy = (schedule_policy_t)next.schedule_policy;
+
+     *config = next;
+     logger_printf(log, "Configuration reloaded\n");
+     if (fixed) logger_printf(log, "Device, telemetry, state, HTTP and gateway settings unchanged until restart\n");
+     return;
+
+error:
+     logger_printf(log, "Error: configuration not reloaded, keeping the running one\n");
+}
+
+static void status_line_log(struct logger *log, const struct system_status *status, const struct controller *ctl)
+{
+     char line[LOG_LINE_MAX];
+     size_t len = 0;
+
+     for (size_t c = 0; c < status->nevcs; ++c)
+	  len = line_printf(line, len, "M/%c S/%c C/%d D/%u ",
+			    get_charging_mode_char(status->evcs[c].charging_mode),
+			    get_charger_status_char(status->evcs[c].charger_status),
+			    status->evcs[c].charge_start,
+			    ctl->charger[c].charge_start);
+     if (status->config.decision_mode == DECISION_FORECAST)
+	  len = line_printf(line, len, "F/%7d FB/%6d ", ctl->forecasting ? ctl->excess_forecast : 0,
+			    ctl->forecasting ? ctl->forecast_bound : 0);
+     line_printf(line, len, "R/%4" PRId64 " A/%7d X/%7d G/%7d B/%7d P/%7d C/%7d E/%7d BS/%3d ES/%3d\n",
+		 (int64_t)ctl->excess.count,
+		 ctl->excess_mean,
+		 status->power_excess, status->power_grid, status->power_battery,
+		 status->power_pv, status->power_consumption, status->power_evcs,
+		 status->soc_battery, status->soc_ev);
+
+     logger_printf(log, "%s", line);
+}
+
+/* Writes what the control step asked of one charger, errors leave it to the next cycle */
+static void charger_apply(struct system_status *status, struct logger *log, size_t charger,
+			  const struct charger_command *cmd)
+{
+     const struct evcs_charger *evcs = &status->evcs[charger];
+     const char *name = evcs->link.name;
+     int debug = status->config.debug;
+
+     /* Writes go through the EVCS shadow, which elides values the charger already holds and
+      * reads the registers back with the write */
+     if (cmd->write_charge_start) {
+	  int rc = evcs_charging_start_set(status, charger, cmd->charge_start);
+	  if (rc == -1) return;
+	  actuation_written(&status->evcs[charger].actuation, rc, monotonic_ns());
+	  if (rc == SHADOW_WRITTEN && debug)
+	       logger_printf(log, "%s: Set charge start to: %u, reads back %u\n", name, cmd->charge_start,
+			     evcs->charge_start);
+     }
+
+     if (cmd->write_current) {
+	  int rc = evcs_charging_current_set(status, charger, cmd->current);
+	  if (rc == -1) return;
+	  if (rc == SHADOW_WRITTEN && debug)
+	       logger_printf(log, "%s: Set charging current to: %u, reads back %u\n", name, cmd->current,
+			     evcs->charging_current);
+     }
+
+     if (cmd->write_auto) {
+	  if (debug) logger_printf(log, "%s: Manual and disconnected - change to Auto\n", name);
+	  evcs_charge_mode_set(status, charger, EVCS_CHARGE_MODE_AUTO);
+     }
+}
+
 int main(void)
 {
      struct system_status current = {0};
+     const char *config_file = getenv("SPARKSHIFT_CONFIG");
+     if (config_file && config_file_load(config_file)) return 1;
      if (config_from_env(&current.config)) return 1;
+     if (system_status_init(&current)) return 1;
+
+     /* Installed before any thread starts, so none of them dies of an early signal */
+     struct sigaction sa = { .sa_handler = io_stats_signal, .sa_flags = SA_RESTART };
+     sigaction(SIGUSR1, &sa, NULL);
+     sa.sa_handler = reload_signal;
+     sigaction(SIGHUP, &sa, NULL);
+
+     /* Devices connect lazily and in parallel from their acquisition workers, a device that is
+      * away at startup is retried with backoff instead of ending the service */
+     static struct acquisition acq;
+     if (acquisition_start(&acq, &current)) return 1;
 
-     if (modbus_device_connect(current.config.evcs, &current.evcs_ctx)) return 1;
-     if (modbus_device_connect(current.config.gx, &current.gx_ctx)) return 1;
+     static struct telemetry tlm;
+     if (current.config.telemetry_dir && telemetry_open(&tlm, current.config.telemetry_dir)) return 1;
 
-     if (system_status_update(&current)) return 1;
+     /* Scrapers only ever read the published snapshot, never the live status */
+     static struct snapshot snap;
+     static struct http_server http;
+     if (current.config.http_port
+	 && http_start(&http, &snap, current.config.http_addr, current.config.http_port)) return 1;
+
+     /* Local tools read the devices through the connections sparkshift holds anyway */
+     static struct gateway gw;
+     if (current.config.gateway_port && gateway_start(&gw, &current)) return 1;
+
+     /* From here on the control loop only queues its output, the log thread writes it */
+     static struct logger log;
+     if (logger_start(&log, current.config.telemetry_dir ? &tlm : NULL, &current,
+		      current.config.gateway_port ? &gw : NULL)) return 1;
+     report_sink_set(logger_report, &log);
 
      if (current.config.dryrun) printf("Dry run configure - ignoring all actions\n");
 
-     /* Initialize desired state with current charging state as we do not yet have a reason to
-      * change without collecting stats */
-     evcs_charging_start_t charge_start = current.evcs_charge_start;
-     int64_t power_excess_accum = 0;
-     int64_t rounds = 0;
+     struct scheduler sched;
+     scheduler_init(&sched, current.config.period_ns, current.config.schedule_policy);
+     int64_t cycle_ns = sched.next_ns;
+     int64_t stats_ns = cycle_ns;
+     int64_t io_stats_ns = cycle_ns;
+
+     static struct controller ctl;
+     if (controller_init(&ctl, &current.config, cycle_ns)) return 1;
+
+     /* A restored window lets the first cycle decide instead of waiting AVERAGING_SECS */
+     static struct state state = { .fd = -1 };
+     if (current.config.state_file) {
+	  if (state_open(&state, current.config.state_file)) return 1;
+	  state_restore(&state, &current.config, &ctl, &current);
+     }
+
+     struct poll_rate poll;
+     poll_rate_init(&poll, &current.config);
 
      for(size_t i = 0;; ++i) {
-	  int64_t power_excess_mean;
-
-	  if (system_status_update(&current)) goto next;
-
-	  rounds += 1;
-	  power_excess_accum += current.power_excess;
-	  power_excess_mean = power_excess_accum / rounds;
-
-	  printf("M/%c S/%c C/%d D/%u R/%4ld A/%7ld X/%7d G/%7d B/%7d P/%7d C/%7d E/%7d BS/%3d ES/%3d\n",
-		 get_charging_mode_char(current.evcs_charging_mode),
-		 get_charger_status_char(current.evcs_charger_status),
-		 current.evcs_charge_start,
-		 charge_start,
-		 rounds,
-		 power_excess_mean,
-		 current.power_excess, current.power_grid, current.power_battery,
-		 current.power_pv, current.power_consumption, current.power_evcs,
-		 current.soc_battery, current.soc_ev);
-
-	  if (current.config.averaging_secs <= (rounds * current.config.sleep_secs)) {
-	       rounds = 0;
-	       power_excess_accum = 0;
-
-	       if (power_excess_mean > current.config.power_excess_min) {
-		    if (current.config.debug) printf("High excess power - want charging\n");
-		    charge_start = EVCS_CHARGING_START;
-	       } else {
-		    if (current.config.debug) printf("Low excess power - refuse charging\n");
-		    charge_start = EVCS_CHARGING_STOP;
+	  struct charger_command cmd[EVCS_MAX];
+
+	  if (reload_requested) {
+	       reload_requested = 0;
+	       config_reload(&current, &ctl, &sched, &log, config_file);
+	  }
+
+	  /* Reads must not run into the next period */
+	  int64_t deadline_ns = current.config.deadline_msecs * NSECS_PER_MSEC;
+	  if (deadline_ns > sched.period_ns) deadline_ns = sched.period_ns;
+
+	  acquisition_cycle(&acq, &current, cycle_ns + deadline_ns);
+	  if (current.config.debug)
+	       for (size_t w = 0; w < acq.nworkers; ++w)
+		    if (acq.missed & acq.workers[w].flag)
+			 logger_printf(&log, "%s missed cycle deadline\n", acq.workers[w].name);
+	  for (size_t c = 0; c < current.nevcs; ++c)
+	       actuation_observe(&current.evcs[c].actuation, &log, &current.evcs[c],
+				 (current.fresh & ACQUIRED_CHARGER(c)) != 0, cycle_ns);
+
+	  control_step(&ctl, &current.config, &current, cycle_ns, cmd);
+	  for (size_t c = 0; c < current.nevcs; ++c)
+	       if (cmd[c].decision) actuation_decided(&current.evcs[c].actuation, ctl.charger[c].charge_start, cycle_ns);
+
+	  if (ctl.sampled) {
+	       if (current.config.telemetry_dir) {
+		    struct telemetry_record rec;
+		    telemetry_record_fill(&rec, &current, ctl.excess_mean, ctl.charger);
+		    logger_telemetry(&log, &rec);
+	       }
+
+	       if (!current.config.telemetry_dir || current.config.debug) status_line_log(&log, &current, &ctl);
+
+	       if (current.config.debug && cycle_ns - stats_ns >= current.config.averaging_secs * NSECS_PER_SEC) {
+		    logger_stats(&log, &sched, 0);
+		    stats_ns = cycle_ns;
 	       }
 	  }
 
-	  if (current.config.dryrun) goto next;
+	  for (size_t c = 0; c < current.nevcs; ++c) {
+	       if (current.config.debug && cmd[c].decision)
+		    logger_printf(&log, "%s: %s\n", current.evcs[c].link.name, cmd[c].decision);
+	       if (!current.config.dryrun) charger_apply(&current, &log, c, &cmd[c]);
+	  }
+
+	  if (current.config.gateway_port) {
+	       gateway_publish(&gw, &current);
+	       gateway_forward(&gw, &current, &acq);
+	  }
 
-	  if (current.evcs_charging_mode == EVCS_CHARGE_MODE_AUTO
-	      && current.evcs_charge_start != charge_start) {
-	       if (current.config.debug) printf("Setting charge start to: %u\n", charge_start);
-	       if (evcs_charging_start_set(&current, charge_start)) goto next;
+	  if (io_stats_requested || (current.config.io_stats_secs
+				     && cycle_ns - io_stats_ns >= current.config.io_stats_secs * NSECS_PER_SEC)) {
+	       io_stats_requested = 0;
+	       io_stats_ns = cycle_ns;
+	       logger_stats(&log, &sched, 1);
 	  }
 
-	  if (current.evcs_charging_mode == EVCS_CHARGE_MODE_MANUAL
-	      && current.evcs_charger_status == EVCS_CHARGER_STATUS_DISCONNECTED) {
-	       if (current.config.debug) printf("Manual and disconnected - change to Auto\n");
-	       if (evcs_charge_mode_set(&current, EVCS_CHARGE_MODE_AUTO)) goto next;
+	  if (state.image) state_save(&state, &ctl, &current);
+
+	  int64_t period_ns = poll_rate_period(&poll, &current.config, &current, ctl.charger, cycle_ns);
+	  if (period_ns != sched.period_ns) {
+	       if (current.config.debug)
+		    logger_printf(&log, "Poll period %.3fs -> %.3fs\n", (double)sched.period_ns / (double)NSECS_PER_SEC,
+				  (double)period_ns / (double)NSECS_PER_SEC);
+	       scheduler_period_set(&sched, period_ns);
+	  }
+
+	  if (current.config.http_port) {
+	       struct status_snapshot data;
+	       status_snapshot_fill(&data, &current);
+	       data.cycles = i + 1;
+	       data.overruns = sched.overruns;
+	       data.jitter_max_ns = sched.jitter_max_ns;
+	       data.period_ns = sched.period_ns;
+	       data.excess_mean = ctl.excess_mean;
+	       data.excess_samples = ctl.excess.count;
+	       data.excess_full = average_window_full(&ctl.excess, cycle_ns);
+	       data.averaging_secs = current.config.averaging_secs;
+	       data.forecasting = ctl.forecasting;
+	       data.excess_forecast = ctl.excess_forecast;
+	       data.forecast_bound = ctl.forecast_bound;
+	       for (size_t c = 0; c < current.nevcs; ++c) {
+		    data.evcs[c].desired_charge_start = (uint16_t)ctl.charger[c].charge_start;
+		    data.evcs[c].share_mean = ctl.charger[c].share_mean;
+	       }
+	       snapshot_publish(&snap, &data);
 	  }
 
-     next:
-	  fflush(stdout);
-	  sleep(current.config.sleep_secs);
+	  logger_wake(&log);
+	  cycle_ns = scheduler_wait(&sched);
      }
 }
@@ -0,0 +1,217 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "powerplay.h"
+
+/*
+ *
+ * State
+ *
+ */
+
+static int64_t state_realtime_ns(void)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_REALTIME, &ts);
+     return (int64_t)ts.tv_sec * NSECS_PER_SEC + ts.tv_nsec;
+}
+
+/* A file of another size is from another version and starts out zeroed, i.e. empty */
+int state_open(struct state *state, const char *path)
+{
+     struct stat st;
+
+     *state = (struct state){0};
+     state->path = path;
+     state->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+     if (state->fd == -1) {
+	  fprintf(stderr, "Error: could not open state file %s: %s\n", path, strerror(errno));
+	  goto error;
+     }
+
+     if (fstat(state->fd, &st) == -1) {
+	  fprintf(stderr, "Error: could not stat state file %s: %s\n", path, strerror(errno));
+	  goto error;
+     }
+
+     if ((size_t)st.st_size != sizeof(struct state_image)
+	 && (ftruncate(state->fd, 0) == -1 || ftruncate(state->fd, sizeof(struct state_image)) == -1)) {
+	  fprintf(stderr, "Error: could not size state file %s: %s\n", path, strerror(errno));
+	  goto error;
+     }
+
+     void *image = mmap(NULL, sizeof(struct state_image), PROT_READ | PROT_WRITE, MAP_SHARED, state->fd, 0);
+     if (image == MAP_FAILED) {
+	  fprintf(stderr, "Error: could not map state file %s: %s\n", path, strerror(errno));
+	  goto error;
+     }
+     state->image = image;
+
+     return 0;
+
+error:
+     state_close(state);
+     fflush(stderr);
+     return -1;
+}
+
+void state_close(struct state *state)
+{
+     if (state->image) munmap(state->image, sizeof(struct state_image));
+     if (state->fd != -1) close(state->fd);
+     state->image = NULL;
+     state->fd = -1;
+}
+
+static int state_plan_equal(const struct state_charger *saved, const struct register_plan *plan)
+{
+     if (saved->nranges != plan->nranges || saved->nvalues != plan->nvalues) return 0;
+
+     for (size_t i = 0; i < plan->nranges; ++i)
+	  if (saved->ranges[i].addr != plan->ranges[i].addr || saved->ranges[i].count != plan->ranges[i].count)
+	       return 0;
+
+     return 1;
+}
+
+/*
+ * Writes a checkpoint into the mapping; the kernel writes it back on its own and it survives the
+ * process being killed at any point. The sequence number is odd while the image is inconsistent,
+ * a reader finding it odd ignores the file.
+ */
+void state_save(struct state *state, const struct controller *ctl, const struct system_status *status)
+{
+     struct state_image *image = state->image;
+     const struct average_window *window = &ctl->excess;
+
+     __atomic_store_n(&image->seq, image->seq | 1, __ATOMIC_RELAXED);
+     __atomic_thread_fence(__ATOMIC_RELEASE);
+
+     image->magic = STATE_MAGIC;
+     image->version = STATE_VERSION;
+     image->saved_ns = monotonic_ns();
+     image->saved_realtime_ns = state_realtime_ns();
+
+     /* Only the newest intervals if the window holds more than fit */
+     size_t n = window->count < STATE_INTERVALS_MAX ? window->count : STATE_INTERVALS_MAX;
+     for (size_t i = 0; i < n; ++i)
+	  image->intervals[i] = window->intervals[(window->tail + window->count - n + i) % window->capacity];
+     image->nintervals = (uint32_t)n;
+     image->primed = window->primed;
+     image->first_ns = n < window->count ? image->intervals[0].start_ns : window->first_ns;
+     image->last_ns = window->last_ns;
+     image->last_value = window->last_value;
+     image->forecast = ctl->forecast;
+
+     image->nevcs = (uint32_t)status->nevcs;
+     for (size_t c = 0; c < status->nevcs; ++c) {
+	  const struct charger_control *charger = &ctl->charger[c];
+	  const struct shadow *shadow = &status->evcs[c].shadow;
+	  const struct register_plan *plan = &status->evcs[c].plan;
+	  struct state_charger *saved = &image->evcs[c];
+
+	  snprintf(saved->host, sizeof(saved->host), "%s", status->config.evcs[c].host);
+	  saved->port = status->config.evcs[c].port;
+
+	  saved->charge_start = (uint16_t)charger->charge_start;
+	  saved->known = (uint16_t)charger->known;
+	  saved->decided_ns = charger->decided_ns;
+	  saved->setpoint = charger->mod.setpoint;
+	  saved->setpoint_ns = charger->mod.updated_ns;
+
+	  saved->write_read_unsupported = shadow->write_read_unsupported;
+	  saved->nvalues = (uint32_t)plan->nvalues;
+	  saved->nranges = (uint32_t)plan->nranges;
+	  memcpy(saved->ranges, plan->ranges, plan->nranges * sizeof(plan->ranges[0]));
+	  memcpy(saved->written, shadow->written, plan->nvalues * sizeof(shadow->written[0]));
+	  memcpy(saved->written_ns, shadow->written_ns, plan->nvalues * sizeof(shadow->written_ns[0]));
+     }
+
+     __atomic_store_n(&image->seq, (image->seq | 1) + 1, __ATOMIC_RELEASE);
+}
+
+/* Moves a time of the writer onto this process's clock, 0 staying unset */
+static int64_t state_time(int64_t t_ns, int64_t shift_ns)
+{
+     return t_ns ? t_ns + shift_ns : 0;
+}
+
+/*
+ * Loads a checkpoint not older than STATE_MAX_AGE_SECS into a freshly initialised controller and
+ * the charger shadows. Chargers are matched by position and address, so one that moved or was
+ * added starts afresh. Returns 1 if the state was restored, 0 if there was none to use.
+ */
+int state_restore(const struct state *state, const struct config *config, struct controller *ctl,
+		  struct system_status *status)
+{
+     const struct state_image *image = state->image;
+     int64_t age_ns = state_realtime_ns() - image->saved_realtime_ns;
+
+     if (image->magic != STATE_MAGIC || image->version != STATE_VERSION) return 0;
+     if (image->seq & 1) {
+	  printf("State in %s was not completely written, starting afresh\n", state->path);
+	  return 0;
+     }
+     if (age_ns < 0 || age_ns > (int64_t)config->state_max_age_secs * NSECS_PER_SEC) {
+	  printf("State in %s is %.0fs old, starting afresh\n", state->path, (double)age_ns / (double)NSECS_PER_SEC);
+	  return 0;
+     }
+
+     /* Where the checkpoint was taken on our monotonic clock */
+     int64_t shift_ns = monotonic_ns() - age_ns - image->saved_ns;
+
+     if (image->primed) {
+	  size_t n = image->nintervals < STATE_INTERVALS_MAX ? image->nintervals : STATE_INTERVALS_MAX;
+
+	  /* Intervals are contiguous, so replaying their starts rebuilds the window */
+	  for (size_t i = 0; i < n; ++i)
+	       average_window_add(&ctl->excess, image->intervals[i].start_ns + shift_ns, image->intervals[i].value);
+	  average_window_add(&ctl->excess, image->last_ns + shift_ns, image->last_value);
+	  ctl->excess.first_ns = image->first_ns + shift_ns;
+     }
+
+     /* Kept as configured now, the checked errors only if the horizon did not change */
+     if (image->forecast.primed) {
+	  struct forecast *forecast = &ctl->forecast;
+	  int64_t horizon_ns = forecast->horizon_ns, smoothing_ns = forecast->level_ns;
+
+	  *forecast = image->forecast;
+	  forecast->last_ns += shift_ns;
+	  forecast->check_ns = state_time(forecast->check_ns, shift_ns);
+	  forecast_tune(forecast, horizon_ns, smoothing_ns);
+     }
+
+     for (size_t c = 0; c < image->nevcs && c < status->nevcs; ++c) {
+	  const struct state_charger *saved = &image->evcs[c];
+	  struct charger_control *charger = &ctl->charger[c];
+	  struct shadow *shadow = &status->evcs[c].shadow;
+
+	  if (strcmp(saved->host, config->evcs[c].host) || saved->port != config->evcs[c].port) continue;
+
+	  charger->charge_start = saved->charge_start ? EVCS_CHARGING_START : EVCS_CHARGING_STOP;
+	  charger->known = saved->known;
+	  charger->decided_ns = saved->decided_ns + shift_ns;
+	  charger->mod.setpoint = saved->setpoint;
+	  charger->mod.updated_ns = state_time(saved->setpoint_ns, shift_ns);
+
+	  shadow->write_read_unsupported = saved->write_read_unsupported;
+	  if (!state_plan_equal(saved, &status->evcs[c].plan)) continue;
+	  for (size_t i = 0; i < saved->nvalues; ++i) {
+	       shadow->written[i] = saved->written[i];
+	       shadow->written_ns[i] = state_time(saved->written_ns[i], shift_ns);
+	  }
+     }
+
+     printf("Restored state from %s saved %.1fs ago with %zu excess samples\n", state->path,
+	    (double)age_ns / (double)NSECS_PER_SEC, ctl->excess.count);
+     fflush(stdout);
+
+     return 1;
+}
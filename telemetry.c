@@ -0,0 +1,255 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "powerplay.h"
+
+/*
+ *
+ * Telemetry
+ *
+ */
+
+/*
+ * Every sample is appended as a fixed-size record to a raw file per UTC day. Minute and hour
+ * rollups are accumulated from the same samples and appended to one file per tier once their
+ * bucket closes. Files start with a small header naming the record type so readers can mmap them
+ * and index records directly. A bucket open at shutdown is lost and a restart within the same
+ * bucket writes a second, partial rollup for it; readers weight rollups by their covered time.
+ */
+
+static int telemetry_file_open(const char *dir, const char *name, uint16_t kind, uint32_t record_size)
+{
+     char path[PATH_MAX];
+     struct telemetry_header header = {
+	  .magic = TELEMETRY_MAGIC,
+	  .version = TELEMETRY_VERSION,
+	  .kind = kind,
+	  .record_size = record_size,
+     };
+     struct telemetry_header found;
+     struct stat st;
+     int fd;
+
+     snprintf(path, sizeof(path), "%s/%s", dir, name);
+     fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+     if (fd == -1) {
+	  fprintf(stderr, "Error: could not open telemetry file %s: %s\n", path, strerror(errno));
+	  goto error;
+     }
+
+     if (fstat(fd, &st) == -1) {
+	  fprintf(stderr, "Error: could not stat telemetry file %s: %s\n", path, strerror(errno));
+	  goto error;
+     }
+
+     if (st.st_size == 0) {
+	  if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+	       fprintf(stderr, "Error: could not write telemetry header %s: %s\n", path, strerror(errno));
+	       goto error;
+	  }
+	  return fd;
+     }
+
+     /* Appending records of another version or kind would leave a file no reader can index */
+     if ((size_t)st.st_size < sizeof(header) || ((size_t)st.st_size - sizeof(header)) % record_size
+	 || pread(fd, &found, sizeof(found), 0) != sizeof(found)
+	 || found.magic != header.magic || found.version != header.version
+	 || found.kind != header.kind || found.record_size != header.record_size) {
+	  fprintf(stderr, "Error: telemetry file %s is truncated or of another format\n", path);
+	  goto error;
+     }
+
+     return fd;
+
+error:
+     if (fd != -1) close(fd);
+     fflush(stderr);
+     return -1;
+}
+
+static int telemetry_raw_open(struct telemetry *tlm, int64_t day)
+{
+     char name[64];
+     time_t secs = (time_t)(day * 86400);
+     struct tm tm;
+
+     gmtime_r(&secs, &tm);
+     strftime(name, sizeof(name), "raw-%Y-%m-%d.tlm", &tm);
+
+     if (tlm->raw_fd != -1) close(tlm->raw_fd);
+     tlm->raw_fd = telemetry_file_open(tlm->dir, name, TELEMETRY_KIND_RAW, sizeof(struct telemetry_record));
+     tlm->raw_day = day;
+
+     return tlm->raw_fd == -1 ? -1 : 0;
+}
+
+int telemetry_open(struct telemetry *tlm, const char *dir)
+{
+     *tlm = (struct telemetry){0};
+     tlm->dir = dir;
+     tlm->raw_fd = tlm->minute_fd = tlm->hour_fd = -1;
+     tlm->minute.span_ms = 60 * 1000;
+     tlm->hour.span_ms = 3600 * 1000;
+
+     tlm->minute_fd = telemetry_file_open(dir, "minute.tlm", TELEMETRY_KIND_MINUTE, sizeof(struct telemetry_rollup));
+     tlm->hour_fd = telemetry_file_open(dir, "hour.tlm", TELEMETRY_KIND_HOUR, sizeof(struct telemetry_rollup));
+     if (tlm->minute_fd == -1 || tlm->hour_fd == -1) {
+	  telemetry_close(tlm);
+	  return -1;
+     }
+
+     return 0;
+}
+
+void telemetry_close(struct telemetry *tlm)
+{
+     if (tlm->raw_fd != -1) close(tlm->raw_fd);
+     if (tlm->minute_fd != -1) close(tlm->minute_fd);
+     if (tlm->hour_fd != -1) close(tlm->hour_fd);
+     tlm->raw_fd = tlm->minute_fd = tlm->hour_fd = -1;
+}
+
+/* Adds the powers of the last sample held for dt_ms */
+static void telemetry_accum_hold(struct telemetry_accum *accum, int64_t dt_ms)
+{
+     const struct telemetry_record *last = &accum->last;
+     int32_t grid = last->grid[0] + last->grid[1] + last->grid[2];
+
+     for (int i = 0; i < 3; ++i) {
+	  accum->pv[i] += last->pv[i] * dt_ms;
+	  accum->consumption[i] += last->consumption[i] * dt_ms;
+	  accum->grid[i] += last->grid[i] * dt_ms;
+     }
+     accum->grid_import += (grid > 0 ? grid : 0) * dt_ms;
+     accum->grid_export += (grid < 0 ? -grid : 0) * dt_ms;
+     accum->battery += last->battery * dt_ms;
+     accum->evcs += last->evcs * dt_ms;
+}
+
+static int telemetry_rollup_flush(struct telemetry_accum *accum, int fd)
+{
+     struct telemetry_rollup rollup = {0};
+     int64_t n = accum->count;
+
+     if (n == 0) return 0;
+
+     /* A bucket with no covered time, a single sample after an outage, has that sample's powers */
+     if (accum->covered_ms == 0) telemetry_accum_hold(accum, 1);
+     int64_t covered_ms = accum->covered_ms ? accum->covered_ms : 1;
+
+     rollup.t_ms = accum->bucket_ms;
+     rollup.count = accum->count;
+     rollup.covered_ms = accum->covered_ms;
+     for (int i = 0; i < 3; ++i) {
+	  rollup.pv[i] = (int32_t)(accum->pv[i] / covered_ms);
+	  rollup.consumption[i] = (int32_t)(accum->consumption[i] / covered_ms);
+	  rollup.grid[i] = (int32_t)(accum->grid[i] / covered_ms);
+     }
+     rollup.grid_import = (int32_t)(accum->grid_import / covered_ms);
+     rollup.grid_export = (int32_t)(accum->grid_export / covered_ms);
+     rollup.battery = (int32_t)(accum->battery / covered_ms);
+     rollup.evcs = (int32_t)(accum->evcs / covered_ms);
+     rollup.excess = (int32_t)(accum->excess / n);
+     rollup.excess_min = accum->excess_min;
+     rollup.excess_max = accum->excess_max;
+     rollup.soc_battery = accum->soc_battery;
+     rollup.charging_ms = accum->charging_ms;
+
+     if (write(fd, &rollup, sizeof(rollup)) != sizeof(rollup)) return -1;
+     return 0;
+}
+
+static int telemetry_accum_add(struct telemetry_accum *accum, int fd, const struct telemetry_record *rec)
+{
+     int64_t bucket_ms = rec->t_ms - rec->t_ms % accum->span_ms;
+     int result = 0;
+
+     if (accum->count && bucket_ms != accum->bucket_ms) {
+	  result = telemetry_rollup_flush(accum, fd);
+	  *accum = (struct telemetry_accum){
+	       .span_ms = accum->span_ms,
+	       .last = accum->last,
+	  };
+     }
+
+     if (accum->count == 0) {
+	  accum->bucket_ms = bucket_ms;
+	  accum->excess_min = accum->excess_max = rec->excess;
+     }
+
+     /* Gaps longer than TELEMETRY_GAP_MS are outages, not covered time. The chargers hold the
+      * powers and chargers hold the last sample up to this one, as the raw tier is read. */
+     int64_t dt_ms = rec->t_ms - accum->last.t_ms;
+     if (accum->last.t_ms && dt_ms > 0 && dt_ms <= TELEMETRY_GAP_MS) {
+	  int charging = 0;
+	  for (size_t c = 0; c < accum->last.nevcs && c < EVCS_MAX; ++c)
+	       charging |= accum->last.charger[c].charger_status == EVCS_CHARGER_STATUS_CHARGING;
+
+	  telemetry_accum_hold(accum, dt_ms);
+	  accum->covered_ms += (uint32_t)dt_ms;
+	  if (charging) accum->charging_ms += (uint32_t)dt_ms;
+     }
+     accum->last = *rec;
+
+     accum->count += 1;
+     accum->excess += rec->excess;
+     if (rec->excess < accum->excess_min) accum->excess_min = rec->excess;
+     if (rec->excess > accum->excess_max) accum->excess_max = rec->excess;
+     accum->soc_battery = rec->soc_battery;
+
+     return result;
+}
+
+int telemetry_append(struct telemetry *tlm, const struct telemetry_record *rec)
+{
+     int64_t day = rec->t_ms / (86400 * 1000);
+
+     if ((tlm->raw_fd == -1 || day != tlm->raw_day) && telemetry_raw_open(tlm, day)) return -1;
+
+     if (write(tlm->raw_fd, rec, sizeof(*rec)) != sizeof(*rec)
+	 || telemetry_accum_add(&tlm->minute, tlm->minute_fd, rec)
+	 || telemetry_accum_add(&tlm->hour, tlm->hour_fd, rec)) {
+	  if (!tlm->write_errors++) {
+	       fprintf(stderr, "Error: could not append telemetry: %s\n", strerror(errno));
+	       fflush(stderr);
+	  }
+	  return -1;
+     }
+
+     return 0;
+}
+
+/* desired holds the controller's state of every charger */
+void telemetry_record_fill(struct telemetry_record *rec, const struct system_status *status,
+			   int32_t excess_mean, const struct charger_control *desired)
+{
+     struct timespec ts;
+
+     clock_gettime(CLOCK_REALTIME, &ts);
+
+     *rec = (struct telemetry_record){0};
+     rec->t_ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+     for (int i = 0; i < 3; ++i) {
+	  rec->pv[i] = status->power_pv_phase[i];
+	  rec->consumption[i] = status->power_consumption_phase[i];
+	  rec->grid[i] = status->power_grid_phase[i];
+     }
+     rec->battery = status->power_battery;
+     rec->evcs = status->power_evcs;
+     rec->soc_battery = status->soc_battery;
+     rec->nevcs = (uint16_t)status->nevcs;
+     for (size_t c = 0; c < status->nevcs; ++c) {
+	  rec->charger[c].charge_start = status->evcs[c].charge_start;
+	  rec->charger[c].charger_status = status->evcs[c].charger_status;
+	  rec->charger[c].charging_mode = status->evcs[c].charging_mode;
+	  rec->charger[c].desired = desired[c].charge_start;
+     }
+     rec->excess = status->power_excess;
+     rec->excess_mean = excess_mean;
+}
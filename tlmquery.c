@@ -0,0 +1,308 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "powerplay.h"
+
+/*
+  Tlmquery - range scans and aggregates over the sparkshift telemetry store
+
+  Usage: tlmquery [-t raw|minute|hour] [-f FROM] [-u UNTIL] [-a] DIR
+
+  -t TIER	tier to read (default minute)
+  -f FROM	start of range, epoch seconds or UTC YYYY-MM-DD[THH:MM[:SS]] (default everything)
+  -u UNTIL	end of range, exclusive, same format (default now)
+  -a		print totals for the range instead of the records
+
+  Files are memory-mapped and the range start is found by binary search, so a query only touches
+  the pages it returns.
+ */
+
+struct mapped_file {
+     void *base;
+     size_t size;
+     const void *records;
+     size_t count;
+};
+
+struct totals {
+     uint64_t samples;
+     double pv_wh, consumption_wh, import_wh, export_wh, evcs_wh;
+     double charging_h, covered_h;
+     double excess_sum;
+     int32_t excess_min, excess_max;
+};
+
+static int file_map(struct mapped_file *file, const char *path, uint16_t kind, uint32_t record_size)
+{
+     const struct telemetry_header *header;
+     struct stat st;
+     int fd;
+
+     *file = (struct mapped_file){0};
+
+     fd = open(path, O_RDONLY | O_CLOEXEC);
+     if (fd == -1) {
+	  if (errno == ENOENT) return 1;
+	  fprintf(stderr, "Error: could not open %s: %s\n", path, strerror(errno));
+	  return -1;
+     }
+
+     if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*header)) {
+	  fprintf(stderr, "Error: %s is not a telemetry file\n", path);
+	  close(fd);
+	  return -1;
+     }
+
+     file->size = (size_t)st.st_size;
+     file->base = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+     close(fd);
+     if (file->base == MAP_FAILED) {
+	  fprintf(stderr, "Error: could not map %s: %s\n", path, strerror(errno));
+	  return -1;
+     }
+
+     header = file->base;
+     if (header->magic != TELEMETRY_MAGIC || header->version != TELEMETRY_VERSION
+	 || header->kind != kind || header->record_size != record_size) {
+	  fprintf(stderr, "Error: %s has an unexpected format\n", path);
+	  munmap(file->base, file->size);
+	  return -1;
+     }
+
+     madvise(file->base, file->size, MADV_SEQUENTIAL);
+     file->records = (const char *)file->base + sizeof(*header);
+     file->count = (file->size - sizeof(*header)) / record_size;
+
+     return 0;
+}
+
+static void file_unmap(struct mapped_file *file)
+{
+     if (file->base) munmap(file->base, file->size);
+     file->base = NULL;
+}
+
+/* First record at or after t_ms; records are appended in time order */
+static size_t lower_bound(const struct mapped_file *file, size_t record_size, int64_t t_ms)
+{
+     size_t lo = 0, hi = file->count;
+
+     while (lo < hi) {
+	  size_t mid = lo + (hi - lo) / 2;
+	  int64_t mid_ms = *(const int64_t *)((const char *)file->records + mid * record_size);
+
+	  if (mid_ms < t_ms) lo = mid + 1;
+	  else hi = mid;
+     }
+
+     return lo;
+}
+
+static int64_t time_parse(const char *str)
+{
+     struct tm tm = {0};
+     char *end;
+     long long secs = strtoll(str, &end, 10);
+
+     if (*end == '\0') return secs * 1000;
+
+     end = strptime(str, "%Y-%m-%dT%H:%M:%S", &tm);
+     if (end == NULL || *end) {
+	  tm = (struct tm){0};
+	  end = strptime(str, "%Y-%m-%dT%H:%M", &tm);
+     }
+     if (end == NULL || *end) {
+	  tm = (struct tm){0};
+	  end = strptime(str, "%Y-%m-%d", &tm);
+     }
+     if (end == NULL || *end) return -1;
+
+     return (int64_t)timegm(&tm) * 1000;
+}
+
+static void time_print(int64_t t_ms)
+{
+     time_t secs = (time_t)(t_ms / 1000);
+     struct tm tm;
+     char buf[32];
+
+     gmtime_r(&secs, &tm);
+     strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+     printf("%s.%03dZ", buf, (int)(t_ms % 1000));
+}
+
+static void totals_excess(struct totals *totals, int32_t excess, int32_t min, int32_t max, uint64_t n)
+{
+     if (totals->samples == 0 || min < totals->excess_min) totals->excess_min = min;
+     if (totals->samples == 0 || max > totals->excess_max) totals->excess_max = max;
+     totals->excess_sum += (double)excess * (double)n;
+     totals->samples += n;
+}
+
+static void raw_scan(const struct mapped_file *file, int64_t from_ms, int64_t until_ms, struct totals *totals)
+{
+     const struct telemetry_record *recs = file->records;
+
+     for (size_t i = lower_bound(file, sizeof(*recs), from_ms); i < file->count && recs[i].t_ms < until_ms; ++i) {
+	  const struct telemetry_record *rec = &recs[i];
+	  int32_t grid = rec->grid[0] + rec->grid[1] + rec->grid[2];
+
+	  if (totals == NULL) {
+	       time_print(rec->t_ms);
+	       printf(" P/%d/%d/%d C/%d/%d/%d G/%d/%d/%d B/%d E/%d BS/%u",
+		      rec->pv[0], rec->pv[1], rec->pv[2],
+		      rec->consumption[0], rec->consumption[1], rec->consumption[2],
+		      rec->grid[0], rec->grid[1], rec->grid[2],
+		      rec->battery, rec->evcs, rec->soc_battery);
+	       for (size_t c = 0; c < rec->nevcs && c < EVCS_MAX; ++c)
+		    printf(" M/%c S/%c C/%u D/%u", get_charging_mode_char(rec->charger[c].charging_mode),
+			   get_charger_status_char(rec->charger[c].charger_status),
+			   rec->charger[c].charge_start, rec->charger[c].desired);
+	       printf(" X/%d A/%d\n", rec->excess, rec->excess_mean);
+	       continue;
+	  }
+
+	  int charging = 0;
+	  for (size_t c = 0; c < rec->nevcs && c < EVCS_MAX; ++c)
+	       charging |= rec->charger[c].charger_status == EVCS_CHARGER_STATUS_CHARGING;
+
+	  /* Sample and hold up to the next record, outages excluded */
+	  double hours = 0;
+	  if (i + 1 < file->count && recs[i + 1].t_ms - rec->t_ms <= TELEMETRY_GAP_MS)
+	       hours = (double)(recs[i + 1].t_ms - rec->t_ms) / 3600000.0;
+
+	  totals->pv_wh += (rec->pv[0] + rec->pv[1] + rec->pv[2]) * hours;
+	  totals->consumption_wh += (rec->consumption[0] + rec->consumption[1] + rec->consumption[2]) * hours;
+	  totals->import_wh += (grid > 0 ? grid : 0) * hours;
+	  totals->export_wh += (grid < 0 ? -grid : 0) * hours;
+	  totals->evcs_wh += rec->evcs * hours;
+	  if (charging) totals->charging_h += hours;
+	  totals->covered_h += hours;
+	  totals_excess(totals, rec->excess, rec->excess, rec->excess, 1);
+     }
+}
+
+static void rollup_scan(const struct mapped_file *file, int64_t from_ms, int64_t until_ms, struct totals *totals)
+{
+     const struct telemetry_rollup *rollups = file->records;
+
+     for (size_t i = lower_bound(file, sizeof(*rollups), from_ms); i < file->count && rollups[i].t_ms < until_ms; ++i) {
+	  const struct telemetry_rollup *r = &rollups[i];
+	  double hours = r->covered_ms / 3600000.0;
+
+	  if (totals == NULL) {
+	       time_print(r->t_ms);
+	       printf(" N/%u P/%d/%d/%d C/%d/%d/%d G/%d/%d/%d I/%d O/%d B/%d E/%d BS/%u X/%d/%d/%d CH/%u\n",
+		      r->count, r->pv[0], r->pv[1], r->pv[2],
+		      r->consumption[0], r->consumption[1], r->consumption[2],
+		      r->grid[0], r->grid[1], r->grid[2], r->grid_import, r->grid_export,
+		      r->battery, r->evcs, r->soc_battery,
+		      r->excess_min, r->excess, r->excess_max, r->charging_ms / 1000);
+	       continue;
+	  }
+
+	  totals->pv_wh += (r->pv[0] + r->pv[1] + r->pv[2]) * hours;
+	  totals->consumption_wh += (r->consumption[0] + r->consumption[1] + r->consumption[2]) * hours;
+	  totals->import_wh += r->grid_import * hours;
+	  totals->export_wh += r->grid_export * hours;
+	  totals->evcs_wh += r->evcs * hours;
+	  totals->charging_h += r->charging_ms / 3600000.0;
+	  totals->covered_h += hours;
+	  totals_excess(totals, r->excess, r->excess_min, r->excess_max, r->count);
+     }
+}
+
+static void totals_print(const struct totals *totals)
+{
+     printf("samples %" PRIu64 " covered %.2f h\n", totals->samples, totals->covered_h);
+     printf("pv %.3f kWh consumption %.3f kWh import %.3f kWh export %.3f kWh evcs %.3f kWh\n",
+	    totals->pv_wh / 1000, totals->consumption_wh / 1000, totals->import_wh / 1000,
+	    totals->export_wh / 1000, totals->evcs_wh / 1000);
+     printf("excess mean %.0f W min %d W max %d W charging %.2f h\n",
+	    totals->samples ? totals->excess_sum / (double)totals->samples : 0.0,
+	    totals->excess_min, totals->excess_max, totals->charging_h);
+}
+
+int main(int argc, char **argv)
+{
+     const char *tier = "minute";
+     int64_t from_ms = 0, until_ms = INT64_MAX;
+     int aggregate = 0;
+     struct totals totals = {0};
+     char path[PATH_MAX];
+     int opt;
+
+     while ((opt = getopt(argc, argv, "t:f:u:a")) != -1) {
+	  switch (opt) {
+	  case 't': tier = optarg; break;
+	  case 'f': from_ms = time_parse(optarg); break;
+	  case 'u': until_ms = time_parse(optarg); break;
+	  case 'a': aggregate = 1; break;
+	  default:
+	       fprintf(stderr, "Usage: %s [-t raw|minute|hour] [-f from] [-u until] [-a] dir\n", argv[0]);
+	       return 1;
+	  }
+     }
+
+     if (optind != argc - 1 || from_ms < 0 || until_ms < 0) {
+	  fprintf(stderr, "Usage: %s [-t raw|minute|hour] [-f from] [-u until] [-a] dir\n", argv[0]);
+	  return 1;
+     }
+
+     const char *dir = argv[optind];
+     struct totals *t = aggregate ? &totals : NULL;
+
+     if (!strcmp(tier, "raw")) {
+	  struct timespec now;
+	  clock_gettime(CLOCK_REALTIME, &now);
+
+	  int64_t last_ms = until_ms == INT64_MAX ? (int64_t)now.tv_sec * 1000 : until_ms - 1;
+	  int64_t day = from_ms / 86400000;
+
+	  /* Without a start, begin at the oldest day file present, searching back at most a year */
+	  if (from_ms == 0) day = last_ms / 86400000 - 366;
+
+	  for (; day <= last_ms / 86400000; ++day) {
+	       struct mapped_file file;
+	       time_t secs = (time_t)(day * 86400);
+	       struct tm tm;
+
+	       gmtime_r(&secs, &tm);
+	       snprintf(path, sizeof(path), "%s/", dir);
+	       strftime(path + strlen(path), sizeof(path) - strlen(path), "raw-%Y-%m-%d.tlm", &tm);
+
+	       int rc = file_map(&file, path, TELEMETRY_KIND_RAW, sizeof(struct telemetry_record));
+	       if (rc == 1) continue;
+	       if (rc == -1) return 1;
+	       raw_scan(&file, from_ms, until_ms, t);
+	       file_unmap(&file);
+	  }
+     } else if (!strcmp(tier, "minute") || !strcmp(tier, "hour")) {
+	  struct mapped_file file;
+	  int minute = !strcmp(tier, "minute");
+
+	  snprintf(path, sizeof(path), "%s/%s.tlm", dir, tier);
+	  int rc = file_map(&file, path, minute ? TELEMETRY_KIND_MINUTE : TELEMETRY_KIND_HOUR,
+			    sizeof(struct telemetry_rollup));
+	  if (rc == 1) fprintf(stderr, "Error: %s does not exist\n", path);
+	  if (rc) return 1;
+	  rollup_scan(&file, from_ms, until_ms, t);
+	  file_unmap(&file);
+     } else {
+	  fprintf(stderr, "Error: unknown tier %s\n", tier);
+	  return 1;
+     }
+
+     if (aggregate) totals_print(&totals);
+
+     return 0;
+}